@@ -10,7 +10,7 @@ use std::fs::File;
 use std::io::{BufRead, BufReader, BufWriter, Write};
 use std::net::{IpAddr, Ipv6Addr};
 use std::num::NonZeroU32;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 
 fn default_ipv4_path() -> PathBuf {
     "./geoip".into()
@@ -30,6 +30,14 @@ struct Args {
     #[argh(option, default = "default_ipv6_path()", short = '6')]
     output_ipv6: PathBuf,
 
+    /// where to store the IPv4 output in the binary format, if anywhere
+    #[argh(option)]
+    binary_ipv4: Option<PathBuf>,
+
+    /// where to store the IPv6 output in the binary format, if anywhere
+    #[argh(option)]
+    binary_ipv6: Option<PathBuf>,
+
     /// where to find the dump file
     #[argh(option, short = 'i')]
     input: PathBuf,
@@ -132,6 +140,85 @@ const PROLOGUE: &str = "\
 #
 ";
 
+/// Bytes at the start of a binary geoip file: see geoip_load_file() in
+/// src/lib/geoip/geoip.c for the whole format.
+const BINARY_MAGIC: &[u8; 8] = b"QHSGEOIP";
+/// The version of the binary format that we write.
+const BINARY_VERSION: u8 = 1;
+
+/// Add a range that starts at `start` to a binary table, unless it is in the
+/// same country as the range before it.
+fn push_range(starts: &mut Vec<u128>, countries: &mut Vec<u16>, start: u128, country: u16) {
+    if countries.last() != Some(&country) {
+        starts.push(start);
+        countries.push(country);
+    }
+}
+
+/// Write sorted, disjoint `(first, last, country code)` ranges of
+/// `addr_len`-byte addresses to `path`, in the binary format that Tor can map
+/// into memory and use without parsing.
+///
+/// The binary format covers the whole address space: addresses between the
+/// ranges that we are given go into ranges with country 0, "unknown".
+fn write_binary<I>(path: &Path, addr_len: usize, ranges: I) -> std::io::Result<()>
+where
+    I: IntoIterator<Item = (u128, u128, [u8; 2])>,
+{
+    let max = if addr_len == 4 {
+        u32::MAX as u128
+    } else {
+        u128::MAX
+    };
+    let mut codes: Vec<[u8; 2]> = Vec::new();
+    let mut starts = Vec::new();
+    let mut countries = Vec::new();
+    // The first address that no range covers yet, or None once the ranges
+    // reach the end of the address space.
+    let mut next = Some(0u128);
+
+    for (first, last, cc) in ranges {
+        let country = match codes.iter().position(|c| *c == cc) {
+            Some(idx) => idx + 1,
+            None => {
+                codes.push(cc);
+                codes.len()
+            }
+        };
+        let uncovered = next.expect("ranges past the end of the address space");
+        assert!(first >= uncovered, "ranges out of order");
+        if first > uncovered {
+            push_range(&mut starts, &mut countries, uncovered, 0);
+        }
+        push_range(&mut starts, &mut countries, first, country as u16);
+        next = if last == max { None } else { Some(last + 1) };
+    }
+    if let Some(uncovered) = next {
+        push_range(&mut starts, &mut countries, uncovered, 0);
+    }
+    assert!(codes.len() <= u16::MAX as usize);
+
+    let mut out = BufWriter::new(File::create(path)?);
+    out.write_all(BINARY_MAGIC)?;
+    out.write_all(&[BINARY_VERSION, addr_len as u8])?;
+    out.write_all(&(codes.len() as u16).to_le_bytes())?;
+    out.write_all(&(starts.len() as u32).to_le_bytes())?;
+    for start in &starts {
+        if addr_len == 4 {
+            out.write_all(&(*start as u32).to_le_bytes())?;
+        } else {
+            out.write_all(&start.to_be_bytes())?;
+        }
+    }
+    for country in &countries {
+        out.write_all(&country.to_le_bytes())?;
+    }
+    for cc in &codes {
+        out.write_all(cc)?;
+    }
+    out.flush()
+}
+
 /// Read an input file in the `location dump` format, and write CSV ipv4 and ipv6 files.
 ///
 /// This code tries to be "efficient enough"; most of the logic is handled by
@@ -223,6 +310,19 @@ fn convert(args: Args) -> std::io::Result<()> {
     v4.flush()?;
     v6.flush()?;
 
+    if let Some(path) = args.binary_ipv4 {
+        let ranges = v4map
+            .iter()
+            .map(|(r, defn)| (*r.start() as u128, *r.end() as u128, defn.cc));
+        write_binary(&path, 4, ranges)?;
+    }
+    if let Some(path) = args.binary_ipv6 {
+        let ranges = v6map
+            .iter()
+            .map(|(r, defn)| (*r.start(), *r.end(), defn.cc));
+        write_binary(&path, 16, ranges)?;
+    }
+
     if let Some(output_asn) = args.output_asn {
         networks.sort();
         let mut asn = BufWriter::new(File::create(output_asn)?);
@@ -98,6 +98,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -365,6 +366,7 @@ static const config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityCalendarQueue, BOOL,    "0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
 #if defined(HAVE_MODULE_RELAY) || defined(QED_HS_UNIT_TESTS)
   /* The unit tests expect the ClientOnly default to be 0. */
@@ -533,6 +535,8 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("CloseHSServiceRendCircuitsImmediatelyOnTimeout"),
   V_IMMUTABLE(HiddenServiceSingleHopMode,  BOOL,     "0"),
   V_IMMUTABLE(HiddenServiceNonAnonymousMode,BOOL,    "0"),
+  V(HiddenServiceOffloadDescriptors, BOOL,           "1"),
+  V(HiddenServiceOffloadIntroductions, BOOL,         "1"),
   V(HTTPProxy,                   STRING,   NULL),
   V(HTTPProxyAuthenticator,      STRING,   NULL),
   V(HTTPSProxy,                  STRING,   NULL),
@@ -2429,6 +2433,9 @@ options_act,(const or_options_t *old_options))
   if (options_act_dirauth(old_options) < 0)
     return -1;
 
+  /* Which nodes we may choose depends on our firewall and bridge options. */
+  node_select_weights_changed();
+
   /* We may need to reschedule some directory stuff if our status changed. */
   if (old_options) {
     if (!bool_eq(dirclient_fetches_dir_info_early(options),
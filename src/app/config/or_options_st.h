@@ -353,6 +353,12 @@ struct or_options_t {
    * directly.
    */
   int HiddenServiceNonAnonymousMode;
+  /** If true, onion services decrypt INTRODUCE2 cells and verify their PoW
+   * solutions on the cpuworkers instead of on the main thread. */
+  int HiddenServiceOffloadIntroductions;
+  /** If true, onion services encode and sign their descriptors for upload
+   * on the cpuworkers instead of on the main thread. */
+  int HiddenServiceOffloadDescriptors;
 
   int ConnLimit; /**< Demanded minimum number of simultaneous connections. */
   int ConnLimit_; /**< Maximum allowed number of simultaneous connections. */
@@ -896,6 +902,11 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, new channels keep their active circuits in a calendar queue
+   * of logarithmic buckets rather than a binary heap when picking which
+   * circuit to relay from next. */
+  int CircuitPriorityCalendarQueue;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1246,6 +1246,13 @@ run_qed_hs_main_loop(void)
   /* Set up our buckets */
   connection_bucket_init();
 
+  /* launch cpuworkers. Need to do this *after* we've read the onion key. */
+  /* launch them always for all tors, now that clients can solve onion PoWs,
+   * and before we load our cached directory information, so that they can
+   * help parse it. */
+  if (cpuworker_init() == -1)
+    return -1;
+
   /* initialize the bootstrap status events to know we're starting up */
   control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
 
@@ -1294,11 +1301,6 @@ run_qed_hs_main_loop(void)
   const time_t now = time(NULL);
   directory_info_has_arrived(now, 1, 0);
 
-  /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-  /* launch them always for all tors, now that clients can solve onion PoWs. */
-  if (cpuworker_init() == -1)
-    return -1;
-
   consdiffmgr_enable_background_compression();
 
   /* Setup shared random protocol subsystem. */
@@ -94,6 +94,7 @@
 #include "feature/control/control_events.h"
 #include "feature/dirauth/authmode.h"
 #include "feature/dirauth/dirauth_config.h"
+#include "feature/dirclient/dirclient.h"
 #include "feature/dircache/dirserv.h"
 #include "feature/dircommon/directory.h"
 #include "feature/hibernate/hibernate.h"
@@ -933,6 +934,9 @@ connection_free_minimal(connection_t *conn)
 
     qed_hs_compress_free(dir_conn->compress_state);
     dir_conn_clear_spool(dir_conn);
+    buf_free(dir_conn->chunk_buf);
+    qed_hs_free(dir_conn->response_headers);
+    dir_conn_clear_pipeline(dir_conn);
 
     hs_ident_dir_conn_free(dir_conn->hs_ident);
     if (dir_conn->guard_state) {
@@ -4795,6 +4799,44 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   connection_write_to_buf_commit(conn);
 }
 
+/** Helper for connection_dir_buf_add(): write a <b>string</b> (of size
+ * <b>len</b>) to directory connection <b>dir_conn</b>, which is sending a
+ * chunked response, as one chunk.  Apply compression if the connection is
+ * configured to use it and finalize it if <b>done</b> is true. */
+static void
+connection_dir_buf_add_chunked(const char *string, size_t len,
+                               dir_connection_t *dir_conn, int done)
+{
+  connection_t *conn = TO_CONN(dir_conn);
+  buf_t *chunk = dir_conn->chunk_buf;
+  char chunk_header[32];
+  int r;
+
+  if (!connection_may_write_to_buf(conn))
+    return;
+
+  if (dir_conn->compress_state != NULL) {
+    CONN_LOG_PROTECT(conn, r = buf_add_compress(chunk,
+                                                dir_conn->compress_state,
+                                                string, len, done));
+  } else {
+    r = buf_add(chunk, string, len);
+  }
+  if (r < 0) {
+    buf_clear(chunk);
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  if (buf_datalen(chunk) == 0)
+    return;
+
+  qed_hs_snprintf(chunk_header, sizeof(chunk_header), "%x\r\n",
+                  (unsigned)buf_datalen(chunk));
+  connection_buf_add(chunk_header, strlen(chunk_header), conn);
+  connection_buf_add_buf(conn, chunk);
+  connection_buf_add("\r\n", 2, conn);
+}
+
 /**
  * Write a <b>string</b> (of size <b>len</b> to directory connection
  * <b>dir_conn</b>. Apply compression if connection is configured to use
@@ -4804,6 +4846,11 @@ void
 connection_dir_buf_add(const char *string, size_t len,
                        dir_connection_t *dir_conn, int done)
 {
+  if (dir_conn->chunked) {
+    connection_dir_buf_add_chunked(string, len, dir_conn, done);
+    return;
+  }
+
   if (dir_conn->compress_state != NULL) {
     connection_buf_add_compress(string, len, dir_conn, done);
     return;
@@ -4819,6 +4866,74 @@ connection_buf_add_compress(const char *string, size_t len,
   connection_write_to_buf_impl_(string, len, TO_CONN(conn), done ? -1 : 1);
 }
 
+/**
+ * Append <b>len</b> bytes at <b>string</b> onto <b>conn</b>'s outbuf without
+ * copying them, and ask it to start writing.  The bytes must stay valid
+ * until the outbuf calls <b>free_fn</b>(<b>free_arg</b>), which happens
+ * exactly once: after they have been flushed, or right away if we can't
+ * queue them.
+ */
+void
+connection_buf_add_external(const char *string, size_t len,
+                            connection_t *conn,
+                            void (*free_fn)(void *), void *free_arg)
+{
+  int r;
+  if (!connection_may_write_to_buf(conn)) {
+    free_fn(free_arg);
+    return;
+  }
+
+  CONN_LOG_PROTECT(conn, r = buf_add_external(conn->outbuf, string, len,
+                                              free_fn, free_arg));
+  if (r < 0) {
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn);
+}
+
+/**
+ * As connection_buf_add_external(), but on directory connection
+ * <b>dir_conn</b>: if it is sending a chunked response, send the bytes as
+ * one chunk.
+ */
+void
+connection_dir_buf_add_external(const char *string, size_t len,
+                                dir_connection_t *dir_conn,
+                                void (*free_fn)(void *), void *free_arg)
+{
+  connection_t *conn = TO_CONN(dir_conn);
+  char chunk_header[32];
+
+  if (!dir_conn->chunked || len == 0) {
+    connection_buf_add_external(string, len, conn, free_fn, free_arg);
+    return;
+  }
+
+  qed_hs_snprintf(chunk_header, sizeof(chunk_header), "%x\r\n",
+                  (unsigned)len);
+  connection_buf_add(chunk_header, strlen(chunk_header), conn);
+  connection_buf_add_external(string, len, conn, free_fn, free_arg);
+  connection_buf_add("\r\n", 2, conn);
+}
+
+/**
+ * If directory connection <b>dir_conn</b> is sending a chunked response,
+ * end its body: all of the body must already have been written with
+ * connection_dir_buf_add() or connection_dir_buf_add_external().
+ */
+void
+connection_dir_end_chunked_body(dir_connection_t *dir_conn)
+{
+  if (!dir_conn->chunked)
+    return;
+
+  connection_buf_add("0\r\n\r\n", 5, TO_CONN(dir_conn));
+  dir_conn->chunked = 0;
+  buf_free(dir_conn->chunk_buf);
+}
+
 /**
  * Add all bytes from <b>buf</b> to <b>conn</b>'s outbuf, draining them
  * from <b>buf</b>. (If the connection is marked and will soon be closed,
@@ -4948,6 +5063,7 @@ connection_get_by_type_nonlinked,(int type))
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn_var) {  \
       if (conn_var && (conn_test)                               \
           && conn_var->type == CONN_TYPE_DIR                    \
+          && conn_var->state != DIR_CONN_STATE_CLIENT_FINISHED  \
           && !conn_var->marked_for_close) {                     \
         dir_connection_t *dirconn_var = TO_DIR_CONN(conn_var);  \
         if (dirconn_var && (dirconn_test)) {                    \
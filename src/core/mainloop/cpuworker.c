@@ -18,6 +18,7 @@
  *      <li>and for solving onion service PoW challenges in pow.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -41,11 +42,6 @@
 
 static void queue_pending_tasks(void);
 
-typedef struct worker_state_t {
-  int generation;
-  server_onion_keys_t *onion_keys;
-} worker_state_t;
-
 static void *
 worker_state_new(void *arg)
 {
@@ -152,8 +148,8 @@ cpuworker_free_all(void)
 }
 
 /** Return the number of threads configured for our CPU worker. */
-unsigned int
-cpuworker_get_n_threads(void)
+MOCK_IMPL(unsigned int,
+cpuworker_get_n_threads,(void))
 {
   if (!threadpool) {
     return 0;
@@ -598,8 +594,6 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   cpuworker_request_t req;
   int should_time;
 
-  qed_hs_assert(threadpool);
-
   if (!circ->p_chan) {
     log_info(LD_OR,"circ->p_chan gone. Failing circ.");
     qed_hs_free(onionskin);
@@ -641,13 +635,13 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   memwipe(&req, 0, sizeof(req));
 
   ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     job);
   if (!queue_entry) {
     log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    --total_pending_tasks;
     qed_hs_free(job);
     return -1;
   }
@@ -660,6 +654,15 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   return 0;
 }
 
+/** Try to cancel <b>ent</b>, which cpuworker_queue_work() returned.  Return
+ * the argument of the work if no worker had started on it yet, or NULL if it
+ * is too late to cancel it. */
+MOCK_IMPL(void *,
+cpuworker_cancel_work,(workqueue_entry_t *ent))
+{
+  return workqueue_entry_cancel(ent);
+}
+
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
  * remove it from the worker queue. */
 void
@@ -669,7 +672,7 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
+  job = cpuworker_cancel_work(circ->workqueue_entry);
   if (job) {
     /* It successfully cancelled. */
     memwipe(job, 0xe0, sizeof(*job));
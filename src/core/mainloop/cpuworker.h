@@ -26,6 +26,7 @@ MOCK_DECL(struct workqueue_entry_t *, cpuworker_queue_work, (
                     enum workqueue_reply_t (*fn)(void *, void *),
                     void (*reply_fn)(void *),
                     void *arg));
+MOCK_DECL(void *, cpuworker_cancel_work, (struct workqueue_entry_t *ent));
 
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
@@ -37,7 +38,18 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
-unsigned int cpuworker_get_n_threads(void);
+MOCK_DECL(unsigned int, cpuworker_get_n_threads, (void));
+
+#ifdef CPUWORKER_PRIVATE
+struct server_onion_keys_t;
+/** The state that each cpuworker thread keeps between jobs. */
+typedef struct worker_state_t {
+  /** How many key updates has this thread seen? */
+  int generation;
+  /** The keys to use for answering onionskins. */
+  struct server_onion_keys_t *onion_keys;
+} worker_state_t;
+#endif /* defined(CPUWORKER_PRIVATE) */
 
 #endif /* !defined(QED_HS_CPUWORKER_H) */
 
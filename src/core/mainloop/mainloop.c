@@ -108,6 +108,7 @@
 
 #include "core/or/cell_st.h"
 #include "core/or/entry_connection_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/networkstatus_st.h"
 #include "core/or/or_connection_st.h"
 #include "app/config/or_state_st.h"
@@ -1207,6 +1208,21 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  /* Close kept-alive directory connections that have been idle for a
+   * while. */
+  if (conn->type == CONN_TYPE_DIR && TO_DIR_CONN(conn)->keep_alive &&
+      ((conn->state == DIR_CONN_STATE_CLIENT_FINISHED &&
+        conn->timestamp_last_read_allowed
+            + DIR_CONN_CLIENT_IDLE_TIMEOUT < now) ||
+       (conn->state == DIR_CONN_STATE_SERVER_COMMAND_WAIT &&
+        conn->timestamp_last_write_allowed
+            + DIR_CONN_SERVER_IDLE_TIMEOUT < now))) {
+    log_info(LD_DIR,"Closing idle kept-alive directory conn (fd %d)",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+
   if (!connection_speaks_cells(conn))
     return; /* we're all done here, the rest is just for OR conns */
 
@@ -13,8 +13,54 @@
 #include "orconfig.h"
 #include "core/or/address_set.h"
 #include "lib/net/address.h"
+#include "lib/container/bitarray.h"
 #include "lib/container/bloomfilt.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * An address set is a blocked Bloom filter, plus the hashes of all the
+ * addresses we have put in it.
+ *
+ * We keep the hashes so that we can take addresses out again: each address
+ * only sets bits in one block of the filter, so when an update drops some
+ * addresses, we clear their blocks and put back the hashes of the
+ * addresses that still live there.  Lookups never look at the hashes.
+ */
+struct address_set_t {
+  /** The filter that answers our lookups. */
+  bloomfilt_t *filter;
+  /** During an update that changes the size of the set, a filter of the new
+   * size, which replaces <b>filter</b> when the update ends.  Otherwise
+   * NULL. */
+  bloomfilt_t *next_filter;
+  /** The key for <b>filter</b> and <b>next_filter</b>.  It stays the same
+   * when we resize, so that the hashes we hold stay valid. */
+  uint8_t key[BLOOMFILT_KEY_LEN];
+  /** The hash of every address that we have added since the last update
+   * began.  The first <b>n_sorted</b> are sorted and distinct. */
+  uint64_t *hashes;
+  /** How many entries of <b>hashes</b> are used? */
+  size_t n_hashes;
+  /** How many entries at the start of <b>hashes</b> are sorted? */
+  size_t n_sorted;
+  /** How many entries does <b>hashes</b> have room for? */
+  size_t hashes_cap;
+  /** During an update of a set that keeps its size, the sorted distinct
+   * hashes of the addresses that were in the set when the update began.
+   * Otherwise NULL. */
+  uint64_t *old_hashes;
+  /** How many entries are in <b>old_hashes</b>? */
+  size_t n_old_hashes;
+  /** True iff we are between address_set_begin_update() and
+   * address_set_end_update(). */
+  unsigned int updating : 1;
+};
 
 /** Wrap our hash function to have the signature that the bloom filter
  * needs. */
@@ -25,6 +71,47 @@ bloomfilt_addr_hash(const struct sipkey *key,
   return qed_hs_addr_keyed_hash(key, item);
 }
 
+/** Helper for qsort: compare two uint64_t values. */
+static int
+compare_uint64s_(const void *a_, const void *b_)
+{
+  const uint64_t a = *(const uint64_t *)a_, b = *(const uint64_t *)b_;
+  return (a > b) - (a < b);
+}
+
+/** Sort the hashes in <b>set</b> and drop the duplicates. */
+static void
+address_set_compact_hashes(address_set_t *set)
+{
+  size_t i, n = 0;
+  if (set->n_sorted == set->n_hashes)
+    return;
+  qsort(set->hashes, set->n_hashes, sizeof(uint64_t), compare_uint64s_);
+  for (i = 0; i < set->n_hashes; ++i) {
+    if (n == 0 || set->hashes[n-1] != set->hashes[i])
+      set->hashes[n++] = set->hashes[i];
+  }
+  set->n_hashes = set->n_sorted = n;
+}
+
+/** Remember that <b>hash</b> is in <b>set</b>. */
+static void
+address_set_append_hash(address_set_t *set, uint64_t hash)
+{
+  if (set->n_hashes == set->hashes_cap) {
+    /* We see the same addresses over and over, so try to make room by
+     * dropping duplicates before we grow the array. */
+    if (set->n_hashes - set->n_sorted > set->n_hashes / 2)
+      address_set_compact_hashes(set);
+    if (set->n_hashes >= set->hashes_cap / 2) {
+      set->hashes_cap = set->hashes_cap ? set->hashes_cap * 2 : 16;
+      set->hashes = qed_hs_reallocarray(set->hashes, set->hashes_cap,
+                                        sizeof(uint64_t));
+    }
+  }
+  set->hashes[set->n_hashes++] = hash;
+}
+
 /**
  * Allocate and return an address_set, suitable for holding up to
  * <b>max_address_guess</b> distinct values.
@@ -32,21 +119,41 @@ bloomfilt_addr_hash(const struct sipkey *key,
 address_set_t *
 address_set_new(int max_addresses_guess)
 {
-  uint8_t k[BLOOMFILT_KEY_LEN];
-  crypto_rand((void*)k, sizeof(k));
-  return bloomfilt_new(max_addresses_guess, bloomfilt_addr_hash, k);
+  address_set_t *set = qed_hs_malloc_zero(sizeof(address_set_t));
+  crypto_rand((void*)set->key, sizeof(set->key));
+  set->filter = bloomfilt_new(max_addresses_guess, bloomfilt_addr_hash,
+                              set->key);
+  return set;
+}
+
+/** Free all storage held in <b>set</b>. */
+void
+address_set_free_(address_set_t *set)
+{
+  if (!set)
+    return;
+  bloomfilt_free(set->filter);
+  bloomfilt_free(set->next_filter);
+  qed_hs_free(set->hashes);
+  qed_hs_free(set->old_hashes);
+  memwipe(set->key, 0, sizeof(set->key));
+  qed_hs_free(set);
 }
 
 /**
  * Add <b>addr</b> to <b>set</b>.
  *
- * All future queries for <b>addr</b> in set will return true. Removing
- * items is not possible.
+ * All future queries for <b>addr</b> in set will return true, until an
+ * update of <b>set</b> ends without adding <b>addr</b> again.
  */
 void
 address_set_add(address_set_t *set, const struct qed_hs_addr_t *addr)
 {
-  bloomfilt_add(set, addr);
+  uint64_t hash = bloomfilt_hash(set->filter, addr);
+  bloomfilt_add_hash(set->filter, hash);
+  if (set->next_filter)
+    bloomfilt_add_hash(set->next_filter, hash);
+  address_set_append_hash(set, hash);
 }
 
 /** As address_set_add(), but take an ipv4 address in host order. */
@@ -66,5 +173,93 @@ int
 address_set_probably_contains(const address_set_t *set,
                               const struct qed_hs_addr_t *addr)
 {
-  return bloomfilt_probably_contains(set, addr);
+  return bloomfilt_probably_contains(set->filter, addr);
+}
+
+/**
+ * Begin replacing the contents of <b>set</b> with a new set of addresses,
+ * of which there are about <b>max_addresses_guess</b>.
+ *
+ * Add every address that should be in the new set with address_set_add(),
+ * then call address_set_end_update().  Until then, lookups still find all
+ * the old addresses as well as the new ones; after that, they only find
+ * the new ones.
+ */
+void
+address_set_begin_update(address_set_t *set, int max_addresses_guess)
+{
+  if (set->updating)
+    address_set_end_update(set);
+
+  qed_hs_assert(!set->old_hashes);
+  qed_hs_assert(!set->next_filter);
+
+  if (bloomfilt_is_sized_for(set->filter, max_addresses_guess)) {
+    address_set_compact_hashes(set);
+    set->old_hashes = set->hashes;
+    set->n_old_hashes = set->n_hashes;
+    set->hashes = NULL;
+    set->n_hashes = set->n_sorted = set->hashes_cap = 0;
+  } else {
+    /* The size of the filter is changing, so we fill a new one from
+     * scratch, and don't need to know what was in the old one. */
+    set->next_filter = bloomfilt_new(max_addresses_guess,
+                                     bloomfilt_addr_hash, set->key);
+    set->n_hashes = set->n_sorted = 0;
+  }
+  set->updating = 1;
+}
+
+/**
+ * Finish an update of <b>set</b> that began with
+ * address_set_begin_update(): remove every address that has not been added
+ * since then.
+ */
+void
+address_set_end_update(address_set_t *set)
+{
+  if (BUG(!set->updating))
+    return;
+  set->updating = 0;
+  address_set_compact_hashes(set);
+
+  if (set->next_filter) {
+    bloomfilt_free(set->filter);
+    set->filter = set->next_filter;
+    set->next_filter = NULL;
+    return;
+  }
+
+  /* Both lists of hashes are sorted: walk them together to find the
+   * hashes that are gone, and clear their blocks. */
+  bitarray_t *dirty = NULL;
+  const uint32_t n_blocks = bloomfilt_get_n_blocks(set->filter);
+  size_t i, j = 0;
+  for (i = 0; i < set->n_old_hashes; ++i) {
+    const uint64_t h = set->old_hashes[i];
+    while (j < set->n_hashes && set->hashes[j] < h)
+      ++j;
+    if (j < set->n_hashes && set->hashes[j] == h)
+      continue;
+    const uint32_t block = bloomfilt_hash_get_block(set->filter, h);
+    if (!dirty)
+      dirty = bitarray_init_zero(n_blocks);
+    if (!bitarray_is_set(dirty, block)) {
+      bitarray_set(dirty, block);
+      bloomfilt_clear_block(set->filter, block);
+    }
+  }
+
+  /* Then put back the hashes that still belong in those blocks. */
+  if (dirty) {
+    for (j = 0; j < set->n_hashes; ++j) {
+      const uint64_t h = set->hashes[j];
+      if (bitarray_is_set(dirty, bloomfilt_hash_get_block(set->filter, h)))
+        bloomfilt_add_hash(set->filter, h);
+    }
+    bitarray_free(dirty);
+  }
+
+  qed_hs_free(set->old_hashes);
+  set->n_old_hashes = 0;
 }
@@ -20,13 +20,18 @@ struct qed_hs_addr_t;
  * is probabilistic: false negatives cannot occur but false positives are
  * possible.
  */
-typedef struct bloomfilt_t address_set_t;
+typedef struct address_set_t address_set_t;
 
 address_set_t *address_set_new(int max_addresses_guess);
-#define address_set_free(set) bloomfilt_free(set)
+void address_set_free_(address_set_t *set);
+#define address_set_free(set) \
+  FREE_AND_NULL(address_set_t, address_set_free_, (set))
 void address_set_add(address_set_t *set, const struct qed_hs_addr_t *addr);
 void address_set_add_ipv4h(address_set_t *set, uint32_t addr);
 int address_set_probably_contains(const address_set_t *set,
                                   const struct qed_hs_addr_t *addr);
 
+void address_set_begin_update(address_set_t *set, int max_addresses_guess);
+void address_set_end_update(address_set_t *set);
+
 #endif /* !defined(QED_HS_ADDRESS_SET_H) */
@@ -62,6 +62,7 @@
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
 #include "core/or/channeltls.h"
+#include "core/or/circid_map.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
@@ -947,6 +948,9 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  /* Drop any placeholders left for circuit IDs with pending destroys */
+  circid_map_free(chan->circid_map);
+
   qed_hs_free(chan);
 }
 
@@ -1018,6 +1022,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  circid_map_free(chan->circid_map);
+
   qed_hs_free(chan);
 }
 
@@ -409,6 +409,11 @@ struct channel_t {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Map from circuit ID to the circuit using it on this channel, including
+   * placeholders for IDs that are waiting on a destroy cell.  Allocated on
+   * first use, and maintained by circuitlist.c. */
+  struct circid_map_t *circid_map;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -179,8 +179,11 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  /* We only have one policy for now so always set it to EWMA. */
-  circuitmux_set_policy(chan->cmux, &ewma_policy);
+  /* Both of our policies are EWMA; they differ only in their queue. */
+  if (get_options()->CircuitPriorityCalendarQueue)
+    circuitmux_set_policy(chan->cmux, &ewma_calq_policy);
+  else
+    circuitmux_set_policy(chan->cmux, &ewma_policy);
 }
 
 /**
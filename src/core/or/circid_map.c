@@ -0,0 +1,196 @@
+/* Copyright (c) 2026, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_map.c
+ * \brief Per-channel map from circuit ID to circuit.
+ *
+ * We look up a circuit by channel and circuit ID every time a cell arrives,
+ * so this lookup needs to be fast.  Each channel owns one of these maps, so
+ * that the lookup never has to hash the channel pointer or walk entries
+ * belonging to other channels, and entries are stored inline in an
+ * open-addressing table so that finding one touches a single contiguous run
+ * of slots instead of chasing a chain of separately allocated nodes.
+ *
+ * We use robin-hood hashing: on insertion, an entry that is further from
+ * its home slot displaces one that is closer to its own, which keeps probe
+ * sequences short and lets unsuccessful lookups stop early.  Removal shifts
+ * the following entries back by one slot, so there are no tombstones.
+ *
+ * Circuit IDs are chosen by our peers, so we hash them with siphash to keep
+ * an adversary from picking IDs that collide.
+ **/
+
+#define CIRCID_MAP_PRIVATE
+#include "core/or/or.h"
+#include "core/or/circid_map.h"
+#include "ext/siphash.h"
+
+/** Return the slot that <b>id</b> hashes to in a map with
+ * <b>capacity</b> slots. */
+static inline unsigned
+circid_map_home_slot(circid_t id, unsigned capacity)
+{
+  return (unsigned) siphash24g(&id, sizeof(id)) & (capacity - 1);
+}
+
+/** Allocate and return a new empty circid_map_t. */
+circid_map_t *
+circid_map_new(void)
+{
+  circid_map_t *map = qed_hs_malloc_zero(sizeof(circid_map_t));
+  map->capacity = CIRCID_MAP_MIN_CAPACITY;
+  map->ents = qed_hs_calloc(map->capacity, sizeof(circid_map_ent_t));
+  return map;
+}
+
+/** Release all storage held by <b>map</b>.  Does not free the circuits. */
+void
+circid_map_free_(circid_map_t *map)
+{
+  if (!map)
+    return;
+  qed_hs_free(map->ents);
+  qed_hs_free(map);
+}
+
+/** Return the number of entries (including placeholders) in <b>map</b>. */
+size_t
+circid_map_size(const circid_map_t *map)
+{
+  return map ? map->n_ents : 0;
+}
+
+/** Return the entry for <b>id</b> in <b>map</b>, or NULL if there is none.
+ * The returned pointer is invalidated by any insertion or removal. */
+circid_map_ent_t *
+circid_map_find(const circid_map_t *map, circid_t id)
+{
+  unsigned mask, idx;
+  uint32_t probe_len;
+
+  if (!map || !map->n_ents)
+    return NULL;
+
+  mask = map->capacity - 1;
+  idx = circid_map_home_slot(id, map->capacity);
+  for (probe_len = 1; ; ++probe_len, idx = (idx + 1) & mask) {
+    circid_map_ent_t *ent = &map->ents[idx];
+    /* With robin-hood ordering, once we reach an empty slot or an entry
+     * closer to its home than we are to ours, id cannot be further on. */
+    if (ent->probe_len < probe_len)
+      return NULL;
+    if (ent->circ_id == id)
+      return ent;
+  }
+}
+
+/** Helper: insert <b>ent</b>, whose circ_id is not already present, into
+ * <b>map</b>, which must have a free slot.  Return the slot where it was
+ * placed. */
+static circid_map_ent_t *
+circid_map_insert_new(circid_map_t *map, circid_map_ent_t ent)
+{
+  unsigned mask = map->capacity - 1;
+  unsigned idx = circid_map_home_slot(ent.circ_id, map->capacity);
+  circid_map_ent_t *result = NULL;
+
+  ent.probe_len = 1;
+  for (;; idx = (idx + 1) & mask, ++ent.probe_len) {
+    circid_map_ent_t *slot = &map->ents[idx];
+    if (slot->probe_len == 0) {
+      *slot = ent;
+      ++map->n_ents;
+      return result ? result : slot;
+    }
+    if (slot->probe_len < ent.probe_len) {
+      /* Take this slot from a richer entry, and carry that entry on. */
+      circid_map_ent_t tmp = *slot;
+      *slot = ent;
+      ent = tmp;
+      if (!result)
+        result = slot;
+    }
+  }
+}
+
+/** Helper: move every entry of <b>map</b> into a table of
+ * <b>new_capacity</b> slots. */
+static void
+circid_map_resize(circid_map_t *map, unsigned new_capacity)
+{
+  circid_map_ent_t *old_ents = map->ents;
+  unsigned old_capacity = map->capacity, i;
+
+  qed_hs_assert(new_capacity >= map->n_ents);
+
+  map->ents = qed_hs_calloc(new_capacity, sizeof(circid_map_ent_t));
+  map->capacity = new_capacity;
+  map->n_ents = 0;
+  for (i = 0; i < old_capacity; ++i) {
+    if (old_ents[i].probe_len)
+      circid_map_insert_new(map, old_ents[i]);
+  }
+  qed_hs_free(old_ents);
+}
+
+/** Return the entry for <b>id</b> in <b>map</b>, adding an empty one (with
+ * no circuit) if there is none.  The returned pointer is invalidated by any
+ * later insertion or removal. */
+circid_map_ent_t *
+circid_map_find_or_insert(circid_map_t *map, circid_t id)
+{
+  circid_map_ent_t *ent, new_ent;
+
+  qed_hs_assert(map);
+
+  ent = circid_map_find(map, id);
+  if (ent)
+    return ent;
+
+  /* Keep the load factor at or below 7/8. */
+  if ((map->n_ents + 1) * 8 > map->capacity * 7)
+    circid_map_resize(map, map->capacity * 2);
+
+  memset(&new_ent, 0, sizeof(new_ent));
+  new_ent.circ_id = id;
+  return circid_map_insert_new(map, new_ent);
+}
+
+/** Remove the entry for <b>id</b> from <b>map</b>.  If there was one, copy
+ * it into *<b>removed_out</b> (if provided) and return 1; otherwise return
+ * 0. */
+int
+circid_map_remove(circid_map_t *map, circid_t id,
+                  circid_map_ent_t *removed_out)
+{
+  circid_map_ent_t *ent = circid_map_find(map, id);
+  unsigned mask, idx, next;
+
+  if (!ent)
+    return 0;
+  if (removed_out)
+    *removed_out = *ent;
+
+  /* Shift each following entry that is away from its home slot back by one,
+   * so that lookups never need to skip over a hole. */
+  mask = map->capacity - 1;
+  idx = (unsigned)(ent - map->ents);
+  for (;;) {
+    next = (idx + 1) & mask;
+    if (map->ents[next].probe_len <= 1)
+      break;
+    map->ents[idx] = map->ents[next];
+    --map->ents[idx].probe_len;
+    idx = next;
+  }
+  memset(&map->ents[idx], 0, sizeof(circid_map_ent_t));
+  --map->n_ents;
+
+  /* Give memory back once a busy channel has quieted down. */
+  if (map->capacity > CIRCID_MAP_MIN_CAPACITY &&
+      map->n_ents * 8 < map->capacity)
+    circid_map_resize(map, map->capacity / 2);
+
+  return 1;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2026, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_map.h
+ * \brief Header file for circid_map.c.
+ **/
+
+#ifndef QED_HS_CIRCID_MAP_H
+#define QED_HS_CIRCID_MAP_H
+
+#include "core/or/or.h"
+
+/**
+ * One entry in a circid_map_t: the circuit (if any) using a circuit ID on
+ * the channel that owns the map.
+ */
+typedef struct circid_map_ent_t {
+  /** The circuit ID for this entry. */
+  circid_t circ_id;
+  /** Zero if this slot is empty; otherwise one more than the distance from
+   * this slot to the slot that circ_id hashes to. */
+  uint32_t probe_len;
+  /** The circuit using circ_id, or NULL if this is a placeholder that keeps
+   * the ID from being reused while a destroy cell is pending. */
+  circuit_t *circuit;
+  /** For debugging 12184: when was this placeholder item added? */
+  time_t made_placeholder_at;
+} circid_map_ent_t;
+
+/**
+ * A map from circuit ID to circuit for the circuits on a single channel.
+ *
+ * This is an open-addressing table using robin-hood hashing, storing its
+ * entries inline so that a lookup touches one contiguous run of memory.
+ * Pointers to entries are only valid until the next insertion or removal.
+ */
+typedef struct circid_map_t circid_map_t;
+
+circid_map_t *circid_map_new(void);
+void circid_map_free_(circid_map_t *map);
+#define circid_map_free(map) \
+  FREE_AND_NULL(circid_map_t, circid_map_free_, (map))
+
+circid_map_ent_t *circid_map_find(const circid_map_t *map, circid_t id);
+circid_map_ent_t *circid_map_find_or_insert(circid_map_t *map, circid_t id);
+int circid_map_remove(circid_map_t *map, circid_t id,
+                      circid_map_ent_t *removed_out);
+size_t circid_map_size(const circid_map_t *map);
+
+#ifdef CIRCID_MAP_PRIVATE
+struct circid_map_t {
+  /** Array of capacity entries; capacity is a power of two. */
+  circid_map_ent_t *ents;
+  /** Number of slots in ents. */
+  unsigned capacity;
+  /** Number of nonempty slots in ents. */
+  unsigned n_ents;
+};
+
+/** Initial number of slots in a circid_map_t. */
+#define CIRCID_MAP_MIN_CAPACITY 8
+#endif /* defined(CIRCID_MAP_PRIVATE) */
+
+#endif /* !defined(QED_HS_CIRCID_MAP_H) */
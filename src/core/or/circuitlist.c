@@ -56,6 +56,7 @@
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
+#include "core/or/circid_map.h"
 #include "feature/client/circpathbias.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -194,58 +195,6 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
-  circid_t circ_id;
-  circuit_t *circuit;
-  /* For debugging 12184: when was this placeholder item added? */
-  time_t made_placeholder_at;
-} chan_circid_circuit_map_t;
-
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
-static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
-{
-  return a->chan == b->chan && a->circ_id == b->circ_id;
-}
-
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
-{
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_);
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             qed_hs_reallocarray_, qed_hs_free_);
-
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
-
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
  * to <b>chan, id</b>.  Adjust the chan,circid map as appropriate, removing
@@ -255,8 +204,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  circid_map_ent_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -277,14 +225,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -298,12 +238,8 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
       circuitmux_detach_circuit(old_chan->cmux, circ);
     }
 
-    /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-    if (found) {
-      qed_hs_free(found);
+    /* we may need to remove it from the channel's circid map */
+    if (circid_map_remove(old_chan->circid_map, old_id, NULL)) {
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -322,20 +258,12 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (chan == NULL)
     return;
 
-  /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
-    found->circuit = circ;
-    found->made_placeholder_at = 0;
-  } else {
-    found = qed_hs_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
-    found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
-  }
+  /* now add the new one to the channel's circid map */
+  if (!chan->circid_map)
+    chan->circid_map = circid_map_new();
+  found = circid_map_find_or_insert(chan->circid_map, id);
+  found->circuit = circ;
+  found->made_placeholder_at = 0;
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -371,14 +299,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  circid_map_ent_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = circid_map_find(chan->circid_map, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -389,12 +313,11 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
   } else {
-    ent = qed_hs_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
+    if (!chan->circid_map)
+      chan->circid_map = circid_map_new();
+    ent = circid_map_find_or_insert(chan->circid_map, id);
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
   }
 }
 
@@ -404,22 +327,14 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  circid_map_ent_t removed;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-  if (ent && ent->circuit) {
+  if (circid_map_remove(chan->circid_map, id, &removed) &&
+      removed.circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
-    return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  qed_hs_free(ent);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -1368,20 +1283,6 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
-
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      qed_hs_assert(c->circuit == NULL);
-      qed_hs_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
 }
 
 /** A helper function for circuit_dump_by_conn() below. Log a bunch
@@ -1477,19 +1378,8 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  const circid_map_ent_t *found = circid_map_find(chan->circid_map, circ_id);
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1586,14 +1476,7 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  const circid_map_ent_t *found = circid_map_find(chan->circid_map, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -23,6 +23,13 @@
  * circuitmux periodically, so that we don't overflow double.
  *
  *
+ * This module provides two implementations of the same policy.  The default,
+ * ewma_policy, keeps the active circuits in a binary heap.  The alternative,
+ * ewma_calq_policy, keeps them in a calendar queue of logarithmically sized
+ * buckets: picking and updating a circuit are O(1), at the cost of serving
+ * circuits whose counts fall in the same bucket in round-robin order rather
+ * than strictly by count.
+ *
  * This module should be used through the interfaces in circuitmux.c, which it
  * implements.
  *
@@ -39,6 +46,7 @@
 #include "core/or/circuitmux_ewma.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/intmath/bits.h"
 #include "feature/nodelist/networkstatus.h"
 #include "app/config/or_options_st.h"
 
@@ -62,6 +70,11 @@ static int ewma_tick_len = EWMA_TICK_LEN_DEFAULT;
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
+/** In the calendar queue, once a cell sent now would be weighted more than
+ * this many times as heavily as a cell sent at the start of the epoch tick,
+ * we renormalize all the active circuits to the current tick. */
+#define EWMA_CALQ_MAX_DRIFT 65536.0
+
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
@@ -111,6 +124,37 @@ static int
 ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2);
 
+/*** Calendar queue circuitmux policy methods ***/
+
+static circuitmux_policy_data_t *
+ewma_calq_alloc_cmux_data(circuitmux_t *cmux);
+static void ewma_calq_free_cmux_data(circuitmux_t *cmux,
+                                     circuitmux_policy_data_t *pol_data);
+static void
+ewma_calq_notify_circ_active(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data,
+                             circuit_t *circ,
+                             circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_calq_notify_circ_inactive(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data,
+                               circuit_t *circ,
+                               circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+ewma_calq_notify_xmit_cells(circuitmux_t *cmux,
+                            circuitmux_policy_data_t *pol_data,
+                            circuit_t *circ,
+                            circuitmux_policy_circ_data_t *pol_circ_data,
+                            unsigned int n_cells);
+static circuit_t *
+ewma_calq_pick_active_circuit(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data);
+static int
+ewma_calq_cmp_cmux(circuitmux_t *cmux_1,
+                   circuitmux_policy_data_t *pol_data_1,
+                   circuitmux_t *cmux_2,
+                   circuitmux_policy_data_t *pol_data_2);
+
 /*** EWMA global variables ***/
 
 /** The per-tick scale factor to be used when computing cell-count EWMA
@@ -134,6 +178,21 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
+/*** EWMA calendar queue circuitmux_policy_t method table ***/
+
+circuitmux_policy_t ewma_calq_policy = {
+  /*.alloc_cmux_data =*/ ewma_calq_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_calq_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_calq_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_calq_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* EWMA doesn't need this */
+  /*.notify_xmit_cells =*/ ewma_calq_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_calq_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_calq_cmp_cmux
+};
+
 /** Have we initialized the ewma tick-counting logic? */
 static int ewma_ticks_initialized = 0;
 /** At what monotime_coarse_t did the current tick begin? */
@@ -228,6 +287,7 @@ ewma_alloc_circ_data(circuitmux_t *cmux,
   cdata->cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
   cdata->cell_ewma.cell_count = 0.0;
   cdata->cell_ewma.heap_index = -1;
+  cdata->cell_ewma.calq_bucket = -1;
   if (direction == CELL_DIRECTION_IN) {
     cdata->cell_ewma.is_for_p_chan = 1;
   } else {
@@ -720,6 +780,346 @@ pop_first_cell_ewma(ewma_policy_data_t *pol)
                               offsetof(cell_ewma_t, heap_index));
 }
 
+/* ==== Calendar queue implementation of the EWMA policy ==== */
+
+/** Return the calendar queue bucket for a circuit whose cell count (scaled
+ * to its policy's epoch tick) is <b>count</b>.  Buckets are
+ * 1/EWMA_CALQ_BUCKETS_PER_OCTAVE of a doubling wide, and counts outside
+ * their range are clamped to the first or last bucket. */
+STATIC int
+ewma_calq_bucket_for_count(double count)
+{
+  int exponent, idx;
+  double mantissa;
+
+  if (!(count > 0.0))
+    return 0;
+
+  /* count == mantissa * 2^exponent, with 0.5 <= mantissa < 1. */
+  mantissa = frexp(count, &exponent);
+  if (exponent - 1 < EWMA_CALQ_MIN_EXPONENT)
+    return 0;
+  if (exponent - 1 >= EWMA_CALQ_MIN_EXPONENT +
+      EWMA_CALQ_N_BUCKETS / EWMA_CALQ_BUCKETS_PER_OCTAVE)
+    return EWMA_CALQ_N_BUCKETS - 1;
+
+  idx = (exponent - 1 - EWMA_CALQ_MIN_EXPONENT) * EWMA_CALQ_BUCKETS_PER_OCTAVE;
+  idx += (int)((mantissa * 2.0 - 1.0) * EWMA_CALQ_BUCKETS_PER_OCTAVE);
+  qed_hs_assert(idx >= 0 && idx < EWMA_CALQ_N_BUCKETS);
+  return idx;
+}
+
+/** Append <b>ewma</b> to the end of the appropriate bucket of <b>pol</b>,
+ * without rescaling it. */
+static void
+calq_insert(ewma_calq_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int b = ewma_calq_bucket_for_count(ewma->cell_count);
+  cell_ewma_t *head = pol->buckets[b];
+
+  if (head) {
+    ewma->calq_next = head;
+    ewma->calq_prev = head->calq_prev;
+    head->calq_prev->calq_next = ewma;
+    head->calq_prev = ewma;
+  } else {
+    ewma->calq_next = ewma->calq_prev = ewma;
+    pol->buckets[b] = ewma;
+    pol->nonempty[b / 64] |= UINT64_C(1) << (b % 64);
+  }
+  ewma->calq_bucket = b;
+  ++pol->n_active;
+}
+
+/** Remove <b>ewma</b> from whichever bucket of <b>pol</b> holds it. */
+static void
+calq_remove(ewma_calq_policy_data_t *pol, cell_ewma_t *ewma)
+{
+  int b = ewma->calq_bucket;
+
+  qed_hs_assert(b >= 0 && b < EWMA_CALQ_N_BUCKETS);
+  qed_hs_assert(pol->buckets[b]);
+
+  if (ewma->calq_next == ewma) {
+    pol->buckets[b] = NULL;
+    pol->nonempty[b / 64] &= ~(UINT64_C(1) << (b % 64));
+  } else {
+    ewma->calq_prev->calq_next = ewma->calq_next;
+    ewma->calq_next->calq_prev = ewma->calq_prev;
+    if (pol->buckets[b] == ewma)
+      pol->buckets[b] = ewma->calq_next;
+  }
+  ewma->calq_next = ewma->calq_prev = NULL;
+  ewma->calq_bucket = -1;
+  --pol->n_active;
+}
+
+/** Return the cell_ewma_t that <b>pol</b> would like to send from next, or
+ * NULL if it has no active circuits. */
+static cell_ewma_t *
+calq_first(const ewma_calq_policy_data_t *pol)
+{
+  int i;
+  for (i = 0; i < EWMA_CALQ_BITMAP_WORDS; ++i) {
+    uint64_t w = pol->nonempty[i];
+    if (w) {
+      /* Isolate the lowest set bit and find its position. */
+      int b = i * 64 + qed_hs_log2(w & (~w + 1));
+      return pol->buckets[b];
+    }
+  }
+  return NULL;
+}
+
+/** Rescale every active circuit on <b>pol</b> to <b>cur_tick</b>, and
+ * move each into the bucket for its new cell count. */
+static void
+calq_renormalize(ewma_calq_policy_data_t *pol, unsigned cur_tick)
+{
+  cell_ewma_t *old_buckets[EWMA_CALQ_N_BUCKETS];
+  double factor = get_scale_factor(pol->epoch_tick, cur_tick);
+  int i;
+
+  memcpy(old_buckets, pol->buckets, sizeof(old_buckets));
+  memset(pol->buckets, 0, sizeof(pol->buckets));
+  memset(pol->nonempty, 0, sizeof(pol->nonempty));
+  pol->n_active = 0;
+
+  /* Every count is multiplied by the same factor, so walking the old buckets
+   * in order keeps circuits in the same relative order. */
+  for (i = 0; i < EWMA_CALQ_N_BUCKETS; ++i) {
+    cell_ewma_t *head = old_buckets[i], *e, *next;
+    if (!head)
+      continue;
+    e = head;
+    do {
+      next = e->calq_next;
+      qed_hs_assert(e->last_adjusted_tick == pol->epoch_tick);
+      e->cell_count *= factor;
+      e->last_adjusted_tick = cur_tick;
+      calq_insert(pol, e);
+      e = next;
+    } while (e != head);
+  }
+  pol->epoch_tick = cur_tick;
+}
+
+/**
+ * Allocate an ewma_calq_policy_data_t and upcast it to a
+ * circuitmux_policy_data_t; this is called when setting the policy on a
+ * circuitmux_t to ewma_calq_policy.
+ */
+
+static circuitmux_policy_data_t *
+ewma_calq_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+
+  qed_hs_assert(cmux);
+
+  pol = qed_hs_malloc_zero(sizeof(*pol));
+  pol->base_.magic = EWMA_CALQ_POL_DATA_MAGIC;
+  pol->epoch_tick = cell_ewma_get_tick();
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free an ewma_calq_policy_data_t allocated with ewma_calq_alloc_cmux_data()
+ */
+
+static void
+ewma_calq_free_cmux_data(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+
+  qed_hs_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_EWMA_CALQ_POL_DATA(pol_data);
+
+  memwipe(pol, 0xda, sizeof(ewma_calq_policy_data_t));
+  qed_hs_free(pol);
+}
+
+/**
+ * Handle circuit activation; this scales the circuit's cell_ewma to the
+ * policy's epoch and inserts it into the calendar queue.
+ */
+
+static void
+ewma_calq_notify_circ_active(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data,
+                             circuit_t *circ,
+                             circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+
+  qed_hs_assert(cmux);
+  qed_hs_assert(pol_data);
+  qed_hs_assert(circ);
+  qed_hs_assert(pol_circ_data);
+
+  pol = TO_EWMA_CALQ_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+
+  qed_hs_assert(cdata->cell_ewma.calq_bucket == -1);
+  scale_single_cell_ewma(&cdata->cell_ewma, pol->epoch_tick);
+  calq_insert(pol, &cdata->cell_ewma);
+}
+
+/**
+ * Handle circuit deactivation; this removes the circuit's cell_ewma from
+ * the calendar queue.
+ */
+
+static void
+ewma_calq_notify_circ_inactive(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data,
+                               circuit_t *circ,
+                               circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+
+  qed_hs_assert(cmux);
+  qed_hs_assert(pol_data);
+  qed_hs_assert(circ);
+  qed_hs_assert(pol_circ_data);
+
+  pol = TO_EWMA_CALQ_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+
+  calq_remove(pol, &cdata->cell_ewma);
+}
+
+/**
+ * Update cell_ewma for this circuit after we've sent some cells, and move
+ * it to the tail of the bucket for its new count.
+ */
+
+static void
+ewma_calq_notify_xmit_cells(circuitmux_t *cmux,
+                            circuitmux_policy_data_t *pol_data,
+                            circuit_t *circ,
+                            circuitmux_policy_circ_data_t *pol_circ_data,
+                            unsigned int n_cells)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+  ewma_policy_circ_data_t *cdata = NULL;
+  unsigned int tick;
+  double fractional_tick, drift;
+  cell_ewma_t *cell_ewma;
+
+  qed_hs_assert(cmux);
+  qed_hs_assert(pol_data);
+  qed_hs_assert(circ);
+  qed_hs_assert(pol_circ_data);
+  qed_hs_assert(n_cells > 0);
+
+  pol = TO_EWMA_CALQ_POL_DATA(pol_data);
+  cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
+  cell_ewma = &(cdata->cell_ewma);
+
+  /* Since we just sent on this circuit, it should be the one we picked. */
+  qed_hs_assert(calq_first(pol) == cell_ewma);
+
+  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+
+  /* Weight of a cell sent at the start of this tick, relative to the epoch.
+   * Only rescale everything once that weight gets large. */
+  drift = get_scale_factor(tick, pol->epoch_tick);
+  if (drift > EWMA_CALQ_MAX_DRIFT) {
+    calq_renormalize(pol, tick);
+    drift = 1.0;
+  }
+
+  calq_remove(pol, cell_ewma);
+  cell_ewma->cell_count +=
+    ((double)(n_cells)) * drift * pow(ewma_scale_factor, -fractional_tick);
+  calq_insert(pol, cell_ewma);
+}
+
+/**
+ * Pick the preferred circuit to send from; this will be the oldest entry in
+ * the lowest nonempty bucket.
+ */
+
+static circuit_t *
+ewma_calq_pick_active_circuit(circuitmux_t *cmux,
+                              circuitmux_policy_data_t *pol_data)
+{
+  ewma_calq_policy_data_t *pol = NULL;
+  cell_ewma_t *cell_ewma = NULL;
+
+  qed_hs_assert(cmux);
+  qed_hs_assert(pol_data);
+
+  pol = TO_EWMA_CALQ_POL_DATA(pol_data);
+
+  cell_ewma = calq_first(pol);
+  return cell_ewma ? cell_ewma_to_circuit(cell_ewma) : NULL;
+}
+
+/**
+ * Compare two calendar-queue EWMA cmuxes, and return -1, 0 or 1 to indicate
+ * which should be more preferred - see circuitmux_compare_muxes() of
+ * circuitmux.c.
+ */
+
+static int
+ewma_calq_cmp_cmux(circuitmux_t *cmux_1,
+                   circuitmux_policy_data_t *pol_data_1,
+                   circuitmux_t *cmux_2,
+                   circuitmux_policy_data_t *pol_data_2)
+{
+  ewma_calq_policy_data_t *p1 = NULL, *p2 = NULL;
+  cell_ewma_t *ce1 = NULL, *ce2 = NULL;
+  double c1, c2;
+
+  qed_hs_assert(cmux_1);
+  qed_hs_assert(pol_data_1);
+  qed_hs_assert(cmux_2);
+  qed_hs_assert(pol_data_2);
+
+  p1 = TO_EWMA_CALQ_POL_DATA(pol_data_1);
+  p2 = TO_EWMA_CALQ_POL_DATA(pol_data_2);
+
+  if (p1 == p2)
+    return 0;
+
+  ce1 = calq_first(p1);
+  ce2 = calq_first(p2);
+
+  if (ce1 == NULL || ce2 == NULL) {
+    /* Prefer whichever one has a circuit, if either does. */
+    if (ce1 != NULL)
+      return -1;
+    else if (ce2 != NULL)
+      return 1;
+    else
+      return 0;
+  }
+
+  /* The two queues may have different epochs: compare their counts on the
+   * scale of the later one. */
+  c1 = ce1->cell_count;
+  c2 = ce2->cell_count;
+  if ((int)(p1->epoch_tick - p2->epoch_tick) < 0)
+    c1 *= get_scale_factor(p1->epoch_tick, p2->epoch_tick);
+  else
+    c2 *= get_scale_factor(p2->epoch_tick, p1->epoch_tick);
+
+  if (c1 < c2)
+    return -1;
+  else if (c1 > c2)
+    return 1;
+  else
+    return 0;
+}
+
 /**
  * Drop all resources held by circuitmux_ewma.c, and deinitialize the
  * module. */
@@ -14,6 +14,8 @@
 
 /* The public EWMA policy callbacks object. */
 extern circuitmux_policy_t ewma_policy;
+/* The EWMA policy, using a calendar queue instead of a binary heap. */
+extern circuitmux_policy_t ewma_calq_policy;
 
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
@@ -28,6 +30,7 @@ void circuitmux_ewma_free_all(void);
 typedef struct cell_ewma_t cell_ewma_t;
 typedef struct ewma_policy_data_t ewma_policy_data_t;
 typedef struct ewma_policy_circ_data_t ewma_policy_circ_data_t;
+typedef struct ewma_calq_policy_data_t ewma_calq_policy_data_t;
 
 /**
  * The cell_ewma_t structure keeps track of how many cells a circuit has
@@ -51,6 +54,11 @@ struct cell_ewma_t {
   /** The position of the circuit within the OR connection's priority
    * queue. */
   int heap_index;
+  /** The calendar queue bucket holding this circuit, or -1 if it is not in
+   * a calendar queue. */
+  int calq_bucket;
+  /** Links within a calendar queue bucket's circular list. */
+  cell_ewma_t *calq_next, *calq_prev;
 };
 
 struct ewma_policy_data_t {
@@ -91,7 +99,46 @@ struct ewma_policy_circ_data_t {
   circuit_t *circ;
 };
 
+/** How many calendar queue buckets do we use for each doubling of the cell
+ * count? */
+#define EWMA_CALQ_BUCKETS_PER_OCTAVE 4
+/** Binary exponent of the smallest cell count with its own bucket; anything
+ * smaller shares bucket 0. */
+#define EWMA_CALQ_MIN_EXPONENT (-15)
+/** Total number of calendar queue buckets; cell counts above the range
+ * covered by these all share the last bucket. */
+#define EWMA_CALQ_N_BUCKETS 256
+/** Number of words in the bitmap of nonempty calendar queue buckets. */
+#define EWMA_CALQ_BITMAP_WORDS (EWMA_CALQ_N_BUCKETS / 64)
+
+/**
+ * Policy data for the calendar-queue variant of EWMA.
+ *
+ * Active circuits are kept in buckets indexed by the logarithm of their
+ * cell count, with a bitmap of nonempty buckets.  Picking a circuit takes
+ * the oldest entry in the lowest nonempty bucket, so circuits whose counts
+ * are within a bucket's width of each other are served round-robin.
+ *
+ * Cell counts are kept scaled to <b>epoch_tick</b>.  Since rescaling every
+ * active circuit by the same factor preserves their order, we do not rescale
+ * on every tick: we only renormalize (and rebucket) when new cells would be
+ * weighted too heavily relative to the epoch.
+ */
+struct ewma_calq_policy_data_t {
+  circuitmux_policy_data_t base_;
+
+  /** For each bucket, the first entry in its circular list, or NULL. */
+  cell_ewma_t *buckets[EWMA_CALQ_N_BUCKETS];
+  /** Bit <b>i</b> is set iff buckets[i] is nonempty. */
+  uint64_t nonempty[EWMA_CALQ_BITMAP_WORDS];
+  /** Number of circuits in all buckets. */
+  int n_active;
+  /** The tick to which the cell_count of every active circuit is scaled. */
+  unsigned int epoch_tick;
+};
+
 #define EWMA_POL_DATA_MAGIC 0x2fd8b16aU
+#define EWMA_CALQ_POL_DATA_MAGIC 0x5a1c4e37U
 #define EWMA_POL_CIRC_DATA_MAGIC 0x761e7747U
 
 /*** Downcasts for the above types ***/
@@ -113,6 +160,23 @@ TO_EWMA_POL_DATA(circuitmux_policy_data_t *pol)
   }
 }
 
+/**
+ * Downcast a circuitmux_policy_data_t to an ewma_calq_policy_data_t and
+ * assert if the cast is impossible.
+ */
+
+static inline ewma_calq_policy_data_t *
+TO_EWMA_CALQ_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    qed_hs_assertf(pol->magic == EWMA_CALQ_POL_DATA_MAGIC,
+                "Mismatch: %"PRIu32" != %"PRIu32,
+                pol->magic, EWMA_CALQ_POL_DATA_MAGIC);
+    return DOWNCAST(ewma_calq_policy_data_t, pol);
+  }
+}
+
 /**
  * Downcast a circuitmux_policy_circ_data_t to an ewma_policy_circ_data_t
  * and assert if the cast is impossible.
@@ -132,6 +196,7 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 
 STATIC unsigned cell_ewma_get_current_tick_and_fraction(double *remainder_out);
 STATIC void cell_ewma_initialize_ticks(void);
+STATIC int ewma_calq_bucket_for_count(double count);
 
 #endif /* defined(CIRCUITMUX_EWMA_PRIVATE) */
 
@@ -2699,8 +2699,48 @@ policy_summarize(smartlist_t *policy, sa_family_t family)
   return result;
 }
 
+/** Return the number of bytes in a short_policy_t with <b>n_entries</b>
+ * entries. */
+static inline size_t
+short_policy_size(unsigned n_entries)
+{
+  return offsetof(short_policy_t, entries) +
+    sizeof(short_policy_entry_t)*n_entries;
+}
+
+/** Return a hashcode for <b>policy</b>. */
+static inline unsigned int
+short_policy_hash(const short_policy_t *policy)
+{
+  return (unsigned) siphash24g(policy->entries,
+                   sizeof(short_policy_entry_t)*policy->n_entries) ^
+    policy->is_accept;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> are the same policy. */
+static inline int
+short_policy_eq(const short_policy_t *a, const short_policy_t *b)
+{
+  return a->is_accept == b->is_accept && a->n_entries == b->n_entries &&
+    fast_memeq(a->entries, b->entries,
+               sizeof(short_policy_entry_t)*a->n_entries);
+}
+
+/** Hashtable holding the one shared copy of each short_policy_t. */
+static HT_HEAD(short_policy_map, short_policy_t) the_short_policies
+  = HT_INITIALIZER();
+
+HT_PROTOTYPE(short_policy_map, short_policy_t, node, short_policy_hash,
+             short_policy_eq);
+HT_GENERATE2(short_policy_map, short_policy_t, node, short_policy_hash,
+             short_policy_eq, 0.6, qed_hs_reallocarray_, qed_hs_free_);
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
- * if the string is not well-formed. */
+ * if the string is not well-formed.
+ *
+ * The result is shared with every other holder of the same policy; release
+ * it with short_policy_free().  The table of shared policies isn't locked,
+ * so only call this from the main thread. */
 short_policy_t *
 parse_short_policy(const char *summary)
 {
@@ -2711,6 +2751,8 @@ parse_short_policy(const char *summary)
   short_policy_entry_t entries[MAX_EXITPOLICY_SUMMARY_LEN]; /* overkill */
   char *next;
 
+  qed_hs_assert_nonfatal_once(in_main_thread());
+
   if (!strcmpstart(summary, "accept ")) {
     is_accept = 1;
     summary += strlen("accept ");
@@ -2783,8 +2825,7 @@ parse_short_policy(const char *summary)
   }
 
   {
-    size_t size = offsetof(short_policy_t, entries) +
-      sizeof(short_policy_entry_t)*(n_entries);
+    size_t size = short_policy_size(n_entries);
     result = qed_hs_malloc_zero(size);
 
     qed_hs_assert( (char*)&result->entries[n_entries-1] < ((char*)result)+size);
@@ -2793,6 +2834,16 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+
+  short_policy_t *found = HT_FIND(short_policy_map, &the_short_policies,
+                                  result);
+  if (found) {
+    qed_hs_free(result);
+    result = found;
+  } else {
+    HT_INSERT(short_policy_map, &the_short_policies, result);
+  }
+  ++result->refcnt;
   return result;
 
  bad_ent:
@@ -2827,11 +2878,20 @@ write_short_policy(const short_policy_t *policy)
   return answer;
 }
 
-/** Release all storage held in <b>policy</b>. */
+/** Release a reference to <b>policy</b>, and free it if it was the last
+ * one.  Only call this from the main thread. */
 void
 short_policy_free_(short_policy_t *policy)
 {
-  qed_hs_free(policy);
+  if (!policy)
+    return;
+
+  qed_hs_assert_nonfatal_once(in_main_thread());
+  qed_hs_assert(policy->refcnt > 0);
+  if (--policy->refcnt == 0) {
+    HT_REMOVE(short_policy_map, &the_short_policies, policy);
+    qed_hs_free(policy);
+  }
 }
 
 /** See whether the <b>addr</b>:<b>port</b> address is likely to be accepted
@@ -3153,4 +3213,5 @@ policies_free_all(void)
     }
   }
   HT_CLEAR(policy_map, &policy_root);
+  HT_CLEAR(short_policy_map, &the_short_policies);
 }
@@ -12,6 +12,8 @@
 #ifndef QED_HS_POLICIES_H
 #define QED_HS_POLICIES_H
 
+#include "ext/ht.h"
+
 /* (length of
  * "accept6 [ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff]/128:65535-65535\n"
  * plus a terminating NUL, rounded up to a nice number.)
@@ -53,8 +55,16 @@ typedef struct short_policy_entry_t {
   uint16_t min_port, max_port;
 } short_policy_entry_t;
 
-/** A short_poliy_t is the parsed version of a policy summary. */
+/** A short_poliy_t is the parsed version of a policy summary.
+ *
+ * Most relays use one of a few policy summaries, so these are shared: every
+ * short_policy_t is a single reference-counted object, held in a hashtable
+ * in policies.c, and must not be modified. */
 typedef struct short_policy_t {
+  /** Hashtable node, used to find the shared copy of a policy. */
+  HT_ENTRY(short_policy_t) node;
+  /** Number of references to this policy. */
+  unsigned int refcnt;
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
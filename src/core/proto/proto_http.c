@@ -109,7 +109,12 @@ fetch_from_buf_http(buf_t *buf,
     }
   } else {
     qed_hs_assert(r == 0);
-    /* Leave bodylen alone */
+    /* A message without a Content-Length on a connection that stays open
+     * has no body: whatever follows it is the next message.  Otherwise,
+     * leave bodylen alone. */
+    if (http_headers_keep_alive(headers, headerlen)) {
+      bodylen = 0;
+    }
   }
 
   /* all happy. copy into the appropriate places, and return 1 */
@@ -173,3 +178,177 @@ buf_http_find_content_length(const char *headers, size_t headerlen,
 
   return ok ? 1 : -1;
 }
+
+/** Return true iff the <b>headerlen</b>-byte HTTP headers at <b>headers</b>
+ * contain the header line <b>line</b> (which must start with "\r\n" and
+ * end with "\r\n"). */
+static int
+http_headers_have_line(const char *headers, size_t headerlen,
+                       const char *line)
+{
+  return qed_hs_memstr(headers, headerlen, line) != NULL;
+}
+
+/** Return true iff the <b>headerlen</b>-byte HTTP headers at <b>headers</b>
+ * ask to keep the connection open once this message is done. */
+int
+http_headers_keep_alive(const char *headers, size_t headerlen)
+{
+  return http_headers_have_line(headers, headerlen,
+                                "\r\nConnection: keep-alive\r\n");
+}
+
+/** There is a (possibly incomplete) HTTP response on <b>buf</b>, from a
+ * server that we asked to keep the connection open.
+ *
+ * If all of its headers are here, and they say that the connection stays
+ * open, then remove them from <b>buf</b>, strdup them into
+ * *<b>headers_out</b>, and return 1.  Then set *<b>chunked_out</b> to true
+ * if the body uses the chunked transfer-coding, and otherwise set
+ * *<b>contentlen_out</b> to its Content-Length.  The caller reads the body
+ * with buf_http_dechunk() or as <b>contentlen_out</b> plain bytes.
+ *
+ * If the headers say that the server will close the connection after this
+ * response, change nothing and return 2: the response runs to EOF, and
+ * fetch_from_buf_http() will read it.
+ *
+ * Return 0 if the headers are not all here yet, and -1 if they are too long
+ * or say nothing about where the body ends.
+ */
+int
+fetch_from_buf_http_keep_alive(buf_t *buf,
+                               char **headers_out, size_t max_headerlen,
+                               int *chunked_out, size_t *contentlen_out)
+{
+  const char *headers;
+  size_t headerlen, headers_in_chunk = 0;
+  int crlf_offset, r;
+
+  *chunked_out = 0;
+  *contentlen_out = 0;
+
+  crlf_offset = buf_find_string_offset(buf, "\r\n\r\n", 4);
+  if (crlf_offset > (int)max_headerlen ||
+      (crlf_offset < 0 && buf_datalen(buf) > max_headerlen)) {
+    log_debug(LD_HTTP,"headers too long.");
+    return -1;
+  } else if (crlf_offset < 0) {
+    log_debug(LD_HTTP,"headers not all here yet.");
+    return 0;
+  }
+  headerlen = crlf_offset + 4;
+  if (max_headerlen <= headerlen) {
+    log_warn(LD_HTTP,"headerlen %d larger than %d. Failing.",
+             (int)headerlen, (int)max_headerlen-1);
+    return -1;
+  }
+  buf_pullup(buf, headerlen, &headers, &headers_in_chunk);
+
+  if (!http_headers_keep_alive(headers, headerlen))
+    return 2;
+
+  if (http_headers_have_line(headers, headerlen,
+                             "\r\nTransfer-Encoding: chunked\r\n")) {
+    *chunked_out = 1;
+  } else {
+    r = buf_http_find_content_length(headers, headerlen, contentlen_out);
+    if (r != 1) {
+      log_warn(LD_PROTOCOL, "Kept-alive HTTP response with %s "
+               "Content-Length.", r == 0 ? "no" : "a bogus");
+      return -1;
+    }
+  }
+
+  *headers_out = qed_hs_malloc(headerlen+1);
+  buf_get_bytes(buf, *headers_out, headerlen);
+  (*headers_out)[headerlen] = 0; /* NUL terminate it */
+  return 1;
+}
+
+/** Longest chunk-size line, including any chunk extension, that we accept
+ * from buf_http_dechunk(). */
+#define MAX_CHUNK_LINE_LEN 64
+
+/** Decode as much as we can of the chunked HTTP body at the start of
+ * <b>buf</b>, moving the data onto <b>body_out</b>.  *<b>chunk_left</b>
+ * holds our position between calls: it must be 0 at the start of a body.
+ *
+ * Return 1 once the last chunk has been read and removed from <b>buf</b>,
+ * 0 if more data is needed, and -1 if the body is malformed or the decoded
+ * body would reach <b>max_bodylen</b> bytes.  We don't accept trailers.
+ */
+int
+buf_http_dechunk(buf_t *buf, buf_t *body_out, size_t *chunk_left,
+                 size_t max_bodylen)
+{
+  char line[MAX_CHUNK_LINE_LEN+4];
+  char *ext, *eos = NULL;
+  uint64_t chunklen;
+  int offset, ok;
+
+  while (1) {
+    if (*chunk_left > 2) {
+      /* We're in the data of a chunk, which is followed by a CRLF. */
+      size_t n = MIN(*chunk_left - 2, buf_datalen(buf));
+      if (n == 0)
+        return 0;
+      if (buf_datalen(body_out) + n >= max_bodylen) {
+        log_warn(LD_HTTP, "Chunked body larger than %d. Failing.",
+                 (int)max_bodylen-1);
+        return -1;
+      }
+      size_t to_move = n;
+      buf_move_to_buf(body_out, buf, &to_move);
+      *chunk_left -= n;
+      continue;
+    }
+
+    if (*chunk_left == 2) {
+      if (buf_datalen(buf) < 2)
+        return 0;
+      buf_peek(buf, line, 2);
+      if (fast_memneq(line, "\r\n", 2)) {
+        log_warn(LD_PROTOCOL, "Chunk not followed by CRLF.");
+        return -1;
+      }
+      buf_drain(buf, 2);
+      *chunk_left = 0;
+      continue;
+    }
+
+    /* We're at a chunk-size line. */
+    offset = buf_find_string_offset(buf, "\r\n", 2);
+    if (offset > MAX_CHUNK_LINE_LEN ||
+        (offset < 0 && buf_datalen(buf) > MAX_CHUNK_LINE_LEN)) {
+      log_warn(LD_PROTOCOL, "Chunk-size line too long.");
+      return -1;
+    } else if (offset < 0) {
+      return 0;
+    }
+    buf_peek(buf, line, offset);
+    line[offset] = '\0';
+    if ((ext = strchr(line, ';')))
+      *ext = '\0';
+    chunklen = qed_hs_parse_uint64(line, 16, 0, INT_MAX, &ok, &eos);
+    if (!ok || offset == 0 || (eos && *eos && !qed_hs_strisspace(eos))) {
+      log_warn(LD_PROTOCOL, "Bogus chunk-size line %s.", escaped(line));
+      return -1;
+    }
+
+    if (chunklen == 0) {
+      /* The last chunk: it's followed by an empty line. */
+      if (buf_datalen(buf) < (size_t)offset + 4)
+        return 0;
+      buf_peek(buf, line, offset + 4);
+      if (fast_memneq(line + offset, "\r\n\r\n", 4)) {
+        log_warn(LD_PROTOCOL, "Unexpected trailer after last chunk.");
+        return -1;
+      }
+      buf_drain(buf, offset + 4);
+      return 1;
+    }
+
+    buf_drain(buf, offset + 2);
+    *chunk_left = (size_t)chunklen + 2;
+  }
+}
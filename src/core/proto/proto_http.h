@@ -19,6 +19,12 @@ int fetch_from_buf_http(struct buf_t *buf,
                         char **body_out, size_t *body_used, size_t max_bodylen,
                         int force_complete);
 int peek_buf_has_http_command(const struct buf_t *buf);
+int http_headers_keep_alive(const char *headers, size_t headerlen);
+int fetch_from_buf_http_keep_alive(struct buf_t *buf,
+                                   char **headers_out, size_t max_headerlen,
+                                   int *chunked_out, size_t *contentlen_out);
+int buf_http_dechunk(struct buf_t *buf, struct buf_t *body_out,
+                     size_t *chunk_left, size_t max_bodylen);
 
 #ifdef PROTO_HTTP_PRIVATE
 STATIC int buf_http_find_content_length(const char *headers, size_t headerlen,
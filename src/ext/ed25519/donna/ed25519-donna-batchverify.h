@@ -187,9 +187,6 @@ ge25519_multi_scalarmult_vartime(ge25519 *r, batch_heap *heap, size_t count) {
 	ge25519_multi_scalarmult_vartime_final(r, &heap->points[max1], heap->scalars[max1]);
 }
 
-/* not actually used for anything other than testing */
-static unsigned char batch_point_buffer[3][32];
-
 static int
 ge25519_is_neutral_vartime(const ge25519 *p) {
 	static const unsigned char zero[32] = {0};
@@ -197,7 +194,6 @@ ge25519_is_neutral_vartime(const ge25519 *p) {
 	curve25519_contract(point_buffer[0], p->x);
 	curve25519_contract(point_buffer[1], p->y);
 	curve25519_contract(point_buffer[2], p->z);
-	memcpy(batch_point_buffer[1], point_buffer[1], 32);
 	return (memcmp(point_buffer[0], zero, 32) == 0) && (memcmp(point_buffer[1], point_buffer[2], 32) == 0);
 }
 
@@ -237,6 +233,11 @@ ED25519_FN(ed25519_sign_open_batch) (const unsigned char **m, size_t *mlen, cons
 			mul256_modm(batch.scalars[i+1], batch.scalars[i+1], r_scalars[i]);
 		}
 
+		/* Tor: reject the same malformed signatures as ed25519_sign_open */
+		for (i = 0; i < batchsize; i++)
+			if ((RS[i][63] & 224) || !ed25519_point_is_canonical(RS[i]))
+				goto fallback;
+
 		/* compute points */
 		batch.points[0] = ge25519_basepoint;
 		for (i = 0; i < batchsize; i++)
@@ -247,6 +248,12 @@ ED25519_FN(ed25519_sign_open_batch) (const unsigned char **m, size_t *mlen, cons
 				goto fallback;
 
 		ge25519_multi_scalarmult_vartime(&p, &batch, (batchsize * 2) + 1);
+		/* Tor: multiply by the cofactor, so that small-order components,
+		   which the random scalars can cancel out, are ignored here and in
+		   ed25519_sign_open alike */
+		ge25519_double(&p, &p);
+		ge25519_double(&p, &p);
+		ge25519_double(&p, &p);
 		if (!ge25519_is_neutral_vartime(&p)) {
 			ret |= 2;
 
@@ -79,14 +79,47 @@ ed25519_hram(hash_512bits hram, const ed25519_signature RS, const ed25519_public
   ed25519_hash_final(&ctx, hram);
 }
 
+/*
+  Tor: Return 1 iff the 32-byte point encoding p is canonical: its y
+  coordinate is less than 2^255 - 19, and its sign bit is clear if x is 0
+  (that is, if y is 1 or -1).
+*/
+static int
+ed25519_point_is_canonical(const unsigned char p[32]) {
+  int high_ones = ((p[31] & 0x7f) == 0x7f), low_zeros = !(p[31] & 0x7f);
+  size_t i;
+
+  for (i = 1; i < 31; i++) {
+    high_ones &= (p[i] == 0xff);
+    low_zeros &= (p[i] == 0);
+  }
+  /* y >= 2^255 - 19 */
+  if (high_ones && p[0] >= 0xed)
+    return 0;
+  /* x = 0, with the sign bit set */
+  if ((p[31] & 0x80) && ((low_zeros && p[0] == 1) ||
+                         (high_ones && p[0] == 0xec)))
+    return 0;
+  return 1;
+}
+
+#include "ed25519-donna-batchverify.h"
+
+/*
+  Tor: Check the signature with the cofactored equation
+  8(SB - H(R,A,m)A - R) = 0, the one the batch verifier uses, so that both
+  give the same answer for every signature.  R must be canonically
+  encoded.
+*/
 static int
 ED25519_FN(ed25519_sign_open) (const unsigned char *m, size_t mlen, const ed25519_public_key pk, const ed25519_signature RS) {
-  ge25519 ALIGN(16) R, A;
+  ge25519 ALIGN(16) R, A, negR;
   hash_512bits hash;
   bignum256modm hram, S;
-  unsigned char checkR[32];
 
-  if ((RS[63] & 224) || !ge25519_unpack_negative_vartime(&A, pk))
+  if ((RS[63] & 224) || !ed25519_point_is_canonical(RS) ||
+      !ge25519_unpack_negative_vartime(&A, pk) ||
+      !ge25519_unpack_negative_vartime(&negR, RS))
     return -1;
 
   /* hram = H(R,A,m) */
@@ -96,16 +129,21 @@ ED25519_FN(ed25519_sign_open) (const unsigned char *m, size_t mlen, const ed2551
   /* S */
   expand256_modm(S, RS + 32, 32);
 
-  /* SB - H(R,A,m)A */
+  /* SB - H(R,A,m)A, which only has partial coordinates; doubling it
+     gives us full ones */
   ge25519_double_scalarmult_vartime(&R, &A, hram, S);
-  ge25519_pack(checkR, &R);
 
-  /* check that R = SB - H(R,A,m)A */
-  return ed25519_verify(RS, checkR, 32) ? 0 : -1;
+  /* check that 8(SB - H(R,A,m)A) + 8(-R) = 0 */
+  ge25519_double(&R, &R);
+  ge25519_double(&R, &R);
+  ge25519_double(&R, &R);
+  ge25519_double(&negR, &negR);
+  ge25519_double(&negR, &negR);
+  ge25519_double(&negR, &negR);
+  ge25519_add(&R, &R, &negR);
+  return ge25519_is_neutral_vartime(&R) ? 0 : -1;
 }
 
-#include "ed25519-donna-batchverify.h"
-
 /*
   Fast Curve25519 basepoint scalar multiplication
 */
@@ -1,13 +1,50 @@
 /* (Modified by Tor to verify signature separately from message) */
+/* (Modified by Tor to use the cofactored verification equation, and to
+ * reject non-canonical R) */
 
 #include "crypto_sign.h"
 #include <string.h>
 #include "crypto_hash_sha512.h"
-#include "crypto_verify_32.h"
 #include "ge.h"
 #include "sc.h"
 
-/* 'signature' must be 64-bytes long. */
+/* Return 1 iff the 32-byte point encoding p is canonical: its y coordinate
+ * is less than 2^255 - 19, and its sign bit is clear if x is 0 (that is,
+ * if y is 1 or -1). */
+static int point_is_canonical(const unsigned char *p)
+{
+  int high_ones = ((p[31] & 0x7f) == 0x7f);
+  int low_zeros = !(p[31] & 0x7f);
+  int i;
+
+  for (i = 1; i < 31; i++) {
+    high_ones &= (p[i] == 0xff);
+    low_zeros &= (p[i] == 0);
+  }
+  /* y >= 2^255 - 19 */
+  if (high_ones && p[0] >= 0xed) return 0;
+  /* x = 0, with the sign bit set */
+  if ((p[31] & 0x80) && ((low_zeros && p[0] == 1) ||
+                         (high_ones && p[0] == 0xec))) return 0;
+  return 1;
+}
+
+/* r = 8*r */
+static void ge_p2_mul_by_cofactor(ge_p2 *r)
+{
+  ge_p1p1 t;
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    ge_p2_dbl(&t,r);
+    ge_p1p1_to_p2(r,&t);
+  }
+}
+
+/* 'signature' must be 64-bytes long.
+ *
+ * We accept the signature iff 8(SB - hA - R) = 0, the same equation that
+ * a batch verifier checks, so that both always agree. */
 int crypto_sign_open(
   const unsigned char *signature,
   const unsigned char *m, size_t mlen,
@@ -18,12 +55,18 @@ int crypto_sign_open(
   unsigned char rcopy[32];
   unsigned char scopy[32];
   unsigned char h[64];
-  unsigned char rcheck[32];
   ge_p3 A;
+  ge_p3 negR3;
   ge_p2 R;
+  ge_p2 negR;
+  fe t0;
+  fe t1;
+  fe t2;
 
   if (signature[63] & 224) goto badsig;
+  if (!point_is_canonical(signature)) goto badsig;
   if (ge_frombytes_negate_vartime(&A,pk) != 0) goto badsig;
+  if (ge_frombytes_negate_vartime(&negR3,signature) != 0) goto badsig;
 
   memmove(pkcopy,pk,32);
   memmove(rcopy,signature,32);
@@ -33,10 +76,20 @@ int crypto_sign_open(
   sc_reduce(h);
 
   ge_double_scalarmult_vartime(&R,h,&A,scopy);
-  ge_tobytes(rcheck,&R);
-  if (crypto_verify_32(rcheck,rcopy) == 0) {
-    return 0;
-  }
+  ge_p3_to_p2(&negR,&negR3);
+  ge_p2_mul_by_cofactor(&R);
+  ge_p2_mul_by_cofactor(&negR);
+
+  /* 8(SB - hA) = -8(-R), in projective coordinates. */
+  fe_mul(t0,R.X,negR.Z);
+  fe_mul(t1,negR.X,R.Z);
+  fe_add(t2,t0,t1);
+  if (fe_isnonzero(t2)) goto badsig;
+  fe_mul(t0,R.Y,negR.Z);
+  fe_mul(t1,negR.Y,R.Z);
+  fe_sub(t2,t0,t1);
+  if (fe_isnonzero(t2)) goto badsig;
+  return 0;
 
 badsig:
   return -1;
@@ -160,6 +160,30 @@ HASHX_API hashx_result hashx_query_type(hashx_ctx* ctx, hashx_type *type_out);
 HASHX_API hashx_result hashx_exec(const hashx_ctx* ctx,
                                   HASHX_INPUT, void* output);
 
+#ifndef HASHX_BLOCK_MODE
+/*
+ * Execute the HashX function on a run of consecutive inputs.
+ *
+ * This gives the same results as calling hashx_exec on each of the inputs
+ * first_input, first_input + 1, ..., first_input + count - 1 and reading the
+ * first 8 bytes of each output as a little-endian integer. It avoids the
+ * per-call overhead, and prepares the input state of several hashes at once.
+ * Only available in counter mode.
+ *
+ * @param ctx is pointer to a HashX instance. A HashX function must have
+ *        been previously created by invoking hashx_make successfully.
+ * @param first_input is the first input to be hashed.
+ * @param count is the number of consecutive inputs to hash.
+ * @param output is a pointer to an array of count results.
+ *
+ * @return HASHX_OK on success, or HASHX_FAIL_UNPREPARED if hashx_make has not
+ *         been invoked successfully on this context.
+ */
+HASHX_API hashx_result hashx_exec_batch64(const hashx_ctx* ctx,
+                                          uint64_t first_input, size_t count,
+                                          uint64_t* output);
+#endif
+
 /*
  * Free a HashX instance.
  *
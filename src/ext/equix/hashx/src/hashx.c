@@ -92,6 +92,60 @@ hashx_result hashx_query_type(hashx_ctx* ctx, hashx_type *type_out) {
 	return HASHX_OK;
 }
 
+#ifndef HASHX_BLOCK_MODE
+
+/* Number of hashes whose input state hashx_exec_batch64 prepares together. */
+#define HASHX_BATCH_LANES 4
+
+hashx_result hashx_exec_batch64(const hashx_ctx* ctx, uint64_t first_input,
+                                size_t count, uint64_t* output) {
+	typedef void program_func(uint64_t r[8]);
+	program_func* compiled = NULL;
+	uint64_t r[HASHX_BATCH_LANES][8];
+
+	assert(ctx != NULL);
+	assert(output != NULL || count == 0);
+
+	if (ctx->func_type == HASHX_TYPE_COMPILED) {
+		assert(ctx->compiler_mem != NULL);
+		compiled = (program_func*)ctx->compiler_mem;
+	} else if (ctx->func_type != HASHX_TYPE_INTERPRETED) {
+		return HASHX_FAIL_UNPREPARED;
+	}
+
+	while (count > 0) {
+		size_t lanes = count < HASHX_BATCH_LANES ? count : HASHX_BATCH_LANES;
+		/* The SipHash states are independent, so computing them back to
+		 * back lets the CPU overlap them. */
+		for (size_t i = 0; i < lanes; ++i) {
+			hashx_siphash24_ctr_state512(&ctx->keys, first_input + i, r[i]);
+		}
+		for (size_t i = 0; i < lanes; ++i) {
+			if (compiled != NULL) {
+				compiled(r[i]);
+			} else {
+				hashx_program_execute(&ctx->program, r[i]);
+			}
+		}
+		/* Same finalization as hashx_exec, keeping only the first word. */
+		for (size_t i = 0; i < lanes; ++i) {
+			r[i][0] += ctx->keys.v0;
+			r[i][1] += ctx->keys.v1;
+			r[i][6] += ctx->keys.v2;
+			r[i][7] += ctx->keys.v3;
+			SIPROUND(r[i][0], r[i][1], r[i][2], r[i][3]);
+			SIPROUND(r[i][4], r[i][5], r[i][6], r[i][7]);
+			output[i] = r[i][0] ^ r[i][4];
+		}
+		first_input += lanes;
+		output += lanes;
+		count -= lanes;
+	}
+	return HASHX_OK;
+}
+
+#endif
+
 hashx_result hashx_exec(const hashx_ctx* ctx, HASHX_INPUT, void* output) {
 	assert(ctx != NULL);
 	assert(output != NULL);
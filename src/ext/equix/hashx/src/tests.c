@@ -198,6 +198,40 @@ static bool test_compiler_ctr2() {
 #endif
 }
 
+#if !defined(HASHX_BLOCK_MODE) && HASHX_SIZE >= 8
+static bool check_batch(hashx_ctx* ctx, uint64_t first, size_t count) {
+	uint64_t values[7];
+	hashx_result result;
+	assert(count <= 7);
+	result = hashx_exec_batch64(ctx, first, count, values);
+	if (result == HASHX_FAIL_UNPREPARED) {
+		return false;
+	}
+	assert(result == HASHX_OK);
+	for (size_t i = 0; i < count; ++i) {
+		unsigned char hash[HASHX_SIZE];
+		uint64_t expected = 0;
+		result = hashx_exec(ctx, first + i, hash);
+		assert(result == HASHX_OK);
+		for (int j = 7; j >= 0; --j) {
+			expected = expected << 8 | hash[j];
+		}
+		assert(values[i] == expected);
+	}
+	return true;
+}
+#endif
+
+static bool test_batch_ctr1() {
+#if !defined(HASHX_BLOCK_MODE) && HASHX_SIZE >= 8
+	bool ok = check_batch(ctx_int, counter2, 7);
+	assert(ok);
+	return check_batch(ctx_cmp, counter3, 7);
+#else
+	return false;
+#endif
+}
+
 static bool test_compiler_block1() {
 #ifndef HASHX_BLOCK_MODE
 	return false;
@@ -263,6 +297,7 @@ int main() {
 	RUN_TEST(test_make3);
 	RUN_TEST(test_compiler_ctr1);
 	RUN_TEST(test_compiler_ctr2);
+	RUN_TEST(test_batch_ctr1);
 	RUN_TEST(test_hash_block1);
 	RUN_TEST(test_compiler_block1);
 	RUN_TEST(test_alloc_automatic);
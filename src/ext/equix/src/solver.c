@@ -41,24 +41,19 @@
 #define CARRY (bucket_idx != 0)
 #define BUCK_START 0
 #define BUCK_END (NUM_COARSE_BUCKETS / 2 + 1)
+#define STAGE0_BATCH 64
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH_WRITE(addr) __builtin_prefetch((addr), 1)
+#else
+#define PREFETCH_WRITE(addr) ((void)(addr))
+#endif
 
 typedef uint32_t u32;
 typedef stage1_idx_item s1_idx;
 typedef stage2_idx_item s2_idx;
 typedef stage3_idx_item s3_idx;
 
-static FORCE_INLINE bool hash_value(hashx_ctx* hash_func, equix_idx index, uint64_t *value_out) {
-	char hash[HASHX_SIZE];
-	hashx_result result = hashx_exec(hash_func, index, hash);
-	if (result == HASHX_OK) {
-		*value_out = load64(hash);
-		return true;
-	} else {
-		assert(false);
-		return false;
-	}
-}
-
 static void build_solution_stage1(equix_idx* output, solver_heap* heap, s2_idx root) {
 	u32 bucket = ITEM_BUCKET(root);
 	u32 bucket_inv = INVERT_BUCKET(bucket);
@@ -100,18 +95,36 @@ static void build_solution(equix_solution* solution, solver_heap* heap, s3_idx l
 }
 
 static void solve_stage0(hashx_ctx* hash_func, solver_heap* heap) {
+	uint64_t values[STAGE0_BATCH];
 	CLEAR(heap->stage1_indices.counts);
-	for (u32 i = 0; i < INDEX_SPACE; ++i) {
-		uint64_t value;
-		if (!hash_value(hash_func, i, &value))
-			break;
-		u32 bucket_idx = value % NUM_COARSE_BUCKETS;
-		u32 item_idx = STAGE1_SIZE(bucket_idx);
-		if (item_idx >= COARSE_BUCKET_ITEMS)
-			continue;
-		STAGE1_SIZE(bucket_idx) = item_idx + 1;
-		STAGE1_IDX(bucket_idx, item_idx) = i;
-		STAGE1_DATA(bucket_idx, item_idx) = value / NUM_COARSE_BUCKETS; /* 52 bits */
+	for (u32 first = 0; first < INDEX_SPACE; first += STAGE0_BATCH) {
+		u32 count = INDEX_SPACE - first;
+		if (count > STAGE0_BATCH)
+			count = STAGE0_BATCH;
+		if (hashx_exec_batch64(hash_func, first, count, values) != HASHX_OK) {
+			assert(false);
+			return;
+		}
+		/* Touch the tail of every bucket this batch writes to before the
+		 * scatter, so that the stores below don't stall on cache misses. */
+		for (u32 i = 0; i < count; ++i) {
+			u32 bucket_idx = values[i] % NUM_COARSE_BUCKETS;
+			u32 item_idx = STAGE1_SIZE(bucket_idx);
+			if (item_idx < COARSE_BUCKET_ITEMS) {
+				PREFETCH_WRITE(&STAGE1_IDX(bucket_idx, item_idx));
+				PREFETCH_WRITE(&STAGE1_DATA(bucket_idx, item_idx));
+			}
+		}
+		for (u32 i = 0; i < count; ++i) {
+			uint64_t value = values[i];
+			u32 bucket_idx = value % NUM_COARSE_BUCKETS;
+			u32 item_idx = STAGE1_SIZE(bucket_idx);
+			if (item_idx >= COARSE_BUCKET_ITEMS)
+				continue;
+			STAGE1_SIZE(bucket_idx) = item_idx + 1;
+			STAGE1_IDX(bucket_idx, item_idx) = first + i;
+			STAGE1_DATA(bucket_idx, item_idx) = value / NUM_COARSE_BUCKETS; /* 52 bits */
+		}
 	}
 }
 
@@ -630,9 +630,19 @@ void
 dirserv_set_node_flags_from_authoritative_status(node_t *node,
                                                  uint32_t authstatus)
 {
-  node->is_valid = (authstatus & RTR_INVALID) ? 0 : 1;
-  node->is_bad_exit = (authstatus & RTR_BADEXIT) ? 1 : 0;
-  node->is_middle_only = (authstatus & RTR_MIDDLEONLY) ? 1 : 0;
+  const int is_valid = (authstatus & RTR_INVALID) ? 0 : 1;
+  const int is_bad_exit = (authstatus & RTR_BADEXIT) ? 1 : 0;
+  const int is_middle_only = (authstatus & RTR_MIDDLEONLY) ? 1 : 0;
+
+  /* These flags decide which nodes we'll pick for circuits. */
+  if (bool_neq(node->is_valid, is_valid) ||
+      bool_neq(node->is_bad_exit, is_bad_exit) ||
+      bool_neq(node->is_middle_only, is_middle_only))
+    router_dir_info_changed();
+
+  node->is_valid = is_valid;
+  node->is_bad_exit = is_bad_exit;
+  node->is_middle_only = is_middle_only;
   node->strip_guard = (authstatus & RTR_STRIPGUARD) ? 1 : 0;
   node->strip_hsdir = (authstatus & RTR_STRIPHSDIR) ? 1 : 0;
   node->strip_v2dir = (authstatus & RTR_STRIPV2DIR) ? 1 : 0;
@@ -952,6 +962,7 @@ directory_remove_invalid(void)
 {
   routerlist_t *rl = router_get_routerlist();
   smartlist_t *nodes = smartlist_new();
+  int flags_changed = 0;
   smartlist_add_all(nodes, nodelist_get_list());
 
   SMARTLIST_FOREACH_BEGIN(nodes, node_t *, node) {
@@ -973,16 +984,19 @@ directory_remove_invalid(void)
       log_info(LD_DIRSERV, "Router '%s' is now %svalid.", description,
                (r&RTR_INVALID) ? "in" : "");
       node->is_valid = (r&RTR_INVALID)?0:1;
+      flags_changed = 1;
     }
     if (bool_neq((r & RTR_BADEXIT), node->is_bad_exit)) {
       log_info(LD_DIRSERV, "Router '%s' is now a %s exit", description,
                (r & RTR_BADEXIT) ? "bad" : "good");
       node->is_bad_exit = (r&RTR_BADEXIT) ? 1: 0;
+      flags_changed = 1;
     }
     if (bool_neq((r & RTR_MIDDLEONLY), node->is_middle_only)) {
       log_info(LD_DIRSERV, "Router '%s' is now %smiddle-only", description,
                (r & RTR_MIDDLEONLY) ? "" : "not");
       node->is_middle_only = (r&RTR_MIDDLEONLY) ? 1: 0;
+      flags_changed = 1;
     }
     if (bool_neq((r & RTR_STRIPGUARD), node->strip_guard)) {
       log_info(LD_DIRSERV, "Router '%s' is now %s guard", description,
@@ -1001,6 +1015,9 @@ directory_remove_invalid(void)
     }
   } SMARTLIST_FOREACH_END(node);
 
+  if (flags_changed)
+    router_dir_info_changed();
+
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
 }
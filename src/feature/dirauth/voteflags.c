@@ -206,6 +206,7 @@ void
 dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
 {
   int n_active, n_active_nonexit, n_familiar;
+  int exit_flags_changed = 0;
   uint32_t *uptimes, *bandwidths_kb, *bandwidths_excluding_exits_kb;
   long *tks;
   double *mtbfs, *wfus;
@@ -257,8 +258,11 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
 
     routerinfo_t *ri = node->ri;
     if (ri) {
-      node->is_exit = (!router_exit_policy_rejects_all(ri) &&
-                       exit_policy_is_general_exit(ri->exit_policy));
+      int is_exit = (!router_exit_policy_rejects_all(ri) &&
+                     exit_policy_is_general_exit(ri->exit_policy));
+      if (bool_neq(node->is_exit, is_exit))
+        exit_flags_changed = 1;
+      node->is_exit = is_exit;
     }
 
     if (router_counts_toward_thresholds(node, now, omit_as_sybil,
@@ -281,6 +285,9 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
     }
   } SMARTLIST_FOREACH_END(node);
 
+  if (exit_flags_changed)
+    router_dir_info_changed();
+
   /* Now, compute thresholds. */
   if (n_active) {
     /* The median uptime is stable. */
@@ -526,6 +533,9 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
     rep_hist_note_router_unreachable(router->cache_info.identity_digest, when);
   }
 
+  if (bool_neq(node->is_running, answer))
+    router_dir_info_changed();
+
   node->is_running = answer;
 }
 
@@ -577,8 +587,13 @@ dirauth_set_routerstatus_from_routerinfo(routerstatus_t *rs,
 
   /* Set these flags so that set_routerstatus_from_routerinfo can copy them.
    */
-  node->is_stable = !dirserv_thinks_router_is_unreliable(now, ri, 1, 0);
-  node->is_fast = !dirserv_thinks_router_is_unreliable(now, ri, 0, 1);
+  const int is_stable = !dirserv_thinks_router_is_unreliable(now, ri, 1, 0);
+  const int is_fast = !dirserv_thinks_router_is_unreliable(now, ri, 0, 1);
+  if (bool_neq(node->is_stable, is_stable) ||
+      bool_neq(node->is_fast, is_fast))
+    router_dir_info_changed();
+  node->is_stable = is_stable;
+  node->is_fast = is_fast;
   node->is_hs_dir = dirserv_thinks_router_is_hs_dir(ri, node, now);
 
   set_routerstatus_from_routerinfo(rs, node, ri);
@@ -25,6 +25,7 @@
 #include "lib/evloop/workqueue.h"
 #include "lib/compress/compress.h"
 #include "lib/encoding/confline.h"
+#include "lib/lock/compat_mutex.h"
 
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
@@ -201,8 +202,13 @@ static int consdiffmgr_ensure_space_for_files(int n);
 static int consensus_queue_compression_work(const char *consensus,
                                             size_t consensus_len,
                                             const networkstatus_t *as_parsed);
+struct cdm_diff_target_t;
 static int consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                                          consensus_cache_entry_t *diff_to);
+                                          consensus_cache_entry_t *diff_to,
+                                          struct cdm_diff_target_t *target);
+static struct cdm_diff_target_t *cdm_diff_target_new(
+                                          consensus_cache_entry_t *ent);
+static void cdm_diff_target_decref(struct cdm_diff_target_t *target);
 static void consdiffmgr_set_cache_flags(void);
 
 /* =====
@@ -923,6 +929,7 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   smartlist_t *diffs = NULL;
   smartlist_t *compute_diffs_from = NULL;
   strmap_t *have_diff_from = NULL;
+  struct cdm_diff_target_t *target = NULL;
 
   // look for the most recent consensus, and for all previous in-range
   // consensuses.  Do they all have diffs to it?
@@ -1003,7 +1010,9 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   //    target consensuses.
   cdm_diff_ht_purge(flavor, most_recent_sha3);
 
-  // 5. Actually launch the requests.
+  // 5. Actually launch the requests.  They all share one copy of the most
+  //    recent consensus, split into lines and interned by whichever of them
+  //    runs first.
   SMARTLIST_FOREACH_BEGIN(compute_diffs_from, consensus_cache_entry_t *, c) {
     if (BUG(c == most_recent))
       continue; // LCOV_EXCL_LINE
@@ -1020,10 +1029,13 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
       // This is already pending, or we encountered an error.
       continue;
     }
-    consensus_diff_queue_diff_work(c, most_recent);
+    if (!target)
+      target = cdm_diff_target_new(most_recent);
+    consensus_diff_queue_diff_work(c, most_recent, target);
   } SMARTLIST_FOREACH_END(c);
 
  done:
+  cdm_diff_target_decref(target);
   smartlist_free(matches);
   smartlist_free(diffs);
   smartlist_free(compute_diffs_from);
@@ -1393,6 +1405,80 @@ store_multiple(consensus_cache_entry_handle_t **handles_out,
   return status;
 }
 
+/**
+ * A consensus that we are computing diffs to, shared by all the diff jobs
+ * that we launched for it in one rescan.  The first worker to need it splits
+ * and interns the consensus; the others wait for it and reuse its work.
+ */
+typedef struct cdm_diff_target_t {
+  /**
+   * The consensus to compute diffs to.  Holds a reference to the cache
+   * entry, whose body must be mapped into memory in the main thread.
+   */
+  consensus_cache_entry_t *ent;
+  /** Protects <b>attempted</b> and <b>target</b>. */
+  qed_hs_mutex_t lock;
+  /** True iff some worker has tried to build <b>target</b>. */
+  bool attempted;
+  /** The split and interned consensus, or NULL if we failed to build it. */
+  consensus_diff_target_t *target;
+  /** Number of jobs (and callers) holding this object.  Only used in the
+   * main thread. */
+  int refcnt;
+} cdm_diff_target_t;
+
+/** Return a new cdm_diff_target_t for the consensus in <b>ent</b>, with one
+ * reference held by the caller. */
+static cdm_diff_target_t *
+cdm_diff_target_new(consensus_cache_entry_t *ent)
+{
+  qed_hs_assert(in_main_thread());
+  cdm_diff_target_t *target = qed_hs_malloc_zero(sizeof(*target));
+  qed_hs_mutex_init_nonrecursive(&target->lock);
+  consensus_cache_entry_incref(ent);
+  target->ent = ent;
+  target->refcnt = 1;
+  return target;
+}
+
+/** Release one reference to <b>target</b>, and free it if that was the last
+ * one. */
+static void
+cdm_diff_target_decref(cdm_diff_target_t *target)
+{
+  qed_hs_assert(in_main_thread());
+  if (!target || --target->refcnt > 0)
+    return;
+  consensus_diff_target_free(target->target);
+  consensus_cache_entry_decref(target->ent);
+  qed_hs_mutex_uninit(&target->lock);
+  qed_hs_free(target);
+}
+
+/**
+ * Worker function: return the split and interned consensus for
+ * <b>target</b>, building it if no other worker has yet.  Return NULL if
+ * it can't be built.
+ */
+static const consensus_diff_target_t *
+cdm_diff_target_get(cdm_diff_target_t *target)
+{
+  qed_hs_mutex_acquire(&target->lock);
+  if (!target->attempted) {
+    const char *cons = NULL;
+    char *owned = NULL;
+    size_t conslen;
+    target->attempted = true;
+    if (uncompress_or_set_ptr(&cons, &conslen, &owned, target->ent) == 0) {
+      qed_hs_assert(cons);
+      target->target = consensus_diff_target_new(cons, conslen);
+    }
+    qed_hs_free(owned);
+  }
+  qed_hs_mutex_release(&target->lock);
+  return target->target;
+}
+
 /**
  * An object passed to a worker thread that will try to produce a consensus
  * diff.
@@ -1410,6 +1496,11 @@ typedef struct consensus_diff_worker_job_t {
    * the main thread. The body must be mapped into memory in the main thread.
    */
   consensus_cache_entry_t *diff_to;
+  /**
+   * Input: The split and interned form of <b>diff_to</b>, shared with the
+   * other jobs computing diffs to the same consensus.
+   */
+  cdm_diff_target_t *target;
 
   /** Output: labels and bodies */
   compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
@@ -1518,31 +1609,26 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
 
   char *consensus_diff;
   {
-    const char *diff_from_nt = NULL, *diff_to_nt = NULL;
-    char *owned1 = NULL, *owned2 = NULL;
-    size_t diff_from_nt_len, diff_to_nt_len;
+    const char *diff_from_nt = NULL;
+    char *owned1 = NULL;
+    size_t diff_from_nt_len;
 
-    if (uncompress_or_set_ptr(&diff_from_nt, &diff_from_nt_len, &owned1,
-                              job->diff_from) < 0) {
+    const consensus_diff_target_t *target = cdm_diff_target_get(job->target);
+    if (!target) {
       return WQ_RPL_REPLY;
     }
-    if (uncompress_or_set_ptr(&diff_to_nt, &diff_to_nt_len, &owned2,
-                              job->diff_to) < 0) {
-      qed_hs_free(owned1);
+    if (uncompress_or_set_ptr(&diff_from_nt, &diff_from_nt_len, &owned1,
+                              job->diff_from) < 0) {
       return WQ_RPL_REPLY;
     }
     qed_hs_assert(diff_from_nt);
-    qed_hs_assert(diff_to_nt);
-
-    // XXXX ugh; this is going to calculate the SHA3 of both its
-    // XXXX inputs again, even though we already have that. Maybe it's time
-    // XXXX to change the API here?
-    consensus_diff = consensus_diff_generate(diff_from_nt,
-                                             diff_from_nt_len,
-                                             diff_to_nt,
-                                             diff_to_nt_len);
+
+    // XXXX ugh; this is going to calculate the SHA3 of diff_from
+    // XXXX again, even though we already have that.
+    consensus_diff = consensus_diff_generate_to_target(diff_from_nt,
+                                                       diff_from_nt_len,
+                                                       target);
     qed_hs_free(owned1);
-    qed_hs_free(owned2);
   }
   if (!consensus_diff) {
     /* Couldn't generate consensus; we'll leave the reply blank. */
@@ -1612,6 +1698,7 @@ consensus_diff_worker_job_free_(consensus_diff_worker_job_t *job)
   }
   consensus_cache_entry_decref(job->diff_from);
   consensus_cache_entry_decref(job->diff_to);
+  cdm_diff_target_decref(job->target);
   qed_hs_free(job);
 }
 
@@ -1701,20 +1788,25 @@ consensus_diff_worker_replyfn(void *work_)
 
 /**
  * Queue the job of computing the diff from <b>diff_from</b> to <b>diff_to</b>
- * in a worker thread.
+ * in a worker thread.  <b>target</b> must be a cdm_diff_target_t for
+ * <b>diff_to</b>; the job takes a new reference to it.
  */
 static int
 consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                               consensus_cache_entry_t *diff_to)
+                               consensus_cache_entry_t *diff_to,
+                               cdm_diff_target_t *target)
 {
   qed_hs_assert(in_main_thread());
+  qed_hs_assert(target->ent == diff_to);
 
   consensus_cache_entry_incref(diff_from);
   consensus_cache_entry_incref(diff_to);
+  ++target->refcnt;
 
   consensus_diff_worker_job_t *job = qed_hs_malloc_zero(sizeof(*job));
   job->diff_from = diff_from;
   job->diff_to = diff_to;
+  job->target = target;
 
   /* Make sure body is mapped. */
   const uint8_t *body;
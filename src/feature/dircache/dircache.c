@@ -16,6 +16,7 @@
 #include "app/config/resolve_addr.h"
 #include "core/mainloop/connection.h"
 #include "core/or/relay.h"
+#include "core/proto/proto_http.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirauth/authmode.h"
 #include "feature/dirauth/process_descs.h"
@@ -108,10 +109,18 @@ write_short_http_response(dir_connection_t *conn, int status,
     qed_hs_asprintf(&datestring, "Date: %s\r\n", datebuf);
   }
 
-  qed_hs_asprintf(&buf, "HTTP/1.0 %d %s\r\n%s\r\n",
-               status, reason_phrase, datestring?datestring:"");
+  if (conn->keep_alive) {
+    /* The client needs to know where this response ends. */
+    qed_hs_asprintf(&buf, "HTTP/1.1 %d %s\r\n%sContent-Length: 0\r\n"
+                    "Connection: keep-alive\r\n\r\n",
+                    status, reason_phrase, datestring?datestring:"");
+  } else {
+    qed_hs_asprintf(&buf, "HTTP/1.0 %d %s\r\n%s\r\n",
+                    status, reason_phrase, datestring?datestring:"");
+  }
 
-  log_debug(LD_DIRSERV,"Wrote status 'HTTP/1.0 %d %s'", status, reason_phrase);
+  log_debug(LD_DIRSERV,"Wrote status 'HTTP/1.%d %d %s'",
+            conn->keep_alive, status, reason_phrase);
   connection_buf_add(buf, strlen(buf), TO_CONN(conn));
 
   qed_hs_free(datestring);
@@ -119,9 +128,13 @@ write_short_http_response(dir_connection_t *conn, int status,
 }
 
 /** Write the header for an HTTP/1.0 response onto <b>conn</b>-\>outbuf,
- * with <b>type</b> as the Content-Type.
+ * with <b>type</b> as the Content-Type.  If we're keeping <b>conn</b> open
+ * after this response, make it an HTTP/1.1 response instead.
  *
- * If <b>length</b> is nonnegative, it is the Content-Length.
+ * If <b>length</b> is nonnegative, it is the Content-Length.  Otherwise, if
+ * we're keeping <b>conn</b> open, the body is sent in chunks: write it with
+ * connection_dir_buf_add(), and end it with
+ * connection_dir_end_chunked_body().
  * If <b>encoding</b> is provided, it is the Content-Encoding.
  * If <b>cache_lifetime</b> is greater than 0, the content may be cached for
  * up to cache_lifetime seconds.  Otherwise, the content may not be cached. */
@@ -139,7 +152,8 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
 
   format_rfc1123_time(date, now);
 
-  buf_add_printf(buf, "HTTP/1.0 200 OK\r\nDate: %s\r\n", date);
+  buf_add_printf(buf, "HTTP/1.%d 200 OK\r\nDate: %s\r\n",
+                 conn->keep_alive, date);
   if (type) {
     buf_add_printf(buf, "Content-Type: %s\r\n", type);
   }
@@ -154,6 +168,14 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
   }
   if (length >= 0) {
     buf_add_printf(buf, "Content-Length: %ld\r\n", (long)length);
+  } else if (conn->keep_alive) {
+    buf_add_string(buf, "Transfer-Encoding: chunked\r\n");
+    conn->chunked = 1;
+    if (!conn->chunk_buf)
+      conn->chunk_buf = buf_new();
+  }
+  if (conn->keep_alive) {
+    buf_add_string(buf, "Connection: keep-alive\r\n");
   }
   if (cache_lifetime > 0) {
     char expbuf[RFC1123_TIME_LEN+1];
@@ -408,6 +430,12 @@ directory_handle_command_get,(dir_connection_t *conn, const char *headers,
     write_short_http_response(conn, 400, "Bad request");
     return 0;
   }
+  /* Keep tunneled connections open for more requests if the client asks
+   * us to.  Onion service descriptor fetches remember the descriptor on the
+   * connection, so they get a connection each. */
+  conn->keep_alive = connection_dir_is_encrypted(conn) &&
+    http_headers_keep_alive(headers, strlen(headers)) &&
+    strcmpstart(url, "/qed-hs/hs/");
   if ((header = http_get_header(headers, "If-Modified-Since: "))) {
     struct tm tm;
     if (parse_http_time(header, &tm) == 0) {
@@ -1087,11 +1115,11 @@ handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
                                                c_sl_idx == c_sl_len - 1));
     } else {
       SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-          connection_buf_add(compress_method != NO_METHOD ?
-                                    d->dir_compressed : d->dir,
-                                  compress_method != NO_METHOD ?
-                                    d->dir_compressed_len : d->dir_len,
-                                  TO_CONN(conn)));
+          connection_dir_buf_add(compress_method != NO_METHOD ?
+                                   d->dir_compressed : d->dir,
+                                 compress_method != NO_METHOD ?
+                                   d->dir_compressed_len : d->dir_len,
+                                 conn, 0));
     }
   vote_done:
     smartlist_free(items);
@@ -1759,6 +1787,9 @@ directory_handle_command(dir_connection_t *conn)
     /* case 1, fall through */
   }
 
+  /* The handler decides whether to keep the connection open again. */
+  conn->keep_alive = 0;
+
   http_set_address_origin(headers, TO_CONN(conn));
   // we should escape headers here as well,
   // but we can't call escaped() twice, as it uses the same buffer
@@ -1775,6 +1806,11 @@ directory_handle_command(dir_connection_t *conn)
     r = -1;
   }
 
+  /* Spooled responses end once the spool is empty; see
+   * connection_dirserv_flushed_some(). */
+  if (r == 0 && !conn->spool)
+    connection_dir_end_chunked_body(conn);
+
   qed_hs_free(headers); qed_hs_free(body);
   return r;
 }
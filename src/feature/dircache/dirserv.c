@@ -383,6 +383,26 @@ spooled_resource_free_(spooled_resource_t *spooled)
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
 
+/** When we can hand the outbuf a reference to a cached object instead of
+ * copying it, we add this much at a time. */
+#define DIRSERV_CACHED_DIR_EXTERNAL_CHUNK_SIZE 65536
+
+/** Helper: release the reference that an outbuf chunk holds on a
+ * cached_dir_t. */
+static void
+cached_dir_decref_void(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
+/** Helper: release the reference that an outbuf chunk holds on a
+ * consensus_cache_entry_t. */
+static void
+consensus_cache_entry_decref_void(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
+
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
 static double
@@ -507,10 +527,29 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     remaining = total_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
-    ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
-
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    ssize_t bytes;
+
+    if (conn->compress_state == NULL) {
+      /* Nothing to compress: let the outbuf refer to the cached object
+       * itself, and keep it alive until those bytes are flushed. */
+      bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_EXTERNAL_CHUNK_SIZE, remaining);
+      if (cached) {
+        ++cached->refcnt;
+        connection_dir_buf_add_external(ptr + spooled->cached_dir_offset,
+                                        bytes, conn,
+                                        cached_dir_decref_void, cached);
+      } else {
+        consensus_cache_entry_incref(cce);
+        connection_dir_buf_add_external(ptr + spooled->cached_dir_offset,
+                                        bytes, conn,
+                                        consensus_cache_entry_decref_void,
+                                        cce);
+      }
+    } else {
+      bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
@@ -774,10 +813,11 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
   if (conn->compress_state) {
     /* Flush the compression state: there could be more bytes pending in there,
      * and we don't want to omit bytes. */
-    connection_buf_add_compress("", 0, conn, 1);
+    connection_dir_buf_add("", 0, conn, 1);
     qed_hs_compress_free(conn->compress_state);
     conn->compress_state = NULL;
   }
+  connection_dir_end_chunked_body(conn);
   return 0;
 }
 
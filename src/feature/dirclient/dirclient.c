@@ -17,6 +17,7 @@
 #include "core/mainloop/mainloop.h"
 #include "core/or/connection_edge.h"
 #include "core/or/policies.h"
+#include "core/proto/proto_http.h"
 #include "feature/client/bridges.h"
 #include "feature/client/entrynodes.h"
 #include "feature/control/control_events.h"
@@ -711,8 +712,8 @@ directory_choose_address_routerstatus(const routerstatus_t *status,
  * server due to a network error: Mark the router as down and try again if
  * possible.
  */
-void
-connection_dir_client_request_failed(dir_connection_t *conn)
+MOCK_IMPL(void,
+connection_dir_client_request_failed,(dir_connection_t *conn))
 {
   if (conn->guard_state) {
     /* We haven't seen a success on this guard state, so consider it to have
@@ -771,6 +772,100 @@ connection_dir_client_request_failed(dir_connection_t *conn)
   }
 }
 
+/** A directory request that we wrote on a kept-alive connection after the
+ * one whose answer we're waiting for. */
+typedef struct dir_pipelined_request_t {
+  /** One of DIR_PURPOSE_*, as in connection_t.purpose. */
+  uint8_t purpose;
+  /** As in dir_connection_t. */
+  uint8_t router_purpose;
+  /** As in dir_connection_t. */
+  char *requested_resource;
+} dir_pipelined_request_t;
+
+/** Release all storage held by <b>req</b>. */
+static void
+dir_pipelined_request_free_(dir_pipelined_request_t *req)
+{
+  if (!req)
+    return;
+  qed_hs_free(req->requested_resource);
+  qed_hs_free(req);
+}
+#define dir_pipelined_request_free(req) \
+  FREE_AND_NULL(dir_pipelined_request_t, dir_pipelined_request_free_, (req))
+
+/** Forget every request that we wrote on <b>conn</b> after the current one,
+ * and free the list. */
+void
+dir_conn_clear_pipeline(dir_connection_t *conn)
+{
+  if (!conn || !conn->pipelined_requests)
+    return;
+  SMARTLIST_FOREACH(conn->pipelined_requests, dir_pipelined_request_t *, req,
+                    dir_pipelined_request_free(req));
+  smartlist_free(conn->pipelined_requests);
+}
+
+/** Make the oldest request that we wrote on <b>conn</b> after its current
+ * one the current one, if there is one, and return true.  Otherwise return
+ * false. */
+static int
+dir_conn_start_next_request(dir_connection_t *conn)
+{
+  dir_pipelined_request_t *req;
+  if (!conn->pipelined_requests || !smartlist_len(conn->pipelined_requests))
+    return 0;
+  req = smartlist_get(conn->pipelined_requests, 0);
+  smartlist_del_keeporder(conn->pipelined_requests, 0);
+  conn->base_.purpose = req->purpose;
+  conn->router_purpose = req->router_purpose;
+  qed_hs_free(conn->requested_resource);
+  conn->requested_resource = req->requested_resource;
+  req->requested_resource = NULL;
+  dir_pipelined_request_free(req);
+  return 1;
+}
+
+/** Called when we are closing <b>conn</b>, once we're done with its current
+ * request: the requests that we wrote after that one will never get an
+ * answer, so treat each of them as failed. */
+void
+connection_dir_client_pipeline_failed(dir_connection_t *conn)
+{
+  while (dir_conn_start_next_request(conn)) {
+    connection_dir_client_request_failed(conn);
+  }
+  dir_conn_clear_pipeline(conn);
+}
+
+/** Add to <b>resources_out</b> the requested resource of every directory
+ * request with purpose <b>purpose</b> that we have written, or are about to
+ * write, and not yet had an answer to.  The strings are not copied, and are
+ * only valid until the connections change. */
+void
+connection_dir_list_pending_resources(int purpose, smartlist_t *resources_out)
+{
+  smartlist_t *conns = get_connection_array();
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    if (conn->type != CONN_TYPE_DIR || conn->marked_for_close)
+      continue;
+    dir_connection_t *dir_conn = TO_DIR_CONN(conn);
+    if (conn->purpose == purpose &&
+        conn->state != DIR_CONN_STATE_CLIENT_FINISHED &&
+        dir_conn->requested_resource)
+      smartlist_add(resources_out, dir_conn->requested_resource);
+    if (!dir_conn->pipelined_requests)
+      continue;
+    SMARTLIST_FOREACH_BEGIN(dir_conn->pipelined_requests,
+                            dir_pipelined_request_t *, req) {
+      if (req->purpose == purpose && req->requested_resource)
+        smartlist_add(resources_out, req->requested_resource);
+    } SMARTLIST_FOREACH_END(req);
+  } SMARTLIST_FOREACH_END(conn);
+}
+
 /** Helper: Attempt to fetch directly the descriptors of each bridge
  * listed in <b>failed</b>.
  */
@@ -1245,6 +1340,65 @@ directory_request_set_dir_from_routerstatus(directory_request_t *req)
   return 0;
 }
 
+/** Return true iff we could send <b>req</b> on a directory connection that
+ * the server keeps open for more requests: that is, if it's a plain fetch,
+ * without a body, of something other than an onion service descriptor. */
+STATIC int
+dir_request_can_keep_alive(const directory_request_t *req)
+{
+  if (req->payload || req->hs_ident)
+    return 0;
+
+  switch (req->dir_purpose) {
+    case DIR_PURPOSE_FETCH_CONSENSUS:
+    case DIR_PURPOSE_FETCH_CERTIFICATE:
+    case DIR_PURPOSE_FETCH_STATUS_VOTE:
+    case DIR_PURPOSE_FETCH_DETACHED_SIGNATURES:
+    case DIR_PURPOSE_FETCH_SERVERDESC:
+    case DIR_PURPOSE_FETCH_EXTRAINFO:
+    case DIR_PURPOSE_FETCH_MICRODESC:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/** Return a directory connection to the server with identity
+ * <b>digest</b> that it has agreed to keep open, and on which we can send a
+ * request with purpose <b>dir_purpose</b> now, or NULL if there is none.
+ * We prefer idle connections.
+ *
+ * We never write a request behind a consensus fetch, or a consensus fetch
+ * behind another request: when one consensus fetch succeeds, we close all
+ * the others, along with whatever else is waiting on them. */
+STATIC dir_connection_t *
+dir_conn_find_keep_alive(const char *digest, uint8_t dir_purpose)
+{
+  smartlist_t *conns = get_connection_array();
+  dir_connection_t *busy = NULL;
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base) {
+    if (base->type != CONN_TYPE_DIR || base->marked_for_close ||
+        DIR_CONN_IS_SERVER(base))
+      continue;
+    dir_connection_t *conn = TO_DIR_CONN(base);
+    if (!conn->keep_alive ||
+        fast_memneq(conn->identity_digest, digest, DIGEST_LEN))
+      continue;
+    if (base->state == DIR_CONN_STATE_CLIENT_FINISHED)
+      return conn;
+    if (!busy &&
+        dir_purpose != DIR_PURPOSE_FETCH_CONSENSUS &&
+        base->purpose != DIR_PURPOSE_FETCH_CONSENSUS &&
+        (!conn->pipelined_requests ||
+         smartlist_len(conn->pipelined_requests) <
+           MAX_PIPELINED_DIR_REQUESTS))
+      busy = conn;
+  } SMARTLIST_FOREACH_END(base);
+
+  return busy;
+}
+
 /**
  * Launch the provided directory request, configured in <b>request</b>.
  * After this function is called, you can free <b>request</b>.
@@ -1337,6 +1491,37 @@ directory_initiate_request,(directory_request_t *request))
     return;
   }
 
+  /* Can we send this request on a connection that we already have? */
+  const int can_keep_alive = use_begindir && !anonymized_connection &&
+    dir_request_can_keep_alive(request);
+  if (can_keep_alive &&
+      (conn = dir_conn_find_keep_alive(digest, dir_purpose))) {
+    // We won't be building a circuit for this request.
+    if (guard_state) {
+      entry_guard_cancel(&guard_state);
+    }
+    if (conn->base_.state == DIR_CONN_STATE_CLIENT_FINISHED) {
+      conn->base_.purpose = dir_purpose;
+      conn->router_purpose = router_purpose;
+      qed_hs_free(conn->requested_resource);
+      conn->requested_resource = resource ? qed_hs_strdup(resource) : NULL;
+      conn->base_.state = DIR_CONN_STATE_CLIENT_SENDING;
+    } else {
+      dir_pipelined_request_t *req = qed_hs_malloc_zero(sizeof(*req));
+      req->purpose = dir_purpose;
+      req->router_purpose = router_purpose;
+      req->requested_resource = resource ? qed_hs_strdup(resource) : NULL;
+      if (!conn->pipelined_requests)
+        conn->pipelined_requests = smartlist_new();
+      smartlist_add(conn->pipelined_requests, req);
+    }
+    log_info(LD_DIR, "Sending %s on kept-alive connection %s.",
+             dir_conn_purpose_to_string(dir_purpose),
+             connection_describe(TO_CONN(conn)));
+    directory_send_command(conn, 0, request);
+    return;
+  }
+
   conn = dir_connection_new(qed_hs_addr_family(&addr));
 
   /* set up conn so it's got all the data we need to remember */
@@ -1347,6 +1532,11 @@ directory_initiate_request,(directory_request_t *request))
 
   conn->base_.purpose = dir_purpose;
   conn->router_purpose = router_purpose;
+  if (resource)
+    conn->requested_resource = qed_hs_strdup(resource);
+  /* Ask the server to keep the connection open, so that we can send our
+   * next requests on it. */
+  conn->wants_keep_alive = can_keep_alive;
 
   /* give it an initial state */
   conn->base_.state = DIR_CONN_STATE_CONNECTING;
@@ -1562,10 +1752,6 @@ directory_send_command(dir_connection_t *conn,
   qed_hs_assert(conn);
   qed_hs_assert(conn->base_.type == CONN_TYPE_DIR);
 
-  qed_hs_free(conn->requested_resource);
-  if (resource)
-    conn->requested_resource = qed_hs_strdup(resource);
-
   /* decorate the ip address if it is ipv6 */
   if (strchr(conn->base_.address, ':')) {
     copy_ipv6_address(decorated_address, conn->base_.address,
@@ -1733,11 +1919,15 @@ directory_send_command(dir_connection_t *conn,
     smartlist_add_asprintf(headers, "Content-Length: %lu\r\n",
                  payload ? (unsigned long)payload_len : 0);
   }
+  if (conn->wants_keep_alive) {
+    smartlist_add_strdup(headers, "Connection: keep-alive\r\n");
+  }
 
   {
     char *header = smartlist_join_strings(headers, "", 0, NULL);
-    qed_hs_snprintf(request, sizeof(request), " HTTP/1.0\r\nHost: %s\r\n%s\r\n",
-                 hoststring, header);
+    qed_hs_snprintf(request, sizeof(request),
+                 " HTTP/1.%d\r\nHost: %s\r\n%s\r\n",
+                 conn->wants_keep_alive, hoststring, header);
     qed_hs_free(header);
   }
 
@@ -1759,7 +1949,7 @@ directory_send_command(dir_connection_t *conn,
             "(purpose: %d, request size: %"QED_HS_PRIuSZ", "
             "payload size: %"QED_HS_PRIuSZ")",
             connection_describe_peer(TO_CONN(conn)),
-            conn->base_.purpose,
+            purpose,
             (total_request_len),
             (payload ? payload_len : 0));
 }
@@ -2020,35 +2210,14 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
 {
   char *body = NULL;
   char *headers = NULL;
-  char *reason = NULL;
   size_t body_len = 0;
-  int status_code;
-  time_t date_header = 0;
-  long apparent_skew;
-  compress_method_t compression;
-  int skewed = 0;
-  int rv;
   int allow_partial = (conn->base_.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
                        conn->base_.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
                        conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC);
   size_t received_bytes;
-  const int anonymized_connection =
-    purpose_needs_anonymity(conn->base_.purpose,
-                            conn->router_purpose,
-                            conn->requested_resource);
 
   received_bytes = connection_get_inbuf_len(TO_CONN(conn));
 
-  log_debug(LD_DIR, "Downloaded %"QED_HS_PRIuSZ" bytes on connection of purpose "
-             "%s; bootstrap %d%%",
-             received_bytes,
-             dir_conn_purpose_to_string(conn->base_.purpose),
-             control_get_bootstrap_percent());
-  {
-    bool bootstrapped = control_get_bootstrap_percent() == 100;
-    total_dl[conn->base_.purpose][bootstrapped] += received_bytes;
-  }
-
   switch (connection_fetch_from_buf_http(TO_CONN(conn),
                               &headers, MAX_HEADERS_SIZE,
                               &body, &body_len, MAX_DIR_DL_SIZE,
@@ -2065,6 +2234,45 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     /* case 1, fall through */
   }
 
+  return connection_dir_client_handle_response(conn, headers, body, body_len,
+                                               received_bytes);
+}
+
+/** We are a client, and we've read the server's whole response to the
+ * current request on <b>conn</b>, in <b>received_bytes</b> bytes: its
+ * <b>headers</b>, and its <b>body_len</b>-byte <b>body</b>.  Take
+ * ownership of both, parse them and act appropriately.
+ *
+ * Return values are as for connection_dir_client_reached_eof().
+ */
+MOCK_IMPL(STATIC int,
+connection_dir_client_handle_response,(dir_connection_t *conn,
+                                       char *headers, char *body,
+                                       size_t body_len,
+                                       size_t received_bytes))
+{
+  char *reason = NULL;
+  int status_code;
+  time_t date_header = 0;
+  long apparent_skew;
+  compress_method_t compression;
+  int skewed = 0;
+  int rv;
+  const int anonymized_connection =
+    purpose_needs_anonymity(conn->base_.purpose,
+                            conn->router_purpose,
+                            conn->requested_resource);
+
+  log_debug(LD_DIR, "Downloaded %"QED_HS_PRIuSZ" bytes on connection of "
+            "purpose %s; bootstrap %d%%",
+            received_bytes,
+            dir_conn_purpose_to_string(conn->base_.purpose),
+            control_get_bootstrap_percent());
+  {
+    bool bootstrapped = control_get_bootstrap_percent() == 100;
+    total_dl[conn->base_.purpose][bootstrapped] += received_bytes;
+  }
+
   if (parse_http_response(headers, &status_code, &date_header,
                           &compression, &reason) < 0) {
     log_warn(LD_HTTP,"Unparseable headers (%s). Closing.",
@@ -2235,6 +2443,7 @@ handle_response_fetch_consensus(dir_connection_t *conn,
 
   const char *consensus;
   char *new_consensus = NULL;
+  consensus_diff_unchanged_t *unchanged = NULL;
   const char *sourcename;
 
   int r;
@@ -2280,8 +2489,10 @@ handle_response_fetch_consensus(dir_connection_t *conn,
       return -1;
     }
 
-    new_consensus = consensus_diff_apply(consensus_body, consensus_body_len,
-                                         body, body_len);
+    new_consensus = consensus_diff_apply_tracking(consensus_body,
+                                                  consensus_body_len,
+                                                  body, body_len,
+                                                  &unchanged);
     qed_hs_munmap_file(mapped_consensus);
     if (new_consensus == NULL) {
       log_warn(LD_DIR, "Could not apply consensus diff received from server "
@@ -2304,10 +2515,13 @@ handle_response_fetch_consensus(dir_connection_t *conn,
     sourcename = "downloaded";
   }
 
-  if ((r=networkstatus_set_current_consensus(consensus,
-                                             strlen(consensus),
-                                             flavname, 0,
-                                             conn->identity_digest))<0) {
+  r = networkstatus_set_current_consensus_from_diff(consensus,
+                                                    strlen(consensus),
+                                                    flavname, 0,
+                                                    conn->identity_digest,
+                                                    unchanged);
+  consensus_diff_unchanged_free(unchanged);
+  if (r < 0) {
     log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
            "Unable to load %s consensus directory %s from "
            "server %s. I'll try again soon.",
@@ -2842,6 +3056,106 @@ handle_response_upload_hsdesc(dir_connection_t *conn,
   return 0;
 }
 
+/** We are a client that asked the server to keep <b>conn</b> open.  Handle
+ * every complete response on its inbuf, in the order we sent the requests.
+ *
+ * If the server says it will close the connection after a response, leave
+ * that response on the inbuf for connection_dir_reached_eof().
+ *
+ * Return 0 on success, or -1 if we marked the connection for close.
+ */
+int
+connection_dir_client_process_keep_alive(dir_connection_t *conn)
+{
+  connection_t *base = TO_CONN(conn);
+  buf_t *inbuf = base->inbuf;
+
+  while (!base->marked_for_close && buf_datalen(inbuf)) {
+    int r, chunked = 0;
+
+    if (base->state == DIR_CONN_STATE_CLIENT_FINISHED) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Unexpected data from %s on an idle directory connection. "
+             "Closing.", connection_describe_peer(base));
+      connection_mark_for_close(base);
+      return -1;
+    }
+
+    if (!conn->response_headers) {
+      r = fetch_from_buf_http_keep_alive(inbuf, &conn->response_headers,
+                                         MAX_HEADERS_SIZE,
+                                         &chunked, &conn->body_left);
+      if (r == 0)
+        return 0;
+      if (r == 2) {
+        /* This is the last response on this connection: let it run to
+         * EOF, and send nothing else. */
+        conn->wants_keep_alive = conn->keep_alive = 0;
+        return 0;
+      }
+      if (r < 0) {
+        log_warn(LD_PROTOCOL, "Bad response headers on kept-alive "
+                 "directory connection %s. Closing.",
+                 connection_describe(base));
+        connection_mark_for_close(base);
+        return -1;
+      }
+      /* The server will keep the connection open: we can send more requests
+       * on it. */
+      conn->keep_alive = 1;
+      conn->chunked = chunked;
+      conn->received_bytes = strlen(conn->response_headers);
+      if (!conn->chunk_buf)
+        conn->chunk_buf = buf_new();
+    }
+
+    size_t before = buf_datalen(inbuf);
+    if (conn->chunked) {
+      r = buf_http_dechunk(inbuf, conn->chunk_buf, &conn->body_left,
+                           MAX_DIR_DL_SIZE);
+    } else {
+      size_t n = MIN(conn->body_left, before);
+      size_t to_move = n;
+      if (buf_datalen(conn->chunk_buf) + n >= MAX_DIR_DL_SIZE) {
+        r = -1;
+      } else {
+        buf_move_to_buf(conn->chunk_buf, inbuf, &to_move);
+        conn->body_left -= n;
+        r = conn->body_left == 0;
+      }
+    }
+    conn->received_bytes += before - buf_datalen(inbuf);
+    if (r == 0)
+      return 0;
+    if (r < 0) {
+      log_warn(LD_PROTOCOL, "Bad response body on kept-alive directory "
+               "connection %s. Closing.", connection_describe(base));
+      connection_mark_for_close(base);
+      return -1;
+    }
+
+    /* We have the whole response. */
+    size_t body_len;
+    char *body = buf_extract(conn->chunk_buf, &body_len);
+    char *headers = conn->response_headers;
+    buf_clear(conn->chunk_buf);
+    conn->response_headers = NULL;
+    if (connection_dir_client_handle_response(conn, headers, body, body_len,
+                                              conn->received_bytes) < 0) {
+      /* As if the server had closed the connection after this response:
+       * try the request again, maybe elsewhere. */
+      connection_mark_for_close(base);
+      return -1;
+    }
+    if (!base->marked_for_close && !dir_conn_start_next_request(conn)) {
+      /* Nothing more to read until we send another request. */
+      base->state = DIR_CONN_STATE_CLIENT_FINISHED;
+      buf_free(conn->chunk_buf);
+    }
+  }
+  return 0;
+}
+
 /** Called when a directory connection reaches EOF. */
 int
 connection_dir_reached_eof(dir_connection_t *conn)
@@ -2854,6 +3168,14 @@ connection_dir_reached_eof(dir_connection_t *conn)
     connection_mark_for_close(TO_CONN(conn));
     return -1;
   }
+  if (conn->keep_alive) {
+    /* We have handled every complete response already: the server closed
+     * the connection in the middle of one. */
+    log_info(LD_HTTP, "Kept-alive directory connection %s closed before "
+             "its response was complete.", connection_describe(TO_CONN(conn)));
+    connection_mark_for_close(TO_CONN(conn));
+    return -1;
+  }
 
   retval = connection_dir_client_reached_eof(conn);
   if (retval == 0) /* success */
@@ -88,9 +88,15 @@ MOCK_DECL(void, directory_initiate_request, (directory_request_t *request));
 
 int router_supports_extrainfo(const char *identity_digest, int is_authority);
 
-void connection_dir_client_request_failed(dir_connection_t *conn);
+MOCK_DECL(void, connection_dir_client_request_failed,
+          (dir_connection_t *conn));
+void connection_dir_client_pipeline_failed(dir_connection_t *conn);
 void connection_dir_client_refetch_hsdesc_if_needed(
                                           dir_connection_t *dir_conn);
+int connection_dir_client_process_keep_alive(dir_connection_t *conn);
+void dir_conn_clear_pipeline(dir_connection_t *conn);
+void connection_dir_list_pending_resources(int purpose,
+                                           smartlist_t *resources_out);
 
 #ifdef DIRCLIENT_PRIVATE
 struct directory_request_t {
@@ -163,6 +169,16 @@ STATIC int handle_response_fetch_consensus(dir_connection_t *conn,
 
 STATIC dirinfo_type_t dir_fetch_type(int dir_purpose, int router_purpose,
                                      const char *resource);
+MOCK_DECL(STATIC int, connection_dir_client_handle_response,
+          (dir_connection_t *conn, char *headers, char *body,
+           size_t body_len, size_t received_bytes));
+
+/** Most requests that we write on a kept-alive directory connection while
+ * still waiting for the answer to an earlier one. */
+#define MAX_PIPELINED_DIR_REQUESTS 8
+STATIC int dir_request_can_keep_alive(const directory_request_t *req);
+STATIC dir_connection_t *dir_conn_find_keep_alive(const char *digest,
+                                                  uint8_t dir_purpose);
 #endif /* defined(DIRCLIENT_PRIVATE) */
 
 #endif /* !defined(QED_HS_DIRCLIENT_H) */
@@ -15,10 +15,11 @@
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take O(ND)
+ * time and linear space to generate an ed diff given two smartlists of N
+ * lines that differ by D lines. As shown in its comment section, calling
+ * calc_changes on the entire two consensuses will calculate what is to be
+ * added and what is to be deleted in the diff, using Myers' diff algorithm.
  * Its comment section briefly explains how it works.
  *
  * In our case specific to consensuses, we take advantage of the fact that
@@ -29,6 +30,14 @@
  * time near-linear. This is explained in more detail in the gen_ed_diff
  * comments.
  *
+ * Before diffing, we intern the lines of the target consensus: each distinct
+ * line gets a small integer identifier, and the lines of the base consensus
+ * are looked up in the same table.  The diff then compares integers instead
+ * of strings.  A consensus_diff_target_t holds an interned target consensus,
+ * so that a directory cache can compute the diffs from all of its older
+ * consensuses to a new one without splitting and interning the new one again
+ * for every diff.
+ *
  * The allocation strategy tries to save time and memory by avoiding needless
  * copies.  Instead of actually splitting the inputs into separate strings, we
  * allocate cdline_t objects, each of which represents a line in the original
@@ -42,6 +51,8 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "ext/ht.h"
+#include "ext/siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
@@ -151,59 +162,23 @@ smartlist_slice(const smartlist_t *list, int start, int end)
   slice->list = list;
   slice->offset = start;
   slice->len = end - start;
+  slice->ids = NULL;
   return slice;
 }
 
-/** Helper: Compute the longest common subsequence lengths for the two slices.
- * Used as part of the diff generation to find the column at which to split
- * slice2 while still having the optimal solution.
- * If direction is -1, the navigation is reversed. Otherwise it must be 1.
- * The length of the resulting integer array is that of the second slice plus
- * one.
+/** Helper: Return true iff line <b>i1</b> of the list that <b>slice1</b> is
+ * made from has the same contents as line <b>i2</b> of the list that
+ * <b>slice2</b> is made from.
  */
-STATIC int *
-lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
-            int direction)
+static inline int
+slice_lines_eq(const smartlist_slice_t *slice1, int i1,
+               const smartlist_slice_t *slice2, int i2)
 {
-  size_t a_size = sizeof(int) * (slice2->len+1);
-
-  /* Resulting lcs lengths. */
-  int *result = qed_hs_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = qed_hs_malloc(a_size);
-
-  qed_hs_assert(direction == 1 || direction == -1);
-
-  int si = slice1->offset;
-  if (direction == -1) {
-    si += (slice1->len-1);
-  }
-
-  for (int i = 0; i < slice1->len; ++i, si+=direction) {
-
-    const cdline_t *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
-
-    int sj = slice2->offset;
-    if (direction == -1) {
-      sj += (slice2->len-1);
-    }
-
-    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
-
-      const cdline_t *line2 = smartlist_get(slice2->list, sj);
-      if (lines_eq(line1, line2)) {
-        /* If the lines are equal, the lcs is one line longer. */
-        result[j + 1] = prev[j] + 1;
-      } else {
-        /* If not, see what lcs parent path is longer. */
-        result[j + 1] = MAX(result[j], prev[j + 1]);
-      }
-    }
+  if (slice1->ids && slice2->ids) {
+    return slice1->ids[i1] == slice2->ids[i2];
   }
-  qed_hs_free(prev);
-  return result;
+  return lines_eq(smartlist_get(slice1->list, i1),
+                  smartlist_get(slice2->list, i2));
 }
 
 /** Helper: Trim any number of lines that are equally at the start or the end
@@ -213,9 +188,7 @@ STATIC void
 trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
 {
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, slice1->offset);
-    const cdline_t *line2 = smartlist_get(slice2->list, slice2->offset);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, slice1->offset, slice2, slice2->offset)) {
       break;
     }
     slice1->offset++; slice1->len--;
@@ -226,9 +199,7 @@ trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
   int i2 = (slice2->offset+slice2->len)-1;
 
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, i1);
-    const cdline_t *line2 = smartlist_get(slice2->list, i2);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, i1, slice2, i2)) {
       break;
     }
     i1--;
@@ -282,33 +253,131 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   }
 }
 
-/*
- * Helper: Given that slice1 has been split by half into top and bot, we want
- * to fetch the column at which to split slice2 so that we are still on track
- * to the optimal diff solution, i.e. the shortest one. We use lcs_lengths
- * since the shortest diff is just another way to say the longest common
- * subsequence.
+/**
+ * Helper: Find a point through which some shortest edit script turning
+ * slice1 into slice2 passes, using the "middle snake" search from Myers' "An
+ * O(ND) Difference Algorithm and Its Variations": we follow the furthest
+ * reaching D-paths forward from the start and backward from the end of both
+ * slices at the same time, until a forward and a backward path overlap.
+ *
+ * On success, store the offsets of the point, relative to the start of each
+ * slice, in *<b>split1_out</b> and *<b>split2_out</b>, and return 0.  Return
+ * -1 if the slices have no lines in common.
+ *
+ * This takes O((N+M)D) time and O(N+M) space, where D is the length of the
+ * shortest edit script.
  */
-static int
-optimal_column_to_split(const smartlist_slice_t *top,
-                        const smartlist_slice_t *bot,
-                        const smartlist_slice_t *slice2)
+STATIC int
+find_middle_snake(const smartlist_slice_t *slice1,
+                  const smartlist_slice_t *slice2,
+                  int *split1_out, int *split2_out)
 {
-  int *lens_top = lcs_lengths(top, slice2, 1);
-  int *lens_bot = lcs_lengths(bot, slice2, -1);
-  int column=0, max_sum=-1;
-
-  for (int i = 0; i < slice2->len+1; ++i) {
-    int sum = lens_top[i] + lens_bot[slice2->len-i];
-    if (sum > max_sum) {
-      column = i;
-      max_sum = sum;
+  const int len1 = slice1->len, len2 = slice2->len;
+  const int off1 = slice1->offset, off2 = slice2->offset;
+  const int max_d = (len1 + len2 + 1) / 2;
+  const int v_offset = max_d;
+  const int v_length = 2 * max_d + 2;
+  const int delta = len1 - len2;
+  /* If the total length difference is odd, the paths can only overlap
+   * while we are extending the forward path; otherwise, while we are
+   * extending the backward path. */
+  const int front = (delta % 2 != 0);
+  /* Furthest x reached on each diagonal k = x - y, going forward from the
+   * start and backward from the end.  Backward positions are counted from
+   * the end of the slices. */
+  int *v1 = qed_hs_malloc(sizeof(int) * v_length);
+  int *v2 = qed_hs_malloc(sizeof(int) * v_length);
+  /* How many diagonals to skip at either end of the search because their
+   * paths ran off the edge of the grid. */
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  int d, k1, k2, x1, y1, x2, y2;
+  int result = -1;
+
+  for (int i = 0; i < v_length; ++i) {
+    v1[i] = v2[i] = -1;
+  }
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (d = 0; d < max_d; ++d) {
+    for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      const int k1_offset = v_offset + k1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) {
+        x1 = v1[k1_offset + 1];
+      } else {
+        x1 = v1[k1_offset - 1] + 1;
+      }
+      y1 = x1 - k1;
+      while (x1 < len1 && y1 < len2 &&
+             slice_lines_eq(slice1, off1 + x1, slice2, off2 + y1)) {
+        x1++;
+        y1++;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > len1) {
+        /* Ran off the right of the grid. */
+        k1end += 2;
+      } else if (y1 > len2) {
+        /* Ran off the bottom of the grid. */
+        k1start += 2;
+      } else if (front) {
+        const int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1) {
+          /* Mirror x2 onto the forward coordinates. */
+          x2 = len1 - v2[k2_offset];
+          if (x1 >= x2) {
+            *split1_out = x1;
+            *split2_out = y1;
+            result = 0;
+            goto done;
+          }
+        }
+      }
+    }
+
+    for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      const int k2_offset = v_offset + k2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) {
+        x2 = v2[k2_offset + 1];
+      } else {
+        x2 = v2[k2_offset - 1] + 1;
+      }
+      y2 = x2 - k2;
+      while (x2 < len1 && y2 < len2 &&
+             slice_lines_eq(slice1, off1 + len1 - x2 - 1,
+                            slice2, off2 + len2 - y2 - 1)) {
+        x2++;
+        y2++;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > len1) {
+        /* Ran off the left of the grid. */
+        k2end += 2;
+      } else if (y2 > len2) {
+        /* Ran off the top of the grid. */
+        k2start += 2;
+      } else if (!front) {
+        const int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+          x1 = v1[k1_offset];
+          y1 = v_offset + x1 - k1_offset;
+          /* Mirror x2 onto the forward coordinates. */
+          x2 = len1 - x2;
+          if (x1 >= x2) {
+            *split1_out = x1;
+            *split2_out = y1;
+            result = 0;
+            goto done;
+          }
+        }
+      }
     }
   }
-  qed_hs_free(lens_top);
-  qed_hs_free(lens_bot);
 
-  return column;
+ done:
+  qed_hs_free(v1);
+  qed_hs_free(v2);
+  return result;
 }
 
 /**
@@ -318,10 +387,9 @@ optimal_column_to_split(const smartlist_slice_t *top,
  * bitarray means it's new.
  *
  * In its base case, either of the smartlists is of length <= 1 and we can
- * quickly see what elements are new or are gone. In the other case, we will
- * split one smartlist by half and we'll use optimal_column_to_split to find
- * the optimal column at which to split the second smartlist so that we are
- * finding the smallest diff possible.
+ * quickly see what elements are new or are gone. In the other case, we use
+ * find_middle_snake to find a point that some shortest diff passes through,
+ * split both slices there, and compute the changes of the two halves.
  */
 STATIC void
 calc_changes(smartlist_slice_t *slice1,
@@ -339,18 +407,25 @@ calc_changes(smartlist_slice_t *slice1,
   /* Keep on splitting the slices in two. */
   } else {
     smartlist_slice_t *top, *bot, *left, *right;
+    int mid1, mid2;
+
+    if (find_middle_snake(slice1, slice2, &mid1, &mid2) < 0) {
+      /* Nothing in common: every line changed. */
+      for (int i = 0; i < slice1->len; ++i)
+        bitarray_set(changed1, slice1->offset + i);
+      for (int i = 0; i < slice2->len; ++i)
+        bitarray_set(changed2, slice2->offset + i);
+      return;
+    }
 
-    /* Split the first slice in half. */
-    int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
+    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid1);
+    bot = smartlist_slice(slice1->list, slice1->offset+mid1,
         slice1->offset+slice1->len);
-
-    /* Split the second slice by the optimal column. */
-    int mid2 = optimal_column_to_split(top, bot, slice2);
     left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
     right = smartlist_slice(slice2->list, slice2->offset+mid2,
         slice2->offset+slice2->len);
+    top->ids = bot->ids = slice1->ids;
+    left->ids = right->ids = slice2->ids;
 
     calc_changes(top, left, changed1, changed2);
     calc_changes(bot, right, changed1, changed2);
@@ -601,16 +676,96 @@ preprocess_consensus(memarea_t *area,
   }
 }
 
+/** Hashtable entry mapping the contents of a line to the identifier we
+ * interned it as. */
+typedef struct cdline_intern_t {
+  HT_ENTRY(cdline_intern_t) node;
+  /** The first line we saw with these contents. */
+  const cdline_t *line;
+  /** The identifier of all lines with these contents. Never 0. */
+  uint32_t id;
+} cdline_intern_t;
+
+/** Helper: hash the contents of the line in a cdline_intern_t. */
+static unsigned
+cdline_intern_hash(const cdline_intern_t *ent)
+{
+  return (unsigned) siphash24g(ent->line->s, ent->line->len);
+}
+/** Helper: compare the lines of two cdline_intern_t objects. */
+static int
+cdline_intern_eq(const cdline_intern_t *ent1, const cdline_intern_t *ent2)
+{
+  return lines_eq(ent1->line, ent2->line);
+}
+
+HT_HEAD(cdline_intern_ht, cdline_intern_t);
+HT_PROTOTYPE(cdline_intern_ht, cdline_intern_t, node, cdline_intern_hash,
+             cdline_intern_eq);
+HT_GENERATE2(cdline_intern_ht, cdline_intern_t, node, cdline_intern_hash,
+             cdline_intern_eq, 0.6, qed_hs_reallocarray, qed_hs_free_);
+
+/** Give every distinct line in <b>lines</b> an identifier, adding the lines
+ * that are not there yet to <b>table</b>.  Table entries are allocated in
+ * <b>area</b>.  Return a newly allocated array holding the identifier of
+ * each line.
+ */
+static uint32_t *
+intern_lines(struct cdline_intern_ht *table, const smartlist_t *lines,
+             memarea_t *area)
+{
+  uint32_t *ids = qed_hs_calloc(smartlist_len(lines) + 1, sizeof(uint32_t));
+  SMARTLIST_FOREACH_BEGIN(lines, const cdline_t *, line) {
+    cdline_intern_t search, *ent;
+    search.line = line;
+    ent = HT_FIND(cdline_intern_ht, table, &search);
+    if (!ent) {
+      ent = memarea_alloc(area, sizeof(cdline_intern_t));
+      ent->line = line;
+      ent->id = HT_SIZE(table) + 1;
+      HT_INSERT(cdline_intern_ht, table, ent);
+    }
+    ids[line_sl_idx] = ent->id;
+  } SMARTLIST_FOREACH_END(line);
+  return ids;
+}
+
+/** Return a newly allocated array holding the identifier in <b>table</b> of
+ * each line in <b>lines</b>, or 0 for lines that are not in <b>table</b>.
+ * Does not modify <b>table</b>, so several threads can call this on the same
+ * table at once.
+ */
+static uint32_t *
+lookup_line_ids(const struct cdline_intern_ht *table,
+                const smartlist_t *lines)
+{
+  uint32_t *ids = qed_hs_calloc(smartlist_len(lines) + 1, sizeof(uint32_t));
+  SMARTLIST_FOREACH_BEGIN(lines, const cdline_t *, line) {
+    cdline_intern_t search, *ent;
+    search.line = line;
+    ent = HT_FIND(cdline_intern_ht, table, &search);
+    if (ent)
+      ids[line_sl_idx] = ent->id;
+  } SMARTLIST_FOREACH_END(line);
+  return ids;
+}
+
 /** Generate an ed diff as a smartlist from two consensuses, also given as
  * smartlists. Will return NULL if the diff could not be generated, which can
  * happen if any lines the script had to add matched "." or if the routers
  * were not properly ordered.
  *
+ * If <b>ids1</b> and <b>ids2</b> are set, they hold the identifiers that the
+ * lines of <b>cons1_orig</b> and <b>cons2</b> were interned as: lines in
+ * <b>cons2</b> must have been interned with intern_lines(), and lines in
+ * <b>cons1_orig</b> must have been looked up in the same table with
+ * lookup_line_ids().  If they are NULL, we intern the lines here.
+ *
  * All cdline_t objects in the resulting object are either references to lines
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
+ * given input in O(ND) time, you can replace all the code until the
  * navigation in reverse order with the following:
  *
  *   int len1 = smartlist_len(cons1);
@@ -622,9 +777,17 @@ preprocess_consensus(memarea_t *area,
  *   calc_changes(cons1_sl, cons2_sl, changed1, changed2);
  */
 STATIC smartlist_t *
-gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
+gen_ed_diff(const smartlist_t *cons1_orig, const uint32_t *ids1,
+            const smartlist_t *cons2, const uint32_t *ids2,
             memarea_t *area)
 {
+  struct cdline_intern_ht table = HT_INITIALIZER();
+  uint32_t *owned_ids1 = NULL, *owned_ids2 = NULL;
+  if (!ids1 || !ids2) {
+    ids2 = owned_ids2 = intern_lines(&table, cons2, area);
+    ids1 = owned_ids1 = lookup_line_ids(&table, cons1_orig);
+  }
+
   smartlist_t *cons1 = smartlist_new();
   smartlist_add_all(cons1, cons1_orig);
   cdline_t *remove_trailer = preprocess_consensus(area, cons1);
@@ -737,6 +900,8 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
+    cons1_sl->ids = ids1;
+    cons2_sl->ids = ids2;
     calc_changes(cons1_sl, cons2_sl, changed1, changed2);
     qed_hs_free(cons1_sl);
     qed_hs_free(cons2_sl);
@@ -814,6 +979,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  HT_CLEAR(cdline_intern_ht, &table);
+  qed_hs_free(owned_ids1);
+  qed_hs_free(owned_ids2);
 
   return result;
 
@@ -822,6 +990,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  HT_CLEAR(cdline_intern_ht, &table);
+  qed_hs_free(owned_ids1);
+  qed_hs_free(owned_ids2);
 
   smartlist_free(result);
 
@@ -1021,15 +1192,17 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
  * as smartlists. Will return NULL if the consensus diff could not be
  * generated. Neither of the two consensuses are modified in any way, so it's
  * up to the caller to free their resources.
+ *
+ * <b>ids1</b> and <b>ids2</b> are as for gen_ed_diff().
  */
 smartlist_t *
-consdiff_gen_diff(const smartlist_t *cons1,
-                  const smartlist_t *cons2,
+consdiff_gen_diff(const smartlist_t *cons1, const uint32_t *ids1,
+                  const smartlist_t *cons2, const uint32_t *ids2,
                   const consensus_digest_t *digests1,
                   const consensus_digest_t *digests2,
                   memarea_t *area)
 {
-  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area);
+  smartlist_t *ed_diff = gen_ed_diff(cons1, ids1, cons2, ids2, area);
   /* ed diff could not be generated - reason already logged by gen_ed_diff. */
   if (!ed_diff) {
     goto error_cleanup;
@@ -1183,15 +1356,84 @@ consdiff_get_digests(const smartlist_t *diff,
   return 1;
 }
 
+/** Given the lines <b>cons1</b> of a consensus and the lines <b>cons2</b>
+ * of the consensus that apply_ed_diff() made from it, return a new
+ * consensus_diff_unchanged_t listing the parts of cons2 that are copied
+ * from a contiguous part of cons1.  <b>digests1</b> is the digest of
+ * cons1. */
+static consensus_diff_unchanged_t *
+find_unchanged_ranges(const smartlist_t *cons1, const smartlist_t *cons2,
+                      const consensus_digest_t *digests1)
+{
+  consensus_diff_unchanged_t *unchanged = qed_hs_malloc_zero(
+                                        sizeof(consensus_diff_unchanged_t));
+  memcpy(unchanged->base_digest, digests1->sha3_256, DIGEST256_LEN);
+  if (smartlist_len(cons1) == 0)
+    return unchanged;
+
+  /* Every line of cons2 refers either into the body of cons1, or into the
+   * diff. */
+  const cdline_t *first = smartlist_get(cons1, 0);
+  const cdline_t *last = smartlist_get(cons1, smartlist_len(cons1) - 1);
+  const uintptr_t base_start = (uintptr_t)first->s;
+  const uintptr_t base_end = (uintptr_t)(last->s + last->len);
+  const cdline_t *prev = NULL;
+  int allocated = 16;
+  size_t offset = 0;
+
+  unchanged->ranges = qed_hs_calloc(allocated, sizeof(consensus_range_t));
+  SMARTLIST_FOREACH_BEGIN(cons2, const cdline_t *, line) {
+    const uintptr_t p = (uintptr_t)line->s;
+    const size_t linelen = line->len + 1;
+    if (p >= base_start && p + line->len <= base_end) {
+      if (prev && line->s == prev->s + prev->len + 1) {
+        /* This line follows the last one in cons1 too. */
+        unchanged->ranges[unchanged->n_ranges - 1].end += linelen;
+      } else {
+        if (unchanged->n_ranges == allocated) {
+          allocated *= 2;
+          unchanged->ranges = qed_hs_reallocarray(unchanged->ranges,
+                                                  allocated,
+                                                  sizeof(consensus_range_t));
+        }
+        consensus_range_t *r = &unchanged->ranges[unchanged->n_ranges++];
+        r->start = offset;
+        r->end = offset + linelen;
+      }
+      prev = line;
+    } else {
+      prev = NULL;
+    }
+    offset += linelen;
+  } SMARTLIST_FOREACH_END(line);
+
+  return unchanged;
+}
+
+/** Release all storage held in <b>unchanged</b>. */
+void
+consensus_diff_unchanged_free_(consensus_diff_unchanged_t *unchanged)
+{
+  if (!unchanged)
+    return;
+  qed_hs_free(unchanged->ranges);
+  qed_hs_free(unchanged);
+}
+
 /** Apply the consensus diff to the given consensus and return a new
  * consensus, also as a line-based smartlist. Will return NULL if the diff
  * could not be applied. Neither the consensus nor the diff are modified in
  * any way, so it's up to the caller to free their resources.
+ *
+ * If <b>unchanged_out</b> is set, also set *<b>unchanged_out</b> on success
+ * to a description of which parts of the result were copied from
+ * <b>cons1</b>.
  */
 char *
 consdiff_apply_diff(const smartlist_t *cons1,
                     const smartlist_t *diff,
-                    const consensus_digest_t *digests1)
+                    const consensus_digest_t *digests1,
+                    consensus_diff_unchanged_t **unchanged_out)
 {
   smartlist_t *cons2 = NULL;
   char *cons2_str = NULL;
@@ -1257,6 +1499,9 @@ consdiff_apply_diff(const smartlist_t *cons1,
     goto error_cleanup;
   }
 
+  if (unchanged_out)
+    *unchanged_out = find_unchanged_ranges(cons1, cons2, digests1);
+
   goto done;
 
  error_cleanup:
@@ -1334,32 +1579,90 @@ consensus_join_lines(const smartlist_t *inp)
   return result;
 }
 
-/** Given two consensus documents, try to compute a diff between them.  On
- * success, return a newly allocated string containing that diff.  On failure,
- * return NULL. */
+/** A consensus that we compute diffs to, split into lines and interned. */
+struct consensus_diff_target_t {
+  /** The consensus itself, NUL-terminated. The lines point into it. */
+  char *body;
+  /** The digest of the consensus. */
+  consensus_digest_t digest;
+  /** Memory area holding <b>lines</b> and the entries of <b>table</b>. */
+  memarea_t *area;
+  /** The lines of the consensus, as cdline_t. */
+  smartlist_t *lines;
+  /** The identifier that each line in <b>lines</b> was interned as. */
+  uint32_t *ids;
+  /** Table of the distinct lines in the consensus. */
+  struct cdline_intern_ht table;
+};
+
+/** Split and intern the consensus document <b>cons</b> of length
+ * <b>conslen</b>, so that we can compute diffs to it.  The returned object
+ * holds its own copy of <b>cons</b>, and is not modified by
+ * consensus_diff_generate_to_target(), so it can be used by several threads
+ * at once.  Return NULL if <b>cons</b> can't be split into lines.
+ */
+consensus_diff_target_t *
+consensus_diff_target_new(const char *cons, size_t conslen)
+{
+  consensus_diff_target_t *target = qed_hs_malloc_zero(sizeof(*target));
+  HT_INIT(cdline_intern_ht, &target->table);
+  target->area = memarea_new();
+  target->lines = smartlist_new();
+  target->body = qed_hs_memdup_nulterm(cons, conslen);
+
+  if (BUG(consensus_compute_digest(target->body, conslen,
+                                   &target->digest) < 0))
+    goto err; // LCOV_EXCL_LINE
+  if (consensus_split_lines(target->lines, target->body, conslen,
+                            target->area) < 0)
+    goto err;
+  target->ids = intern_lines(&target->table, target->lines, target->area);
+
+  return target;
+ err:
+  consensus_diff_target_free(target);
+  return NULL;
+}
+
+/** Release all storage held in <b>target</b>. */
+void
+consensus_diff_target_free_(consensus_diff_target_t *target)
+{
+  if (!target)
+    return;
+  HT_CLEAR(cdline_intern_ht, &target->table);
+  qed_hs_free(target->ids);
+  smartlist_free(target->lines);
+  memarea_drop_all(target->area);
+  qed_hs_free(target->body);
+  qed_hs_free(target);
+}
+
+/** Given a consensus document and a target made with
+ * consensus_diff_target_new(), try to compute a diff between them.  On
+ * success, return a newly allocated string containing that diff.  On
+ * failure, return NULL. */
 char *
-consensus_diff_generate(const char *cons1, size_t cons1len,
-                        const char *cons2, size_t cons2len)
+consensus_diff_generate_to_target(const char *cons1, size_t cons1len,
+                                  const consensus_diff_target_t *target)
 {
-  consensus_digest_t d1, d2;
-  smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
-  int r1, r2;
+  consensus_digest_t d1;
+  smartlist_t *lines1 = NULL, *result_lines = NULL;
+  uint32_t *ids1 = NULL;
   char *result = NULL;
 
-  r1 = consensus_compute_digest_as_signed(cons1, cons1len, &d1);
-  r2 = consensus_compute_digest(cons2, cons2len, &d2);
-  if (BUG(r1 < 0 || r2 < 0))
+  if (BUG(consensus_compute_digest_as_signed(cons1, cons1len, &d1) < 0))
     return NULL; // LCOV_EXCL_LINE
 
   memarea_t *area = memarea_new();
   lines1 = smartlist_new();
-  lines2 = smartlist_new();
   if (consensus_split_lines(lines1, cons1, cons1len, area) < 0)
     goto done;
-  if (consensus_split_lines(lines2, cons2, cons2len, area) < 0)
-    goto done;
+  ids1 = lookup_line_ids(&target->table, lines1);
 
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  result_lines = consdiff_gen_diff(lines1, ids1,
+                                   target->lines, target->ids,
+                                   &d1, &target->digest, area);
 
  done:
   if (result_lines) {
@@ -1369,7 +1672,26 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
 
   memarea_drop_all(area);
   smartlist_free(lines1);
-  smartlist_free(lines2);
+  qed_hs_free(ids1);
+
+  return result;
+}
+
+/** Given two consensus documents, try to compute a diff between them.  On
+ * success, return a newly allocated string containing that diff.  On failure,
+ * return NULL. */
+char *
+consensus_diff_generate(const char *cons1, size_t cons1len,
+                        const char *cons2, size_t cons2len)
+{
+  consensus_diff_target_t *target;
+  char *result;
+
+  target = consensus_diff_target_new(cons2, cons2len);
+  if (!target)
+    return NULL;
+  result = consensus_diff_generate_to_target(cons1, cons1len, target);
+  consensus_diff_target_free(target);
 
   return result;
 }
@@ -1382,6 +1704,20 @@ consensus_diff_apply(const char *consensus,
                      size_t consensus_len,
                      const char *diff,
                      size_t diff_len)
+{
+  return consensus_diff_apply_tracking(consensus, consensus_len,
+                                       diff, diff_len, NULL);
+}
+
+/** As consensus_diff_apply(), but if <b>unchanged_out</b> is set, also set
+ * *<b>unchanged_out</b> on success to a newly allocated description of the
+ * parts of the new consensus that the diff left as they were. */
+char *
+consensus_diff_apply_tracking(const char *consensus,
+                              size_t consensus_len,
+                              const char *diff,
+                              size_t diff_len,
+                              consensus_diff_unchanged_t **unchanged_out)
 {
   consensus_digest_t d1;
   smartlist_t *lines1 = NULL, *lines2 = NULL;
@@ -1400,7 +1736,7 @@ consensus_diff_apply(const char *consensus,
   if (consensus_split_lines(lines2, diff, diff_len, area) < 0)
     goto done;
 
-  result = consdiff_apply_diff(lines1, lines2, &d1);
+  result = consdiff_apply_diff(lines1, lines2, &d1, unchanged_out);
 
  done:
   smartlist_free(lines1);
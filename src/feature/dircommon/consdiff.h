@@ -17,8 +17,50 @@ char *consensus_diff_generate(const char *cons1, size_t cons1len,
 char *consensus_diff_apply(const char *consensus, size_t consensus_len,
                            const char *diff, size_t diff_len);
 
+/** A range of bytes [start, end) in a document. */
+typedef struct consensus_range_t {
+  size_t start;
+  size_t end;
+} consensus_range_t;
+
+/** The parts of a consensus made by applying a diff that the diff left as
+ * they were in the consensus it was applied to. */
+typedef struct consensus_diff_unchanged_t {
+  /** The SHA3-256 digest-as-signed of the consensus that the diff was
+   * applied to. */
+  uint8_t base_digest[DIGEST256_LEN];
+  /** Number of elements in <b>ranges</b>. */
+  int n_ranges;
+  /** Sorted, disjoint ranges of whole lines of the new consensus, each of
+   * which was copied from a contiguous part of the old one. */
+  consensus_range_t *ranges;
+} consensus_diff_unchanged_t;
+
+char *consensus_diff_apply_tracking(const char *consensus,
+                                    size_t consensus_len,
+                                    const char *diff, size_t diff_len,
+                                    consensus_diff_unchanged_t **unchanged_out);
+void consensus_diff_unchanged_free_(consensus_diff_unchanged_t *unchanged);
+#define consensus_diff_unchanged_free(unchanged) \
+  FREE_AND_NULL(consensus_diff_unchanged_t, consensus_diff_unchanged_free_, \
+                (unchanged))
+
 int looks_like_a_consensus_diff(const char *document, size_t len);
 
+/** A consensus that we are going to compute one or more diffs to, split into
+ * lines and interned once so that it can be shared read-only between
+ * several diff computations, including ones running in different threads. */
+typedef struct consensus_diff_target_t consensus_diff_target_t;
+
+consensus_diff_target_t *consensus_diff_target_new(const char *cons,
+                                                   size_t conslen);
+void consensus_diff_target_free_(consensus_diff_target_t *target);
+#define consensus_diff_target_free(target) \
+  FREE_AND_NULL(consensus_diff_target_t, consensus_diff_target_free_, \
+                (target))
+char *consensus_diff_generate_to_target(const char *cons1, size_t cons1len,
+                                        const consensus_diff_target_t *target);
+
 #ifdef CONSDIFF_PRIVATE
 #include "lib/container/bitarray.h"
 
@@ -37,13 +79,16 @@ typedef struct consensus_digest_t {
 } consensus_digest_t;
 
 STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
+                                      const uint32_t *ids1,
                                       const smartlist_t *cons2,
+                                      const uint32_t *ids2,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
                                       struct memarea_t *area);
 STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
                                  const smartlist_t *diff,
-                                 const consensus_digest_t *digests1);
+                                 const consensus_digest_t *digests1,
+                                 consensus_diff_unchanged_t **unchanged_out);
 STATIC int consdiff_get_digests(const smartlist_t *diff,
                                 char *digest1_out,
                                 char *digest2_out);
@@ -59,9 +104,18 @@ typedef struct smartlist_slice_t {
   int offset;
   /** Length of the slice, i.e. the number of elements it holds. */
   int len;
+  /**
+   * Interned identifiers of the lines in <b>list</b>, indexed like
+   * <b>list</b>, or NULL if the lines have not been interned.  When both
+   * slices being compared have identifiers, lines are compared by
+   * identifier instead of by contents.
+   */
+  const uint32_t *ids;
 } smartlist_slice_t;
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
+                                const uint32_t *ids1,
                                 const smartlist_t *cons2,
+                                const uint32_t *ids2,
                                 struct memarea_t *area);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
@@ -71,9 +125,9 @@ STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
-STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
-                        const smartlist_slice_t *slice2,
-                        int direction);
+STATIC int find_middle_snake(const smartlist_slice_t *slice1,
+                             const smartlist_slice_t *slice2,
+                             int *split1_out, int *split2_out);
 STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
 STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
 STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
@@ -31,6 +31,16 @@ struct dir_connection_t {
   /** Is this dirconn direct, or via a multi-hop Tor circuit?
    * Direct connections can use the DirPort, or BEGINDIR over the ORPort. */
   unsigned int dirconn_direct:1;
+  /** Client only: did we ask the server to keep this connection open after
+   * each response? */
+  unsigned int wants_keep_alive:1;
+  /** On a client, true iff the server agreed to keep this connection open,
+   * so that we can send more requests on it.  On a server, true iff we
+   * agreed to keep it open after the response to the last request. */
+  unsigned int keep_alive:1;
+  /** True iff the body of the response we're reading (client) or writing
+   * (server) uses the chunked transfer-coding. */
+  unsigned int chunked:1;
 
   /** If we're fetching descriptors, what router purpose shall we assign
    * to them? */
@@ -42,6 +52,25 @@ struct dir_connection_t {
   /** The compression object doing on-the-fly compression for spooled data. */
   struct qed_hs_compress_state_t *compress_state;
 
+  /** On a server, scratch space for framing the next chunk of a chunked
+   * response.  On a client, the body of the kept-alive response that we're
+   * reading, as far as we have it. */
+  struct buf_t *chunk_buf;
+  /** Client only: the headers of the kept-alive response that we're
+   * reading, once we have all of them. */
+  char *response_headers;
+  /** Client only: how much of the body of the kept-alive response we're
+   * reading is still to come.  See buf_http_dechunk() for chunked bodies;
+   * otherwise it's a byte count. */
+  size_t body_left;
+  /** Client only: how many bytes of the kept-alive response we're reading
+   * have arrived so far. */
+  size_t received_bytes;
+  /** Client only: the requests that we've written on this connection after
+   * the one described by our purpose and requested_resource, oldest first,
+   * as dir_pipelined_request_t. */
+  smartlist_t *pipelined_requests;
+
   /* Hidden service connection identifier for dir connections: Used by HS
      client-side code to fetch HS descriptors, and by the service-side code to
      upload descriptors. Also used by the HSDir, setting only the blinded key,
@@ -450,7 +450,10 @@ connection_dir_process_inbuf(dir_connection_t *conn)
   /* Directory clients write, then read data until they receive EOF;
    * directory servers read data until they get an HTTP command, then
    * write their response (when it's finished flushing, they mark for
-   * close).
+   * close).  On a tunneled connection that both sides keep open, the
+   * client may write more requests, and reads each response as soon as it
+   * is complete; the server goes back to waiting for a command after each
+   * response.
    */
 
   /* If we're on the dirserver side, look for a command. */
@@ -475,6 +478,9 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return -1;
   }
 
+  if (conn->wants_keep_alive)
+    return connection_dir_client_process_keep_alive(conn);
+
   if (!conn->base_.inbuf_reached_eof)
     log_debug(LD_HTTP,"Got data, not eof. Leaving on inbuf.");
   return 0;
@@ -492,6 +498,8 @@ connection_dir_about_to_close(dir_connection_t *dir_conn)
      * failed: forget about this router, and maybe try again. */
     connection_dir_client_request_failed(dir_conn);
   }
+  /* The requests we wrote after that one never got an answer either. */
+  connection_dir_client_pipeline_failed(dir_conn);
 
   /* If we are an HSDir, mark the corresponding descriptor as downloaded. This
    * is needed for the OOM cache cleanup.
@@ -536,10 +544,23 @@ connection_dir_finished_flushing(dir_connection_t *conn)
       log_debug(LD_DIR,"client finished sending command.");
       conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
       return 0;
+    case DIR_CONN_STATE_CLIENT_READING:
+    case DIR_CONN_STATE_CLIENT_FINISHED:
+      /* We sent another request on a kept-alive connection. */
+      log_debug(LD_DIR,"client finished sending pipelined command.");
+      return 0;
     case DIR_CONN_STATE_SERVER_WRITING:
       if (conn->spool) {
         log_warn(LD_BUG, "Emptied a dirserv buffer, but it's still spooling!");
         connection_mark_for_close(TO_CONN(conn));
+      } else if (conn->keep_alive) {
+        log_debug(LD_DIRSERV, "Finished writing server response. Waiting "
+                  "for another command.");
+        qed_hs_compress_free(conn->compress_state);
+        conn->base_.state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
+        /* The client may have sent its next command already. */
+        if (connection_get_inbuf_len(TO_CONN(conn)))
+          return connection_dir_process_inbuf(conn);
       } else {
         log_debug(LD_DIRSERV, "Finished writing server response. Closing.");
         connection_mark_for_close(TO_CONN(conn));
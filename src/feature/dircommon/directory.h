@@ -30,6 +30,14 @@ const dir_connection_t *CONST_TO_DIR_CONN(const connection_t *c);
 #define DIR_CONN_STATE_SERVER_WRITING 6
 #define DIR_CONN_STATE_MAX_ 6
 
+/** How long, in seconds, does a client keep an idle kept-alive directory
+ * connection open for more requests? */
+#define DIR_CONN_CLIENT_IDLE_TIMEOUT 60
+/** How long, in seconds, does a server wait for the next command on a
+ * kept-alive directory connection?  This is longer than the client timeout,
+ * so that it's almost always the client that closes the connection. */
+#define DIR_CONN_SERVER_IDLE_TIMEOUT 120
+
 #define DIR_PURPOSE_MIN_ 6
 /** A connection to a directory server: download one or more server
  * descriptors. */
@@ -9,9 +9,11 @@
  * \brief Code to parse and validate microdescriptors.
  **/
 
+#define MICRODESC_PARSE_PRIVATE
 #include "core/or/or.h"
 
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/dirparse/parsecommon.h"
@@ -23,7 +25,10 @@
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/lock/compat_mutex.h"
 #include "lib/memarea/memarea.h"
+#include "lib/thread/threads.h"
 
 #include "feature/nodelist/microdesc_st.h"
 
@@ -165,6 +170,58 @@ microdesc_extract_body(microdesc_t *md,
   return no_onion_key ? -1 : 0;
 }
 
+/** The fields of a microdescriptor that we parse into interned objects.
+ * Node families and short policies are interned in tables that only the
+ * main thread may touch, so a worker thread leaves these as strings. */
+typedef struct md_interned_lines_t {
+  /** The "family" line, or NULL if there is none. */
+  char *family;
+  /** The "p" and "p6" exit policy summaries, or NULL if there are none. */
+  char *exit_policy;
+  char *ipv6_exit_policy;
+} md_interned_lines_t;
+
+/** Release all storage held in <b>lines</b>. */
+static void
+md_interned_lines_free_(md_interned_lines_t *lines)
+{
+  if (!lines)
+    return;
+  qed_hs_free(lines->family);
+  qed_hs_free(lines->exit_policy);
+  qed_hs_free(lines->ipv6_exit_policy);
+  qed_hs_free(lines);
+}
+#define md_interned_lines_free(lines) \
+  FREE_AND_NULL(md_interned_lines_t, md_interned_lines_free_, (lines))
+
+/** Set the family and exit policies of <b>md</b> from the "family", "p" and
+ * "p6" lines <b>family</b>, <b>exit_policy</b> and <b>ipv6_exit_policy</b>,
+ * any of which may be NULL.  Only call this from the main thread. */
+static void
+microdesc_set_interned_fields(microdesc_t *md,
+                              const char *family,
+                              const char *exit_policy,
+                              const char *ipv6_exit_policy)
+{
+  if (family) {
+    md->family = nodefamily_parse(family,
+                                  NULL,
+                                  NF_WARN_MALFORMED);
+  }
+  if (exit_policy) {
+    md->exit_policy = parse_short_policy(exit_policy);
+  }
+  if (ipv6_exit_policy) {
+    md->ipv6_exit_policy = parse_short_policy(ipv6_exit_policy);
+  }
+
+  if (policy_is_reject_star_or_null(md->exit_policy) &&
+      policy_is_reject_star_or_null(md->ipv6_exit_policy)) {
+    md->policy_is_reject_star = 1;
+  }
+}
+
 /**
  * Parse a microdescriptor which begins at <b>s</b> and ends at
  * <b>start_of_next_microdesc</b>.  Store its fields into <b>md</b>.  Use
@@ -172,6 +229,12 @@ microdesc_extract_body(microdesc_t *md,
  * is true, then one or more annotations may precede the microdescriptor body
  * proper.  Use <b>area</b> for memory management, clearing it when done.
  *
+ * If <b>lines_out</b> is NULL, parse the family and exit policy lines into
+ * <b>md</b>.  Otherwise, leave them unset in <b>md</b>, and set
+ * *<b>lines_out</b> to a newly allocated md_interned_lines_t holding copies
+ * of those lines, for the caller to pass to microdesc_set_interned_fields()
+ * on the main thread.
+ *
  * On success, return 0; otherwise return -1.
  **/
 static int
@@ -179,7 +242,8 @@ microdesc_parse_fields(microdesc_t *md,
                        memarea_t *area,
                        const char *s, const char *start_of_next_microdesc,
                        int allow_annotations,
-                       saved_location_t where)
+                       saved_location_t where,
+                       md_interned_lines_t **lines_out)
 {
   smartlist_t *tokens = smartlist_new();
   int rv = -1;
@@ -214,8 +278,8 @@ microdesc_parse_fields(microdesc_t *md,
       log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
       goto err;
     }
-    md->onion_curve25519_pkey =
-      qed_hs_memdup(&k, sizeof(curve25519_public_key_t));
+    memcpy(&md->onion_curve25519_pkey_storage, &k, sizeof(k));
+    md->onion_curve25519_pkey = &md->onion_curve25519_pkey_storage;
   }
 
   smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
@@ -234,7 +298,8 @@ microdesc_parse_fields(microdesc_t *md,
           smartlist_free(id_lines);
           goto err;
         }
-        md->ed25519_identity_pkey = qed_hs_memdup(&k, sizeof(k));
+        memcpy(&md->ed25519_identity_pkey_storage, &k, sizeof(k));
+        md->ed25519_identity_pkey = &md->ed25519_identity_pkey_storage;
       }
     } SMARTLIST_FOREACH_END(t);
     smartlist_free(id_lines);
@@ -248,11 +313,6 @@ microdesc_parse_fields(microdesc_t *md,
     }
   }
 
-  if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
-    md->family = nodefamily_parse(tok->args[0],
-                                  NULL,
-                                  NF_WARN_MALFORMED);
-  }
   if ((tok = find_opt_by_keyword(tokens, K_FAMILY_IDS))) {
     smartlist_t *ids = smartlist_new();
     smartlist_split_string(ids, tok->args[0], " ",
@@ -264,16 +324,26 @@ microdesc_parse_fields(microdesc_t *md,
     }
   }
 
-  if ((tok = find_opt_by_keyword(tokens, K_P))) {
-    md->exit_policy = parse_short_policy(tok->args[0]);
-  }
-  if ((tok = find_opt_by_keyword(tokens, K_P6))) {
-    md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
-  }
-
-  if (policy_is_reject_star_or_null(md->exit_policy) &&
-      policy_is_reject_star_or_null(md->ipv6_exit_policy)) {
-    md->policy_is_reject_star = 1;
+  {
+    const char *family = NULL, *exit_policy = NULL, *ipv6_exit_policy = NULL;
+    if ((tok = find_opt_by_keyword(tokens, K_FAMILY)))
+      family = tok->args[0];
+    if ((tok = find_opt_by_keyword(tokens, K_P)))
+      exit_policy = tok->args[0];
+    if ((tok = find_opt_by_keyword(tokens, K_P6)))
+      ipv6_exit_policy = tok->args[0];
+
+    if (lines_out) {
+      md_interned_lines_t *lines = qed_hs_malloc_zero(sizeof(*lines));
+      lines->family = family ? qed_hs_strdup(family) : NULL;
+      lines->exit_policy = exit_policy ? qed_hs_strdup(exit_policy) : NULL;
+      lines->ipv6_exit_policy =
+        ipv6_exit_policy ? qed_hs_strdup(ipv6_exit_policy) : NULL;
+      *lines_out = lines;
+    } else {
+      microdesc_set_interned_fields(md, family, exit_policy,
+                                    ipv6_exit_policy);
+    }
   }
 
   rv = 0;
@@ -286,38 +356,32 @@ microdesc_parse_fields(microdesc_t *md,
   return rv;
 }
 
-/** Parse as many microdescriptors as are found from the string starting at
- * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
- * annotations we recognize and ignore ones we don't.
- *
- * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the body field of each microdesc_t.
+/** Parse the microdescriptors from <b>s</b> up to <b>eos</b>, which is part
+ * of a larger document starting at <b>start</b>, and add them to
+ * <b>result</b>.  Use <b>area</b> for memory management.  If
+ * <b>lines_out</b> is provided, leave each microdescriptor's family and exit
+ * policies unparsed and add an md_interned_lines_t for it to
+ * <b>lines_out</b>, in step with <b>result</b>; see
+ * microdesc_parse_fields().  Other arguments are as for
+ * microdescs_parse_from_string().
  *
- * Return all newly parsed microdescriptors in a newly allocated
- * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
- * microdesc digest to it for every microdesc that we found to be badly
- * formed. (This may cause duplicates) */
-smartlist_t *
-microdescs_parse_from_string(const char *s, const char *eos,
-                             int allow_annotations,
-                             saved_location_t where,
-                             smartlist_t *invalid_digests_out)
+ * This touches no global state except for logging, so it is safe to call
+ * from a worker thread when <b>lines_out</b> is provided. */
+static void
+microdescs_parse_range(const char *start, const char *s, const char *eos,
+                       int allow_annotations,
+                       saved_location_t where,
+                       memarea_t *area,
+                       smartlist_t *result,
+                       smartlist_t *invalid_digests_out,
+                       smartlist_t *lines_out)
 {
-  smartlist_t *result;
   microdesc_t *md = NULL;
-  memarea_t *area;
-  const char *start = s;
   const char *start_of_next_microdesc;
 
-  if (!eos)
-    eos = s + strlen(s);
-
-  s = eat_whitespace_eos(s, eos);
-  area = memarea_new();
-  result = smartlist_new();
-
   while (s < eos) {
-   bool okay = false;
+    bool okay = false;
+    md_interned_lines_t *lines = NULL;
 
     start_of_next_microdesc = find_start_of_next_microdesc(s, eos);
     if (!start_of_next_microdesc)
@@ -339,8 +403,11 @@ microdescs_parse_from_string(const char *s, const char *eos,
     }
 
     if (microdesc_parse_fields(md, area, s, start_of_next_microdesc,
-                               allow_annotations, where) == 0) {
+                               allow_annotations, where,
+                               lines_out ? &lines : NULL) == 0) {
       smartlist_add(result, md);
+      if (lines_out)
+        smartlist_add(lines_out, lines);
       md = NULL; // prevent free
       okay = true;
     }
@@ -354,7 +421,255 @@ microdescs_parse_from_string(const char *s, const char *eos,
     md = NULL;
     s = start_of_next_microdesc;
   }
+}
+
+/** Documents shorter than this many bytes are always parsed on the main
+ * thread alone. This is a few hundred microdescriptors. */
+#define MD_PARSE_PARALLEL_MIN_BYTES (64*1024)
+/** Smallest chunk, in bytes, that we hand to a single thread. */
+#define MD_PARSE_MIN_CHUNK_BYTES (16*1024)
+/** We split a document into this many chunks per thread, so that a thread
+ * that gets stuck behind other work doesn't hold up the rest for long. */
+#define MD_PARSE_CHUNKS_PER_THREAD 4
+
+/** Part of a microdescriptor document, and what we got by parsing it. */
+typedef struct md_parse_chunk_t {
+  /** The start of the first microdescriptor in this chunk. */
+  const char *s;
+  /** The end of this chunk: the start of the next chunk, or the end of the
+   * document. */
+  const char *eos;
+  /** The microdesc_t objects we parsed from this chunk. */
+  smartlist_t *result;
+  /** The md_interned_lines_t of each microdesc in result. */
+  smartlist_t *interned_lines;
+  /** The digests of the microdescriptors we could not parse. */
+  smartlist_t *invalid_digests;
+} md_parse_chunk_t;
+
+/** A microdescriptor document that we are parsing in chunks, on the main
+ * thread and on cpuworkers at once. */
+typedef struct md_parse_batch_t {
+  /** Protects next_chunk and n_done. */
+  qed_hs_mutex_t lock;
+  /** Signalled when the last chunk is parsed. */
+  qed_hs_cond_t done_cond;
+  /** Index of the first chunk that no thread has started on. */
+  int next_chunk;
+  /** Number of chunks that have been parsed. */
+  int n_done;
+  /** Number of chunks in chunks. */
+  int n_chunks;
+  /** The chunks of the document. */
+  md_parse_chunk_t *chunks;
+  /** As for microdescs_parse_from_string(). */
+  const char *start;
+  int allow_annotations;
+  saved_location_t where;
+  /** One reference for the call that is parsing the document, and one for
+   * each cpuworker job whose reply we haven't handled. Only used on the main
+   * thread. */
+  int refcnt;
+} md_parse_batch_t;
+
+/** Release a reference to <b>batch</b>, freeing it if that was the last. */
+static void
+md_parse_batch_decref(md_parse_batch_t *batch)
+{
+  qed_hs_assert(batch->refcnt > 0);
+  if (--batch->refcnt > 0)
+    return;
+  qed_hs_cond_uninit(&batch->done_cond);
+  qed_hs_mutex_uninit(&batch->lock);
+  qed_hs_free(batch->chunks);
+  qed_hs_free(batch);
+}
+
+/** Parse chunks of <b>batch</b> that no other thread has started on, until
+ * there are none left.  Safe to call from any thread. */
+static void
+md_parse_batch_run(md_parse_batch_t *batch)
+{
+  memarea_t *area = NULL;
+
+  for (;;) {
+    md_parse_chunk_t *chunk;
+    qed_hs_mutex_acquire(&batch->lock);
+    chunk = batch->next_chunk < batch->n_chunks ?
+      &batch->chunks[batch->next_chunk++] : NULL;
+    qed_hs_mutex_release(&batch->lock);
+    if (!chunk)
+      break;
+
+    if (!area)
+      area = memarea_new();
+    microdescs_parse_range(batch->start, chunk->s, chunk->eos,
+                           batch->allow_annotations, batch->where, area,
+                           chunk->result, chunk->invalid_digests,
+                           chunk->interned_lines);
+
+    qed_hs_mutex_acquire(&batch->lock);
+    if (++batch->n_done == batch->n_chunks)
+      qed_hs_cond_signal_one(&batch->done_cond);
+    qed_hs_mutex_release(&batch->lock);
+  }
+
+  if (area)
+    memarea_drop_all(area);
+}
+
+/** Worker function: help parse the md_parse_batch_t in <b>arg</b>. Runs in a
+ * cpuworker thread. */
+static workqueue_reply_t
+md_parse_threadfn(void *state, void *arg)
+{
+  (void)state;
+  md_parse_batch_run(arg);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: the main thread no longer needs to wait for this job
+ * before freeing its md_parse_batch_t. */
+static void
+md_parse_replyfn(void *arg)
+{
+  md_parse_batch_decref(arg);
+}
+
+/** Parse the microdescriptors from <b>s</b> to <b>eos</b> as
+ * microdescs_parse_from_string() does, splitting the document at
+ * microdescriptor boundaries into chunks of about <b>chunk_bytes</b> bytes,
+ * and queueing <b>n_helpers</b> cpuworker jobs to parse chunks alongside the
+ * main thread.  The results are merged in document order, so they are the
+ * same as from parsing the whole document at once.  <b>start</b> is the
+ * start of the whole document. */
+STATIC smartlist_t *
+microdescs_parse_in_chunks(const char *start, const char *s, const char *eos,
+                           int allow_annotations,
+                           saved_location_t where,
+                           smartlist_t *invalid_digests_out,
+                           int n_helpers, size_t chunk_bytes)
+{
+  md_parse_batch_t *batch = qed_hs_malloc_zero(sizeof(md_parse_batch_t));
+  smartlist_t *result = smartlist_new();
+  int chunks_allocated = 16;
+
+  qed_hs_mutex_init_for_cond(&batch->lock);
+  qed_hs_cond_init(&batch->done_cond);
+  batch->start = start;
+  batch->allow_annotations = allow_annotations;
+  batch->where = where;
+  batch->refcnt = 1;
+  batch->chunks = qed_hs_calloc(chunks_allocated, sizeof(md_parse_chunk_t));
+
+  /* Walk the microdescriptor boundaries exactly as a single pass over the
+   * document would, cutting a new chunk whenever the current one is long
+   * enough. */
+  while (s < eos) {
+    const char *cp = s, *next;
+    md_parse_chunk_t *chunk;
+    while (cp < eos && (size_t)(cp - s) < chunk_bytes) {
+      next = find_start_of_next_microdesc(cp, eos);
+      cp = next ? next : eos;
+    }
+    if (batch->n_chunks == chunks_allocated) {
+      chunks_allocated *= 2;
+      batch->chunks = qed_hs_reallocarray(batch->chunks, chunks_allocated,
+                                          sizeof(md_parse_chunk_t));
+    }
+    chunk = &batch->chunks[batch->n_chunks++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->s = s;
+    chunk->eos = cp;
+    chunk->result = smartlist_new();
+    chunk->interned_lines = smartlist_new();
+    if (invalid_digests_out)
+      chunk->invalid_digests = smartlist_new();
+    s = cp;
+  }
+
+  n_helpers = MIN(n_helpers, batch->n_chunks - 1);
+  for (int i = 0; i < n_helpers; ++i) {
+    if (!cpuworker_queue_work(WQ_PRI_HIGH, md_parse_threadfn,
+                              md_parse_replyfn, batch))
+      break;
+    ++batch->refcnt;
+  }
+
+  /* Work on the document ourselves too, so that we never wait for a chunk
+   * that nobody has started on. */
+  md_parse_batch_run(batch);
+  qed_hs_mutex_acquire(&batch->lock);
+  while (batch->n_done < batch->n_chunks)
+    qed_hs_cond_wait(&batch->done_cond, &batch->lock, NULL);
+  qed_hs_mutex_release(&batch->lock);
+
+  for (int i = 0; i < batch->n_chunks; ++i) {
+    md_parse_chunk_t *chunk = &batch->chunks[i];
+    SMARTLIST_FOREACH_BEGIN(chunk->result, microdesc_t *, md) {
+      md_interned_lines_t *lines =
+        smartlist_get(chunk->interned_lines, md_sl_idx);
+      microdesc_set_interned_fields(md, lines->family, lines->exit_policy,
+                                    lines->ipv6_exit_policy);
+      md_interned_lines_free(lines);
+    } SMARTLIST_FOREACH_END(md);
+    smartlist_add_all(result, chunk->result);
+    smartlist_free(chunk->result);
+    smartlist_free(chunk->interned_lines);
+    if (chunk->invalid_digests) {
+      smartlist_add_all(invalid_digests_out, chunk->invalid_digests);
+      smartlist_free(chunk->invalid_digests);
+    }
+  }
+
+  md_parse_batch_decref(batch);
+  return result;
+}
+
+/** Parse as many microdescriptors as are found from the string starting at
+ * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
+ * annotations we recognize and ignore ones we don't.
+ *
+ * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
+ * descriptor in the body field of each microdesc_t.
+ *
+ * Large documents, such as the microdescriptor cache, are split up and
+ * parsed on the cpuworkers as well as on the main thread.
+ *
+ * Return all newly parsed microdescriptors in a newly allocated
+ * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
+ * microdesc digest to it for every microdesc that we found to be badly
+ * formed. (This may cause duplicates) */
+smartlist_t *
+microdescs_parse_from_string(const char *s, const char *eos,
+                             int allow_annotations,
+                             saved_location_t where,
+                             smartlist_t *invalid_digests_out)
+{
+  smartlist_t *result;
+  memarea_t *area;
+  const char *start = s;
+  const unsigned n_threads = cpuworker_get_n_threads();
+
+  if (!eos)
+    eos = s + strlen(s);
+
+  s = eat_whitespace_eos(s, eos);
+
+  if (n_threads > 0 && eos - s >= MD_PARSE_PARALLEL_MIN_BYTES) {
+    size_t chunk_bytes = (eos - s) / ((n_threads + 1) *
+                                      MD_PARSE_CHUNKS_PER_THREAD);
+    return microdescs_parse_in_chunks(start, s, eos, allow_annotations,
+                                      where, invalid_digests_out,
+                                      (int) n_threads,
+                                      MAX(chunk_bytes,
+                                          MD_PARSE_MIN_CHUNK_BYTES));
+  }
 
+  area = memarea_new();
+  result = smartlist_new();
+  microdescs_parse_range(start, s, eos, allow_annotations, where, area,
+                         result, invalid_digests_out, NULL);
   memarea_drop_all(area);
 
   return result;
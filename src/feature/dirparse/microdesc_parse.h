@@ -17,4 +17,13 @@ smartlist_t *microdescs_parse_from_string(const char *s, const char *eos,
                                           saved_location_t where,
                                           smartlist_t *invalid_digests_out);
 
+#ifdef MICRODESC_PARSE_PRIVATE
+STATIC smartlist_t *microdescs_parse_in_chunks(const char *start,
+                                        const char *s, const char *eos,
+                                        int allow_annotations,
+                                        saved_location_t where,
+                                        smartlist_t *invalid_digests_out,
+                                        int n_helpers, size_t chunk_bytes);
+#endif /* defined(MICRODESC_PARSE_PRIVATE) */
+
 #endif /* !defined(QED_HS_MICRODESC_PARSE_H) */
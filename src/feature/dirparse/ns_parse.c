@@ -16,6 +16,7 @@
 #include "core/or/protover.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
+#include "feature/dircommon/consdiff.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
@@ -28,6 +29,7 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/memarea/memarea.h"
 
@@ -36,6 +38,7 @@
 #include "feature/nodelist/document_signature_st.h"
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
+#include "feature/nodelist/routerstatus_st.h"
 #include "feature/nodelist/vote_routerstatus_st.h"
 #include "feature/dirparse/authcert_members.h"
 
@@ -1088,13 +1091,121 @@ dup_protocols_string(smartlist_t *tokens, bool *error, directory_keyword kw)
   return qed_hs_strdup(tok->args[0]);
 }
 
-/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s,
-                                     size_t s_len,
-                                     const char **eos_out,
-                                     networkstatus_type_t ns_type)
+/** Given the start <b>s</b> of the routerstatus entries in a networkstatus
+ * document ending at <b>s_eos</b>, return the start of the directory footer,
+ * or of the first directory signature, whichever comes first. */
+static const char *
+find_end_of_routerstatus_list(const char *s, const char *s_eos)
+{
+  const char *footer, *sig;
+  if (s_eos - s < 2 || fast_memneq(s, "r ", 2))
+    return s;
+  footer = qed_hs_memstr(s, s_eos-s, "\ndirectory-footer");
+  sig = qed_hs_memstr(s, s_eos-s, "\ndirectory-signature");
+  if (footer && sig)
+    return MIN(footer, sig) + 1;
+  else if (footer)
+    return footer+1;
+  else if (sig)
+    return sig+1;
+  else
+    return s_eos;
+}
+
+/** Ways for networkstatus_parse_vote_impl() to get the routerstatus
+ * entries of a consensus without parsing all of them. */
+typedef struct ns_parse_shortcuts_t {
+  /** A snapshot of the entries, as made by ns_snapshot_encode(), or NULL. */
+  const uint8_t *snap;
+  /** Length of <b>snap</b>. */
+  size_t snap_len;
+  /** Set to 1 if the entries came from <b>snap</b>. */
+  int used_snapshot;
+  /** A consensus that the one we're parsing was made from with a diff, or
+   * NULL. */
+  const networkstatus_t *prev;
+  /** The parts of the document that the diff from <b>prev</b> left as they
+   * were.  Set iff <b>prev</b> is set. */
+  const consensus_diff_unchanged_t *unchanged;
+  /** Index of the first range in <b>unchanged</b> that might cover the
+   * entry we're looking at. */
+  int range_idx;
+  /** Number of entries copied from <b>prev</b>. */
+  int n_reused;
+} ns_parse_shortcuts_t;
+
+/** Helper for networkstatus_parse_vote_impl(): if the routerstatus entry at
+ * <b>s</b> in the consensus <b>doc</b> is the same text as an entry in
+ * shortcuts-\>prev, return a copy of that entry and set *<b>s</b> to the
+ * start of the next one.  Otherwise return NULL. */
+static routerstatus_t *
+routerstatus_reuse_entry(const char *doc, const char **s, const char *eos,
+                         ns_parse_shortcuts_t *shortcuts)
+{
+  const consensus_diff_unchanged_t *unchanged = shortcuts->unchanged;
+  const size_t start = *s - doc;
+  const char *entry_eos, *next_eol, *cp, *nick_end;
+  char id_b64[BASE64_DIGEST_LEN+1], nickname[MAX_NICKNAME_LEN+1];
+  char id[DIGEST_LEN];
+
+  while (shortcuts->range_idx < unchanged->n_ranges &&
+         unchanged->ranges[shortcuts->range_idx].end <= start)
+    ++shortcuts->range_idx;
+  if (shortcuts->range_idx == unchanged->n_ranges ||
+      unchanged->ranges[shortcuts->range_idx].start > start)
+    return NULL;
+
+  /* The entry ends where the next line starts, so that line must be
+   * unchanged too: otherwise the same text could have been followed by more
+   * lines of the same entry in prev. */
+  entry_eos = find_start_of_next_routerstatus(*s, eos);
+  next_eol = memchr(entry_eos, '\n', eos - entry_eos);
+  if (!next_eol ||
+      (size_t)(next_eol + 1 - doc) >
+      unchanged->ranges[shortcuts->range_idx].end)
+    return NULL;
+
+  /* "r SP nickname SP identity SP ..." */
+  cp = *s + 2;
+  nick_end = memchr(cp, ' ', MIN(entry_eos - cp, MAX_NICKNAME_LEN + 1));
+  if (!nick_end || nick_end == cp ||
+      entry_eos - nick_end < BASE64_DIGEST_LEN + 2 ||
+      nick_end[BASE64_DIGEST_LEN + 1] != ' ')
+    return NULL;
+  memcpy(nickname, cp, nick_end - cp);
+  nickname[nick_end - cp] = '\0';
+  memcpy(id_b64, nick_end + 1, BASE64_DIGEST_LEN);
+  id_b64[BASE64_DIGEST_LEN] = '\0';
+  if (digest_from_base64(id, id_b64) < 0)
+    return NULL;
+
+  const routerstatus_t *old =
+    smartlist_bsearch(shortcuts->prev->routerstatus_list, id,
+                      compare_digest_to_routerstatus_entry);
+  if (!old || strcmp(old->nickname, nickname))
+    return NULL;
+
+  routerstatus_t *rs = qed_hs_memdup(old, sizeof(routerstatus_t));
+  if (old->exitsummary)
+    rs->exitsummary = qed_hs_strdup(old->exitsummary);
+  /* These aren't part of the consensus; start over as a new parse would. */
+  rs->last_dir_503_at = 0;
+  memset(&rs->dl_status, 0, sizeof(rs->dl_status));
+
+  ++shortcuts->n_reused;
+  *s = entry_eos;
+  return rs;
+}
+
+/** Helper for networkstatus_parse_vote_from_string() and its variants:
+ * if <b>shortcuts</b> is set, use it to avoid parsing the routerstatus
+ * entries of a consensus where we can. */
+static networkstatus_t *
+networkstatus_parse_vote_impl(const char *s,
+                              size_t s_len,
+                              const char **eos_out,
+                              networkstatus_type_t ns_type,
+                              ns_parse_shortcuts_t *shortcuts)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -1472,7 +1583,24 @@ networkstatus_parse_vote_from_string(const char *s,
   rs_tokens = smartlist_new();
   rs_area = memarea_new();
   s = end_of_header;
-  ns->routerstatus_list = smartlist_new();
+  if (shortcuts && shortcuts->snap && ns->type == NS_TYPE_CONSENSUS &&
+      (ns->routerstatus_list = ns_snapshot_decode(shortcuts->snap,
+                                                  shortcuts->snap_len,
+                                                  sha3_as_signed, flav,
+                                                  ns->consensus_method))) {
+    s = find_end_of_routerstatus_list(s, eos);
+    shortcuts->used_snapshot = 1;
+  } else {
+    ns->routerstatus_list = smartlist_new();
+  }
+  if (shortcuts && shortcuts->prev &&
+      (ns->type != NS_TYPE_CONSENSUS ||
+       shortcuts->prev->type != NS_TYPE_CONSENSUS ||
+       shortcuts->prev->flavor != flav ||
+       shortcuts->prev->consensus_method != ns->consensus_method)) {
+    /* The entries would not have been parsed the same way. */
+    shortcuts->prev = NULL;
+  }
 
   while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
     if (ns->type != NS_TYPE_CONSENSUS) {
@@ -1486,7 +1614,10 @@ networkstatus_parse_vote_from_string(const char *s,
       }
     } else {
       routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
+      if (shortcuts && shortcuts->prev &&
+          (rs = routerstatus_reuse_entry(s_dup, &s, eos, shortcuts))) {
+        smartlist_add(ns->routerstatus_list, rs);
+      } else if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
                                                      rs_tokens,
                                                      NULL, NULL,
                                                      ns->consensus_method,
@@ -1698,6 +1829,9 @@ networkstatus_parse_vote_from_string(const char *s,
   if (eos_out)
     *eos_out = end_of_footer;
 
+  if (ns->type == NS_TYPE_CONSENSUS)
+    networkstatus_compact_routerstatus_list(ns);
+
   goto done;
  err:
   dump_desc(s_dup, "v3 networkstatus");
@@ -1737,3 +1871,64 @@ networkstatus_parse_vote_from_string(const char *s,
 
   return ns;
 }
+
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s,
+                                     size_t s_len,
+                                     const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_impl(s, s_len, eos_out, ns_type, NULL);
+}
+
+/** As networkstatus_parse_vote_from_string(), for a consensus in
+ * <b>s</b>.  If the <b>snap_len</b>-byte snapshot in <b>snap</b> was made
+ * from this same consensus, take the routerstatus entries from it, and set
+ * *<b>used_snapshot_out</b> to 1; otherwise set it to 0 and parse them from
+ * the text. */
+networkstatus_t *
+networkstatus_parse_consensus_with_snapshot(const char *s,
+                                            size_t s_len,
+                                            const uint8_t *snap,
+                                            size_t snap_len,
+                                            int *used_snapshot_out)
+{
+  ns_parse_shortcuts_t shortcuts;
+  memset(&shortcuts, 0, sizeof(shortcuts));
+  shortcuts.snap = snap;
+  shortcuts.snap_len = snap_len;
+  networkstatus_t *ns = networkstatus_parse_vote_impl(s, s_len, NULL,
+                                                      NS_TYPE_CONSENSUS,
+                                                      &shortcuts);
+  *used_snapshot_out = ns ? shortcuts.used_snapshot : 0;
+  return ns;
+}
+
+/** As networkstatus_parse_vote_from_string(), for a consensus in <b>s</b>
+ * that we made by applying a diff to <b>prev</b>.  <b>unchanged</b> tells
+ * which parts of <b>s</b> the diff left as they were; routerstatus entries
+ * entirely within those parts are copied from <b>prev</b> instead of being
+ * parsed again.  Set *<b>n_reused_out</b> to the number of entries copied.
+ *
+ * The caller must make sure that <b>unchanged</b> was made by applying a
+ * diff to the consensus that <b>prev</b> was parsed from. */
+networkstatus_t *
+networkstatus_parse_consensus_reusing(
+                                 const char *s,
+                                 size_t s_len,
+                                 const networkstatus_t *prev,
+                                 const consensus_diff_unchanged_t *unchanged,
+                                 int *n_reused_out)
+{
+  ns_parse_shortcuts_t shortcuts;
+  memset(&shortcuts, 0, sizeof(shortcuts));
+  shortcuts.prev = prev;
+  shortcuts.unchanged = unchanged;
+  networkstatus_t *ns = networkstatus_parse_vote_impl(s, s_len, NULL,
+                                                      NS_TYPE_CONSENSUS,
+                                                      &shortcuts);
+  *n_reused_out = ns ? shortcuts.n_reused : 0;
+  return ns;
+}
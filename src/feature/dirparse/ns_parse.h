@@ -27,6 +27,17 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            size_t len,
                                            const char **eos_out,
                                            enum networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_consensus_with_snapshot(const char *s,
+                                                    size_t len,
+                                                    const uint8_t *snap,
+                                                    size_t snap_len,
+                                                    int *used_snapshot_out);
+struct consensus_diff_unchanged_t;
+networkstatus_t *networkstatus_parse_consensus_reusing(const char *s,
+                         size_t len,
+                         const networkstatus_t *prev,
+                         const struct consensus_diff_unchanged_t *unchanged,
+                         int *n_reused_out);
 
 #ifdef NS_PARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
@@ -179,6 +179,59 @@ static int check_family_certs(const smartlist_t *family_cert_tokens,
                               smartlist_t **family_ids_out,
                               time_t *family_expiration_out);
 
+/** The Ed25519 signature checks for a single router descriptor or extra-info
+ * document.  router_parse_list_from_string() collects these from every
+ * descriptor it parses, so that it can check them all in one batch. */
+typedef struct desc_ed_checks_t {
+  /** The signatures to check.  Their keys and messages point into the
+   * descriptor's signing key certificate, or into the fields below. */
+  ed25519_checkable_t check[3];
+  /** How many members of <b>check</b> are in use. */
+  int n_checks;
+  /** The ntor-onion-key-crosscert certificate, if any. */
+  qed_hs_cert_t *ntor_cc_cert;
+  /** The ntor onion key, as an Ed25519 key. */
+  ed25519_public_key_t ntor_cc_pk;
+  /** The digest signed by the router-sig-ed25519 signature. */
+  uint8_t d256[DIGEST256_LEN];
+  /** The routerinfo_t or extrainfo_t that these checks are for. */
+  void *desc;
+  /** The start of the descriptor in the string we parsed it from. */
+  const char *desc_start;
+} desc_ed_checks_t;
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                         int cache_copy,
+                                         int allow_annotations,
+                                         const char *prepend_annotations,
+                                         int *can_dl_again_out,
+                                         desc_ed_checks_t **checks_out);
+static extrainfo_t *extrainfo_parse_entry_impl(const char *s,
+                                         const char *end, int cache_copy,
+                                         struct digest_ri_map_t *routermap,
+                                         int *can_dl_again_out,
+                                         desc_ed_checks_t **checks_out);
+
+/** Release all storage held in <b>checks</b>. */
+static void
+desc_ed_checks_free_(desc_ed_checks_t *checks)
+{
+  if (!checks)
+    return;
+  qed_hs_cert_free(checks->ntor_cc_cert);
+  qed_hs_free(checks);
+}
+#define desc_ed_checks_free(checks) \
+  FREE_AND_NULL(desc_ed_checks_t, desc_ed_checks_free_, (checks))
+
+/** Check every signature in <b>checks</b>.  Return 0 if they are all good,
+ * and -1 otherwise. */
+static int
+desc_ed_checks_run(const desc_ed_checks_t *checks)
+{
+  return ed25519_checksig_batch(NULL, checks->check, checks->n_checks);
+}
+
 /** Set <b>digest</b> to the SHA-1 digest of the hash of the first router in
  * <b>s</b>. Return 0 on success, -1 on failure.
  */
@@ -237,6 +290,67 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** Check all the Ed25519 signatures in <b>pending</b>, a list of
+ * desc_ed_checks_t for the descriptors in <b>dest</b>, as a single batch.
+ * Remove every descriptor with a bad signature from <b>dest</b>, add its
+ * digest to <b>invalid_digests_out</b> if that is set, and free it.  Free
+ * every member of <b>pending</b>.
+ */
+static void
+check_deferred_ed_sigs(smartlist_t *pending, smartlist_t *dest,
+                       int is_extrainfo, smartlist_t *invalid_digests_out)
+{
+  ed25519_checkable_t *all_checks;
+  int *all_okay;
+  int n_checks = 0, idx = 0;
+
+  SMARTLIST_FOREACH(pending, desc_ed_checks_t *, c, n_checks += c->n_checks);
+  if (n_checks == 0)
+    return;
+
+  all_checks = qed_hs_calloc(n_checks, sizeof(ed25519_checkable_t));
+  all_okay = qed_hs_calloc(n_checks, sizeof(int));
+  SMARTLIST_FOREACH_BEGIN(pending, desc_ed_checks_t *, c) {
+    memcpy(&all_checks[idx], c->check,
+           c->n_checks * sizeof(ed25519_checkable_t));
+    idx += c->n_checks;
+  } SMARTLIST_FOREACH_END(c);
+
+  ed25519_checksig_batch(all_okay, all_checks, n_checks);
+
+  idx = 0;
+  SMARTLIST_FOREACH_BEGIN(pending, desc_ed_checks_t *, c) {
+    int okay = 1;
+    for (int i = 0; i < c->n_checks; ++i)
+      okay &= all_okay[idx++];
+    if (!okay) {
+      log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+      smartlist_remove_keeporder(dest, c->desc);
+      if (is_extrainfo) {
+        extrainfo_t *ei = c->desc;
+        dump_desc(c->desc_start, "extra-info descriptor");
+        if (invalid_digests_out)
+          smartlist_add(invalid_digests_out,
+                        qed_hs_memdup(ei->cache_info.signed_descriptor_digest,
+                                      DIGEST_LEN));
+        extrainfo_free(ei);
+      } else {
+        routerinfo_t *ri = c->desc;
+        dump_desc(c->desc_start, "router descriptor");
+        if (invalid_digests_out)
+          smartlist_add(invalid_digests_out,
+                        qed_hs_memdup(ri->cache_info.signed_descriptor_digest,
+                                      DIGEST_LEN));
+        routerinfo_free(ri);
+      }
+    }
+    desc_ed_checks_free(c);
+  } SMARTLIST_FOREACH_END(c);
+
+  qed_hs_free(all_checks);
+  qed_hs_free(all_okay);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>want_extrainfo</b> is set),
  * parses them and stores the result in <b>dest</b>. All routers are marked
@@ -266,6 +380,8 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  desc_ed_checks_t *checks;
+  smartlist_t *pending_checks = smartlist_new();
 
   qed_hs_assert(s);
   qed_hs_assert(*s);
@@ -281,6 +397,7 @@ router_parse_list_from_string(const char **s, const char *eos,
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
     int dl_again = 0;
+    checks = NULL;
     if (find_start_of_next_router_or_extrainfo(s, eos, &have_extrainfo) < 0)
       break;
 
@@ -298,19 +415,20 @@ router_parse_list_from_string(const char **s, const char *eos,
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
       have_raw_digest = router_get_extrainfo_hash(*s, end-*s, raw_digest) == 0;
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map, &dl_again);
+                                       rl->identity_map, &dl_again, &checks);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       &checks);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -331,10 +449,19 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (checks) {
+      checks->desc = elt;
+      checks->desc_start = *s;
+      smartlist_add(pending_checks, checks);
+    }
     *s = end;
     smartlist_add(dest, elt);
   }
 
+  check_deferred_ed_sigs(pending_checks, dest, want_extrainfo,
+                         invalid_digests_out);
+  smartlist_free(pending_checks);
+
   return 0;
 }
 
@@ -401,6 +528,22 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out, NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>checks_out</b> is
+ * provided, don't check the descriptor's Ed25519 signatures: instead, set
+ * *<b>checks_out</b> to a newly allocated desc_ed_checks_t holding them, or
+ * to NULL if there are none.  The caller must check them before trusting the
+ * router. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        desc_ed_checks_t **checks_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -412,6 +555,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   int ok = 1;
   memarea_t *area = NULL;
   qed_hs_cert_t *ntor_cc_cert = NULL;
+  desc_ed_checks_t *checks = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -779,15 +923,20 @@ router_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[3];
-      int check_ok[3];
+      checks = qed_hs_malloc_zero(sizeof(desc_ed_checks_t));
+      checks->ntor_cc_cert = ntor_cc_cert;
+      ntor_cc_cert = NULL;
+      memcpy(&checks->ntor_cc_pk, &ntor_cc_pk, sizeof(ntor_cc_pk));
+      memcpy(checks->d256, d256, sizeof(d256));
+
+      ed25519_checkable_t *check = checks->check;
       time_t expires = TIME_MAX;
       if (qed_hs_cert_get_checkable_sig(&check[0], cert, NULL, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
         goto err;
       }
-      if (qed_hs_cert_get_checkable_sig(&check[1],
-                               ntor_cc_cert, &ntor_cc_pk, &expires) < 0) {
+      if (qed_hs_cert_get_checkable_sig(&check[1], checks->ntor_cc_cert,
+                                     &checks->ntor_cc_pk, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for ntor_cc_cert.");
         goto err;
       }
@@ -798,12 +947,16 @@ router_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
       check[2].pubkey = &cert->signed_key;
-      check[2].msg = d256;
+      check[2].msg = checks->d256;
       check[2].len = DIGEST256_LEN;
+      checks->n_checks = 3;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
-        goto err;
+      if (!checks_out) {
+        if (desc_ed_checks_run(checks) < 0) {
+          log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+          goto err;
+        }
+        desc_ed_checks_free(checks);
       }
 
       /* We check this before adding it to the routerlist. */
@@ -971,10 +1124,17 @@ router_parse_entry_from_string(const char *s, const char *end,
   goto done;
 
  err:
+  /* If we put off checking the Ed25519 signatures, we still need to know
+   * whether they were good before we say it's okay to download again. */
+  if (can_dl_again && checks && desc_ed_checks_run(checks) < 0)
+    can_dl_again = 0;
+  desc_ed_checks_free(checks);
   dump_desc(s_dup, "router descriptor");
   routerinfo_free(router);
   router = NULL;
  done:
+  if (checks_out)
+    *checks_out = checks;
   crypto_pk_free(rsa_pubkey);
   qed_hs_cert_free(ntor_cc_cert);
   if (tokens) {
@@ -1006,6 +1166,19 @@ extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                             int cache_copy, struct digest_ri_map_t *routermap,
                             int *can_dl_again_out)
+{
+  return extrainfo_parse_entry_impl(s, end, cache_copy, routermap,
+                                    can_dl_again_out, NULL);
+}
+
+/** As extrainfo_parse_entry_from_string(), but if <b>checks_out</b> is
+ * provided, put off checking the document's Ed25519 signatures as
+ * router_parse_entry_impl() does. */
+static extrainfo_t *
+extrainfo_parse_entry_impl(const char *s, const char *end,
+                           int cache_copy, struct digest_ri_map_t *routermap,
+                           int *can_dl_again_out,
+                           desc_ed_checks_t **checks_out)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -1015,6 +1188,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
   routerinfo_t *router = NULL;
   memarea_t *area = NULL;
   const char *s_dup = s;
+  desc_ed_checks_t *checks = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -1147,8 +1321,10 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[2];
-      int check_ok[2];
+      checks = qed_hs_malloc_zero(sizeof(desc_ed_checks_t));
+      memcpy(checks->d256, d256, sizeof(d256));
+
+      ed25519_checkable_t *check = checks->check;
       if (qed_hs_cert_get_checkable_sig(&check[0], cert, NULL, NULL) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
         goto err;
@@ -1160,12 +1336,16 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
       check[1].pubkey = &cert->signed_key;
-      check[1].msg = d256;
+      check[1].msg = checks->d256;
       check[1].len = DIGEST256_LEN;
+      checks->n_checks = 2;
 
-      if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
-        goto err;
+      if (!checks_out) {
+        if (desc_ed_checks_run(checks) < 0) {
+          log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+          goto err;
+        }
+        desc_ed_checks_free(checks);
       }
       /* We don't check the certificate expiration time: checking that it
        * matches the cert in the router descriptor is adequate. */
@@ -1204,10 +1384,15 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
 
   goto done;
  err:
+  if (can_dl_again && checks && desc_ed_checks_run(checks) < 0)
+    can_dl_again = 0;
+  desc_ed_checks_free(checks);
   dump_desc(s_dup, "extra-info descriptor");
   extrainfo_free(extrainfo);
   extrainfo = NULL;
  done:
+  if (checks_out)
+    *checks_out = checks;
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
@@ -538,42 +538,80 @@ lookup_v3_desc_as_client(const uint8_t *key)
   return cached_desc;
 }
 
+/** Decrypt the encoded descriptor of <b>entry</b>, which must not have been
+ * decoded yet, into entry->desc, and account for the memory it uses if
+ * <b>entry</b> is in the cache. If <b>plaintext</b> is not NULL, it holds
+ * the plaintext layer of the descriptor, already checked, and we take over
+ * its contents instead of decoding that layer again. Return the decode
+ * status: on HS_DESC_DECODE_OK, entry->desc is set; on a missing or bad
+ * client authorization, it stays NULL and can be decoded later. */
+static hs_desc_decode_status_t
+cache_client_desc_decode(hs_cache_client_descriptor_t *entry,
+                         hs_desc_plaintext_data_t *plaintext,
+                         bool is_cached)
+{
+  hs_desc_decode_status_t ret;
+  hs_descriptor_t *desc = NULL;
+
+  qed_hs_assert(entry);
+  qed_hs_assert(!entry_has_decrypted_descriptor(entry));
+
+  if (plaintext) {
+    ret = hs_client_decrypt_descriptor(plaintext, &entry->key, &desc);
+  } else {
+    ret = hs_client_decode_descriptor(entry->encoded_desc, &entry->key,
+                                      &desc);
+  }
+  entry->decoded = 1;
+  if (ret != HS_DESC_DECODE_OK) {
+    /* We are not suppose to have a descriptor if the decoding code is not
+     * indicating success. Just in case, don't leak it. */
+    if (BUG(desc != NULL)) {
+      hs_descriptor_free(desc);
+    }
+    return ret;
+  }
+  qed_hs_assert(desc);
+
+  if (BUG(desc->plaintext_data.revision_counter !=
+          entry->revision_counter)) {
+    hs_descriptor_free(desc);
+    return HS_DESC_DECODE_GENERIC_ERROR;
+  }
+  entry->desc = desc;
+  if (is_cached) {
+    /* Update cache size with the decoded descriptor for the OOM handler. */
+    hs_cache_increment_allocation(hs_desc_obj_size(desc));
+  }
+  return ret;
+}
+
 /** Parse the encoded descriptor in <b>desc_str</b> using
- * <b>service_identity_pk</b> to decrypt it first.
+ * <b>service_identity_pk</b>. We always check its plaintext layer; if
+ * <b>decode_now</b> is true, we also decrypt it.
  *
  * If everything goes well, allocate and return a new
  * hs_cache_client_descriptor_t object. In case of error, return NULL. */
 static hs_cache_client_descriptor_t *
 cache_client_desc_new(const char *desc_str,
                       const ed25519_public_key_t *service_identity_pk,
+                      bool decode_now,
                       hs_desc_decode_status_t *decode_status_out)
 {
   hs_desc_decode_status_t ret;
-  hs_descriptor_t *desc = NULL;
+  hs_desc_plaintext_data_t plaintext;
   hs_cache_client_descriptor_t *client_desc = NULL;
 
   qed_hs_assert(desc_str);
   qed_hs_assert(service_identity_pk);
 
-  /* Decode the descriptor we just fetched. */
-  ret = hs_client_decode_descriptor(desc_str, service_identity_pk, &desc);
-  if (ret != HS_DESC_DECODE_OK &&
-      ret != HS_DESC_DECODE_NEED_CLIENT_AUTH &&
-      ret != HS_DESC_DECODE_BAD_CLIENT_AUTH) {
-    /* In the case of a missing or bad client authorization, we'll keep the
-     * descriptor in the cache because those credentials can arrive later. */
+  /* Make sure the descriptor is authentic before we spend any memory on
+   * it. This is cheap compared to decrypting it. */
+  ret = hs_client_check_descriptor_plaintext(desc_str, service_identity_pk,
+                                             &plaintext);
+  if (ret != HS_DESC_DECODE_OK) {
     goto end;
   }
-  /* Make sure we do have a descriptor if decoding was successful. */
-  if (ret == HS_DESC_DECODE_OK) {
-    qed_hs_assert(desc);
-  } else {
-    if (BUG(desc != NULL)) {
-      /* We are not suppose to have a descriptor if the decoding code is not
-       * indicating success. Just in case, bail early to recover. */
-      goto end;
-    }
-  }
 
   /* All is good: make a cache object for this descriptor */
   client_desc = qed_hs_malloc_zero(sizeof(hs_cache_client_descriptor_t));
@@ -582,10 +620,24 @@ cache_client_desc_new(const char *desc_str,
    * time period since that's when clients need to start using the next blinded
    * pk of the service (and hence will need its next descriptor). */
   client_desc->expiration_ts = hs_get_start_time_of_next_time_period(0);
-  client_desc->desc = desc;
+  client_desc->revision_counter = plaintext.revision_counter;
   client_desc->encoded_desc = qed_hs_strdup(desc_str);
 
+  if (decode_now) {
+    /* The plaintext layer we just checked goes into the descriptor. */
+    ret = cache_client_desc_decode(client_desc, &plaintext, false);
+    if (ret != HS_DESC_DECODE_OK &&
+        ret != HS_DESC_DECODE_NEED_CLIENT_AUTH &&
+        ret != HS_DESC_DECODE_BAD_CLIENT_AUTH) {
+      /* In the case of a missing or bad client authorization, we'll keep the
+       * descriptor in the cache because those credentials can arrive later. */
+      cache_client_desc_free(client_desc);
+      goto end;
+    }
+  }
+
  end:
+  hs_desc_plaintext_data_free_contents(&plaintext);
   if (decode_status_out) {
     *decode_status_out = ret;
   }
@@ -786,24 +838,11 @@ cache_store_as_client(hs_cache_client_descriptor_t *client_desc)
    * client authorization. */
   cache_entry = lookup_v3_desc_as_client(client_desc->key.pubkey);
   if (cache_entry != NULL) {
-    /* If the current or the new cache entry don't have a decrypted descriptor
-     * (missing client authorization), we always replace the current one with
-     * the new one. Reason is that we can't inspect the revision counter
-     * within the plaintext data so we blindly replace. */
-    if (!entry_has_decrypted_descriptor(cache_entry) ||
-        !entry_has_decrypted_descriptor(client_desc)) {
-      remove_v3_desc_as_client(cache_entry);
-      cache_client_desc_free(cache_entry);
-      goto store;
-    }
-
-    /* From this point on, we know that the decrypted descriptor is in the
-     * current entry and new object thus safe to access. */
-
-    /* If we have an entry in our cache that has a revision counter greater
-     * than the one we just fetched, discard the one we fetched. */
-    if (cache_entry->desc->plaintext_data.revision_counter >
-        client_desc->desc->plaintext_data.revision_counter) {
+    /* We always know the revision counter of both entries from their
+     * plaintext layer, even when we couldn't decrypt them. If we have an
+     * entry in our cache that has a revision counter greater than the one we
+     * just fetched, discard the one we fetched. */
+    if (cache_entry->revision_counter > client_desc->revision_counter) {
       cache_client_desc_free(client_desc);
       goto done;
     }
@@ -813,13 +852,14 @@ cache_store_as_client(hs_cache_client_descriptor_t *client_desc)
     /* We just removed an old descriptor and will replace it. We'll close all
      * intro circuits related to this old one so we don't have leftovers. We
      * leave the rendezvous circuits opened because they could be in use. */
-    hs_client_close_intro_circuits_from_desc(cache_entry->desc);
+    if (entry_has_decrypted_descriptor(cache_entry)) {
+      hs_client_close_intro_circuits_from_desc(cache_entry->desc);
+    }
 
     /* Free it. */
     cache_client_desc_free(cache_entry);
   }
 
- store:
   /* Store descriptor in cache */
   store_v3_desc_as_client(client_desc);
 
@@ -922,8 +962,12 @@ hs_cache_lookup_encoded_as_client(const ed25519_public_key_t *key)
 
 /** Public API: Given the HS ed25519 identity public key in <b>key</b>, return
  *  its HS descriptor if it's stored in our cache, or NULL if not or if the
- *  descriptor was never decrypted. The later can happen if we are waiting for
- *  client authorization to be added. */
+ *  descriptor can't be decrypted. The later can happen if we are waiting for
+ *  client authorization to be added.
+ *
+ *  If the descriptor was stored without being decrypted, decrypt it now. If
+ *  that fails for any reason other than client authorization, the entry is
+ *  useless: remove it from the cache so that we fetch a new one. */
 const hs_descriptor_t *
 hs_cache_lookup_as_client(const ed25519_public_key_t *key)
 {
@@ -932,13 +976,64 @@ hs_cache_lookup_as_client(const ed25519_public_key_t *key)
   qed_hs_assert(key);
 
   cached_desc = lookup_v3_desc_as_client(key->pubkey);
-  if (cached_desc && entry_has_decrypted_descriptor(cached_desc)) {
+  if (!cached_desc) {
+    return NULL;
+  }
+
+  if (!cached_desc->decoded) {
+    hs_desc_decode_status_t ret =
+      cache_client_desc_decode(cached_desc, NULL, true);
+    if (ret != HS_DESC_DECODE_OK &&
+        ret != HS_DESC_DECODE_NEED_CLIENT_AUTH &&
+        ret != HS_DESC_DECODE_BAD_CLIENT_AUTH) {
+      log_info(LD_REND, "Unable to decode a cached hidden service "
+                        "descriptor. Removing it from the cache.");
+      remove_v3_desc_as_client(cached_desc);
+      cache_client_desc_free(cached_desc);
+      return NULL;
+    }
+  }
+
+  if (entry_has_decrypted_descriptor(cached_desc)) {
     return cached_desc->desc;
   }
 
   return NULL;
 }
 
+/** Helper: parse <b>desc_str</b>, decrypting it if <b>decode_now</b> is
+ *  true, and store it in the client cache. Return the decode status as
+ *  described for hs_cache_store_as_client(). */
+static hs_desc_decode_status_t
+cache_store_as_client_impl(const char *desc_str,
+                           const ed25519_public_key_t *identity_pk,
+                           bool decode_now)
+{
+  hs_desc_decode_status_t ret;
+  hs_cache_client_descriptor_t *client_desc = NULL;
+
+  /* Create client cache descriptor object */
+  client_desc = cache_client_desc_new(desc_str, identity_pk, decode_now,
+                                      &ret);
+  if (!client_desc) {
+    log_warn(LD_GENERAL, "HSDesc parsing failed!");
+    log_debug(LD_GENERAL, "Failed to parse HSDesc: %s.", escaped(desc_str));
+    goto err;
+  }
+
+  /* Push it to the cache */
+  if (cache_store_as_client(client_desc) < 0) {
+    ret = HS_DESC_DECODE_GENERIC_ERROR;
+    goto err;
+  }
+
+  return ret;
+
+ err:
+  cache_client_desc_free(client_desc);
+  return ret;
+}
+
 /** Public API: Given an encoded descriptor, store it in the client HS cache.
  *  Return a decode status which changes how we handle the SOCKS connection
  *  depending on its value:
@@ -959,31 +1054,28 @@ hs_desc_decode_status_t
 hs_cache_store_as_client(const char *desc_str,
                          const ed25519_public_key_t *identity_pk)
 {
-  hs_desc_decode_status_t ret;
-  hs_cache_client_descriptor_t *client_desc = NULL;
-
   qed_hs_assert(desc_str);
   qed_hs_assert(identity_pk);
 
-  /* Create client cache descriptor object */
-  client_desc = cache_client_desc_new(desc_str, identity_pk, &ret);
-  if (!client_desc) {
-    log_warn(LD_GENERAL, "HSDesc parsing failed!");
-    log_debug(LD_GENERAL, "Failed to parse HSDesc: %s.", escaped(desc_str));
-    goto err;
-  }
-
-  /* Push it to the cache */
-  if (cache_store_as_client(client_desc) < 0) {
-    ret = HS_DESC_DECODE_GENERIC_ERROR;
-    goto err;
-  }
+  return cache_store_as_client_impl(desc_str, identity_pk, true);
+}
 
-  return ret;
+/** Public API: Like hs_cache_store_as_client(), but only check the
+ *  plaintext layer of the descriptor before storing it, and leave it to be
+ *  decrypted the first time hs_cache_lookup_as_client() asks for it. Use
+ *  this when nobody is waiting for the descriptor, so that we don't pay for
+ *  decrypting descriptors we may never use.
+ *
+ *  On success, HS_DESC_DECODE_OK is returned even though we don't yet know
+ *  whether we have the client authorization needed to decrypt it. */
+hs_desc_decode_status_t
+hs_cache_store_undecoded_as_client(const char *desc_str,
+                                   const ed25519_public_key_t *identity_pk)
+{
+  qed_hs_assert(desc_str);
+  qed_hs_assert(identity_pk);
 
- err:
-  cache_client_desc_free(client_desc);
-  return ret;
+  return cache_store_as_client_impl(desc_str, identity_pk, false);
 }
 
 /** Remove and free a client cache descriptor entry for the given onion
@@ -1137,9 +1229,10 @@ hs_cache_client_new_auth_parse(const ed25519_public_key_t *service_pk)
     goto end;
   }
 
-  /* Attempt a decode. If we are successful, inform the caller. */
-  if (hs_client_decode_descriptor(cached_desc->encoded_desc, service_pk,
-                                  &cached_desc->desc) == HS_DESC_DECODE_OK) {
+  /* Attempt a decode. If we are successful, inform the caller. This also
+   * covers a descriptor that was stored without being decrypted. */
+  if (cache_client_desc_decode(cached_desc, NULL, true) ==
+      HS_DESC_DECODE_OK) {
     ret = true;
   }
 
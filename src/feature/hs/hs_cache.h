@@ -105,6 +105,9 @@ const char *
 hs_cache_lookup_encoded_as_client(const struct ed25519_public_key_t *key);
 hs_desc_decode_status_t hs_cache_store_as_client(const char *desc_str,
                            const struct ed25519_public_key_t *identity_pk);
+hs_desc_decode_status_t hs_cache_store_undecoded_as_client(
+                           const char *desc_str,
+                           const struct ed25519_public_key_t *identity_pk);
 void hs_cache_remove_as_client(const struct ed25519_public_key_t *key);
 void hs_cache_clean_as_client(time_t now);
 void hs_cache_purge_as_client(void);
@@ -145,6 +148,16 @@ typedef struct hs_cache_client_descriptor_t {
    * the proper client authorization is given tor. */
   hs_descriptor_t *desc;
 
+  /** True iff we have tried to decrypt encoded_desc. We only check the
+   * plaintext layer of a descriptor nobody is waiting for when we store it,
+   * and decrypt it the first time it is looked up. */
+  unsigned int decoded : 1;
+
+  /** Revision counter from the plaintext layer of encoded_desc, which we
+   * always decode, so that we can tell which of two descriptors is newer
+   * even when we can't decrypt them. */
+  uint64_t revision_counter;
+
   /** Encoded descriptor in string form. Can't be NULL. */
   char *encoded_desc;
 } hs_cache_client_descriptor_t;
@@ -146,24 +146,22 @@ decrypt_introduce2(const uint8_t *enc_key, const uint8_t *encrypted_section,
 /** Given a pointer to the decrypted data of the ENCRYPTED section of an
  * INTRODUCE2 cell of length decrypted_len, parse and validate the cell
  * content. Return a newly allocated cell structure or NULL on error. The
- * circuit and service object are only used for logging purposes. */
+ * circuit ID and onion address are only used for logging purposes. */
 static trn_cell_introduce_encrypted_t *
 parse_introduce2_encrypted(const uint8_t *decrypted_data,
-                           size_t decrypted_len, const origin_circuit_t *circ,
-                           const hs_service_t *service)
+                           size_t decrypted_len, uint32_t circ_id,
+                           const char *onion_address)
 {
   trn_cell_introduce_encrypted_t *enc_cell = NULL;
 
   qed_hs_assert(decrypted_data);
-  qed_hs_assert(circ);
-  qed_hs_assert(service);
+  qed_hs_assert(onion_address);
 
   if (trn_cell_introduce_encrypted_parse(&enc_cell, decrypted_data,
                                          decrypted_len) < 0) {
     log_info(LD_REND, "Unable to parse the decrypted ENCRYPTED section of "
                       "the INTRODUCE2 cell on circuit %u for service %s",
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             circ_id, safe_str_client(onion_address));
     goto err;
   }
 
@@ -173,8 +171,7 @@ parse_introduce2_encrypted(const uint8_t *decrypted_data,
                       "expected %u on circuit %u for service %s",
              trn_cell_introduce_encrypted_get_onion_key_type(enc_cell),
              TRUNNEL_HS_INTRO_ONION_KEY_TYPE_NTOR,
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             circ_id, safe_str_client(onion_address));
     goto err;
   }
 
@@ -183,8 +180,8 @@ parse_introduce2_encrypted(const uint8_t *decrypted_data,
     log_info(LD_REND, "INTRODUCE2 onion key length is invalid. Got %u but "
                       "expected %d on circuit %u for service %s",
              (unsigned)trn_cell_introduce_encrypted_getlen_onion_key(enc_cell),
-             CURVE25519_PUBKEY_LEN, TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             CURVE25519_PUBKEY_LEN, circ_id,
+             safe_str_client(onion_address));
     goto err;
   }
   /* XXX: Validate NSPEC field as well. */
@@ -196,20 +193,18 @@ parse_introduce2_encrypted(const uint8_t *decrypted_data,
 }
 
 /** Parse an INTRODUCE2 cell from payload of size payload_len for the given
- * service and circuit which are used only for logging purposes. The resulting
- * parsed cell is put in cell_ptr_out.
+ * onion address and circuit ID which are used only for logging purposes. The
+ * resulting parsed cell is put in cell_ptr_out.
  *
  * Return 0 on success else a negative value and cell_ptr_out is untouched. */
 static int
-parse_introduce2_cell(const hs_service_t *service,
-                      const origin_circuit_t *circ, const uint8_t *payload,
-                      size_t payload_len,
+parse_introduce2_cell(uint32_t circ_id, const char *onion_address,
+                      const uint8_t *payload, size_t payload_len,
                       trn_cell_introduce1_t **cell_ptr_out)
 {
   trn_cell_introduce1_t *cell = NULL;
 
-  qed_hs_assert(service);
-  qed_hs_assert(circ);
+  qed_hs_assert(onion_address);
   qed_hs_assert(payload);
   qed_hs_assert(cell_ptr_out);
 
@@ -217,8 +212,7 @@ parse_introduce2_cell(const hs_service_t *service,
   if (trn_cell_introduce1_parse(&cell, payload, payload_len) < 0) {
     log_info(LD_PROTOCOL, "Unable to parse INTRODUCE2 cell on circuit %u "
                           "for service %s",
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             circ_id, safe_str_client(onion_address));
     goto err;
   }
 
@@ -795,26 +789,19 @@ hs_cell_parse_intro_established(const uint8_t *payload, size_t payload_len)
   return ret;
 }
 
-/** Parse the cell PoW solution extension. Return 0 on success and data
- * structure is updated with the PoW effort. Return -1 on any kind of error
- * including if PoW couldn't be verified. */
+/** Parse the cell PoW solution extension. Return 0 on success and the
+ * solution is copied into the data structure, to be verified by the caller.
+ * Return -1 if the extension is malformed. */
 static int
-handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
-                                const hs_service_intro_point_t *ip,
+parse_introduce2_encrypted_cell_pow_extension(
                                 const trn_extension_field_t *field,
                                 hs_cell_introduce2_data_t *data)
 {
   int ret = -1;
   trn_cell_extension_pow_t *pow = NULL;
-  hs_pow_solution_t sol;
+  hs_pow_solution_t *sol = &data->pow_solution;
 
   qed_hs_assert(field);
-  qed_hs_assert(ip);
-
-  if (!service->state.pow_state) {
-    log_info(LD_REND, "Unsolicited PoW solution in INTRODUCE2 request.");
-    goto end;
-  }
 
   if (trn_cell_extension_pow_parse(&pow,
                trn_extension_field_getconstarray_field(field),
@@ -831,27 +818,20 @@ handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
   }
 
   /* Effort E */
-  sol.effort = trn_cell_extension_pow_get_pow_effort(pow);
+  sol->effort = trn_cell_extension_pow_get_pow_effort(pow);
   /* Seed C */
-  memcpy(sol.seed_head, trn_cell_extension_pow_getconstarray_pow_seed(pow),
+  memcpy(sol->seed_head, trn_cell_extension_pow_getconstarray_pow_seed(pow),
          HS_POW_SEED_HEAD_LEN);
   /* Nonce N */
-  memcpy(sol.nonce, trn_cell_extension_pow_getconstarray_pow_nonce(pow),
+  memcpy(sol->nonce, trn_cell_extension_pow_getconstarray_pow_nonce(pow),
          HS_POW_NONCE_LEN);
   /* Solution S */
-  memcpy(sol.equix_solution,
+  memcpy(sol->equix_solution,
          trn_cell_extension_pow_getconstarray_pow_solution(pow),
          HS_POW_EQX_SOL_LEN);
+  data->has_pow_solution = 1;
 
-  if (hs_pow_verify(&ip->blinded_id, service->state.pow_state, &sol)) {
-    log_info(LD_REND, "PoW INTRODUCE2 request failed to verify.");
-    goto end;
-  }
-
-  log_info(LD_REND, "PoW INTRODUCE2 request successfully verified.");
-  data->rdv_data.pow_effort = sol.effort;
-
-  /* Successfully parsed and verified the PoW solution */
+  /* Successfully parsed the PoW solution */
   ret = 0;
 
  end:
@@ -859,6 +839,32 @@ handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
   return ret;
 }
 
+/** Verify the PoW solution that was parsed into <b>data</b> against the PoW
+ * state of <b>service</b>. Return 0 on success and data structure is updated
+ * with the PoW effort. Return -1 if the PoW couldn't be verified. */
+static int
+verify_introduce2_pow(const hs_service_t *service,
+                      const hs_service_intro_point_t *ip,
+                      hs_cell_introduce2_data_t *data)
+{
+  qed_hs_assert(ip);
+
+  if (!service->state.pow_state) {
+    log_info(LD_REND, "Unsolicited PoW solution in INTRODUCE2 request.");
+    return -1;
+  }
+
+  if (hs_pow_verify(&ip->blinded_id, service->state.pow_state,
+                    &data->pow_solution)) {
+    log_info(LD_REND, "PoW INTRODUCE2 request failed to verify.");
+    return -1;
+  }
+
+  log_info(LD_REND, "PoW INTRODUCE2 request successfully verified.");
+  data->rdv_data.pow_effort = data->pow_solution.effort;
+  return 0;
+}
+
 /** For the encrypted INTRO2 cell in <b>encrypted_section</b>, use the crypto
  * material in <b>data</b> to compute the right ntor keys. Also validate the
  * INTRO2 MAC to ensure that the keys are the right ones.
@@ -929,12 +935,10 @@ get_introduce2_keys_and_verify_mac(hs_cell_introduce2_data_t *data,
 
 /** Parse the given INTRODUCE cell extension. Update the data object
  * accordingly depending on the extension. Return 0 if it validated
- * correctly, or return -1 if it is malformed (for example because it
- * includes a PoW that doesn't verify). */
+ * correctly, or return -1 if it is malformed. A PoW solution is only
+ * parsed here; the caller is responsible for verifying it. */
 static int
-parse_introduce_cell_extension(const hs_service_t *service,
-                               const hs_service_intro_point_t *ip,
-                               hs_cell_introduce2_data_t *data,
+parse_introduce_cell_extension(hs_cell_introduce2_data_t *data,
                                const trn_extension_field_t *field)
 {
   int ret = 0;
@@ -951,9 +955,8 @@ parse_introduce_cell_extension(const hs_service_t *service,
     data->pv.supports_congestion_control = data->rdv_data.cc_enabled;
     break;
   case TRUNNEL_EXT_TYPE_POW:
-    /* PoW request. If successful, the effort is put in the data. */
-    if (handle_introduce2_encrypted_cell_pow_extension(service, ip,
-                                                       field, data) < 0) {
+    /* PoW request. If successful, the solution is put in the data. */
+    if (parse_introduce2_encrypted_cell_pow_extension(field, data) < 0) {
       log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid PoW cell extension.");
       ret = -1;
     }
@@ -966,41 +969,26 @@ parse_introduce_cell_extension(const hs_service_t *service,
   return ret;
 }
 
-/** Parse the INTRODUCE2 cell using data which contains everything we need to
- * do so and contains the destination buffers of information we extract and
- * compute from the cell. Return 0 on success else a negative value. The
- * service and circ are only used for logging purposes. */
-ssize_t
-hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
-                         const origin_circuit_t *circ,
-                         const hs_service_t *service,
-                         const hs_service_intro_point_t *ip)
+/** Helper: parse the INTRODUCE2 cell in data into *<b>cell_out</b>, and
+ * point *<b>encrypted_section_out</b> and *<b>encrypted_section_len_out</b>
+ * at its ENCRYPTED section. The circuit ID and onion address are only used
+ * for logging purposes. Return 0 on success else a negative value. */
+static int
+parse_introduce2_encrypted_section(const hs_cell_introduce2_data_t *data,
+                                   uint32_t circ_id, const char *onion_address,
+                                   trn_cell_introduce1_t **cell_out,
+                                   const uint8_t **encrypted_section_out,
+                                   size_t *encrypted_section_len_out)
 {
-  int ret = -1;
-  time_t elapsed;
-  uint8_t *decrypted = NULL;
-  size_t encrypted_section_len;
-  const uint8_t *encrypted_section;
   trn_cell_introduce1_t *cell = NULL;
-  trn_cell_introduce_encrypted_t *enc_cell = NULL;
-  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
-
-  qed_hs_assert(data);
-  qed_hs_assert(circ);
-  qed_hs_assert(service);
+  size_t encrypted_section_len;
 
   /* Parse the cell into a decoded data structure pointed by cell_ptr. */
-  if (parse_introduce2_cell(service, circ, data->payload, data->payload_len,
-                            &cell) < 0) {
-    goto done;
+  if (parse_introduce2_cell(circ_id, onion_address, data->payload,
+                            data->payload_len, &cell) < 0) {
+    return -1;
   }
 
-  log_info(LD_REND, "Received a decodable INTRODUCE2 cell on circuit %u "
-                    "for service %s. Decoding encrypted section...",
-           TO_CIRCUIT(circ)->n_circ_id,
-           safe_str_client(service->onion_address));
-
-  encrypted_section = trn_cell_introduce1_getconstarray_encrypted(cell);
   encrypted_section_len = trn_cell_introduce1_getlen_encrypted(cell);
 
   /* Encrypted section must at least contain the CLIENT_PK and MAC which is
@@ -1008,10 +996,46 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   if (encrypted_section_len < (CURVE25519_PUBKEY_LEN + DIGEST256_LEN)) {
     log_info(LD_REND, "Invalid INTRODUCE2 encrypted section length "
                       "for service %s. Dropping cell.",
-             safe_str_client(service->onion_address));
+             safe_str_client(onion_address));
+    trn_cell_introduce1_free(cell);
+    return -1;
+  }
+
+  *cell_out = cell;
+  *encrypted_section_out = trn_cell_introduce1_getconstarray_encrypted(cell);
+  *encrypted_section_len_out = encrypted_section_len;
+  return 0;
+}
+
+/** Check that the INTRODUCE2 cell in data can be parsed, and that its
+ * ENCRYPTED section is not in the replay cache of data, adding it there.
+ * This is the part of INTRODUCE2 handling that touches shared state without
+ * doing any public key operations, so it must run on the main thread before
+ * hs_cell_decrypt_introduce2(). The circuit ID and onion address are only
+ * used for logging purposes. Return 0 on success else a negative value. */
+int
+hs_cell_introduce2_check_replay(hs_cell_introduce2_data_t *data,
+                                uint32_t circ_id, const char *onion_address)
+{
+  int ret = -1;
+  time_t elapsed;
+  size_t encrypted_section_len;
+  const uint8_t *encrypted_section;
+  trn_cell_introduce1_t *cell = NULL;
+
+  qed_hs_assert(data);
+  qed_hs_assert(onion_address);
+
+  if (parse_introduce2_encrypted_section(data, circ_id, onion_address, &cell,
+                                         &encrypted_section,
+                                         &encrypted_section_len) < 0) {
     goto done;
   }
 
+  log_info(LD_REND, "Received a decodable INTRODUCE2 cell on circuit %u "
+                    "for service %s. Decoding encrypted section...",
+           circ_id, safe_str_client(onion_address));
+
   /* Check our replay cache for this introduction point. */
   if (replaycache_add_test_and_elapsed(data->replay_cache, encrypted_section,
                                        encrypted_section_len, &elapsed)) {
@@ -1021,6 +1045,40 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
     goto done;
   }
 
+  ret = 0;
+
+ done:
+  trn_cell_introduce1_free(cell);
+  return ret;
+}
+
+/** Compute the ntor keys for the INTRODUCE2 cell in data, verify its MAC,
+ * decrypt its ENCRYPTED section and extract the rendezvous data and
+ * extensions from it into data. A PoW solution, if any, is parsed but not
+ * verified. This touches no shared state, so it can run on a cpuworker. The
+ * circuit ID and onion address are only used for logging purposes. Return 0
+ * on success else a negative value. */
+int
+hs_cell_decrypt_introduce2(hs_cell_introduce2_data_t *data,
+                           uint32_t circ_id, const char *onion_address)
+{
+  int ret = -1;
+  uint8_t *decrypted = NULL;
+  size_t encrypted_section_len;
+  const uint8_t *encrypted_section;
+  trn_cell_introduce1_t *cell = NULL;
+  trn_cell_introduce_encrypted_t *enc_cell = NULL;
+  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
+
+  qed_hs_assert(data);
+  qed_hs_assert(onion_address);
+
+  if (parse_introduce2_encrypted_section(data, circ_id, onion_address, &cell,
+                                         &encrypted_section,
+                                         &encrypted_section_len) < 0) {
+    goto done;
+  }
+
   /* First bytes of the ENCRYPTED section are the client public key (they are
    * guaranteed to exist because of the length check above). We are gonna use
    * the client public key to compute the ntor keys and decrypt the payload:
@@ -1033,8 +1091,7 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                                   encrypted_section_len);
   if (!intro_keys) {
     log_warn(LD_REND, "Could not get valid INTRO2 keys on circuit %u "
-             "for service %s", TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             "for service %s", circ_id, safe_str_client(onion_address));
     goto done;
   }
 
@@ -1055,15 +1112,14 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
     if (decrypted == NULL) {
       log_info(LD_REND, "Unable to decrypt the ENCRYPTED section of an "
                         "INTRODUCE2 cell on circuit %u for service %s",
-               TO_CIRCUIT(circ)->n_circ_id,
-               safe_str_client(service->onion_address));
+               circ_id, safe_str_client(onion_address));
       goto done;
     }
 
     /* Parse this blob into an encrypted cell structure so we can then extract
      * the data we need out of it. */
     enc_cell = parse_introduce2_encrypted(decrypted, encrypted_data_len,
-                                          circ, service);
+                                          circ_id, onion_address);
     memwipe(decrypted, 0, encrypted_data_len);
     if (enc_cell == NULL) {
       goto done;
@@ -1107,22 +1163,14 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
         /* The number of extensions should match the number of fields. */
         break;
       }
-      if (parse_introduce_cell_extension(service, ip, data, field) < 0) {
+      if (parse_introduce_cell_extension(data, field) < 0) {
         goto done;
       }
     }
   }
 
-  /* If the client asked for congestion control, but we don't support it,
-   * that's a failure. It should not have asked, based on our descriptor. */
-  if (data->rdv_data.cc_enabled && !congestion_control_enabled()) {
-    goto done;
-  }
-
   /* Success. */
   ret = 0;
-  log_info(LD_REND,
-           "Valid INTRODUCE2 cell. Willing to launch rendezvous circuit.");
 
  done:
   if (intro_keys) {
@@ -1135,6 +1183,51 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   return ret;
 }
 
+/** Parse the INTRODUCE2 cell using data which contains everything we need to
+ * do so and contains the destination buffers of information we extract and
+ * compute from the cell. Return 0 on success else a negative value. The
+ * service and circ are only used for logging purposes. */
+ssize_t
+hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
+                         const origin_circuit_t *circ,
+                         const hs_service_t *service,
+                         const hs_service_intro_point_t *ip)
+{
+  uint32_t circ_id;
+
+  qed_hs_assert(data);
+  qed_hs_assert(circ);
+  qed_hs_assert(service);
+
+  circ_id = TO_CIRCUIT(circ)->n_circ_id;
+
+  if (hs_cell_introduce2_check_replay(data, circ_id,
+                                      service->onion_address) < 0) {
+    return -1;
+  }
+
+  if (hs_cell_decrypt_introduce2(data, circ_id,
+                                 service->onion_address) < 0) {
+    return -1;
+  }
+
+  if (data->has_pow_solution &&
+      verify_introduce2_pow(service, ip, data) < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid PoW cell extension.");
+    return -1;
+  }
+
+  /* If the client asked for congestion control, but we don't support it,
+   * that's a failure. It should not have asked, based on our descriptor. */
+  if (data->rdv_data.cc_enabled && !congestion_control_enabled()) {
+    return -1;
+  }
+
+  log_info(LD_REND,
+           "Valid INTRODUCE2 cell. Willing to launch rendezvous circuit.");
+  return 0;
+}
+
 /** Build a RENDEZVOUS1 cell with the given rendezvous cookie and handshake
  * info. The encoded cell is put in cell_out and the length of the data is
  * returned. This can't fail. */
@@ -100,6 +100,10 @@ typedef struct hs_cell_introduce2_data_t {
   replaycache_t *replay_cache;
   /** Flow control negotiation parameters. */
   protover_summary_flags_t pv;
+  /** PoW solution found in the cell. Only set if has_pow_solution is true. */
+  hs_pow_solution_t pow_solution;
+  /** True iff the cell carried a PoW solution extension. */
+  unsigned int has_pow_solution : 1;
 } hs_cell_introduce2_data_t;
 
 /* Build cell API. */
@@ -124,6 +128,11 @@ ssize_t hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                  const origin_circuit_t *circ,
                                  const hs_service_t *service,
                                  const hs_service_intro_point_t *ip);
+int hs_cell_introduce2_check_replay(hs_cell_introduce2_data_t *data,
+                                    uint32_t circ_id,
+                                    const char *onion_address);
+int hs_cell_decrypt_introduce2(hs_cell_introduce2_data_t *data,
+                               uint32_t circ_id, const char *onion_address);
 int hs_cell_parse_introduce_ack(const uint8_t *payload, size_t payload_len);
 int hs_cell_parse_rendezvous2(const uint8_t *payload, size_t payload_len,
                               uint8_t *handshake_info,
@@ -19,6 +19,7 @@
 #include "core/or/extendinfo.h"
 #include "core/or/congestion_control_common.h"
 #include "core/crypto/onion_crypto.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/client/circpathbias.h"
 #include "feature/hs/hs_cell.h"
 #include "feature/hs/hs_circuit.h"
@@ -35,6 +36,7 @@
 #include "lib/crypt_ops/crypto_dh.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/time/compat_time.h"
 
 /* Trunnel. */
@@ -1298,10 +1300,321 @@ get_subcredential_for_handling_intro2_cell(const hs_service_t *service,
   return 0;
 }
 
+/** Give back the INTRODUCE2 slot that queue_introduce2_work() took on
+ * <b>ip</b> for a cell that turned out to be invalid. */
+static void
+release_introduce2_slot(hs_service_intro_point_t *ip)
+{
+  if (BUG(ip->introduce2_count == 0)) {
+    return;
+  }
+  ip->introduce2_count--;
+}
+
+/** Helper: We have a fully verified INTRODUCE2 cell in <b>data</b> that
+ * arrived on the introduction point <b>ip</b> of <b>service</b>. Check its
+ * rendezvous cookie against our replay cache, then either queue the
+ * rendezvous request or launch the rendezvous circuit. Return 0 on success
+ * else a negative value.
+ *
+ * If <b>slot_reserved</b> is true, the cell was already counted against
+ * <b>ip</b> when it was queued on a cpuworker. */
+static int
+handle_verified_introduce2(const hs_service_t *service,
+                           hs_service_intro_point_t *ip,
+                           hs_cell_introduce2_data_t *data, time_t now,
+                           bool slot_reserved)
+{
+  time_t elapsed;
+
+  /* Check whether we've seen this REND_COOKIE before to detect repeats. */
+  if (replaycache_add_test_and_elapsed(
+           service->state.replay_cache_rend_cookie,
+           data->rdv_data.rendezvous_cookie,
+           sizeof(data->rdv_data.rendezvous_cookie),
+           &elapsed)) {
+    /* A Tor client will send a new INTRODUCE1 cell with the same REND_COOKIE
+     * as its previous one if its intro circ times out while in state
+     * CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT. If we received the first
+     * INTRODUCE1 cell (the intro-point relay converts it into an INTRODUCE2
+     * cell), we are already trying to connect to that rend point (and may
+     * have already succeeded); drop this cell. */
+    log_info(LD_REND, "We received an INTRODUCE2 cell with same REND_COOKIE "
+                      "field %ld seconds ago. Dropping cell.",
+             (long int) elapsed);
+    hs_metrics_reject_intro_req(service,
+                                HS_METRICS_ERR_INTRO_REQ_INTRODUCE2_REPLAY);
+    if (slot_reserved) {
+      release_introduce2_slot(ip);
+    }
+    return -1;
+  }
+
+  /* At this point, we just confirmed that the full INTRODUCE2 cell is valid
+   * so increment our counter that we've seen one on this intro point. */
+  if (!slot_reserved) {
+    ip->introduce2_count++;
+  }
+
+  /* Add the rendezvous request to the priority queue if PoW defenses are
+   * enabled, otherwise rendezvous as usual. */
+  if (have_module_pow() && service->config.has_pow_defenses_enabled) {
+    log_info(LD_REND,
+             "Adding introduction request to pqueue with effort: %u",
+             data->rdv_data.pow_effort);
+    if (enqueue_rend_request(service, ip, data, now) < 0) {
+      return -1;
+    }
+
+    /* Track the total effort in valid requests received this period */
+    service->state.pow_state->total_effort += data->rdv_data.pow_effort;
+  } else {
+    /* Launch rendezvous circuit with the onion key and rend cookie. */
+    launch_rendezvous_point_circuit(service, &ip->auth_key_kp.pubkey,
+                                    &ip->enc_key_kp, &data->rdv_data, now);
+  }
+
+  /* Update metrics that a new introduction was successful. */
+  hs_metrics_new_introduction(service);
+  return 0;
+}
+
+/** Most INTRODUCE2 cells we let wait on each cpuworker thread. Beyond that,
+ * we drop new cells rather than let an introduction flood grow the work
+ * queue without bound. */
+#define MAX_PENDING_INTRODUCE2_PER_THREAD 64
+
+/** Number of INTRODUCE2 cells currently queued on the cpuworkers. */
+static unsigned int n_pending_introduce2 = 0;
+
+/** An INTRODUCE2 cell handed to a cpuworker for decryption and PoW
+ * verification. The job owns copies of everything the worker needs, so that
+ * the worker never touches the service, the introduction point or the
+ * circuit, any of which may be gone by the time the reply arrives. */
+typedef struct introduce2_job_t {
+  /** Identity key of the service, to find it again on reply. */
+  ed25519_public_key_t service_identity_pk;
+  /** Introduction point keys. */
+  ed25519_public_key_t ip_auth_pk;
+  curve25519_keypair_t ip_enc_kp;
+  /** Subcredentials to try, and how many there are. */
+  hs_subcredential_t *subcredentials;
+  size_t n_subcredentials;
+  /** Copy of the cell payload. */
+  uint8_t *payload;
+  /** For logging: the circuit ID and onion address. */
+  uint32_t circ_id;
+  char onion_address[HS_SERVICE_ADDR_LEN_BASE32 + 1];
+  /** Snapshot of the service's PoW seeds, if it had PoW state. */
+  hs_pow_verifier_inputs_t pow_inputs;
+  unsigned int has_pow_inputs : 1;
+  /** When we received the cell. */
+  time_t received_at;
+
+  /** The cell data. Points into the fields above, and receives the parsed
+   * rendezvous data and PoW solution. */
+  hs_cell_introduce2_data_t data;
+  /** Set by the worker: did decryption and parsing succeed? */
+  unsigned int decrypted_ok : 1;
+  /** Set by the worker: did the PoW solution, if any, verify? */
+  unsigned int pow_ok : 1;
+} introduce2_job_t;
+
+/** Release all storage held in <b>job</b>. */
+static void
+introduce2_job_free(introduce2_job_t *job)
+{
+  if (!job)
+    return;
+  link_specifier_smartlist_free(job->data.rdv_data.link_specifiers);
+  if (job->subcredentials) {
+    memwipe(job->subcredentials, 0,
+            job->n_subcredentials * sizeof(hs_subcredential_t));
+    qed_hs_free(job->subcredentials);
+  }
+  qed_hs_free(job->payload);
+  memwipe(job, 0, sizeof(*job));
+  qed_hs_free(job);
+}
+
+/** Worker function: This function runs on a cpuworker, and does the public
+ * key operations, decryption and PoW verification for an introduce2_job_t.
+ */
+static workqueue_reply_t
+introduce2_worker_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  introduce2_job_t *job = work_;
+
+  job->decrypted_ok =
+    hs_cell_decrypt_introduce2(&job->data, job->circ_id,
+                               job->onion_address) == 0;
+  if (!job->decrypted_ok || !job->data.has_pow_solution) {
+    return WQ_RPL_REPLY;
+  }
+
+  if (!job->has_pow_inputs) {
+    log_info(LD_REND, "Unsolicited PoW solution in INTRODUCE2 request.");
+  } else if (hs_pow_verify_solution(&job->pow_inputs,
+                                    &job->data.pow_solution)) {
+    log_info(LD_REND, "PoW INTRODUCE2 request failed to verify.");
+  } else {
+    job->pow_ok = 1;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Worker function: This function runs in the main thread, and receives an
+ * introduce2_job_t that a cpuworker has already processed. */
+static void
+introduce2_worker_replyfn(void *work_)
+{
+  introduce2_job_t *job = work_;
+  hs_service_t *service;
+  hs_service_intro_point_t *ip = NULL;
+
+  qed_hs_assert(in_main_thread());
+  qed_hs_assert(n_pending_introduce2 > 0);
+  --n_pending_introduce2;
+
+  service = hs_service_find(&job->service_identity_pk);
+  if (service)
+    ip = hs_service_find_intro_point(service, &job->ip_auth_pk);
+  if (!ip) {
+    log_info(LD_REND, "Service or introduction point for INTRODUCE2 cell "
+                      "on circuit %u went away while we were decrypting it.",
+             job->circ_id);
+    goto done;
+  }
+
+  if (!job->decrypted_ok) {
+    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
+    goto reject;
+  }
+
+  if (job->data.has_pow_solution) {
+    /* The worker only checked the solution against a snapshot of our seeds;
+     * make sure it is still acceptable and not a replay. */
+    if (!job->pow_ok || !service->state.pow_state ||
+        hs_pow_note_verified_solution(service->state.pow_state,
+                                      &job->data.pow_solution) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid PoW cell extension.");
+      hs_metrics_reject_intro_req(service,
+                                  HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
+      goto reject;
+    }
+    log_info(LD_REND, "PoW INTRODUCE2 request successfully verified.");
+    job->data.rdv_data.pow_effort = job->data.pow_solution.effort;
+  }
+
+  /* If the client asked for congestion control, but we don't support it,
+   * that's a failure. It should not have asked, based on our descriptor. */
+  if (job->data.rdv_data.cc_enabled && !congestion_control_enabled()) {
+    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
+    goto reject;
+  }
+
+  log_info(LD_REND,
+           "Valid INTRODUCE2 cell. Willing to launch rendezvous circuit.");
+  handle_verified_introduce2(service, ip, &job->data, job->received_at,
+                             true);
+  goto done;
+
+ reject:
+  release_introduce2_slot(ip);
+ done:
+  introduce2_job_free(job);
+}
+
+/** Return true iff we should hand INTRODUCE2 cells to the cpuworkers instead
+ * of handling them on the main thread. */
+static bool
+should_queue_introduce2_work(void)
+{
+  return get_options()->HiddenServiceOffloadIntroductions &&
+         cpuworker_get_n_threads() > 0;
+}
+
+/** Queue the decryption and PoW verification of the INTRODUCE2 cell in
+ * <b>data</b>, which arrived on circuit <b>circ</b> for the introduction
+ * point <b>ip</b> of <b>service</b>, on a cpuworker. The replay cache of the
+ * introduction point must already have been checked. Return 0 if the cell
+ * was queued else a negative value.
+ *
+ * A queued cell counts against the INTRODUCE2 limit of <b>ip</b> right away,
+ * as it would on the synchronous path, so that cells in flight can't keep
+ * the intro point alive past introduce2_max. The reply gives the slot back
+ * if the cell turns out to be invalid. */
+static int
+queue_introduce2_work(const hs_service_t *service,
+                      const origin_circuit_t *circ,
+                      hs_service_intro_point_t *ip,
+                      const hs_cell_introduce2_data_t *data, time_t now)
+{
+  static ratelim_t full_ratelim = RATELIM_INIT(60);
+  introduce2_job_t *job;
+
+  if (n_pending_introduce2 >=
+      MAX_PENDING_INTRODUCE2_PER_THREAD * cpuworker_get_n_threads()) {
+    log_fn_ratelim(&full_ratelim, LOG_NOTICE, LD_REND,
+                   "Too many INTRODUCE2 cells are waiting for a cpuworker. "
+                   "Dropping new ones for service %s.",
+                   safe_str_client(service->onion_address));
+    return -1;
+  }
+
+  job = qed_hs_malloc_zero(sizeof(*job));
+  ed25519_pubkey_copy(&job->service_identity_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&job->ip_auth_pk, data->auth_pk);
+  memcpy(&job->ip_enc_kp, data->enc_kp, sizeof(job->ip_enc_kp));
+  job->n_subcredentials = data->n_subcredentials;
+  job->subcredentials = qed_hs_memdup(data->subcredentials,
+                         data->n_subcredentials * sizeof(hs_subcredential_t));
+  job->payload = qed_hs_memdup(data->payload, data->payload_len);
+  job->circ_id = TO_CIRCUIT(circ)->n_circ_id;
+  strlcpy(job->onion_address, service->onion_address,
+          sizeof(job->onion_address));
+  job->received_at = now;
+
+  if (service->state.pow_state) {
+    const hs_pow_service_state_t *pow_state = service->state.pow_state;
+    ed25519_pubkey_copy(&job->pow_inputs.service_blinded_id, &ip->blinded_id);
+    memcpy(job->pow_inputs.seed_current, pow_state->seed_current,
+           HS_POW_SEED_LEN);
+    memcpy(job->pow_inputs.seed_previous, pow_state->seed_previous,
+           HS_POW_SEED_LEN);
+    job->pow_inputs.CompiledProofOfWorkHash =
+      get_options()->CompiledProofOfWorkHash;
+    job->has_pow_inputs = 1;
+  }
+
+  job->data.auth_pk = &job->ip_auth_pk;
+  job->data.enc_kp = &job->ip_enc_kp;
+  job->data.n_subcredentials = job->n_subcredentials;
+  job->data.subcredentials = job->subcredentials;
+  job->data.payload = job->payload;
+  job->data.payload_len = data->payload_len;
+  job->data.rdv_data.link_specifiers = smartlist_new();
+
+  if (!cpuworker_queue_work(WQ_PRI_MED, introduce2_worker_threadfn,
+                            introduce2_worker_replyfn, job)) {
+    introduce2_job_free(job);
+    return -1;
+  }
+
+  ++n_pending_introduce2;
+  ip->introduce2_count++;
+  return 0;
+}
+
 /** We just received an INTRODUCE2 cell on the established introduction circuit
  * circ.  Handle the INTRODUCE2 payload of size payload_len for the given
  * circuit and service. This cell is associated with the intro point object ip
- * and the subcredential. Return 0 on success else a negative value. */
+ * and the subcredential. Return 0 on success else a negative value.
+ *
+ * If HiddenServiceOffloadIntroductions is set and we have cpuworkers, the
+ * public key operations and PoW verification are queued on a cpuworker, and
+ * a return of 0 only means that the cell was queued. */
 int
 hs_circ_handle_introduce2(const hs_service_t *service,
                           const origin_circuit_t *circ,
@@ -1310,7 +1623,6 @@ hs_circ_handle_introduce2(const hs_service_t *service,
                           const uint8_t *payload, size_t payload_len)
 {
   int ret = -1;
-  time_t elapsed;
   hs_cell_introduce2_data_t data;
   time_t now = time(NULL);
 
@@ -1322,6 +1634,7 @@ hs_circ_handle_introduce2(const hs_service_t *service,
 
   /* Populate the data structure with everything we need for the cell to be
    * parsed, decrypted and key material computed correctly. */
+  memset(&data, 0, sizeof(data));
   data.auth_pk = &ip->auth_key_kp.pubkey;
   data.enc_kp = &ip->enc_key_kp;
   data.payload = payload;
@@ -1338,58 +1651,26 @@ hs_circ_handle_introduce2(const hs_service_t *service,
     goto done;
   }
 
-  if (hs_cell_parse_introduce2(&data, circ, service, ip) < 0) {
-    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
-    goto done;
-  }
-
-  /* Check whether we've seen this REND_COOKIE before to detect repeats. */
-  if (replaycache_add_test_and_elapsed(
-           service->state.replay_cache_rend_cookie,
-           data.rdv_data.rendezvous_cookie,
-           sizeof(data.rdv_data.rendezvous_cookie),
-           &elapsed)) {
-    /* A Tor client will send a new INTRODUCE1 cell with the same REND_COOKIE
-     * as its previous one if its intro circ times out while in state
-     * CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT. If we received the first
-     * INTRODUCE1 cell (the intro-point relay converts it into an INTRODUCE2
-     * cell), we are already trying to connect to that rend point (and may
-     * have already succeeded); drop this cell. */
-    log_info(LD_REND, "We received an INTRODUCE2 cell with same REND_COOKIE "
-                      "field %ld seconds ago. Dropping cell.",
-             (long int) elapsed);
-    hs_metrics_reject_intro_req(service,
-                                HS_METRICS_ERR_INTRO_REQ_INTRODUCE2_REPLAY);
-    goto done;
-  }
-
-  /* At this point, we just confirmed that the full INTRODUCE2 cell is valid
-   * so increment our counter that we've seen one on this intro point. */
-  ip->introduce2_count++;
-
-  /* Add the rendezvous request to the priority queue if PoW defenses are
-   * enabled, otherwise rendezvous as usual. */
-  if (have_module_pow() && service->config.has_pow_defenses_enabled) {
-    log_info(LD_REND,
-             "Adding introduction request to pqueue with effort: %u",
-             data.rdv_data.pow_effort);
-    if (enqueue_rend_request(service, ip, &data, now) < 0) {
+  if (should_queue_introduce2_work()) {
+    /* The replay cache belongs to the intro point, so check it here; the
+     * rest of the work happens on a cpuworker. */
+    if (hs_cell_introduce2_check_replay(&data, TO_CIRCUIT(circ)->n_circ_id,
+                                        service->onion_address) < 0 ||
+        queue_introduce2_work(service, circ, ip, &data, now) < 0) {
+      hs_metrics_reject_intro_req(service,
+                                  HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
       goto done;
     }
-
-    /* Track the total effort in valid requests received this period */
-    service->state.pow_state->total_effort += data.rdv_data.pow_effort;
-
-    /* Successfully added rend circuit to priority queue. */
     ret = 0;
     goto done;
   }
 
-  /* Launch rendezvous circuit with the onion key and rend cookie. */
-  launch_rendezvous_point_circuit(service, &ip->auth_key_kp.pubkey,
-                                  &ip->enc_key_kp, &data.rdv_data, now);
-  /* Success. */
-  ret = 0;
+  if (hs_cell_parse_introduce2(&data, circ, service, ip) < 0) {
+    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
+    goto done;
+  }
+
+  ret = handle_verified_introduce2(service, ip, &data, now, false);
 
  done:
   /* Note that if PoW defenses are enabled, this is NULL. */
@@ -229,8 +229,8 @@ purge_hid_serv_request(const ed25519_public_key_t *identity_pk)
    * to a new time period meaning that we won't be able to purge the request
    * from the previous time period. That is fine because they will expire at
    * some point and we don't care about those anymore. */
-  hs_build_blinded_pubkey(identity_pk, NULL, 0,
-                          hs_get_time_period_num(0), &blinded_pk);
+  hs_get_blinded_keys_cached(identity_pk, hs_get_time_period_num(0),
+                          &blinded_pk, NULL);
   ed25519_public_to_base64(base64_blinded_pk, &blinded_pk);
   /* Purge last hidden service request from cache for this blinded key. */
   hs_purge_hid_serv_from_last_hid_serv_requests(base64_blinded_pk);
@@ -400,8 +400,8 @@ directory_launch_v3_desc_fetch(const ed25519_public_key_t *onion_identity_pk,
   qed_hs_assert(onion_identity_pk);
 
   /* Get blinded pubkey */
-  hs_build_blinded_pubkey(onion_identity_pk, NULL, 0,
-                          current_time_period, &blinded_pubkey);
+  hs_get_blinded_keys_cached(onion_identity_pk, current_time_period,
+                          &blinded_pubkey, NULL);
   /* ...and base64 it. */
   ed25519_public_to_base64(base64_blinded_pubkey, &blinded_pubkey);
 
@@ -451,8 +451,8 @@ pick_hsdir_v3(const ed25519_public_key_t *onion_identity_pk)
   qed_hs_assert(onion_identity_pk);
 
   /* Get blinded pubkey of hidden service */
-  hs_build_blinded_pubkey(onion_identity_pk, NULL, 0,
-                          current_time_period, &blinded_pubkey);
+  hs_get_blinded_keys_cached(onion_identity_pk, current_time_period,
+                          &blinded_pubkey, NULL);
   /* ...and base64 it. */
   ed25519_public_to_base64(base64_blinded_pubkey, &blinded_pubkey);
 
@@ -1649,9 +1649,17 @@ client_dir_fetch_200(dir_connection_t *dir_conn,
   qed_hs_assert(entry_conns);
   qed_hs_assert(body);
 
-  /* We got something: Try storing it in the cache. */
-  decode_status = hs_cache_store_as_client(body,
-                                           &dir_conn->hs_ident->identity_pk);
+  /* We got something: Try storing it in the cache. If nobody is waiting for
+   * it (for instance, it was fetched with HSFETCH), only check its plaintext
+   * layer now, and decrypt it when we first need its introduction points. */
+  if (smartlist_len(entry_conns) > 0) {
+    decode_status =
+      hs_cache_store_as_client(body, &dir_conn->hs_ident->identity_pk);
+  } else {
+    decode_status =
+      hs_cache_store_undecoded_as_client(body,
+                                         &dir_conn->hs_ident->identity_pk);
+  }
   switch (decode_status) {
   case HS_DESC_DECODE_OK:
   case HS_DESC_DECODE_NEED_CLIENT_AUTH:
@@ -2148,6 +2156,35 @@ hs_desc_decode_status_t
 hs_client_decode_descriptor(const char *desc_str,
                             const ed25519_public_key_t *service_identity_pk,
                             hs_descriptor_t **desc)
+{
+  hs_desc_decode_status_t ret;
+  hs_desc_plaintext_data_t plaintext;
+
+  qed_hs_assert(desc_str);
+  qed_hs_assert(service_identity_pk);
+  qed_hs_assert(desc);
+
+  memset(&plaintext, 0, sizeof(plaintext));
+  ret = hs_client_check_descriptor_plaintext(desc_str, service_identity_pk,
+                                             &plaintext);
+  if (ret != HS_DESC_DECODE_OK) {
+    *desc = NULL;
+    return ret;
+  }
+  return hs_client_decrypt_descriptor(&plaintext, service_identity_pk, desc);
+}
+
+/** Decrypt the descriptor of the service with key <b>service_identity_pk</b>
+ * whose <b>plaintext</b> layer was already checked by
+ * hs_client_check_descriptor_plaintext(), and set the desc pointer with a
+ * newly allocated descriptor object. The contents of <b>plaintext</b> are
+ * taken over (and it is left zeroed) whatever the outcome.
+ *
+ * Return values are the same as for hs_client_decode_descriptor(). */
+hs_desc_decode_status_t
+hs_client_decrypt_descriptor(hs_desc_plaintext_data_t *plaintext,
+                             const ed25519_public_key_t *service_identity_pk,
+                             hs_descriptor_t **desc)
 {
   hs_desc_decode_status_t ret;
   hs_subcredential_t subcredential;
@@ -2155,7 +2192,7 @@ hs_client_decode_descriptor(const char *desc_str,
   hs_client_service_authorization_t *client_auth = NULL;
   curve25519_secret_key_t *client_auth_sk = NULL;
 
-  qed_hs_assert(desc_str);
+  qed_hs_assert(plaintext);
   qed_hs_assert(service_identity_pk);
   qed_hs_assert(desc);
 
@@ -2166,36 +2203,62 @@ hs_client_decode_descriptor(const char *desc_str,
   }
 
   /* Create subcredential for this HS so that we can decrypt */
-  {
-    uint64_t current_time_period = hs_get_time_period_num(0);
-    hs_build_blinded_pubkey(service_identity_pk, NULL, 0, current_time_period,
-                            &blinded_pubkey);
-    hs_get_subcredential(service_identity_pk, &blinded_pubkey, &subcredential);
-  }
+  hs_get_blinded_keys_cached(service_identity_pk, hs_get_time_period_num(0),
+                          &blinded_pubkey, &subcredential);
 
-  /* Parse descriptor */
-  ret = hs_desc_decode_descriptor(desc_str, &subcredential,
-                                  client_auth_sk, desc);
+  /* Decrypt the descriptor. Its signing key was cross certified with the
+   * blinded key when we checked the plaintext. */
+  ret = hs_desc_decrypt_descriptor(plaintext, &subcredential,
+                                   client_auth_sk, desc);
   memwipe(&subcredential, 0, sizeof(subcredential));
+  return ret;
+}
+
+/** With the given encoded descriptor in desc_str and the service key in
+ * service_identity_pk, decode only the plaintext layer of the descriptor and
+ * check that its signing key is certified by the service's blinded key, so
+ * that we know the descriptor is authentic without decrypting it. Without
+ * this validation, anyone knowing the subcredential and onion address can
+ * forge a descriptor.
+ *
+ * On success, return HS_DESC_DECODE_OK and fill <b>plaintext_out</b>, whose
+ * contents the caller must free, or pass on to
+ * hs_client_decrypt_descriptor(). Otherwise return an error status and
+ * leave <b>plaintext_out</b> zeroed. */
+hs_desc_decode_status_t
+hs_client_check_descriptor_plaintext(
+                     const char *desc_str,
+                     const ed25519_public_key_t *service_identity_pk,
+                     hs_desc_plaintext_data_t *plaintext_out)
+{
+  hs_desc_decode_status_t ret;
+  ed25519_public_key_t blinded_pubkey;
+
+  qed_hs_assert(desc_str);
+  qed_hs_assert(service_identity_pk);
+  qed_hs_assert(plaintext_out);
+
+  memset(plaintext_out, 0, sizeof(*plaintext_out));
+  ret = hs_desc_decode_plaintext(desc_str, plaintext_out);
   if (ret != HS_DESC_DECODE_OK) {
     goto err;
   }
 
-  /* Make sure the descriptor signing key cross certifies with the computed
-   * blinded key. Without this validation, anyone knowing the subcredential
-   * and onion address can forge a descriptor. */
-  qed_hs_cert_t *cert = (*desc)->plaintext_data.signing_key_cert;
-  if (qed_hs_cert_checksig(cert,
+  hs_get_blinded_keys_cached(service_identity_pk, hs_get_time_period_num(0),
+                          &blinded_pubkey, NULL);
+  if (qed_hs_cert_checksig(plaintext_out->signing_key_cert,
                         &blinded_pubkey, approx_time()) < 0) {
     log_warn(LD_GENERAL, "Descriptor signing key certificate signature "
              "doesn't validate with computed blinded key: %s",
-             qed_hs_cert_describe_signature_status(cert));
+             qed_hs_cert_describe_signature_status(
+                                        plaintext_out->signing_key_cert));
     ret = HS_DESC_DECODE_GENERIC_ERROR;
     goto err;
   }
-
   return HS_DESC_DECODE_OK;
+
  err:
+  hs_desc_plaintext_data_free_contents(plaintext_out);
   return ret;
 }
 
@@ -2762,6 +2825,8 @@ hs_client_purge_state(void)
   hs_purge_last_hid_serv_requests();
   /* Purge ephemeral client authorization. */
   purge_ephemeral_client_auth();
+  /* Forget which services we derived blinded keys for. */
+  hs_blinded_keys_cache_free_all();
 
   log_info(LD_REND, "Hidden service client state has been purged.");
 }
@@ -114,6 +114,14 @@ hs_desc_decode_status_t hs_client_decode_descriptor(
                      const char *desc_str,
                      const ed25519_public_key_t *service_identity_pk,
                      hs_descriptor_t **desc);
+hs_desc_decode_status_t hs_client_decrypt_descriptor(
+                     hs_desc_plaintext_data_t *plaintext,
+                     const ed25519_public_key_t *service_identity_pk,
+                     hs_descriptor_t **desc);
+hs_desc_decode_status_t hs_client_check_descriptor_plaintext(
+                     const char *desc_str,
+                     const ed25519_public_key_t *service_identity_pk,
+                     hs_desc_plaintext_data_t *plaintext_out);
 int hs_client_any_intro_points_usable(const ed25519_public_key_t *service_pk,
                                       const hs_descriptor_t *desc);
 int hs_client_refetch_hsdesc(const ed25519_public_key_t *identity_pk);
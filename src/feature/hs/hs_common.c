@@ -22,6 +22,7 @@
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/hs/hs_ob.h"
+#include "feature/hs/hs_pow.h"
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_service.h"
 #include "feature/dynhost/dynhost_handlers.h"
@@ -945,6 +946,138 @@ hs_build_blinded_pubkey(const ed25519_public_key_t *pk,
   memwipe(param, 0, sizeof(param));
 }
 
+/** A service's blinded public key and subcredential for one time period. */
+typedef struct hs_blinded_keys_t {
+  /** Time period number and length that blinded_pk was derived for. A zero
+   * length means this slot is unused. */
+  uint64_t time_period_num;
+  uint64_t time_period_length;
+  /** Blinded public key of the service for that time period. */
+  ed25519_public_key_t blinded_pk;
+  /** Subcredential derived from the identity key and blinded_pk. */
+  hs_subcredential_t subcredential;
+} hs_blinded_keys_t;
+
+/** The blinded keys we remember for one service. Clients use both the
+ * current and the next time period around a period boundary, so like the
+ * disaster SRV cache we keep two of them. */
+typedef struct hs_blinded_keys_entry_t {
+  hs_blinded_keys_t keys[2];
+} hs_blinded_keys_entry_t;
+
+/** Map from service identity public key to the hs_blinded_keys_entry_t
+ * holding the blinded keys we last derived for it. Blinding a key is a
+ * scalar multiplication, and a client does it for the same service every
+ * time it fetches, picks an HSDir or decodes a descriptor, so we remember
+ * the result for each time period. */
+static digest256map_t *blinded_keys_cache = NULL;
+
+/** Upper bound on the number of entries in blinded_keys_cache. When we hit
+ * it, we simply start over: this is a cache of cheap-to-rebuild values. */
+#define BLINDED_KEYS_CACHE_MAX 1024
+
+/** Helper: free a hs_blinded_keys_entry_t passed as a void pointer. */
+static void
+hs_blinded_keys_entry_free_void(void *ptr)
+{
+  hs_blinded_keys_entry_t *entry = ptr;
+  if (entry) {
+    memwipe(entry, 0, sizeof(*entry));
+    qed_hs_free(entry);
+  }
+}
+
+/** Forget every blinded key we have cached. */
+void
+hs_blinded_keys_cache_free_all(void)
+{
+  digest256map_free(blinded_keys_cache, hs_blinded_keys_entry_free_void);
+}
+
+/** Return the cached blinded keys of the service with identity key
+ * <b>identity_pk</b> for <b>time_period_num</b> with the current time period
+ * length, or NULL if we don't have them. */
+STATIC const hs_blinded_keys_t *
+hs_blinded_keys_cache_lookup(const ed25519_public_key_t *identity_pk,
+                             uint64_t time_period_num)
+{
+  hs_blinded_keys_entry_t *entry;
+  uint64_t time_period_length = get_time_period_length();
+
+  qed_hs_assert(identity_pk);
+
+  if (!blinded_keys_cache) {
+    return NULL;
+  }
+  entry = digest256map_get(blinded_keys_cache, identity_pk->pubkey);
+  if (!entry) {
+    return NULL;
+  }
+  for (unsigned i = 0; i < ARRAY_LENGTH(entry->keys); i++) {
+    if (entry->keys[i].time_period_num == time_period_num &&
+        entry->keys[i].time_period_length == time_period_length) {
+      return &entry->keys[i];
+    }
+  }
+  return NULL;
+}
+
+/** Put the blinded public key of the service with identity key
+ * <b>identity_pk</b> for <b>time_period_num</b> in <b>blinded_pk_out</b>,
+ * and, if <b>subcred_out</b> is not NULL, the matching subcredential in it.
+ * This gives the same result as hs_build_blinded_pubkey() with no secret
+ * followed by hs_get_subcredential(), but reuses the result computed for
+ * this service and time period if it is one of the last two we used. */
+void
+hs_get_blinded_keys_cached(const ed25519_public_key_t *identity_pk,
+                           uint64_t time_period_num,
+                           ed25519_public_key_t *blinded_pk_out,
+                           hs_subcredential_t *subcred_out)
+{
+  const hs_blinded_keys_t *keys;
+
+  qed_hs_assert(identity_pk);
+  qed_hs_assert(blinded_pk_out);
+
+  keys = hs_blinded_keys_cache_lookup(identity_pk, time_period_num);
+  if (!keys) {
+    hs_blinded_keys_entry_t *entry = NULL;
+    hs_blinded_keys_t *slot;
+
+    if (!blinded_keys_cache) {
+      blinded_keys_cache = digest256map_new();
+    } else {
+      entry = digest256map_get(blinded_keys_cache, identity_pk->pubkey);
+    }
+    if (!entry) {
+      if (digest256map_size(blinded_keys_cache) >= BLINDED_KEYS_CACHE_MAX) {
+        hs_blinded_keys_cache_free_all();
+        blinded_keys_cache = digest256map_new();
+      }
+      entry = qed_hs_malloc_zero(sizeof(*entry));
+      digest256map_set(blinded_keys_cache, identity_pk->pubkey, entry);
+    }
+    /* Replace the lower period number. An unused slot has period 0. */
+    if (entry->keys[0].time_period_num <= entry->keys[1].time_period_num) {
+      slot = &entry->keys[0];
+    } else {
+      slot = &entry->keys[1];
+    }
+    slot->time_period_num = time_period_num;
+    slot->time_period_length = get_time_period_length();
+    hs_build_blinded_pubkey(identity_pk, NULL, 0, time_period_num,
+                            &slot->blinded_pk);
+    hs_get_subcredential(identity_pk, &slot->blinded_pk,
+                         &slot->subcredential);
+    keys = slot;
+  }
+
+  ed25519_pubkey_copy(blinded_pk_out, &keys->blinded_pk);
+  if (subcred_out) {
+    memcpy(subcred_out, &keys->subcredential, sizeof(*subcred_out));
+  }
+}
+
 /** From a given ed25519 keypair kp and an optional secret, compute a blinded
  * keypair for the current time period and put it in blinded_kp_out. This is
  * only useful by the service side because the client doesn't have access to
@@ -1704,6 +1837,7 @@ hs_init(void)
   hs_circuitmap_init();
   hs_service_init();
   hs_cache_init();
+  hs_pow_init();
 }
 
 /** Release and cleanup all memory of the HS subsystem (all version). This is
@@ -1716,6 +1850,8 @@ hs_free_all(void)
   hs_cache_free_all();
   hs_client_free_all();
   hs_ob_free_all();
+  hs_pow_free_all();
+  hs_blinded_keys_cache_free_all();
 }
 
 /** For the given origin circuit circ, decrement the number of rendezvous
@@ -197,6 +197,12 @@ struct hs_subcredential_t;
 void hs_get_subcredential(const struct ed25519_public_key_t *identity_pk,
                           const struct ed25519_public_key_t *blinded_pk,
                           struct hs_subcredential_t *subcred_out);
+void hs_get_blinded_keys_cached(
+                          const struct ed25519_public_key_t *identity_pk,
+                          uint64_t time_period_num,
+                          struct ed25519_public_key_t *blinded_pk_out,
+                          struct hs_subcredential_t *subcred_out);
+void hs_blinded_keys_cache_free_all(void);
 
 uint64_t hs_get_previous_time_period_num(time_t now);
 uint64_t hs_get_time_period_num(time_t now);
@@ -257,6 +263,7 @@ link_specifier_t *link_specifier_dup(const link_specifier_t *src);
 #ifdef HS_COMMON_PRIVATE
 
 struct ed25519_public_key_t;
+struct hs_blinded_keys_t;
 
 STATIC void get_disaster_srv(uint64_t time_period_num, uint8_t *srv_out);
 STATIC void build_blinded_key_param(
@@ -280,6 +287,10 @@ STATIC uint64_t get_time_period_length(void);
 STATIC uint8_t *get_first_cached_disaster_srv(void);
 STATIC uint8_t *get_second_cached_disaster_srv(void);
 
+STATIC const struct hs_blinded_keys_t *hs_blinded_keys_cache_lookup(
+                        const struct ed25519_public_key_t *identity_pk,
+                        uint64_t time_period_num);
+
 #endif /* defined(QED_HS_UNIT_TESTS) */
 
 #endif /* defined(HS_COMMON_PRIVATE) */
@@ -2659,9 +2659,9 @@ static hs_desc_decode_status_t
 
 /** Fully decode the given descriptor plaintext and store the data in the
  * plaintext data object. */
-hs_desc_decode_status_t
-hs_desc_decode_plaintext(const char *encoded,
-                         hs_desc_plaintext_data_t *plaintext)
+MOCK_IMPL(hs_desc_decode_status_t,
+hs_desc_decode_plaintext,(const char *encoded,
+                          hs_desc_plaintext_data_t *plaintext))
 {
   int ok = 0;
   hs_desc_decode_status_t ret = HS_DESC_DECODE_PLAINTEXT_ERROR;
@@ -2731,24 +2731,28 @@ hs_desc_decode_plaintext(const char *encoded,
   return ret;
 }
 
-/** Fully decode an encoded descriptor and set a newly allocated descriptor
- * object in desc_out.  Client secret key is used to decrypt the "encrypted"
- * section if not NULL else it's ignored.
- *
- * Return 0 on success. A negative value is returned on error and desc_out is
- * set to NULL. */
-hs_desc_decode_status_t
-hs_desc_decode_descriptor(const char *encoded,
-                          const hs_subcredential_t *subcredential,
-                          const curve25519_secret_key_t *client_auth_sk,
-                          hs_descriptor_t **desc_out)
+/** Helper for hs_desc_decode_descriptor() and hs_desc_decrypt_descriptor():
+ * build a descriptor object in desc_out from either the <b>encoded</b>
+ * descriptor or, if it is NULL, the already decoded <b>plaintext</b> layer,
+ * whose contents we take over. */
+static hs_desc_decode_status_t
+desc_decode_descriptor(const char *encoded,
+                       hs_desc_plaintext_data_t *plaintext,
+                       const hs_subcredential_t *subcredential,
+                       const curve25519_secret_key_t *client_auth_sk,
+                       hs_descriptor_t **desc_out)
 {
   hs_desc_decode_status_t ret = HS_DESC_DECODE_GENERIC_ERROR;
   hs_descriptor_t *desc;
 
-  qed_hs_assert(encoded);
+  qed_hs_assert(encoded || plaintext);
 
   desc = qed_hs_malloc_zero(sizeof(hs_descriptor_t));
+  if (plaintext) {
+    /* From now on, the plaintext data is freed along with desc. */
+    memcpy(&desc->plaintext_data, plaintext, sizeof(desc->plaintext_data));
+    memset(plaintext, 0, sizeof(*plaintext));
+  }
 
   /* Subcredentials are not optional. */
   if (BUG(!subcredential ||
@@ -2759,9 +2763,11 @@ hs_desc_decode_descriptor(const char *encoded,
 
   memcpy(&desc->subcredential, subcredential, sizeof(desc->subcredential));
 
-  ret = hs_desc_decode_plaintext(encoded, &desc->plaintext_data);
-  if (ret != HS_DESC_DECODE_OK) {
-    goto err;
+  if (!plaintext) {
+    ret = hs_desc_decode_plaintext(encoded, &desc->plaintext_data);
+    if (ret != HS_DESC_DECODE_OK) {
+      goto err;
+    }
   }
 
   ret = hs_desc_decode_superencrypted(desc, &desc->superencrypted_data);
@@ -2791,6 +2797,41 @@ hs_desc_decode_descriptor(const char *encoded,
   return ret;
 }
 
+/** Fully decode an encoded descriptor and set a newly allocated descriptor
+ * object in desc_out.  Client secret key is used to decrypt the "encrypted"
+ * section if not NULL else it's ignored.
+ *
+ * Return 0 on success. A negative value is returned on error and desc_out is
+ * set to NULL. */
+hs_desc_decode_status_t
+hs_desc_decode_descriptor(const char *encoded,
+                          const hs_subcredential_t *subcredential,
+                          const curve25519_secret_key_t *client_auth_sk,
+                          hs_descriptor_t **desc_out)
+{
+  qed_hs_assert(encoded);
+
+  return desc_decode_descriptor(encoded, NULL, subcredential,
+                                client_auth_sk, desc_out);
+}
+
+/** Like hs_desc_decode_descriptor(), but start from a <b>plaintext</b> layer
+ * that hs_desc_decode_plaintext() already decoded, so that we don't parse
+ * it and check its signature again. The contents of <b>plaintext</b> are
+ * moved into the new descriptor, or freed on error; either way, it is left
+ * zeroed. */
+hs_desc_decode_status_t
+hs_desc_decrypt_descriptor(hs_desc_plaintext_data_t *plaintext,
+                           const hs_subcredential_t *subcredential,
+                           const curve25519_secret_key_t *client_auth_sk,
+                           hs_descriptor_t **desc_out)
+{
+  qed_hs_assert(plaintext);
+
+  return desc_decode_descriptor(NULL, plaintext, subcredential,
+                                client_auth_sk, desc_out);
+}
+
 /** Table of encode function version specific. The functions are indexed by the
  * version number so v3 callback is at index 3 in the array. */
 static int
@@ -2964,6 +3005,104 @@ hs_descriptor_free_(hs_descriptor_t *desc)
   qed_hs_free(desc);
 }
 
+/** Return a newly allocated deep copy of the descriptor intro point
+ * <b>ip</b>. */
+static hs_desc_intro_point_t *
+hs_desc_intro_point_dup(const hs_desc_intro_point_t *ip)
+{
+  hs_desc_intro_point_t *dup = hs_desc_intro_point_new();
+
+  SMARTLIST_FOREACH(ip->link_specifiers, const link_specifier_t *, ls,
+                    smartlist_add(dup->link_specifiers,
+                                  link_specifier_dup(ls)));
+  memcpy(&dup->onion_key, &ip->onion_key, sizeof(dup->onion_key));
+  memcpy(&dup->enc_key, &ip->enc_key, sizeof(dup->enc_key));
+  if (ip->auth_key_cert) {
+    dup->auth_key_cert = qed_hs_cert_dup(ip->auth_key_cert);
+  }
+  if (ip->enc_key_cert) {
+    dup->enc_key_cert = qed_hs_cert_dup(ip->enc_key_cert);
+  }
+  if (ip->legacy.key) {
+    dup->legacy.key = crypto_pk_dup_key(ip->legacy.key);
+  }
+  if (ip->legacy.cert.encoded) {
+    dup->legacy.cert.encoded = qed_hs_memdup(ip->legacy.cert.encoded,
+                                             ip->legacy.cert.len);
+    dup->legacy.cert.len = ip->legacy.cert.len;
+  }
+  dup->cross_certified = ip->cross_certified;
+  return dup;
+}
+
+/** Return a newly allocated deep copy of the descriptor <b>desc</b>. The copy
+ * shares no memory with <b>desc</b>, so it can be encoded on another thread
+ * while the original keeps changing. */
+hs_descriptor_t *
+hs_descriptor_dup(const hs_descriptor_t *desc)
+{
+  hs_descriptor_t *dup;
+
+  qed_hs_assert(desc);
+
+  dup = qed_hs_memdup(desc, sizeof(*desc));
+
+  /* Plaintext data. */
+  {
+    const hs_desc_plaintext_data_t *src = &desc->plaintext_data;
+    hs_desc_plaintext_data_t *dst = &dup->plaintext_data;
+    if (src->signing_key_cert) {
+      dst->signing_key_cert = qed_hs_cert_dup(src->signing_key_cert);
+    }
+    if (src->superencrypted_blob) {
+      dst->superencrypted_blob = qed_hs_memdup(src->superencrypted_blob,
+                                               src->superencrypted_blob_size);
+    }
+  }
+
+  /* Superencrypted data. */
+  {
+    const hs_desc_superencrypted_data_t *src = &desc->superencrypted_data;
+    hs_desc_superencrypted_data_t *dst = &dup->superencrypted_data;
+    if (src->clients) {
+      dst->clients = smartlist_new();
+      SMARTLIST_FOREACH(src->clients, const hs_desc_authorized_client_t *, c,
+                        smartlist_add(dst->clients,
+                                      qed_hs_memdup(c, sizeof(*c))));
+    }
+    if (src->encrypted_blob) {
+      dst->encrypted_blob = qed_hs_memdup(src->encrypted_blob,
+                                          src->encrypted_blob_size);
+    }
+  }
+
+  /* Encrypted data. */
+  {
+    const hs_desc_encrypted_data_t *src = &desc->encrypted_data;
+    hs_desc_encrypted_data_t *dst = &dup->encrypted_data;
+    if (src->intro_auth_types) {
+      dst->intro_auth_types = smartlist_new();
+      SMARTLIST_FOREACH(src->intro_auth_types, const char *, a,
+                        smartlist_add_strdup(dst->intro_auth_types, a));
+    }
+    if (src->flow_control_pv) {
+      dst->flow_control_pv = qed_hs_strdup(src->flow_control_pv);
+    }
+    if (src->pow_params) {
+      dst->pow_params = qed_hs_memdup(src->pow_params,
+                                      sizeof(*src->pow_params));
+    }
+    if (src->intro_points) {
+      dst->intro_points = smartlist_new();
+      SMARTLIST_FOREACH(src->intro_points, const hs_desc_intro_point_t *, ip,
+                        smartlist_add(dst->intro_points,
+                                      hs_desc_intro_point_dup(ip)));
+    }
+  }
+
+  return dup;
+}
+
 /** Return the size in bytes of the given plaintext data object. A sizeof() is
  * not enough because the object contains pointers and the encrypted blob.
  * This is particularly useful for our OOM subsystem that tracks the HSDir
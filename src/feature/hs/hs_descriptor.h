@@ -273,6 +273,7 @@ hs_desc_is_supported_version(uint32_t version)
 void hs_descriptor_free_(hs_descriptor_t *desc);
 #define hs_descriptor_free(desc) \
   FREE_AND_NULL(hs_descriptor_t, hs_descriptor_free_, (desc))
+hs_descriptor_t *hs_descriptor_dup(const hs_descriptor_t *desc);
 void hs_desc_plaintext_data_free_(hs_desc_plaintext_data_t *desc);
 #define hs_desc_plaintext_data_free(desc) \
   FREE_AND_NULL(hs_desc_plaintext_data_t, hs_desc_plaintext_data_free_, (desc))
@@ -296,8 +297,14 @@ hs_desc_decode_status_t hs_desc_decode_descriptor(const char *encoded,
                               const hs_subcredential_t *subcredential,
                               const curve25519_secret_key_t *client_auth_sk,
                               hs_descriptor_t **desc_out);
-hs_desc_decode_status_t hs_desc_decode_plaintext(const char *encoded,
-                             hs_desc_plaintext_data_t *plaintext);
+hs_desc_decode_status_t hs_desc_decrypt_descriptor(
+                              hs_desc_plaintext_data_t *plaintext,
+                              const hs_subcredential_t *subcredential,
+                              const curve25519_secret_key_t *client_auth_sk,
+                              hs_descriptor_t **desc_out);
+MOCK_DECL(hs_desc_decode_status_t,
+          hs_desc_decode_plaintext,(const char *encoded,
+                                    hs_desc_plaintext_data_t *plaintext));
 hs_desc_decode_status_t hs_desc_decode_superencrypted(
                                 const hs_descriptor_t *desc,
                                 hs_desc_superencrypted_data_t *desc_out);
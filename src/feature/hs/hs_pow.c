@@ -7,6 +7,8 @@
  * when a hidden service is defending against DoS attacks.
  **/
 
+#define HS_POW_PRIVATE
+
 #include <stdio.h>
 
 #include "core/or/or.h"
@@ -190,12 +192,121 @@ hs_pow_equix_option_flags(int CompiledProofOfWorkHash)
   }
 }
 
+/** Most idle verification contexts that we keep for reuse. */
+#define HS_POW_MAX_IDLE_VERIFY_CTX 16
+
+/** An idle Equi-X verification context and the flags it was made with. */
+typedef struct verify_ctx_entry_t {
+  equix_ctx *ctx;
+  equix_ctx_flags flags;
+} verify_ctx_entry_t;
+
+/** Lock protecting verify_ctx_pool. NULL until hs_pow_init() is called. */
+static qed_hs_mutex_t *verify_ctx_pool_lock = NULL;
+/** Idle verification contexts. Allocating a context maps pages for its
+ * compiled hash function, so we reuse contexts across verifications instead;
+ * each thread that is verifying holds one. */
+static verify_ctx_entry_t verify_ctx_pool[HS_POW_MAX_IDLE_VERIFY_CTX];
+/** Number of entries in use at the start of verify_ctx_pool. */
+static int verify_ctx_pool_len = 0;
+
+/** Return an Equi-X context for verifying with <b>flags</b>, reusing an idle
+ * one if we can. Give it back with verify_ctx_release(). Return NULL on
+ * failure. Safe to call from any thread. */
+static equix_ctx *
+verify_ctx_acquire(equix_ctx_flags flags)
+{
+  verify_ctx_entry_t ent = { NULL, 0 };
+
+  if (verify_ctx_pool_lock) {
+    qed_hs_mutex_acquire(verify_ctx_pool_lock);
+    if (verify_ctx_pool_len > 0) {
+      ent = verify_ctx_pool[--verify_ctx_pool_len];
+    }
+    qed_hs_mutex_release(verify_ctx_pool_lock);
+  }
+  if (ent.ctx && ent.flags != flags) {
+    /* The option changed since this context was made. */
+    equix_free(ent.ctx);
+    ent.ctx = NULL;
+  }
+  if (!ent.ctx) {
+    ent.ctx = equix_alloc(flags);
+  }
+  return ent.ctx;
+}
+
+/** Give back <b>ctx</b>, which was made with <b>flags</b> and returned by
+ * verify_ctx_acquire(), so that it can be reused. Safe to call from any
+ * thread. */
+static void
+verify_ctx_release(equix_ctx *ctx, equix_ctx_flags flags)
+{
+  if (!ctx) {
+    return;
+  }
+  if (verify_ctx_pool_lock) {
+    qed_hs_mutex_acquire(verify_ctx_pool_lock);
+    if (verify_ctx_pool_len < HS_POW_MAX_IDLE_VERIFY_CTX) {
+      verify_ctx_pool[verify_ctx_pool_len].ctx = ctx;
+      verify_ctx_pool[verify_ctx_pool_len].flags = flags;
+      ++verify_ctx_pool_len;
+      ctx = NULL;
+    }
+    qed_hs_mutex_release(verify_ctx_pool_lock);
+  }
+  equix_free(ctx);
+}
+
+/** Set up the pool of reusable verification contexts. Called on the main
+ * thread before any cpuworker verifies solutions; until then, each
+ * verification makes and frees its own context. */
+void
+hs_pow_init(void)
+{
+  if (!verify_ctx_pool_lock) {
+    verify_ctx_pool_lock = qed_hs_mutex_new_nonrecursive();
+  }
+}
+
+/** Free the pool of verification contexts, and the replay cache. Called on
+ * shutdown, on the main thread. */
+void
+hs_pow_free_all(void)
+{
+  if (verify_ctx_pool_lock) {
+    for (int i = 0; i < verify_ctx_pool_len; ++i) {
+      equix_free(verify_ctx_pool[i].ctx);
+    }
+    verify_ctx_pool_len = 0;
+    qed_hs_mutex_free(verify_ctx_pool_lock);
+  }
+  hs_pow_remove_seed_from_cache(NULL);
+  HT_CLEAR(nonce_cache_table_ht, &nonce_cache_table);
+}
+
 /** Solve the EquiX/blake2b PoW scheme using the parameters in pow_params, and
  * store the solution in pow_solution_out. Returns 0 on success and -1
  * otherwise. Called by a client, from a cpuworker thread. */
 int
 hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
              hs_pow_solution_t *pow_solution_out)
+{
+  return hs_pow_solve_cancellable(pow_inputs, NULL, pow_solution_out);
+}
+
+/** As hs_pow_solve(), but meant to run alongside other solvers working on
+ * the same inputs. Each solver starts from its own random nonce, so they
+ * search disjoint parts of the nonce space. If <b>cancel</b> is not NULL,
+ * give up as soon as it becomes nonzero, and make it nonzero when we find a
+ * solution so that the other solvers stop too.
+ *
+ * Returns 0 on success, 1 if we gave up because of <b>cancel</b>, and -1 on
+ * failure. Called by a client, from a cpuworker thread. */
+int
+hs_pow_solve_cancellable(const hs_pow_solver_inputs_t *pow_inputs,
+                         atomic_counter_t *cancel,
+                         hs_pow_solution_t *pow_solution_out)
 {
   int ret = -1;
   uint8_t nonce[HS_POW_NONCE_LEN];
@@ -227,6 +338,12 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
   log_info(LD_REND, "Solving proof of work (effort %u)", effort);
 
   for (;;) {
+    if (cancel && atomic_counter_get(cancel)) {
+      log_info(LD_REND, "Another thread solved the proof of work first.");
+      ret = 1;
+      goto end;
+    }
+
     /* Calculate solutions to S = equix_solve(C || N || E),  */
     equix_solutions_buffer buffer;
     equix_result result;
@@ -262,6 +379,8 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
                     (unsigned)(duration_usec % 1000000));
 
             /* Indicate success and we are done. */
+            if (cancel)
+              atomic_counter_add(cancel, 1);
             ret = 0;
             goto end;
           }
@@ -305,50 +424,76 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
   return ret;
 }
 
-/** Verify the solution in pow_solution using the service's current PoW
- * parameters found in pow_state. Returns 0 on success and -1 otherwise. Called
- * by the service. */
+/** Helper: Return the seed among <b>seed_current</b> and <b>seed_previous</b>
+ * that starts with <b>seed_head</b>, or NULL if neither does. */
+static const uint8_t *
+find_seed_by_head(const uint8_t *seed_current, const uint8_t *seed_previous,
+                  const uint8_t *seed_head)
+{
+  if (fast_memeq(seed_current, seed_head, HS_POW_SEED_HEAD_LEN)) {
+    return seed_current;
+  } else if (fast_memeq(seed_previous, seed_head, HS_POW_SEED_HEAD_LEN)) {
+    return seed_previous;
+  }
+  return NULL;
+}
+
+/** Helper: Return true iff the (nonce, seed) tuple of <b>pow_solution</b> is
+ * in the replay cache. */
+static bool
+nonce_cache_contains(const hs_pow_solution_t *pow_solution)
+{
+  nonce_cache_entry_t search;
+
+  memcpy(search.bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
+  memcpy(search.bytes.seed_head, pow_solution->seed_head,
+         HS_POW_SEED_HEAD_LEN);
+  return HT_FIND(nonce_cache_table_ht, &nonce_cache_table, &search) != NULL;
+}
+
+/** Helper: Add the (nonce, seed) tuple of <b>pow_solution</b> to the replay
+ * cache. */
+static void
+nonce_cache_add(const hs_pow_solution_t *pow_solution)
+{
+  nonce_cache_entry_t *entry = qed_hs_malloc_zero(sizeof(nonce_cache_entry_t));
+  memcpy(entry->bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
+  memcpy(entry->bytes.seed_head, pow_solution->seed_head,
+         HS_POW_SEED_HEAD_LEN);
+  HT_INSERT(nonce_cache_table_ht, &nonce_cache_table, entry);
+}
+
+/** Verify the solution in pow_solution against the seeds and blinded ID in
+ * <b>inputs</b>. This does not consult or update the replay cache, so it is
+ * safe to call from a cpuworker; the caller must follow a successful return
+ * with hs_pow_note_verified_solution() on the main thread. Returns 0 on
+ * success and -1 otherwise. */
 int
-hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
-              const hs_pow_service_state_t *pow_state,
-              const hs_pow_solution_t *pow_solution)
+hs_pow_verify_solution(const hs_pow_verifier_inputs_t *inputs,
+                       const hs_pow_solution_t *pow_solution)
 {
   int ret = -1;
   uint8_t *challenge = NULL;
-  nonce_cache_entry_t search, *entry = NULL;
   equix_ctx *ctx = NULL;
+  equix_ctx_flags flags = EQUIX_CTX_VERIFY;
   const uint8_t *seed = NULL;
 
-  qed_hs_assert(pow_state);
+  qed_hs_assert(inputs);
   qed_hs_assert(pow_solution);
-  qed_hs_assert(service_blinded_id);
-  qed_hs_assert_nonfatal(!ed25519_public_key_is_zero(service_blinded_id));
+  qed_hs_assert_nonfatal(
+    !ed25519_public_key_is_zero(&inputs->service_blinded_id));
 
   /* Find a valid seed C that starts with the seed head. Fail if no such seed
    * exists. */
-  if (fast_memeq(pow_state->seed_current, pow_solution->seed_head,
-                 HS_POW_SEED_HEAD_LEN)) {
-    seed = pow_state->seed_current;
-  } else if (fast_memeq(pow_state->seed_previous, pow_solution->seed_head,
-                        HS_POW_SEED_HEAD_LEN)) {
-    seed = pow_state->seed_previous;
-  } else {
+  seed = find_seed_by_head(inputs->seed_current, inputs->seed_previous,
+                           pow_solution->seed_head);
+  if (!seed) {
     log_warn(LD_REND, "Seed head didn't match either seed.");
     goto done;
   }
 
-  /* Fail if N = POW_NONCE is present in the replay cache. */
-  memcpy(search.bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
-  memcpy(search.bytes.seed_head, pow_solution->seed_head,
-         HS_POW_SEED_HEAD_LEN);
-  entry = HT_FIND(nonce_cache_table_ht, &nonce_cache_table, &search);
-  if (entry) {
-    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
-    goto done;
-  }
-
   /* Build the challenge with the params we have. */
-  challenge = build_equix_challenge(service_blinded_id, seed,
+  challenge = build_equix_challenge(&inputs->service_blinded_id, seed,
                                     pow_solution->nonce, pow_solution->effort);
 
   if (!validate_equix_challenge(challenge, pow_solution->equix_solution,
@@ -357,8 +502,11 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
     goto done;
   }
 
-  ctx = equix_alloc(EQUIX_CTX_VERIFY |
-    hs_pow_equix_option_flags(get_options()->CompiledProofOfWorkHash));
+  /* This may run on a cpuworker, so the option comes from inputs rather
+   * than from get_options(). */
+  flags = EQUIX_CTX_VERIFY |
+    hs_pow_equix_option_flags(inputs->CompiledProofOfWorkHash);
+  ctx = verify_ctx_acquire(flags);
   if (!ctx) {
     goto done;
   }
@@ -376,19 +524,76 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
   /* PoW verified successfully. */
   ret = 0;
 
-  /* Add the (nonce, seed) tuple to the replay cache. */
-  entry = qed_hs_malloc_zero(sizeof(nonce_cache_entry_t));
-  memcpy(entry->bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
-  memcpy(entry->bytes.seed_head, pow_solution->seed_head,
-         HS_POW_SEED_HEAD_LEN);
-  HT_INSERT(nonce_cache_table_ht, &nonce_cache_table, entry);
-
  done:
   qed_hs_free(challenge);
-  equix_free(ctx);
+  verify_ctx_release(ctx, flags);
   return ret;
 }
 
+/** Finish accepting pow_solution, which hs_pow_verify_solution() accepted
+ * using an earlier snapshot of pow_state. Fail if its seed has since been
+ * rotated out, or if its (nonce, seed) tuple is in the replay cache;
+ * otherwise add the tuple to the replay cache. Returns 0 on success and -1
+ * otherwise. Called by the service, on the main thread. */
+int
+hs_pow_note_verified_solution(const hs_pow_service_state_t *pow_state,
+                              const hs_pow_solution_t *pow_solution)
+{
+  qed_hs_assert(pow_state);
+  qed_hs_assert(pow_solution);
+
+  if (!find_seed_by_head(pow_state->seed_current, pow_state->seed_previous,
+                         pow_solution->seed_head)) {
+    log_info(LD_REND, "PoW seed was rotated out while we were verifying "
+                      "the solution.");
+    return -1;
+  }
+
+  /* Fail if N = POW_NONCE is present in the replay cache. */
+  if (nonce_cache_contains(pow_solution)) {
+    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
+    return -1;
+  }
+
+  nonce_cache_add(pow_solution);
+  return 0;
+}
+
+/** Verify the solution in pow_solution using the service's current PoW
+ * parameters found in pow_state. Returns 0 on success and -1 otherwise. Called
+ * by the service. */
+int
+hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
+              const hs_pow_service_state_t *pow_state,
+              const hs_pow_solution_t *pow_solution)
+{
+  hs_pow_verifier_inputs_t inputs;
+
+  qed_hs_assert(pow_state);
+  qed_hs_assert(pow_solution);
+  qed_hs_assert(service_blinded_id);
+
+  /* Check the replay cache first: it is far cheaper than verifying. */
+  if (nonce_cache_contains(pow_solution)) {
+    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
+    return -1;
+  }
+
+  memset(&inputs, 0, sizeof(inputs));
+  ed25519_pubkey_copy(&inputs.service_blinded_id, service_blinded_id);
+  memcpy(inputs.seed_current, pow_state->seed_current, HS_POW_SEED_LEN);
+  memcpy(inputs.seed_previous, pow_state->seed_previous, HS_POW_SEED_LEN);
+  inputs.CompiledProofOfWorkHash = get_options()->CompiledProofOfWorkHash;
+
+  if (hs_pow_verify_solution(&inputs, pow_solution) < 0) {
+    return -1;
+  }
+
+  /* Add the (nonce, seed) tuple to the replay cache. */
+  nonce_cache_add(pow_solution);
+  return 0;
+}
+
 /** Remove entries from the (nonce, seed) replay cache which are for the seed
  * beginning with seed_head. If seed_head is NULL, remove all cache entries. */
 void
@@ -417,11 +622,37 @@ hs_pow_free_service_state(hs_pow_service_state_t *state)
    Thread workers
    =====*/
 
+/** Most cpuworker threads that we'll have search for one solution. */
+#define HS_POW_MAX_SOLVER_JOBS 16
+
+/** Number of solver jobs, across all puzzles, that we have queued and not
+ * yet handled the reply for. */
+static unsigned int n_solver_jobs_pending = 0;
+
+/**
+ * The pow_worker_job_t objects that search in parallel for a solution to
+ * the same puzzle.
+ */
+typedef struct pow_solve_group_t {
+  /** Made nonzero by the first job to find a solution, so that the others
+   * stop searching. Shared with the worker threads. */
+  atomic_counter_t solved;
+  /** Number of jobs in this group whose reply we haven't handled yet. Only
+   * used in the main thread. */
+  unsigned int n_pending;
+  /** True once we have acted on a reply from this group, successful or not.
+   * Only used in the main thread. */
+  bool handled;
+} pow_solve_group_t;
+
 /**
  * An object passed to a worker thread that will try to solve the pow.
  */
 typedef struct pow_worker_job_t {
 
+  /** The group of jobs working on the same puzzle as this one. */
+  pow_solve_group_t *group;
+
   /** Inputs for the PoW solver (seed, chosen effort) */
   hs_pow_solver_inputs_t pow_inputs;
 
@@ -446,7 +677,8 @@ pow_worker_threadfn(void *state_, void *work_)
   pow_worker_job_t *job = work_;
   job->pow_solution_out = qed_hs_malloc_zero(sizeof(hs_pow_solution_t));
 
-  if (hs_pow_solve(&job->pow_inputs, job->pow_solution_out)) {
+  if (hs_pow_solve_cancellable(&job->pow_inputs, &job->group->solved,
+                               job->pow_solution_out)) {
     qed_hs_free(job->pow_solution_out);
     job->pow_solution_out = NULL; /* how we signal that we came up empty */
   }
@@ -465,6 +697,20 @@ pow_worker_job_free(pow_worker_job_t *job)
   qed_hs_free(job);
 }
 
+/**
+ * Helper: note that the reply for one job in <b>group</b> has been handled,
+ * and release the group once every job has replied.
+ */
+static void
+pow_solve_group_note_reply(pow_solve_group_t *group)
+{
+  qed_hs_assert(group->n_pending > 0);
+  if (--group->n_pending == 0) {
+    atomic_counter_destroy(&group->solved);
+    qed_hs_free(group);
+  }
+}
+
 /**
  * Worker function: This function runs in the main thread, and receives
  * a pow_worker_job_t that the worker thread has already processed.
@@ -476,6 +722,15 @@ pow_worker_replyfn(void *work_)
   qed_hs_assert(work_);
 
   pow_worker_job_t *job = work_;
+  pow_solve_group_t *group = job->group;
+
+  /* Only the first solution from a group is useful. If this job came up
+   * empty, wait for its siblings unless it is the last one. */
+  if (group->handled ||
+      (!job->pow_solution_out && group->n_pending > 1)) {
+    goto done;
+  }
+  group->handled = true;
 
   /* Look up the circuits that we're going to use this pow in.
    * There's room for improvement here. We already had a fast mapping to
@@ -533,11 +788,37 @@ pow_worker_replyfn(void *work_)
     }
   }
 
+ done:
+  qed_hs_assert(n_solver_jobs_pending > 0);
+  --n_solver_jobs_pending;
+  pow_solve_group_note_reply(group);
   pow_worker_job_free(job);
 }
 
 /**
- * Queue the job of solving the pow in a worker thread.
+ * Return the number of solver jobs to queue for a new puzzle.
+ *
+ * Solving takes a long time, and every cpuworker thread that is solving
+ * can't handle onion skins or anything else.  So we leave one thread free
+ * for other work, and share the rest among all the puzzles we are solving
+ * at once.  Every puzzle still gets at least one job.
+ */
+STATIC unsigned int
+hs_pow_get_n_solver_jobs(void)
+{
+  unsigned int n_threads = cpuworker_get_n_threads();
+  unsigned int max_jobs = n_threads > 1 ? n_threads - 1 : 1;
+
+  max_jobs = MIN(max_jobs, HS_POW_MAX_SOLVER_JOBS);
+  if (n_solver_jobs_pending >= max_jobs)
+    return 1;
+  return max_jobs - n_solver_jobs_pending;
+}
+
+/**
+ * Queue the job of solving the pow in worker threads. We split the search
+ * across as many jobs as hs_pow_get_n_solver_jobs() allows, and the first
+ * job to find a solution stops the others.
  */
 int
 hs_pow_queue_work(uint32_t intro_circ_identifier,
@@ -550,20 +831,38 @@ hs_pow_queue_work(uint32_t intro_circ_identifier,
   qed_hs_assert_nonfatal(
     !ed25519_public_key_is_zero(&pow_inputs->service_blinded_id));
 
-  pow_worker_job_t *job = qed_hs_malloc_zero(sizeof(*job));
-  job->intro_circ_identifier = intro_circ_identifier;
-  memcpy(&job->rend_circ_cookie, rend_circ_cookie,
-         sizeof job->rend_circ_cookie);
-  memcpy(&job->pow_inputs, pow_inputs, sizeof job->pow_inputs);
-
-  workqueue_entry_t *work;
-  work = cpuworker_queue_work(WQ_PRI_LOW,
-                              pow_worker_threadfn,
-                              pow_worker_replyfn,
-                              job);
-  if (!work) {
-    pow_worker_job_free(job);
+  unsigned int n_jobs = hs_pow_get_n_solver_jobs();
+
+  pow_solve_group_t *group = qed_hs_malloc_zero(sizeof(*group));
+  atomic_counter_init(&group->solved);
+
+  for (unsigned int i = 0; i < n_jobs; i++) {
+    pow_worker_job_t *job = qed_hs_malloc_zero(sizeof(*job));
+    job->group = group;
+    job->intro_circ_identifier = intro_circ_identifier;
+    memcpy(&job->rend_circ_cookie, rend_circ_cookie,
+           sizeof job->rend_circ_cookie);
+    memcpy(&job->pow_inputs, pow_inputs, sizeof job->pow_inputs);
+
+    workqueue_entry_t *work;
+    work = cpuworker_queue_work(WQ_PRI_LOW,
+                                pow_worker_threadfn,
+                                pow_worker_replyfn,
+                                job);
+    if (!work) {
+      pow_worker_job_free(job);
+      break;
+    }
+    group->n_pending++;
+    n_solver_jobs_pending++;
+  }
+
+  if (group->n_pending == 0) {
+    atomic_counter_destroy(&group->solved);
+    qed_hs_free(group);
     return -1;
   }
+  log_info(LD_REND, "Solving proof of work on %u cpuworker threads.",
+           group->n_pending);
   return 0;
 }
@@ -14,6 +14,7 @@
 #include "lib/evloop/token_bucket.h"
 #include "lib/smartlist_core/smartlist_core.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/thread/threads.h"
 
 /* Service updates the suggested effort every HS_UPDATE_PERIOD seconds.
  * This parameter controls how often we can change hs descriptor data to
@@ -88,6 +89,20 @@ typedef struct hs_pow_solver_inputs_t {
   int CompiledProofOfWorkHash;
 } hs_pow_solver_inputs_t;
 
+/** The inputs a service needs to verify a PoW solution away from the main
+ * thread: a snapshot of the seeds from its PoW state, and the options that
+ * matter to the verifier. */
+typedef struct hs_pow_verifier_inputs_t {
+  /** Blinded public ID of the descriptor the solution was made for. */
+  ed25519_public_key_t service_blinded_id;
+  /** The service's current seed. */
+  uint8_t seed_current[HS_POW_SEED_LEN];
+  /** The service's previous seed, which we still accept. */
+  uint8_t seed_previous[HS_POW_SEED_LEN];
+  /** Configuration option, choice of hash implementation. AUTOBOOL. */
+  int CompiledProofOfWorkHash;
+} hs_pow_verifier_inputs_t;
+
 /** State and parameters of PoW defenses, stored in the service state. */
 typedef struct hs_pow_service_state_t {
   /* If PoW defenses are enabled this is a priority queue containing acceptable
@@ -165,18 +180,31 @@ typedef struct hs_pow_solution_t {
 /* API */
 int hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
                  hs_pow_solution_t *pow_solution_out);
+int hs_pow_solve_cancellable(const hs_pow_solver_inputs_t *pow_inputs,
+                             atomic_counter_t *cancel,
+                             hs_pow_solution_t *pow_solution_out);
 
 int hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
                   const hs_pow_service_state_t *pow_state,
                   const hs_pow_solution_t *pow_solution);
+int hs_pow_verify_solution(const hs_pow_verifier_inputs_t *inputs,
+                           const hs_pow_solution_t *pow_solution);
+int hs_pow_note_verified_solution(const hs_pow_service_state_t *pow_state,
+                                  const hs_pow_solution_t *pow_solution);
 
 void hs_pow_remove_seed_from_cache(const uint8_t *seed_head);
 void hs_pow_free_service_state(hs_pow_service_state_t *state);
+void hs_pow_init(void);
+void hs_pow_free_all(void);
 
 int hs_pow_queue_work(uint32_t intro_circ_identifier,
                       const uint8_t *rend_circ_cookie,
                       const hs_pow_solver_inputs_t *pow_inputs);
 
+#ifdef HS_POW_PRIVATE
+STATIC unsigned int hs_pow_get_n_solver_jobs(void);
+#endif
+
 #else /* !defined(HAVE_MODULE_POW) */
 #define have_module_pow() (0)
 
@@ -189,6 +217,17 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
   return -1;
 }
 
+static inline int
+hs_pow_solve_cancellable(const hs_pow_solver_inputs_t *pow_inputs,
+                         atomic_counter_t *cancel,
+                         hs_pow_solution_t *pow_solution_out)
+{
+  (void)pow_inputs;
+  (void)cancel;
+  (void)pow_solution_out;
+  return -1;
+}
+
 static inline int
 hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
               const hs_pow_service_state_t *pow_state,
@@ -200,6 +239,24 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
   return -1;
 }
 
+static inline int
+hs_pow_verify_solution(const hs_pow_verifier_inputs_t *inputs,
+                       const hs_pow_solution_t *pow_solution)
+{
+  (void)inputs;
+  (void)pow_solution;
+  return -1;
+}
+
+static inline int
+hs_pow_note_verified_solution(const hs_pow_service_state_t *pow_state,
+                              const hs_pow_solution_t *pow_solution)
+{
+  (void)pow_state;
+  (void)pow_solution;
+  return -1;
+}
+
 static inline void
 hs_pow_remove_seed_from_cache(const uint8_t *seed_head)
 {
@@ -212,6 +269,16 @@ hs_pow_free_service_state(hs_pow_service_state_t *state)
   (void)state;
 }
 
+static inline void
+hs_pow_init(void)
+{
+}
+
+static inline void
+hs_pow_free_all(void)
+{
+}
+
 static inline int
 hs_pow_queue_work(uint32_t intro_circ_identifier,
                   const uint8_t *rend_circ_cookie,
@@ -13,6 +13,7 @@
 #include "app/config/config.h"
 #include "app/config/statefile.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -34,6 +35,7 @@
 #include "lib/crypt_ops/crypto_ope.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/time/tvdiff.h"
 #include "lib/time/compat_time.h"
 
@@ -643,6 +645,15 @@ service_intro_point_find(const hs_service_t *service,
   return ip;
 }
 
+/** For a given service and authentication key, return the intro point or NULL
+ * if not found. */
+hs_service_intro_point_t *
+hs_service_find_intro_point(const hs_service_t *service,
+                            const ed25519_public_key_t *auth_key)
+{
+  return service_intro_point_find(service, auth_key);
+}
+
 /** For a given service and intro point, return the descriptor for which the
  * intro point is assigned to. NULL is returned if not found. */
 STATIC hs_service_descriptor_t *
@@ -3125,15 +3136,15 @@ run_build_circuit_event(time_t now)
   } FOR_EACH_SERVICE_END;
 }
 
-/** Encode and sign the service descriptor desc and upload it to the given
- * hidden service directory.  This does nothing if PublishHidServDescriptors
- * is false. */
+/** Upload the service descriptor desc, already encoded and signed in
+ * <b>encoded_desc</b>, to the given hidden service directory.  This does
+ * nothing if PublishHidServDescriptors is false or if <b>encoded_desc</b> is
+ * NULL because we couldn't encode the descriptor. */
 static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
-                           hs_service_descriptor_t *desc, const node_t *hsdir)
+                           hs_service_descriptor_t *desc, const node_t *hsdir,
+                           const char *encoded_desc)
 {
-  char *encoded_desc = NULL;
-
   qed_hs_assert(service);
   qed_hs_assert(desc);
   qed_hs_assert(hsdir);
@@ -3146,10 +3157,7 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
     goto end;
   }
 
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
+  if (!encoded_desc) {
     goto end;
   }
 
@@ -3187,7 +3195,6 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
   }
 
  end:
-  qed_hs_free(encoded_desc);
   return;
 }
 
@@ -3264,13 +3271,14 @@ set_descriptor_revision_counter(hs_service_descriptor_t *hs_desc, time_t now,
   hs_desc->desc->plaintext_data.revision_counter = rev_counter;
 }
 
-/** Encode and sign the service descriptor desc and upload it to the
- * responsible hidden service directories. If for_next_period is true, the set
- * of directories are selected using the next hsdir_index. This does nothing
- * if PublishHidServDescriptors is false. */
-STATIC void
-upload_descriptor_to_all(const hs_service_t *service,
-                         hs_service_descriptor_t *desc)
+/** Upload the service descriptor desc, already encoded and signed in
+ * <b>encoded_desc</b>, to the responsible hidden service directories. If
+ * <b>desc</b> is the service's next descriptor, the set of directories is
+ * selected using the next hsdir_index. */
+static void
+upload_encoded_descriptor_to_all(const hs_service_t *service,
+                                 hs_service_descriptor_t *desc,
+                                 const char *encoded_desc)
 {
   smartlist_t *responsible_dirs = NULL;
 
@@ -3303,12 +3311,19 @@ upload_descriptor_to_all(const hs_service_t *service,
      * routerstatus_t found in the consensus else we have a problem. */
     qed_hs_assert(hsdir_node);
     /* Upload this descriptor to the chosen directory. */
-    upload_descriptor_to_hsdir(service, desc, hsdir_node);
+    upload_descriptor_to_hsdir(service, desc, hsdir_node, encoded_desc);
   } SMARTLIST_FOREACH_END(hsdir_rs);
 
-  /* Set the next upload time for this descriptor. Even if we are configured
-   * to not upload, we still want to follow the right cycle of life for this
-   * descriptor. */
+  smartlist_free(responsible_dirs);
+}
+
+/** Set the next upload time of the descriptor <b>desc</b> of
+ * <b>service</b>. Even if we are configured to not upload, we still want to
+ * follow the right cycle of life for this descriptor. */
+static void
+set_descriptor_next_upload_time(const hs_service_t *service,
+                                hs_service_descriptor_t *desc)
+{
   desc->next_upload_time =
     (time(NULL) + crypto_rand_int_range(HS_SERVICE_NEXT_UPLOAD_TIME_MIN,
                                         HS_SERVICE_NEXT_UPLOAD_TIME_MAX));
@@ -3318,9 +3333,179 @@ upload_descriptor_to_all(const hs_service_t *service,
     log_debug(LD_REND, "Service %s set to upload a descriptor at %s",
               safe_str_client(service->onion_address), fmt_next_time);
   }
+}
 
-  smartlist_free(responsible_dirs);
-  return;
+/** A descriptor that we encode and sign on a cpuworker before uploading it.
+ * The main thread identifies the service descriptor it came from by the
+ * service identity key, the blinded key and the job id, since the service
+ * can be reconfigured or its descriptors rotated while the job is queued. */
+typedef struct desc_encode_job_t {
+  /** Identity key of the service. */
+  ed25519_public_key_t identity_pk;
+  /** Blinded key of the descriptor. */
+  ed25519_public_key_t blinded_pk;
+  /** Value of encode_job_id in the service descriptor when we queued this
+   * job. */
+  uint64_t job_id;
+
+  /* Inputs: a copy of the descriptor and what we need to encode it. */
+  hs_descriptor_t *desc;
+  ed25519_keypair_t signing_kp;
+  uint8_t descriptor_cookie[HS_DESC_DESCRIPQED_HS_COOKIE_LEN];
+  bool use_descriptor_cookie;
+
+  /* Output: the encoded descriptor, or NULL on failure. */
+  char *encoded_desc;
+} desc_encode_job_t;
+
+/** Last job id that we gave to a desc_encode_job_t. Never 0, so that 0 in a
+ * service descriptor means that no job is pending. */
+static uint64_t last_desc_encode_job_id = 0;
+
+/** Free a desc_encode_job_t and wipe its key material. */
+static void
+desc_encode_job_free(desc_encode_job_t *job)
+{
+  if (!job)
+    return;
+  hs_descriptor_free(job->desc);
+  qed_hs_free(job->encoded_desc);
+  memwipe(job, 0, sizeof(*job));
+  qed_hs_free(job);
+}
+
+/** Worker function: This function runs on a cpuworker, and encodes, signs and
+ * checks the descriptor of a desc_encode_job_t. */
+static workqueue_reply_t
+desc_encode_worker_threadfn(void *state_, void *work_)
+{
+  desc_encode_job_t *job = work_;
+  (void) state_;
+
+  if (hs_desc_encode_descriptor(job->desc, &job->signing_kp,
+                                job->use_descriptor_cookie ?
+                                  job->descriptor_cookie : NULL,
+                                &job->encoded_desc) < 0) {
+    job->encoded_desc = NULL;
+  }
+  /* We don't need the descriptor or the signing key anymore. */
+  hs_descriptor_free(job->desc);
+  memwipe(&job->signing_kp, 0, sizeof(job->signing_kp));
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: Back on the main thread, upload the descriptor encoded by
+ * a desc_encode_job_t if its service descriptor is still around. */
+static void
+desc_encode_worker_replyfn(void *work_)
+{
+  desc_encode_job_t *job = work_;
+  hs_service_t *service;
+  hs_service_descriptor_t *desc = NULL;
+
+  service = hs_service_find(&job->identity_pk);
+  if (!service) {
+    /* The service went away while we were encoding. */
+    goto done;
+  }
+  FOR_EACH_DESCRIPQED_HS_BEGIN(service, d) {
+    if (d->encode_job_id == job->job_id &&
+        ed25519_pubkey_eq(&d->blinded_kp.pubkey, &job->blinded_pk)) {
+      desc = d;
+    }
+  } FOR_EACH_DESCRIPQED_HS_END;
+  if (!desc) {
+    /* The descriptor was rotated out or rebuilt. */
+    goto done;
+  }
+  desc->encode_job_id = 0;
+
+  /* This should NEVER fail, as in upload_descriptor_to_all(). */
+  if (BUG(job->encoded_desc == NULL)) {
+    goto done;
+  }
+  upload_encoded_descriptor_to_all(service, desc, job->encoded_desc);
+
+ done:
+  desc_encode_job_free(job);
+}
+
+/** Return true iff we should encode descriptors on the cpuworkers instead of
+ * on the main thread. */
+static bool
+should_queue_desc_encode_work(void)
+{
+  return get_options()->HiddenServiceOffloadDescriptors &&
+         cpuworker_get_n_threads() > 0;
+}
+
+/** Queue the encoding of the descriptor <b>desc</b> of <b>service</b> on a
+ * cpuworker. Once it is encoded, it is uploaded to the responsible HSDirs.
+ * Return 0 if the job was queued else a negative value. */
+static int
+queue_desc_encode_work(const hs_service_t *service,
+                       hs_service_descriptor_t *desc)
+{
+  desc_encode_job_t *job;
+
+  job = qed_hs_malloc_zero(sizeof(*job));
+  ed25519_pubkey_copy(&job->identity_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&job->blinded_pk, &desc->blinded_kp.pubkey);
+  job->job_id = ++last_desc_encode_job_id;
+  job->desc = hs_descriptor_dup(desc->desc);
+  memcpy(&job->signing_kp, &desc->signing_kp, sizeof(job->signing_kp));
+  /* Same as service_encode_descriptor(). */
+  if (is_client_auth_enabled(service)) {
+    memcpy(job->descriptor_cookie, desc->descriptor_cookie,
+           sizeof(job->descriptor_cookie));
+    job->use_descriptor_cookie = true;
+  }
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW, desc_encode_worker_threadfn,
+                            desc_encode_worker_replyfn, job)) {
+    desc_encode_job_free(job);
+    return -1;
+  }
+
+  desc->encode_job_id = job->job_id;
+  return 0;
+}
+
+/** Encode and sign the service descriptor desc and upload it to the
+ * responsible hidden service directories. If for_next_period is true, the set
+ * of directories are selected using the next hsdir_index. This does nothing
+ * if PublishHidServDescriptors is false.
+ *
+ * If HiddenServiceOffloadDescriptors is set and we have cpuworkers, the
+ * descriptor is encoded on a cpuworker and uploaded when it comes back. */
+STATIC void
+upload_descriptor_to_all(const hs_service_t *service,
+                         hs_service_descriptor_t *desc)
+{
+  char *encoded_desc = NULL;
+
+  qed_hs_assert(service);
+  qed_hs_assert(desc);
+
+  /* We encode the descriptor once for all the HSDirs, and not at all if tor
+   * is configured to not publish. */
+  if (get_options()->PublishHidServDescriptors) {
+    if (should_queue_desc_encode_work() &&
+        queue_desc_encode_work(service, desc) == 0) {
+      set_descriptor_next_upload_time(service, desc);
+      return;
+    }
+    /* First of all, we'll encode the descriptor. This should NEVER fail but
+     * just in case, let's make sure we have an actual usable descriptor. */
+    if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
+                                      &encoded_desc) < 0)) {
+      encoded_desc = NULL;
+    }
+  }
+
+  upload_encoded_descriptor_to_all(service, desc, encoded_desc);
+  set_descriptor_next_upload_time(service, desc);
+  qed_hs_free(encoded_desc);
 }
 
 /** The set of HSDirs have changed: check if the change affects our descriptor
@@ -3557,6 +3742,12 @@ run_upload_descriptor_event(time_t now)
         service_desc_schedule_upload(desc, now, 0);
       }
 
+      /* Is this descriptor still being encoded for its last upload? If it
+       * changed since, we'll upload it again once that's done. */
+      if (desc->encode_job_id != 0) {
+        continue;
+      }
+
       /* Can this descriptor be uploaded? */
       if (!should_service_upload_descriptor(service, desc, now)) {
         continue;
@@ -3803,8 +3994,6 @@ service_handle_introduce2(origin_circuit_t *circ, const uint8_t *payload,
                                 payload, payload_len) < 0) {
     goto err;
   }
-  /* Update metrics that a new introduction was successful. */
-  hs_metrics_new_introduction(service);
 
   return 0;
  err:
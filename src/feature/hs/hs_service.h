@@ -180,6 +180,10 @@ typedef struct hs_service_descriptor_t {
    *  is different from this list, this means we received new dirinfo and we
    *  need to reupload our descriptor. */
   smartlist_t *previous_hsdirs;
+
+  /** Mutable: If nonzero, a cpuworker is encoding this descriptor for
+   * upload, and this is the id of its job. */
+  uint64_t encode_job_id;
 } hs_service_descriptor_t;
 
 /** Service key material. */
@@ -361,6 +365,9 @@ void hs_service_free_(hs_service_t *service);
 #define hs_service_free(s) FREE_AND_NULL(hs_service_t, hs_service_free_, (s))
 
 hs_service_t *hs_service_find(const ed25519_public_key_t *ident_pk);
+hs_service_intro_point_t *hs_service_find_intro_point(
+                                 const hs_service_t *service,
+                                 const ed25519_public_key_t *auth_key);
 MOCK_DECL(unsigned int, hs_service_get_num_services,(void));
 void hs_service_stage_services(const smartlist_t *service_list);
 int hs_service_load_all_keys(void);
@@ -17,12 +17,109 @@
  * malleable.)
  *
  * This module is used from rendservice.c.
+ *
+ * Under an introduction flood we see a great many digests, so we keep them
+ * inline in open-addressing tables instead of allocating each one, and we
+ * split them into buckets by the time we last saw them.  Expiring old
+ * entries then means emptying whole buckets, instead of walking every
+ * entry.
  */
 
 #define REPLAYCACHE_PRIVATE
 
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "ext/siphash.h"
+#include "lib/intmath/muldiv.h"
+
+/** Return the slot where we start looking for the digest whose siphash is
+ * <b>hash</b> in <b>b</b>. Digests come from data that an attacker chooses,
+ * so we hash them with siphash rather than using their bits directly. */
+static inline unsigned
+replaycache_bucket_home_slot(const replaycache_bucket_t *b, uint64_t hash)
+{
+  return (unsigned) hash & (b->capacity - 1);
+}
+
+/** Return the entry for <b>digest</b>, whose siphash is <b>hash</b>, in
+ * <b>b</b>, or NULL if there is none. */
+static replaycache_ent_t *
+replaycache_bucket_find(const replaycache_bucket_t *b,
+                        const uint8_t *digest, uint64_t hash)
+{
+  unsigned mask, idx;
+
+  if (!b->n_ents)
+    return NULL;
+
+  mask = b->capacity - 1;
+  for (idx = replaycache_bucket_home_slot(b, hash); ; idx = (idx + 1) & mask) {
+    replaycache_ent_t *ent = &b->ents[idx];
+    if (ent->seen == 0)
+      return NULL;
+    if (fast_memeq(ent->digest, digest, DIGEST256_LEN))
+      return ent;
+  }
+}
+
+/** Helper: put <b>digest</b>, whose siphash is <b>hash</b>, into the first
+ * free slot for it in <b>b</b>, which must have one. Return that slot. */
+static replaycache_ent_t *
+replaycache_bucket_place(replaycache_bucket_t *b,
+                         const uint8_t *digest, uint64_t hash)
+{
+  unsigned mask = b->capacity - 1;
+  unsigned idx = replaycache_bucket_home_slot(b, hash);
+
+  while (b->ents[idx].seen != 0)
+    idx = (idx + 1) & mask;
+  memcpy(b->ents[idx].digest, digest, DIGEST256_LEN);
+  ++b->n_ents;
+  return &b->ents[idx];
+}
+
+/** Add <b>digest</b>, whose siphash is <b>hash</b>, to <b>b</b>, seen at
+ * <b>seen</b>. The digest must not already be in <b>b</b>. */
+static void
+replaycache_bucket_add(replaycache_bucket_t *b,
+                       const uint8_t *digest, uint64_t hash, time_t seen)
+{
+  /* Keep the load factor at or below 3/4. */
+  if ((b->n_ents + 1) * 4 > b->capacity * 3) {
+    replaycache_ent_t *old_ents = b->ents;
+    unsigned old_capacity = b->capacity, i;
+
+    b->capacity = old_capacity ? old_capacity * 2 : REPLAYCACHE_MIN_CAPACITY;
+    b->ents = qed_hs_calloc(b->capacity, sizeof(replaycache_ent_t));
+    b->n_ents = 0;
+    for (i = 0; i < old_capacity; ++i) {
+      if (old_ents[i].seen == 0)
+        continue;
+      replaycache_bucket_place(b, old_ents[i].digest,
+                               siphash24g(old_ents[i].digest,
+                                          DIGEST256_LEN))->seen =
+        old_ents[i].seen;
+    }
+    qed_hs_free(old_ents);
+  }
+
+  replaycache_bucket_place(b, digest, hash)->seen = seen;
+}
+
+/** Drop every entry in <b>b</b>. Keep its slots for the next span if it was
+ * busy enough that we'd probably need them again. */
+static void
+replaycache_bucket_clear(replaycache_bucket_t *b)
+{
+  if (b->n_ents * 4 >= b->capacity) {
+    memset(b->ents, 0, b->capacity * sizeof(replaycache_ent_t));
+  } else {
+    qed_hs_free(b->ents);
+    b->capacity = 0;
+  }
+  b->n_ents = 0;
+  b->span = -1;
+}
 
 /** Free the replaycache r and all of its entries.
  */
@@ -34,7 +131,8 @@ replaycache_free_(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, qed_hs_free_);
+  for (int i = 0; i < REPLAYCACHE_N_BUCKETS; ++i)
+    qed_hs_free(r->buckets[i].ents);
 
   qed_hs_free(r);
 }
@@ -60,16 +158,79 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = qed_hs_malloc(sizeof(*r));
+  r = qed_hs_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  /* Any horizon-long stretch of time then touches at most
+   * REPLAYCACHE_N_BUCKETS spans, so by the time we reuse a bucket for a new
+   * span, everything in it has aged out. */
+  if (horizon)
+    r->bucket_width = MAX(1, CEIL_DIV(horizon, REPLAYCACHE_N_BUCKETS - 2));
+  for (int i = 0; i < REPLAYCACHE_N_BUCKETS; ++i)
+    r->buckets[i].span = -1;
 
  err:
   return r;
 }
 
+#ifdef QED_HS_UNIT_TESTS
+/** Return the number of entries in <b>r</b>, counting a digest once for
+ * each bucket it is in. */
+STATIC size_t
+replaycache_size(const replaycache_t *r)
+{
+  size_t n = 0;
+  for (int i = 0; i < REPLAYCACHE_N_BUCKETS; ++i)
+    n += r->buckets[i].n_ents;
+  return n;
+}
+#endif /* defined(QED_HS_UNIT_TESTS) */
+
+/** Return the newest entry for <b>digest</b>, whose siphash is
+ * <b>hash</b>, in <b>r</b>, or NULL if there is none.  Set *<b>bucket_out</b>
+ * to the bucket holding the entry. */
+static replaycache_ent_t *
+replaycache_find(replaycache_t *r, const uint8_t *digest, uint64_t hash,
+                 replaycache_bucket_t **bucket_out)
+{
+  for (int i = 0; i < REPLAYCACHE_N_BUCKETS; ++i) {
+    const time_t span = r->newest_span - i;
+    replaycache_bucket_t *b;
+    replaycache_ent_t *ent;
+    if (span < 0)
+      break;
+    b = &r->buckets[span % REPLAYCACHE_N_BUCKETS];
+    if (b->span != span)
+      continue;
+    if ((ent = replaycache_bucket_find(b, digest, hash))) {
+      *bucket_out = b;
+      return ent;
+    }
+  }
+  return NULL;
+}
+
+/** Return the bucket of <b>r</b> for new entries seen at <b>present</b>,
+ * emptying it first if it still holds an older span. */
+static replaycache_bucket_t *
+replaycache_get_current_bucket(replaycache_t *r, time_t present)
+{
+  time_t span = r->bucket_width ? present / r->bucket_width : 0;
+  replaycache_bucket_t *b;
+
+  /* If our clock went backwards, keep using the newest bucket. */
+  if (span < r->newest_span)
+    span = r->newest_span;
+  b = &r->buckets[span % REPLAYCACHE_N_BUCKETS];
+  if (b->span != span) {
+    replaycache_bucket_clear(b);
+    b->span = span;
+  }
+  r->newest_span = span;
+  return b;
+}
+
 /** See documentation for replaycache_add_and_test().
  */
 STATIC int
@@ -79,7 +240,9 @@ replaycache_add_and_test_internal(
 {
   int rv = 0;
   uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  uint64_t hash;
+  replaycache_ent_t *ent;
+  replaycache_bucket_t *current, *bucket = NULL;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -90,23 +253,26 @@ replaycache_add_and_test_internal(
 
   /* compute digest */
   crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
+  hash = siphash24g(digest, DIGEST256_LEN);
 
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
+  /* check the cache, after making room for this span so that we don't
+   * look at a bucket we're about to empty */
+  current = replaycache_get_current_bucket(r, present);
+  ent = replaycache_find(r, digest, hash, &bucket);
 
   /* seen before? */
-  if (access_time != NULL) {
+  if (ent != NULL) {
     /*
      * If it's far enough in the past, no hit.  If the horizon is zero, we
      * never expire.
      */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
+    if (ent->seen >= present - r->horizon || r->horizon == 0) {
       /* replay cache hit, return 1 */
       rv = 1;
       /* If we want to output an elapsed time, do so */
       if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
+        if (present >= ent->seen) {
+          *elapsed = present - ent->seen;
         } else {
           /* We shouldn't really be seeing hits from the future, but... */
           *elapsed = 0;
@@ -114,16 +280,20 @@ replaycache_add_and_test_internal(
       }
     }
     /*
-     * If it's ahead of the cached time, update
+     * If it's ahead of the cached time, update.  An entry in an older
+     * bucket gets a fresh copy in the current one, so that it doesn't age
+     * out with the old bucket; the old copy is never found again, since we
+     * search the newest buckets first.
      */
-    if (*access_time < present) {
-      *access_time = present;
+    if (ent->seen < present) {
+      if (bucket == current)
+        ent->seen = present;
+      else
+        replaycache_bucket_add(current, digest, hash, present);
     }
   } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = qed_hs_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
+    /* No, so no hit and add the digest at the current time */
+    replaycache_bucket_add(current, digest, hash, present);
   }
 
   /* now scrub the cache if it's time */
@@ -138,13 +308,8 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
@@ -156,21 +321,13 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   /* if we're never expiring, don't bother scrubbing */
   if (r->horizon == 0) return;
 
-  /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      qed_hs_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
-    }
+  /* okay, scrub time: empty every bucket whose whole span has aged out. */
+  for (int i = 0; i < REPLAYCACHE_N_BUCKETS; ++i) {
+    replaycache_bucket_t *b = &r->buckets[i];
+    if (b->span < 0)
+      continue;
+    if ((b->span + 1) * r->bucket_width <= present - r->horizon)
+      replaycache_bucket_clear(b);
   }
 
   /* update scrubbed timestamp */
@@ -13,6 +13,36 @@ typedef struct replaycache_t replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+/** Number of time buckets in a replaycache_t that expires its entries. */
+#define REPLAYCACHE_N_BUCKETS 6
+/** Smallest nonzero number of slots in a replaycache_bucket_t. */
+#define REPLAYCACHE_MIN_CAPACITY 16
+
+/** One digest we've seen, stored inline in a replaycache_bucket_t. */
+typedef struct replaycache_ent_t {
+  /** SHA256 digest of the data we saw. */
+  uint8_t digest[DIGEST256_LEN];
+  /** When we last saw it, or 0 if this slot is empty. */
+  time_t seen;
+} replaycache_ent_t;
+
+/**
+ * The digests we saw during one span of time: an open-addressing table
+ * using linear probing.  Entries are never removed one at a time; we expire
+ * them by emptying the whole bucket at once, so there are no tombstones.
+ */
+typedef struct replaycache_bucket_t {
+  /** Which span of bucket_width seconds this bucket holds, counted from the
+   * epoch; or -1 if it holds nothing. */
+  time_t span;
+  /** Array of capacity slots; capacity is zero or a power of two. */
+  replaycache_ent_t *ents;
+  /** Number of slots in ents. */
+  unsigned capacity;
+  /** Number of nonempty slots in ents. */
+  unsigned n_ents;
+} replaycache_bucket_t;
+
 struct replaycache_t {
   /** Scrub interval */
   time_t scrub_interval;
@@ -24,9 +54,18 @@ struct replaycache_t {
    */
   time_t horizon;
   /**
-   * Digest map: keys are digests, values are times the digest was last seen
+   * Length of the span of time held by each bucket, or 0 if we never
+   * expire entries, in which case we only use the first bucket.
+   */
+  time_t bucket_width;
+  /** The latest span we've put an entry in. */
+  time_t newest_span;
+  /**
+   * Buckets of digests we've seen, indexed by span modulo
+   * REPLAYCACHE_N_BUCKETS.  Each entry is in the bucket for the span in
+   * which it was last seen (or a later one, if our clock went backwards).
    */
-  digest256map_t *digests_seen;
+  replaycache_bucket_t buckets[REPLAYCACHE_N_BUCKETS];
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -57,6 +96,9 @@ STATIC int replaycache_add_and_test_internal(
     time_t *elapsed);
 STATIC void replaycache_scrub_if_needed_internal(
     time_t present, replaycache_t *r);
+#ifdef QED_HS_UNIT_TESTS
+STATIC size_t replaycache_size(const replaycache_t *r);
+#endif /* defined(QED_HS_UNIT_TESTS) */
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
 
@@ -1179,24 +1179,21 @@ list_pending_fpsk_downloads(fp_pair_map_t *result)
 {
   const char *pfx = "fp-sk/";
   smartlist_t *tmp;
-  smartlist_t *conns;
-  const char *resource;
+  smartlist_t *resources;
 
   qed_hs_assert(result);
 
   tmp = smartlist_new();
-  conns = get_connection_array();
-
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == DIR_PURPOSE_FETCH_CERTIFICATE &&
-        !conn->marked_for_close) {
-      resource = TO_DIR_CONN(conn)->requested_resource;
-      if (!strcmpstart(resource, pfx))
-        dir_split_resource_into_fingerprint_pairs(resource + strlen(pfx),
-                                                  tmp);
-    }
-  } SMARTLIST_FOREACH_END(conn);
+  resources = smartlist_new();
+
+  connection_dir_list_pending_resources(DIR_PURPOSE_FETCH_CERTIFICATE,
+                                        resources);
+  SMARTLIST_FOREACH_BEGIN(resources, const char *, resource) {
+    if (!strcmpstart(resource, pfx))
+      dir_split_resource_into_fingerprint_pairs(resource + strlen(pfx),
+                                                tmp);
+  } SMARTLIST_FOREACH_END(resource);
+  smartlist_free(resources);
 
   SMARTLIST_FOREACH_BEGIN(tmp, fp_pair_t *, fp) {
     fp_pair_map_set(result, fp, (void*)1);
@@ -909,8 +909,10 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
   //qed_hs_assert(md->held_in_map == 0);
   //qed_hs_assert(md->held_by_nodes == 0);
 
-  qed_hs_free(md->onion_curve25519_pkey);
-  qed_hs_free(md->ed25519_identity_pkey);
+  if (md->onion_curve25519_pkey != &md->onion_curve25519_pkey_storage)
+    qed_hs_free(md->onion_curve25519_pkey);
+  if (md->ed25519_identity_pkey != &md->ed25519_identity_pkey_storage)
+    qed_hs_free(md->ed25519_identity_pkey);
   if (md->body && md->saved_location != SAVED_IN_CACHE)
     qed_hs_free(md->body);
 
@@ -19,6 +19,8 @@ struct short_policy_t;
 struct smartlist_t;
 
 #include "ext/ht.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
 
 /** A microdescriptor is the smallest amount of information needed to build a
  * circuit through a router.  They are generated by the directory authorities,
@@ -64,9 +66,11 @@ struct microdesc_t {
 
   /* Fields in the microdescriptor. */
 
-  /** As routerinfo_t.onion_curve25519_pkey */
+  /** As routerinfo_t.onion_curve25519_pkey.  When we parsed this
+   * microdescriptor, points to <b>onion_curve25519_pkey_storage</b>. */
   struct curve25519_public_key_t *onion_curve25519_pkey;
-  /** Ed25519 identity key, if included. */
+  /** Ed25519 identity key, if included.  When we parsed this
+   * microdescriptor, points to <b>ed25519_identity_pkey_storage</b>. */
   struct ed25519_public_key_t *ed25519_identity_pkey;
   /** As routerinfo_t.ipv6_addr */
   qed_hs_addr_t ipv6_addr;
@@ -83,6 +87,14 @@ struct microdesc_t {
   struct short_policy_t *exit_policy;
   /** IPv6 exit policy summary */
   struct short_policy_t *ipv6_exit_policy;
+
+  /* Keys, kept here rather than allocated one by one, since nearly every
+   * microdescriptor has both. Use the pointers above, not these. */
+
+  /** Storage for the key in <b>onion_curve25519_pkey</b>. */
+  struct curve25519_public_key_t onion_curve25519_pkey_storage;
+  /** Storage for the key in <b>ed25519_identity_pkey</b>. */
+  struct ed25519_public_key_t ed25519_identity_pkey_storage;
 };
 
 #endif /* !defined(MICRODESC_ST_H) */
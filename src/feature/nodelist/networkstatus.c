@@ -65,6 +65,7 @@
 #include "feature/control/control_events.h"
 #include "feature/dirauth/reachability.h"
 #include "feature/dircache/consdiffmgr.h"
+#include "feature/dircommon/consdiff.h"
 #include "feature/dircache/dirserv.h"
 #include "feature/dirclient/dirclient.h"
 #include "feature/dirclient/dirclient_modes.h"
@@ -81,6 +82,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
@@ -193,6 +195,13 @@ static int reload_consensus_from_file(const char *fname,
                                       const char *flavor,
                                       unsigned flags,
                                       const char *source_dir);
+static int networkstatus_set_current_consensus_impl(
+                                 const char *consensus,
+                                 size_t consensus_len,
+                                 const char *flavor,
+                                 unsigned flags,
+                                 const char *source_dir,
+                                 const consensus_diff_unchanged_t *unchanged);
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -246,6 +255,39 @@ networkstatus_get_cache_fname,(int flav,
   return get_cachedir_fname(buf);
 }
 
+/** Return a new string containing the filename for the binary snapshot of
+ * the routerstatus entries in our cached consensus of flavor <b>flav</b>. */
+static char *
+networkstatus_get_snapshot_fname(int flav)
+{
+  char *consensus_fname, *result;
+  consensus_fname = networkstatus_get_cache_fname(flav,
+                                          networkstatus_get_flavor_name(flav),
+                                          0);
+  qed_hs_asprintf(&result, "%s.snapshot", consensus_fname);
+  qed_hs_free(consensus_fname);
+  return result;
+}
+
+/** Write a binary snapshot of the routerstatus entries in <b>c</b>, which
+ * we've just accepted as our consensus of flavor <b>flav</b>, so that we
+ * don't need to parse them again the next time we start. */
+static void
+networkstatus_write_snapshot(const networkstatus_t *c, int flav)
+{
+  size_t len = 0;
+  uint8_t *snap = ns_snapshot_encode(c, &len);
+  if (!snap)
+    return;
+  char *fname = networkstatus_get_snapshot_fname(flav);
+  if (write_bytes_to_file(fname, (const char *)snap, len, 1) < 0) {
+    log_info(LD_FS, "Couldn't write consensus snapshot to %s",
+             escaped(fname));
+  }
+  qed_hs_free(fname);
+  qed_hs_free(snap);
+}
+
 /**
  * Read and return the cached consensus of type <b>flavorname</b>.  If
  * <b>unverified</b> is false, get the one we haven't verified. Return NULL if
@@ -331,6 +373,69 @@ routerstatus_free_(routerstatus_t *rs)
   qed_hs_free(rs);
 }
 
+/** Return true iff <b>rs</b> lives in the routerstatus_block of <b>ns</b>,
+ * rather than in an allocation of its own. */
+static inline int
+networkstatus_routerstatus_in_block(const networkstatus_t *ns,
+                                    const routerstatus_t *rs)
+{
+  return ns->routerstatus_block &&
+    rs >= ns->routerstatus_block &&
+    rs < ns->routerstatus_block + ns->n_routerstatus_block;
+}
+
+/** Move the routerstatus_t entries of the consensus <b>ns</b> into a single
+ * allocation, in order, along with their exit policy summaries, keeping
+ * just one copy of each summary.  This saves a heap allocation per entry,
+ * and keeps the entries together for the scans we do over them when
+ * picking paths.
+ *
+ * After this, the entries must only be freed along with <b>ns</b>. */
+void
+networkstatus_compact_routerstatus_list(networkstatus_t *ns)
+{
+  if (BUG(ns->type != NS_TYPE_CONSENSUS) || ns->routerstatus_block)
+    return;
+  const int n = smartlist_len(ns->routerstatus_list);
+  if (n == 0)
+    return;
+
+  /* Find the distinct summaries, and where each will go. */
+  strmap_t *summary_offsets = strmap_new();
+  size_t summaries_len = 0;
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *, rs) {
+    if (!rs->exitsummary || strmap_get(summary_offsets, rs->exitsummary))
+      continue;
+    /* Store offset+1, so that no offset is NULL. */
+    strmap_set(summary_offsets, rs->exitsummary,
+               (void *)(uintptr_t)(summaries_len + 1));
+    summaries_len += strlen(rs->exitsummary) + 1;
+  } SMARTLIST_FOREACH_END(rs);
+
+  routerstatus_t *block =
+    qed_hs_malloc(sizeof(routerstatus_t) * n + summaries_len);
+  char *summaries = (char *)(block + n);
+  STRMAP_FOREACH(summary_offsets, summary, void *, offset_plus_1) {
+    const size_t offset = (uintptr_t)offset_plus_1 - 1;
+    memcpy(summaries + offset, summary, strlen(summary) + 1);
+  } STRMAP_FOREACH_END;
+
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+    routerstatus_t *dest = &block[rs_sl_idx];
+    memcpy(dest, rs, sizeof(routerstatus_t));
+    if (rs->exitsummary) {
+      void *offset_plus_1 = strmap_get(summary_offsets, rs->exitsummary);
+      dest->exitsummary = summaries + ((uintptr_t)offset_plus_1 - 1);
+    }
+    routerstatus_free(rs);
+    SMARTLIST_REPLACE_CURRENT(ns->routerstatus_list, rs, dest);
+  } SMARTLIST_FOREACH_END(rs);
+
+  strmap_free(summary_offsets, NULL);
+  ns->routerstatus_block = block;
+  ns->n_routerstatus_block = n;
+}
+
 /** Free all storage held in <b>sig</b> */
 void
 document_signature_free_(document_signature_t *sig)
@@ -404,12 +509,15 @@ networkstatus_vote_free_(networkstatus_t *ns)
       SMARTLIST_FOREACH(ns->routerstatus_list, vote_routerstatus_t *, rs,
                         vote_routerstatus_free(rs));
     } else {
-      SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
-                        routerstatus_free(rs));
+      SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+        if (! networkstatus_routerstatus_in_block(ns, rs))
+          routerstatus_free(rs);
+      } SMARTLIST_FOREACH_END(rs);
     }
 
     smartlist_free(ns->routerstatus_list);
   }
+  qed_hs_free(ns->routerstatus_block);
 
   if (ns->bw_file_headers) {
     SMARTLIST_FOREACH(ns->bw_file_headers, char *, c, qed_hs_free(c));
@@ -1936,6 +2044,42 @@ networkstatus_set_current_consensus(const char *consensus,
                                     const char *flavor,
                                     unsigned flags,
                                     const char *source_dir)
+{
+  return networkstatus_set_current_consensus_impl(consensus, consensus_len,
+                                                  flavor, flags, source_dir,
+                                                  NULL);
+}
+
+/** As networkstatus_set_current_consensus().  If <b>consensus</b> was made
+ * by applying a diff, <b>unchanged</b> is the description of the parts that
+ * the diff left alone, from consensus_diff_apply_tracking(); otherwise it is
+ * NULL.  If the diff was applied to our current consensus of the same
+ * flavor, we copy the routerstatus entries in those parts from it instead
+ * of parsing them again. */
+int
+networkstatus_set_current_consensus_from_diff(
+                                 const char *consensus,
+                                 size_t consensus_len,
+                                 const char *flavor,
+                                 unsigned flags,
+                                 const char *source_dir,
+                                 const consensus_diff_unchanged_t *unchanged)
+{
+  return networkstatus_set_current_consensus_impl(consensus, consensus_len,
+                                                  flavor, flags, source_dir,
+                                                  unchanged);
+}
+
+/** Helper for networkstatus_set_current_consensus() and
+ * networkstatus_set_current_consensus_from_diff(). */
+static int
+networkstatus_set_current_consensus_impl(
+                                 const char *consensus,
+                                 size_t consensus_len,
+                                 const char *flavor,
+                                 unsigned flags,
+                                 const char *source_dir,
+                                 const consensus_diff_unchanged_t *unchanged)
 {
   networkstatus_t *c=NULL;
   int r, result = -1;
@@ -1953,6 +2097,8 @@ networkstatus_set_current_consensus(const char *consensus,
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
   int checked_protocols_already = 0;
+  int used_snapshot = 0;
+  const networkstatus_t *prev = NULL;
 
   if (flav < 0 || flav >= N_CONSENSUS_FLAVORS) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1960,10 +2106,40 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
-  /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus,
-                                           consensus_len,
-                                           NULL, NS_TYPE_CONSENSUS);
+  /* Make sure it's parseable.  If it's the consensus we cached last time,
+   * we can take its routerstatus entries from the snapshot we wrote then. */
+  if (from_cache && !was_waiting_for_certs) {
+    char *snap_fname = networkstatus_get_snapshot_fname(flav);
+    qed_hs_mmap_t *snap_map = qed_hs_mmap_file(snap_fname);
+    const uint8_t *snap = NULL;
+    size_t snap_len = 0;
+    qed_hs_free(snap_fname);
+    if (snap_map) {
+      snap = (const uint8_t *)snap_map->data;
+      snap_len = snap_map->size;
+    }
+    c = networkstatus_parse_consensus_with_snapshot(consensus, consensus_len,
+                                                    snap, snap_len,
+                                                    &used_snapshot);
+    qed_hs_munmap_file(snap_map);
+  } else if (unchanged &&
+             (prev = networkstatus_get_latest_consensus_by_flavor(flav)) &&
+             fast_memeq(prev->digest_sha3_as_signed, unchanged->base_digest,
+                        DIGEST256_LEN)) {
+    /* We made this from our current consensus, so most of its entries are
+     * the ones we already have. */
+    int n_reused = 0;
+    c = networkstatus_parse_consensus_reusing(consensus, consensus_len,
+                                              prev, unchanged, &n_reused);
+    if (c)
+      log_info(LD_DIR, "Reused %d of %d routerstatus entries from our "
+               "previous %s consensus.", n_reused,
+               smartlist_len(c->routerstatus_list), flavor);
+  } else {
+    c = networkstatus_parse_vote_from_string(consensus,
+                                             consensus_len,
+                                             NULL, NS_TYPE_CONSENSUS);
+  }
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -2191,6 +2367,9 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_bytes_to_file(consensus_fname, consensus, consensus_len, 1);
   }
+  if (!used_snapshot) {
+    networkstatus_write_snapshot(c, flav);
+  }
 
   warn_early_consensus(c, flavor, now);
 
@@ -25,6 +25,7 @@ void routerstatus_free_(routerstatus_t *rs);
 #define routerstatus_free(rs) \
   FREE_AND_NULL(routerstatus_t, routerstatus_free_, (rs))
 void networkstatus_vote_free_(networkstatus_t *ns);
+void networkstatus_compact_routerstatus_list(networkstatus_t *ns);
 #define networkstatus_vote_free(ns) \
   FREE_AND_NULL(networkstatus_t, networkstatus_vote_free_, (ns))
 networkstatus_voter_info_t *networkstatus_get_voter_by_id(
@@ -115,6 +116,14 @@ int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags,
                                         const char *source_dir);
+struct consensus_diff_unchanged_t;
+int networkstatus_set_current_consensus_from_diff(
+                         const char *consensus,
+                         size_t consensus_len,
+                         const char *flavor,
+                         unsigned flags,
+                         const char *source_dir,
+                         const struct consensus_diff_unchanged_t *unchanged);
 void networkstatus_note_certs_arrived(const char *source_dir);
 void routers_update_all_from_networkstatus(time_t now, int dir_version);
 void routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
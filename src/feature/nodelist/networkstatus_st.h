@@ -94,6 +94,13 @@ struct networkstatus_t {
    * the elements are vote_routerstatus_t; for a consensus, the elements
    * are routerstatus_t. */
   smartlist_t *routerstatus_list;
+  /** Consensus only: if set, a single allocation holding
+   * <b>n_routerstatus_block</b> routerstatus_t entries of
+   * routerstatus_list, followed by their exit policy summaries.  See
+   * networkstatus_compact_routerstatus_list(). */
+  routerstatus_t *routerstatus_block;
+  /** Number of routerstatus_t in <b>routerstatus_block</b>. */
+  int n_routerstatus_block;
 
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
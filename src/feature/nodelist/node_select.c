@@ -480,6 +480,105 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
                            entries, n_entries, total, rand_val);
 }
 
+/** Build and return a new weighted_alias_t for choosing among the
+ * <b>n_entries</b> indices of <b>entries</b>, each with probability
+ * proportional to its weight, as choose_array_element_by_weight() would.
+ * If all weights are 0, the table chooses an index uniformly at random.
+ * Return NULL if there are no entries. */
+STATIC weighted_alias_t *
+weighted_alias_new(const double *entries, int n_entries)
+{
+  weighted_alias_t *table;
+  uint64_t *units;
+  int *small, *large;
+  int n_small = 0, n_large = 0, i;
+  double total = 0.0, scale;
+  uint64_t sum = 0;
+
+  if (n_entries < 1)
+    return NULL;
+
+  for (i = 0; i < n_entries; ++i)
+    total += entries[i];
+
+  table = qed_hs_malloc_zero(sizeof(weighted_alias_t));
+  table->n = n_entries;
+  table->threshold = qed_hs_calloc(n_entries, sizeof(uint64_t));
+  table->alias = qed_hs_calloc(n_entries, sizeof(int));
+  units = qed_hs_calloc(n_entries, sizeof(uint64_t));
+  small = qed_hs_calloc(n_entries, sizeof(int));
+  large = qed_hs_calloc(n_entries, sizeof(int));
+
+  /* Rescale the weights to integers so that n_entries times their sum
+   * still fits comfortably in a uint64_t. */
+  scale = total > 0.0 ?
+    ((double)(INT64_MAX / 4) / n_entries) / total : 0.0;
+  for (i = 0; i < n_entries; ++i) {
+    units[i] = total > 0.0 ? (uint64_t) qed_hs_llround(entries[i] * scale) : 1;
+    sum += units[i];
+  }
+  table->total = sum;
+
+  /* Vose's method: repeatedly fill up a column that holds less than its
+   * share with units from an index that holds more. */
+  for (i = 0; i < n_entries; ++i) {
+    units[i] *= n_entries;
+    if (units[i] < sum)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[--n_large];
+    table->threshold[s] = units[s];
+    table->alias[s] = l;
+    units[l] -= sum - units[s];
+    if (units[l] < sum)
+      small[n_small++] = l;
+    else
+      large[n_large++] = l;
+  }
+  /* Whatever is left holds exactly one full column. */
+  while (n_large) {
+    const int l = large[--n_large];
+    table->threshold[l] = sum;
+    table->alias[l] = l;
+  }
+  while (n_small) {
+    const int s = small[--n_small];
+    table->threshold[s] = sum;
+    table->alias[s] = s;
+  }
+
+  qed_hs_free(units);
+  qed_hs_free(small);
+  qed_hs_free(large);
+  return table;
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+weighted_alias_free_(weighted_alias_t *table)
+{
+  if (!table)
+    return;
+  qed_hs_free(table->threshold);
+  qed_hs_free(table->alias);
+  qed_hs_free(table);
+}
+
+/** Choose a random index from <b>table</b>, as described in
+ * weighted_alias_new(). */
+STATIC int
+weighted_alias_choose(const weighted_alias_t *table)
+{
+  const int col = crypto_rand_int(table->n);
+  if (crypto_rand_uint64(table->total) < table->threshold[col])
+    return col;
+  return table->alias[col];
+}
+
 /** Return bw*1000, unless bw*1000 would overflow, in which case return
  * INT32_MAX. */
 static inline int32_t
@@ -932,6 +1031,155 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** A cached weighted_alias_t for choosing, with some bandwidth_weight_rule_t,
+ * among the nodes that router_can_choose_node() accepts with some set of
+ * router_crn_flags_t. */
+typedef struct node_weight_table_t {
+  /** The rule we used to weight the nodes. */
+  bandwidth_weight_rule_t rule;
+  /** The flags we used to select the nodes. */
+  router_crn_flags_t flags;
+  /** The nodelist_idx of each node in the table. */
+  int *node_idx;
+  /** The table for choosing among node_idx, or NULL if there were no
+   * nodes. */
+  weighted_alias_t *alias;
+} node_weight_table_t;
+
+/** The node_weight_table_t objects we have built since our directory
+ * information last changed. Rebuilt lazily when they are next needed. */
+static smartlist_t *node_weight_tables = NULL;
+
+/** Most tables we'll keep at once. We only use a few combinations of rule
+ * and flags in practice, so this is only a backstop. */
+#define NODE_WEIGHT_TABLES_MAX 32
+
+/** How many times we draw from a node_weight_table_t, rejecting excluded
+ * nodes, before falling back to weighting the remaining nodes directly. */
+#define NODE_WEIGHT_TABLE_MAX_TRIES 32
+
+/** Release all storage held by <b>table</b>. */
+static void
+node_weight_table_free_(node_weight_table_t *table)
+{
+  if (!table)
+    return;
+  weighted_alias_free(table->alias);
+  qed_hs_free(table->node_idx);
+  qed_hs_free(table);
+}
+#define node_weight_table_free(table) \
+  FREE_AND_NULL(node_weight_table_t, node_weight_table_free_, (table))
+
+/** Called when the set of nodes we might choose, or their weights, may have
+ * changed: forget all our node_weight_table_t objects. */
+void
+node_select_weights_changed(void)
+{
+  if (!node_weight_tables)
+    return;
+  SMARTLIST_FOREACH(node_weight_tables, node_weight_table_t *, table,
+                    node_weight_table_free(table));
+  smartlist_clear(node_weight_tables);
+}
+
+/** Release all storage held by the node selection cache. */
+void
+node_select_free_all(void)
+{
+  node_select_weights_changed();
+  smartlist_free(node_weight_tables);
+}
+
+/** Return the node_weight_table_t for choosing nodes that match
+ * <b>flags</b> with <b>rule</b>, building it if we don't have one. */
+static const node_weight_table_t *
+node_weight_table_get(router_crn_flags_t flags, bandwidth_weight_rule_t rule)
+{
+  node_weight_table_t *table;
+  smartlist_t *sl;
+  double *bandwidths = NULL;
+
+  if (!node_weight_tables)
+    node_weight_tables = smartlist_new();
+  SMARTLIST_FOREACH(node_weight_tables, node_weight_table_t *, t, {
+    if (t->flags == flags && t->rule == rule)
+      return t;
+  });
+  if (smartlist_len(node_weight_tables) >= NODE_WEIGHT_TABLES_MAX)
+    node_select_weights_changed();
+
+  table = qed_hs_malloc_zero(sizeof(node_weight_table_t));
+  table->flags = flags;
+  table->rule = rule;
+
+  sl = smartlist_new();
+  router_add_running_nodes_to_smartlist(sl, flags);
+  if (compute_weighted_bandwidths(sl, rule, &bandwidths, NULL) == 0) {
+    table->node_idx = qed_hs_calloc(smartlist_len(sl), sizeof(int));
+    SMARTLIST_FOREACH(sl, const node_t *, node,
+                      table->node_idx[node_sl_idx] = node->nodelist_idx);
+    table->alias = weighted_alias_new(bandwidths, smartlist_len(sl));
+  }
+  log_debug(LD_CIRC, "Built a node weight table for rule %s with %d nodes.",
+            bandwidth_weight_rule_to_string(rule), smartlist_len(sl));
+  qed_hs_free(bandwidths);
+  smartlist_free(sl);
+
+  smartlist_add(node_weight_tables, table);
+  return table;
+}
+
+/** Try to choose a node as router_choose_random_node_helper() does, but in
+ * constant time, by drawing from a cached node_weight_table_t until we get a
+ * node that is not excluded.  This gives each remaining node the same
+ * probability as weighting the remaining nodes directly.
+ *
+ * Return NULL if we didn't find a node in a few tries; the caller should
+ * then fall back to the slow way. */
+static const node_t *
+node_choose_from_weight_table(const smartlist_t *excludednodes,
+                              const routerset_t *excludedset,
+                              router_crn_flags_t flags,
+                              bandwidth_weight_rule_t rule)
+{
+  const node_weight_table_t *table = node_weight_table_get(flags, rule);
+  const smartlist_t *nodelist = nodelist_get_list();
+  const int nodelist_len = smartlist_len(nodelist);
+  bitarray_t *excluded_idx;
+  const node_t *choice = NULL;
+
+  if (!table->alias)
+    return NULL;
+
+  /* Excluded nodes that aren't in the nodelist can't be in the table
+   * either, so we can skip them. */
+  excluded_idx = bitarray_init_zero(nodelist_len);
+  SMARTLIST_FOREACH_BEGIN(excludednodes, const node_t *, node) {
+    const int idx = node->nodelist_idx;
+    if (idx >= 0 && idx < nodelist_len && node == smartlist_get(nodelist, idx))
+      bitarray_set(excluded_idx, idx);
+  } SMARTLIST_FOREACH_END(node);
+
+  for (int i = 0; i < NODE_WEIGHT_TABLE_MAX_TRIES; ++i) {
+    const int idx = table->node_idx[weighted_alias_choose(table->alias)];
+    const node_t *node;
+    if (idx < 0 || idx >= nodelist_len || bitarray_is_set(excluded_idx, idx))
+      continue;
+    node = smartlist_get(nodelist, idx);
+    /* Check the node again, in case it changed without our noticing. */
+    if (!router_can_choose_node(node, flags))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    choice = node;
+    break;
+  }
+
+  bitarray_free(excluded_idx);
+  return choice;
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1191,15 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
-  const node_t *choice = NULL;
+  smartlist_t *sl;
+  const node_t *choice;
+
+  choice = node_choose_from_weight_table(excludednodes, excludedset,
+                                         flags, rule);
+  if (choice)
+    return choice;
 
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -88,12 +88,41 @@ const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
 
+void node_select_weights_changed(void);
+void node_select_free_all(void);
+
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
 #ifdef NODE_SELECT_PRIVATE
+/** A Walker alias table: a way to choose an index at random, weighted by a
+ * fixed set of weights, in constant time.
+ *
+ * We split the range of indices into n equal columns, each holding
+ * <b>total</b> units of probability.  Column i gives threshold[i] of its
+ * units to index i, and the rest to index alias[i].  All the arithmetic is
+ * on integers, so the probability of choosing each index is exactly its
+ * (rescaled) weight divided by the sum of the weights. */
+typedef struct weighted_alias_t {
+  /** Number of indices to choose from. */
+  int n;
+  /** Units of probability in each column; the sum of the rescaled
+   * weights. */
+  uint64_t total;
+  /** For each column, how many of its units belong to the column itself. */
+  uint64_t *threshold;
+  /** For each column, the index that gets the rest of its units. */
+  int *alias;
+} weighted_alias_t;
+
+STATIC weighted_alias_t *weighted_alias_new(const double *entries,
+                                            int n_entries);
+STATIC void weighted_alias_free_(weighted_alias_t *table);
+#define weighted_alias_free(table) \
+  FREE_AND_NULL(weighted_alias_t, weighted_alias_free_, (table))
+STATIC int weighted_alias_choose(const weighted_alias_t *table);
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
 STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
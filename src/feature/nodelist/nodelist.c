@@ -723,6 +723,7 @@ nodelist_set_consensus(const networkstatus_t *ns)
 
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
+  node_select_weights_changed();
 
   nodelist_update_consensus_params(ns);
 
@@ -733,9 +734,12 @@ nodelist_set_consensus(const networkstatus_t *ns)
   estimated_addresses += (get_n_authorities(V3_DIRINFO | BRIDGE_DIRINFO) *
                           get_estimated_address_per_node());
   /* Clear our sets because we will repopulate them with what this new
-   * consensus contains. */
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
+   * consensus contains.  The address set only drops the addresses that we
+   * don't add back before address_set_end_update(), so that a consensus
+   * that changes a few relays only costs us a few blocks of the filter. */
+  if (!the_nodelist->node_addrs)
+    the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  address_set_begin_update(the_nodelist->node_addrs, estimated_addresses);
   digestmap_free(the_nodelist->reentry_set, NULL);
   the_nodelist->reentry_set = digestmap_new();
 
@@ -795,6 +799,7 @@ nodelist_set_consensus(const networkstatus_t *ns)
   /* Then, add all trusted configured directories. Some might not be in the
    * consensus so make sure we know them. */
   dirlist_add_trusted_dir_addresses();
+  address_set_end_update(the_nodelist->node_addrs);
 
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -931,6 +936,8 @@ nodelist_purge(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  node_select_weights_changed();
+
   /* Remove the non-usable nodes. */
   for (iter = HT_START(nodelist_map, &the_nodelist->nodes_by_id); iter; ) {
     node_t *node = *iter;
@@ -956,6 +963,8 @@ nodelist_purge(void)
 void
 nodelist_free_all(void)
 {
+  node_select_free_all();
+
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
@@ -2533,6 +2542,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_weights_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
 }
@@ -0,0 +1,317 @@
+/* Copyright (c) 2007-2024, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.c
+ * \brief Binary snapshots of the routerstatus entries in a consensus.
+ *
+ * Parsing the few thousand "r" entries of a cached consensus is most of the
+ * work we do to load it at startup.  After we accept a consensus, we write
+ * its routerstatus_t entries next to it in a simple fixed-size record
+ * format; on the next start, if the snapshot was made from a document with
+ * the same SHA3-256 digest (as signed), we copy the records straight into
+ * the new networkstatus_t instead of tokenizing the entries again.
+ *
+ * The snapshot is only a cache of what we already parsed and accepted
+ * ourselves: any mismatch in the header, or anything that doesn't look
+ * right in the records, makes us ignore it and parse the text instead.
+ * Since the protocol summaries in a routerstatus_t depend on which
+ * protocols this build knows about, we also refuse snapshots written by
+ * any other version of the code.
+ **/
+
+#define NS_SNAPSHOT_PRIVATE
+#include "core/or/or.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/ns_snapshot.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+#include "lib/version/torversion.h"
+
+/** Magic bytes at the start of every snapshot. */
+#define NS_SNAPSHOT_MAGIC "QEDNSSNP"
+#define NS_SNAPSHOT_MAGIC_LEN 8
+
+/** Offset value meaning "this routerstatus has no exit summary". */
+#define NO_STRING UINT32_MAX
+
+/* Bits in the address flags byte of a record. */
+#define ADDR_HAS_IPV4 (1u<<0)
+#define ADDR_HAS_IPV6 (1u<<1)
+
+/** Call F(field, bit) for every one-bit field in a routerstatus_t that we
+ * save, along with the bit we save it in. */
+#define FOREACH_RS_FLAG(F)                      \
+  F(is_authority, 0)                            \
+  F(is_exit, 1)                                 \
+  F(is_stable, 2)                               \
+  F(is_fast, 3)                                 \
+  F(is_flagged_running, 4)                      \
+  F(is_named, 5)                                \
+  F(is_unnamed, 6)                              \
+  F(is_valid, 7)                                \
+  F(is_possible_guard, 8)                       \
+  F(is_bad_exit, 9)                             \
+  F(is_middle_only, 10)                         \
+  F(is_hs_dir, 11)                              \
+  F(is_v2_dir, 12)                              \
+  F(is_staledesc, 13)                           \
+  F(is_sybil, 14)                               \
+  F(has_bandwidth, 15)                          \
+  F(has_exitsummary, 16)                        \
+  F(bw_is_unmeasured, 17)                       \
+  F(has_guardfraction, 18)
+
+/** As FOREACH_RS_FLAG, for the fields in a protover_summary_flags_t. */
+#define FOREACH_PV_FLAG(F)                              \
+  F(protocols_known, 0)                                 \
+  F(supports_extend2_cells, 1)                          \
+  F(supports_accepting_ipv6_extends, 2)                 \
+  F(supports_initiating_ipv6_extends, 3)                \
+  F(supports_canonical_ipv6_conns, 4)                   \
+  F(supports_ed25519_link_handshake_compat, 5)          \
+  F(supports_ed25519_link_handshake_any, 6)             \
+  F(supports_ed25519_hs_intro, 7)                       \
+  F(supports_establish_intro_dos_extension, 8)          \
+  F(supports_v3_hsdir, 9)                               \
+  F(supports_v3_rendezvous_point, 10)                   \
+  F(supports_hs_setup_padding, 11)                      \
+  F(supports_congestion_control, 12)                    \
+  F(supports_conflux, 13)
+
+/** Write the fixed-size record for <b>rs</b> into <b>out</b>, which has
+ * NS_SNAPSHOT_RECORD_LEN bytes.  <b>exitsummary_offset</b> is the offset of
+ * its exit summary in the string table, or NO_STRING. */
+static void
+encode_routerstatus(uint8_t *out, const routerstatus_t *rs,
+                    uint32_t exitsummary_offset)
+{
+  uint32_t flags = 0, pv_flags = 0;
+  uint8_t addr_flags = 0;
+
+  memset(out, 0, NS_SNAPSHOT_RECORD_LEN);
+  memcpy(out, rs->identity_digest, DIGEST_LEN);
+  memcpy(out + 20, rs->descriptor_digest, DIGEST256_LEN);
+  strlcpy((char *)out + 52, rs->nickname, MAX_NICKNAME_LEN+1);
+  if (qed_hs_addr_family(&rs->ipv4_addr) == AF_INET) {
+    addr_flags |= ADDR_HAS_IPV4;
+    set_uint32(out + 72, htonl(qed_hs_addr_to_ipv4h(&rs->ipv4_addr)));
+  }
+  set_uint16(out + 76, htons(rs->ipv4_orport));
+  set_uint16(out + 78, htons(rs->ipv4_dirport));
+  if (qed_hs_addr_family(&rs->ipv6_addr) == AF_INET6) {
+    addr_flags |= ADDR_HAS_IPV6;
+    memcpy(out + 80, qed_hs_addr_to_in6_addr8(&rs->ipv6_addr), 16);
+  }
+  set_uint16(out + 96, htons(rs->ipv6_orport));
+  out[98] = addr_flags;
+
+#define ENCODE_RS_FLAG(field, bit) \
+  if (rs->field) flags |= (UINT32_C(1) << (bit));
+#define ENCODE_PV_FLAG(field, bit) \
+  if (rs->pv.field) pv_flags |= (UINT32_C(1) << (bit));
+  FOREACH_RS_FLAG(ENCODE_RS_FLAG)
+  FOREACH_PV_FLAG(ENCODE_PV_FLAG)
+#undef ENCODE_RS_FLAG
+#undef ENCODE_PV_FLAG
+
+  set_uint32(out + 100, htonl(flags));
+  set_uint32(out + 104, htonl(pv_flags));
+  set_uint32(out + 108, htonl(rs->bandwidth_kb));
+  set_uint32(out + 112, htonl(rs->guardfraction_percentage));
+  set_uint32(out + 116, htonl(exitsummary_offset));
+}
+
+/** Read the record at <b>in</b> into a newly allocated routerstatus_t, taking
+ * exit summaries from the <b>strings_len</b>-byte table at <b>strings</b>.
+ * Return NULL if the record is malformed. */
+static routerstatus_t *
+decode_routerstatus(const uint8_t *in, const char *strings,
+                    size_t strings_len)
+{
+  routerstatus_t *rs = qed_hs_malloc_zero(sizeof(routerstatus_t));
+  uint32_t flags, pv_flags, exitsummary_offset;
+  uint8_t addr_flags = in[98];
+
+  memcpy(rs->identity_digest, in, DIGEST_LEN);
+  memcpy(rs->descriptor_digest, in + 20, DIGEST256_LEN);
+  memcpy(rs->nickname, in + 52, MAX_NICKNAME_LEN+1);
+  if (rs->nickname[MAX_NICKNAME_LEN] != '\0')
+    goto err;
+  if (addr_flags & ADDR_HAS_IPV4)
+    qed_hs_addr_from_ipv4h(&rs->ipv4_addr, ntohl(get_uint32(in + 72)));
+  rs->ipv4_orport = ntohs(get_uint16(in + 76));
+  rs->ipv4_dirport = ntohs(get_uint16(in + 78));
+  if (addr_flags & ADDR_HAS_IPV6)
+    qed_hs_addr_from_ipv6_bytes(&rs->ipv6_addr, in + 80);
+  rs->ipv6_orport = ntohs(get_uint16(in + 96));
+
+  flags = ntohl(get_uint32(in + 100));
+  pv_flags = ntohl(get_uint32(in + 104));
+#define DECODE_RS_FLAG(field, bit) \
+  rs->field = !! (flags & (UINT32_C(1) << (bit)));
+#define DECODE_PV_FLAG(field, bit) \
+  rs->pv.field = !! (pv_flags & (UINT32_C(1) << (bit)));
+  FOREACH_RS_FLAG(DECODE_RS_FLAG)
+  FOREACH_PV_FLAG(DECODE_PV_FLAG)
+#undef DECODE_RS_FLAG
+#undef DECODE_PV_FLAG
+
+  rs->bandwidth_kb = ntohl(get_uint32(in + 108));
+  rs->guardfraction_percentage = ntohl(get_uint32(in + 112));
+  exitsummary_offset = ntohl(get_uint32(in + 116));
+  if (exitsummary_offset != NO_STRING) {
+    if (exitsummary_offset >= strings_len)
+      goto err;
+    const char *s = strings + exitsummary_offset;
+    const char *nul = memchr(s, '\0', strings_len - exitsummary_offset);
+    if (!nul)
+      goto err;
+    rs->exitsummary = qed_hs_memdup(s, nul - s + 1);
+  }
+  return rs;
+ err:
+  routerstatus_free(rs);
+  return NULL;
+}
+
+/** Encode the routerstatus entries of the consensus <b>ns</b> as a snapshot.
+ * Return a newly allocated buffer holding it, and set *<b>len_out</b> to its
+ * length.  Return NULL if <b>ns</b> isn't a consensus. */
+uint8_t *
+ns_snapshot_encode(const networkstatus_t *ns, size_t *len_out)
+{
+  const char *version = get_version();
+  const size_t version_len = strlen(version);
+  const int n = smartlist_len(ns->routerstatus_list);
+  strmap_t *string_offsets;
+  smartlist_t *strings;
+  size_t strings_len = 0, len;
+  uint8_t *result, *cp;
+
+  if (ns->type != NS_TYPE_CONSENSUS)
+    return NULL;
+
+  /* Exit summaries repeat a lot, so we only store each one once. */
+  string_offsets = strmap_new();
+  strings = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *, rs) {
+    if (!rs->exitsummary || strmap_get(string_offsets, rs->exitsummary))
+      continue;
+    /* Store offset+1, so that the first string isn't NULL. */
+    strmap_set(string_offsets, rs->exitsummary,
+               (void *)(uintptr_t)(strings_len + 1));
+    smartlist_add(strings, rs->exitsummary);
+    strings_len += strlen(rs->exitsummary) + 1;
+  } SMARTLIST_FOREACH_END(rs);
+
+  len = NS_SNAPSHOT_HEADER_LEN + version_len +
+    (size_t)n * NS_SNAPSHOT_RECORD_LEN + strings_len;
+  result = cp = qed_hs_malloc(len);
+
+  memcpy(cp, NS_SNAPSHOT_MAGIC, NS_SNAPSHOT_MAGIC_LEN);
+  set_uint32(cp + 8, htonl(NS_SNAPSHOT_FORMAT_VERSION));
+  set_uint32(cp + 12, htonl(ns->flavor));
+  set_uint32(cp + 16, htonl(ns->consensus_method));
+  set_uint32(cp + 20, htonl(n));
+  set_uint32(cp + 24, htonl((uint32_t)strings_len));
+  set_uint32(cp + 28, htonl((uint32_t)version_len));
+  memcpy(cp + 32, ns->digest_sha3_as_signed, DIGEST256_LEN);
+  cp += NS_SNAPSHOT_HEADER_LEN;
+  memcpy(cp, version, version_len);
+  cp += version_len;
+
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *, rs) {
+    uint32_t offset = NO_STRING;
+    if (rs->exitsummary) {
+      void *v = strmap_get(string_offsets, rs->exitsummary);
+      offset = (uint32_t)((uintptr_t)v - 1);
+    }
+    encode_routerstatus(cp, rs, offset);
+    cp += NS_SNAPSHOT_RECORD_LEN;
+  } SMARTLIST_FOREACH_END(rs);
+
+  SMARTLIST_FOREACH_BEGIN(strings, const char *, s) {
+    size_t slen = strlen(s) + 1;
+    memcpy(cp, s, slen);
+    cp += slen;
+  } SMARTLIST_FOREACH_END(s);
+  qed_hs_assert(cp == result + len);
+
+  smartlist_free(strings);
+  strmap_free(string_offsets, NULL);
+  *len_out = len;
+  return result;
+}
+
+/** Try to use the <b>snap_len</b>-byte snapshot at <b>snap</b> for a
+ * consensus of flavor <b>flav</b>, made with <b>consensus_method</b>, whose
+ * signed portion has the SHA3-256 digest <b>sha3_as_signed</b>.
+ *
+ * On success, return a new list of routerstatus_t, in the order in which
+ * they appeared in the consensus.  Return NULL if the snapshot was made for
+ * some other document, by some other version of the code, or is malformed.
+ */
+smartlist_t *
+ns_snapshot_decode(const uint8_t *snap, size_t snap_len,
+                   const uint8_t *sha3_as_signed,
+                   consensus_flavor_t flav,
+                   int consensus_method)
+{
+  const char *version = get_version();
+  uint32_t n, strings_len, version_len;
+  const uint8_t *records;
+  const char *strings;
+  smartlist_t *result = NULL;
+  uint32_t i;
+
+  if (snap_len < NS_SNAPSHOT_HEADER_LEN ||
+      fast_memneq(snap, NS_SNAPSHOT_MAGIC, NS_SNAPSHOT_MAGIC_LEN) ||
+      ntohl(get_uint32(snap + 8)) != NS_SNAPSHOT_FORMAT_VERSION ||
+      ntohl(get_uint32(snap + 12)) != (uint32_t)flav ||
+      ntohl(get_uint32(snap + 16)) != (uint32_t)consensus_method ||
+      fast_memneq(snap + 32, sha3_as_signed, DIGEST256_LEN))
+    return NULL;
+
+  n = ntohl(get_uint32(snap + 20));
+  strings_len = ntohl(get_uint32(snap + 24));
+  version_len = ntohl(get_uint32(snap + 28));
+  if (version_len != strlen(version) ||
+      (uint64_t)snap_len != (uint64_t)NS_SNAPSHOT_HEADER_LEN + version_len +
+                            (uint64_t)n * NS_SNAPSHOT_RECORD_LEN +
+                            strings_len ||
+      fast_memneq(snap + NS_SNAPSHOT_HEADER_LEN, version, version_len)) {
+    log_info(LD_DIR, "Ignoring consensus snapshot from a different version "
+             "or with a bad length.");
+    return NULL;
+  }
+
+  records = snap + NS_SNAPSHOT_HEADER_LEN + version_len;
+  strings = (const char *)records + (size_t)n * NS_SNAPSHOT_RECORD_LEN;
+
+  result = smartlist_new();
+  for (i = 0; i < n; ++i) {
+    const uint8_t *rec = records + (size_t)i * NS_SNAPSHOT_RECORD_LEN;
+    routerstatus_t *rs = decode_routerstatus(rec, strings, strings_len);
+    if (!rs)
+      goto err;
+    if (i > 0) {
+      const routerstatus_t *prev = smartlist_get(result, i - 1);
+      if (fast_memcmp(prev->identity_digest, rs->identity_digest,
+                      DIGEST_LEN) >= 0) {
+        routerstatus_free(rs);
+        goto err;
+      }
+    }
+    smartlist_add(result, rs);
+  }
+  return result;
+
+ err:
+  log_warn(LD_DIR, "Consensus snapshot was malformed; ignoring it.");
+  SMARTLIST_FOREACH(result, routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(result);
+  return NULL;
+}
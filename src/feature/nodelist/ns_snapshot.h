@@ -0,0 +1,27 @@
+/* Copyright (c) 2007-2024, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.h
+ * \brief Header file for ns_snapshot.c.
+ **/
+
+#ifndef QED_HS_NS_SNAPSHOT_H
+#define QED_HS_NS_SNAPSHOT_H
+
+uint8_t *ns_snapshot_encode(const networkstatus_t *ns, size_t *len_out);
+smartlist_t *ns_snapshot_decode(const uint8_t *snap, size_t snap_len,
+                                const uint8_t *sha3_as_signed,
+                                consensus_flavor_t flav,
+                                int consensus_method);
+
+#ifdef NS_SNAPSHOT_PRIVATE
+/** Current version of the snapshot format. */
+#define NS_SNAPSHOT_FORMAT_VERSION 1
+/** Length of the fixed part of a snapshot header. */
+#define NS_SNAPSHOT_HEADER_LEN 64
+/** Length of one encoded routerstatus_t. */
+#define NS_SNAPSHOT_RECORD_LEN 120
+#endif /* defined(NS_SNAPSHOT_PRIVATE) */
+
+#endif /* !defined(QED_HS_NS_SNAPSHOT_H) */
@@ -2379,23 +2379,20 @@ list_pending_downloads(digestmap_t *result, digest256map_t *result256,
 {
   const size_t p_len = strlen(prefix);
   smartlist_t *tmp = smartlist_new();
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *resources = smartlist_new();
   int flags = DSR_HEX;
   if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
     flags = DSR_DIGEST256|DSR_BASE64;
 
   qed_hs_assert(result || result256);
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == purpose &&
-        !conn->marked_for_close) {
-      const char *resource = TO_DIR_CONN(conn)->requested_resource;
-      if (!strcmpstart(resource, prefix))
-        dir_split_resource_into_fingerprints(resource + p_len,
-                                             tmp, NULL, flags);
-    }
-  } SMARTLIST_FOREACH_END(conn);
+  connection_dir_list_pending_resources(purpose, resources);
+  SMARTLIST_FOREACH_BEGIN(resources, const char *, resource) {
+    if (!strcmpstart(resource, prefix))
+      dir_split_resource_into_fingerprints(resource + p_len,
+                                           tmp, NULL, flags);
+  } SMARTLIST_FOREACH_END(resource);
+  smartlist_free(resources);
 
   if (result) {
     SMARTLIST_FOREACH(tmp, char *, d,
@@ -65,6 +65,8 @@ struct routerstatus_t {
   unsigned int has_exitsummary:1; /**< The vote/consensus had exit summaries */
   unsigned int bw_is_unmeasured:1; /**< This is a consensus entry, with
                                     * the Unmeasured flag set. */
+  /** The consensus has guardfraction information for this router. */
+  unsigned int has_guardfraction:1;
 
   /** Flags to summarize the protocol versions for this routerstatus_t. */
   protover_summary_flags_t pv;
@@ -72,8 +74,6 @@ struct routerstatus_t {
   uint32_t bandwidth_kb; /**< Bandwidth (capacity) of the router as reported in
                        * the vote/consensus, in kilobytes/sec. */
 
-  /** The consensus has guardfraction information for this router. */
-  unsigned int has_guardfraction:1;
   /** The guardfraction value of this router. */
   uint32_t guardfraction_percentage;
 
@@ -534,6 +534,10 @@ geoip_start_dirreq(uint64_t dirreq_id, size_t response_size,
   dirreq_map_entry_t *ent;
   if (!get_options()->DirReqStatistics)
     return;
+  /* A kept-alive tunneled connection can ask for more than one network
+   * status; we only measure the first. */
+  if (dirreq_map_get_(type, dirreq_id))
+    return;
   ent = qed_hs_malloc_zero(sizeof(dirreq_map_entry_t));
   ent->dirreq_id = dirreq_id;
   tor_gettimeofday(&ent->request_time);
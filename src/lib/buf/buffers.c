@@ -66,6 +66,11 @@
  * string, use the buf_pullup function to make them so.  Don't do this more
  * than necessary.
  *
+ * A chunk can also refer to memory that the buffer doesn't own, such as a
+ * mapped file that we're sending, so that we don't copy it onto the heap.
+ * Such "external" chunks have no room to add data, and we never write to
+ * them.
+ *
  * The major free Unix kernels have handled buffers like this since, like,
  * forever.
  */
@@ -136,6 +141,8 @@ buf_chunk_free_unchecked(chunk_t *chunk)
   qed_hs_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (CHUNK_IS_EXTERNAL(chunk))
+    chunk->ext_free_fn(chunk->ext_free_arg);
   qed_hs_free(chunk);
 }
 static inline chunk_t *
@@ -151,6 +158,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->ext_free_fn = NULL;
+  ch->ext_free_arg = NULL;
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
@@ -229,6 +238,21 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (CHUNK_IS_EXTERNAL(buf->head)) {
+    /* We can't add data to memory we don't own, so copy the head into a
+     * chunk of our own first. */
+    chunk_t *ext = buf->head, *newhead;
+    newhead = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+    memcpy(newhead->mem, ext->data, ext->datalen);
+    newhead->datalen = ext->datalen;
+    newhead->inserted_time = ext->inserted_time;
+    newhead->next = ext->next;
+    if (buf->tail == ext)
+      buf->tail = newhead;
+    buf->head = newhead;
+    buf_chunk_free_unchecked(ext);
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -435,6 +459,15 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (CHUNK_IS_EXTERNAL(in_chunk)) {
+    /* We can't share the external memory: copy its contents instead. */
+    chunk_t *newch =
+      chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->datalen));
+    memcpy(newch->mem, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
   chunk_t *newch = qed_hs_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -555,6 +588,51 @@ buf_add(buf_t *buf, const char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Append <b>data_len</b> bytes from <b>data</b> to the end of <b>buf</b>
+ * without copying them.  The memory at <b>data</b> must stay valid and
+ * unchanged until the buffer calls <b>free_fn</b>(<b>free_arg</b>), which
+ * it does exactly once: when it no longer needs the bytes, or right away if
+ * it can't take them.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                 void (*free_fn)(void *), void *free_arg)
+{
+  qed_hs_assert(free_fn);
+  check();
+
+  if (!data_len) {
+    free_fn(free_arg);
+    return (int)buf->datalen;
+  }
+  if (BUG(buf->datalen > BUF_MAX_LEN) ||
+      BUG(buf->datalen > BUF_MAX_LEN - data_len)) {
+    free_fn(free_arg);
+    return -1;
+  }
+
+  chunk_t *chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  /* We never write through this pointer. */
+  chunk->data = (char *)data;
+  chunk->datalen = data_len;
+  chunk->ext_free_fn = free_fn;
+  chunk->ext_free_arg = free_arg;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += data_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Add a nul-terminated <b>string</b> to <b>buf</b>, not including the
  * terminating NUL. */
 void
@@ -921,8 +999,15 @@ buf_assert_ok(buf_t *buf)
     qed_hs_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
-      qed_hs_assert(ch->datalen <= ch->memlen);
       qed_hs_assert(ch->datalen <= BUF_MAX_LEN);
+      if (CHUNK_IS_EXTERNAL(ch)) {
+        qed_hs_assert(ch->memlen == 0);
+        qed_hs_assert(ch->data);
+        if (!ch->next)
+          qed_hs_assert(ch == buf->tail);
+        continue;
+      }
+      qed_hs_assert(ch->datalen <= ch->memlen);
       qed_hs_assert(ch->data >= &ch->mem[0]);
       qed_hs_assert(ch->data <= &ch->mem[0]+ch->memlen);
       if (ch->data == &ch->mem[0]+ch->memlen) {
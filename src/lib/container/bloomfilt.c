@@ -5,10 +5,21 @@
 
 /**
  * \file bloomfilt.c
- * \brief Uses bitarray_t to implement a bloom filter.
+ * \brief Implements a blocked ("split block") Bloom filter.
+ *
+ * Instead of setting bits all over one big bit array, we use one 64-bit
+ * keyed hash per item: its high half picks a 256-bit block, and its low
+ * half, multiplied by eight fixed odd constants, picks one bit in each of
+ * the block's eight 32-bit words.  A lookup therefore touches one cache
+ * line, and the eight words can be tested with a single vector operation.
+ *
+ * Since an item only ever touches its own block, a block can be cleared
+ * and refilled from the hashes of the items that land in it, which lets
+ * our callers remove items without rebuilding the whole filter.
  **/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib/malloc/malloc.h"
 #include "lib/container/bloomfilt.h"
@@ -16,36 +27,127 @@
 #include "lib/log/util_bug.h"
 #include "ext/siphash.h"
 
-/** How many bloom-filter bits we set per address. This is twice the
- * BLOOMFILT_N_HASHES value, since we split the siphash output into two 32-bit
- * values. */
-#define N_BITS_PER_ITEM (BLOOMFILT_N_HASHES * 2)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/** How many 32-bit words are in a block, and how many bits we set per
+ * item. */
+#define BLOCK_WORDS 8
+/** How many bytes are in a block. */
+#define BLOCK_BYTES (BLOCK_WORDS * 4)
+/** How many bits are in a block. */
+#define BLOCK_BITS (BLOCK_BYTES * 8)
+/** Alignment of the block array: one cache line, so that no block is ever
+ * split across two. */
+#define BLOCK_ALIGN 64
+
+/** Odd multipliers that spread the low half of an item's hash over the
+ * words of its block.  (These are the ones that Parquet's split block Bloom
+ * filters use.) */
+static const uint32_t bloomfilt_salt[BLOCK_WORDS] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
 
 struct bloomfilt_t {
-  /** siphash keys to make BLOOMFILT_N_HASHES independent hashes for each
-   * items. */
-  struct sipkey key[BLOOMFILT_N_HASHES];
+  /** siphash key used to hash each item. */
+  struct sipkey key;
   bloomfilt_hash_fn hashfn; /**< Function used to generate hashes */
-  uint32_t mask; /**< One less than the number of bits in <b>ba</b>; always
-                  * one less than a power of two. */
-  bitarray_t *ba; /**< A bit array to implement the Bloom filter. */
+  uint32_t block_mask; /**< One less than the number of blocks; always
+                        * one less than a power of two. */
+  /** The blocks of the filter, aligned to BLOCK_ALIGN. */
+  uint32_t *blocks;
+  /** The allocation that holds <b>blocks</b>. */
+  void *blocks_mem;
 };
 
-#define BIT(set, n) ((n) & (set)->mask)
+/** Return a pointer to the first word of block number <b>block</b> in
+ * <b>set</b>. */
+#define BLOCK(set, block) ((set)->blocks + (size_t)(block) * BLOCK_WORDS)
+
+/** Return the number of blocks that bloomfilt_new() would use for a filter
+ * of <b>max_elements</b> elements. */
+static uint32_t
+bloomfilt_n_blocks_for(int max_elements)
+{
+  /* We use between 16 and 32 bits per element, as we did when this was a
+   * plain Bloom filter with 4 bits per element.  With 8 bits per element in
+   * 256-bit blocks, a full filter at 16 bits per element gives about 0.1%
+   * false positives, where the plain one gave about 0.2%. */
+  uint64_t n_bits = UINT64_C(1) << (qed_hs_log2(max_elements)+5);
+  if (n_bits < BLOCK_BITS)
+    return 1;
+  return (uint32_t)(n_bits / BLOCK_BITS);
+}
+
+#if defined(__AVX2__)
+/** Return the 8 words of bits that an item with the low hash bits
+ * <b>x</b> sets in its block. */
+static inline __m256i
+bloomfilt_make_mask(uint32_t x)
+{
+  const __m256i salt =
+    _mm256_loadu_si256((const __m256i *)bloomfilt_salt);
+  __m256i bits = _mm256_mullo_epi32(_mm256_set1_epi32((int)x), salt);
+  bits = _mm256_srli_epi32(bits, 27);
+  return _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+}
+#endif /* defined(__AVX2__) */
+
+/** Set the bits for an item with hash <b>hash</b> in <b>set</b>. */
+void
+bloomfilt_add_hash(bloomfilt_t *set, uint64_t hash)
+{
+  uint32_t *b = BLOCK(set, (uint32_t)(hash >> 32) & set->block_mask);
+  uint32_t x = (uint32_t)hash;
+#if defined(__AVX2__)
+  __m256i *v = (__m256i *)b;
+  _mm256_store_si256(v, _mm256_or_si256(_mm256_load_si256(v),
+                                        bloomfilt_make_mask(x)));
+#else
+  int i;
+  for (i = 0; i < BLOCK_WORDS; ++i)
+    b[i] |= UINT32_C(1) << ((x * bloomfilt_salt[i]) >> 27);
+#endif /* defined(__AVX2__) */
+}
+
+/** Return nonzero if all the bits for an item with hash <b>hash</b> are set
+ * in <b>set</b>. */
+int
+bloomfilt_probably_contains_hash(const bloomfilt_t *set, uint64_t hash)
+{
+  const uint32_t *b = BLOCK(set, (uint32_t)(hash >> 32) & set->block_mask);
+  uint32_t x = (uint32_t)hash;
+#if defined(__AVX2__)
+  return _mm256_testc_si256(_mm256_load_si256((const __m256i *)b),
+                            bloomfilt_make_mask(x));
+#else
+  /* No early exit: the loop is branch-free, so the compiler can vectorize
+   * it on its own. */
+  uint32_t missing = 0;
+  int i;
+  for (i = 0; i < BLOCK_WORDS; ++i) {
+    uint32_t bit = UINT32_C(1) << ((x * bloomfilt_salt[i]) >> 27);
+    missing |= bit & ~b[i];
+  }
+  return missing == 0;
+#endif /* defined(__AVX2__) */
+}
+
+/** Return the keyed hash that <b>set</b> uses for <b>item</b>. */
+uint64_t
+bloomfilt_hash(const bloomfilt_t *set, const void *item)
+{
+  return set->hashfn(&set->key, item);
+}
 
 /** Add the element <b>item</b> to <b>set</b>. */
 void
 bloomfilt_add(bloomfilt_t *set,
               const void *item)
 {
-  int i;
-  for (i = 0; i < BLOOMFILT_N_HASHES; ++i) {
-    uint64_t h = set->hashfn(&set->key[i], item);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    bitarray_set(set->ba, BIT(set, high_bits));
-    bitarray_set(set->ba, BIT(set, low_bits));
-  }
+  bloomfilt_add_hash(set, bloomfilt_hash(set, item));
 }
 
 /** If <b>item</b> is in <b>set</b>, return nonzero.  Otherwise,
@@ -54,17 +156,41 @@ int
 bloomfilt_probably_contains(const bloomfilt_t *set,
                             const void *item)
 {
-  int i, matches = 0;
-  for (i = 0; i < BLOOMFILT_N_HASHES; ++i) {
-    uint64_t h = set->hashfn(&set->key[i], item);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    // Note that !! is necessary here, since bitarray_is_set does not
-    // necessarily return 1 on true.
-    matches += !! bitarray_is_set(set->ba, BIT(set, high_bits));
-    matches += !! bitarray_is_set(set->ba, BIT(set, low_bits));
-  }
-  return matches == N_BITS_PER_ITEM;
+  return bloomfilt_probably_contains_hash(set, bloomfilt_hash(set, item));
+}
+
+/** Return the index of the block that an item with hash <b>hash</b> uses
+ * in <b>set</b>. */
+uint32_t
+bloomfilt_hash_get_block(const bloomfilt_t *set, uint64_t hash)
+{
+  return (uint32_t)(hash >> 32) & set->block_mask;
+}
+
+/** Return the number of blocks in <b>set</b>. */
+uint32_t
+bloomfilt_get_n_blocks(const bloomfilt_t *set)
+{
+  return set->block_mask + 1;
+}
+
+/** Clear every bit in block number <b>block</b> of <b>set</b>.  The caller
+ * is responsible for adding back the hashes of any items in that block
+ * that should stay in the set. */
+void
+bloomfilt_clear_block(bloomfilt_t *set, uint32_t block)
+{
+  if (BUG(block > set->block_mask))
+    return;
+  memset(BLOCK(set, block), 0, BLOCK_BYTES);
+}
+
+/** Return true iff bloomfilt_new() would make a filter of the same size as
+ * <b>set</b> for <b>max_elements</b> elements. */
+int
+bloomfilt_is_sized_for(const bloomfilt_t *set, int max_elements)
+{
+  return bloomfilt_n_blocks_for(max_elements) == set->block_mask + 1;
 }
 
 /** Return a newly allocated bloomfilt_t, optimized to hold a total of
@@ -79,23 +205,19 @@ bloomfilt_new(int max_elements,
               bloomfilt_hash_fn hashfn,
               const uint8_t *random_key)
 {
-  /* The probability of false positives is about P=(1 - exp(-kn/m))^k, where k
-   * is the number of hash functions per entry, m is the bits in the array,
-   * and n is the number of elements inserted.  For us, k==4, n<=max_elements,
-   * and m==n_bits= approximately max_elements*32.  This gives
-   *   P<(1-exp(-4*n/(32*n)))^4 == (1-exp(1/-8))^4 == .00019
-   *
-   * It would be more optimal in space vs false positives to get this false
-   * positive rate by going for k==13, and m==18.5n, but we also want to
-   * conserve CPU, and k==13 is pretty big.
-   */
-  int n_bits = 1u << (qed_hs_log2(max_elements)+5);
+  uint32_t n_blocks = bloomfilt_n_blocks_for(max_elements);
   bloomfilt_t *r = qed_hs_malloc(sizeof(bloomfilt_t));
-  r->mask = n_bits - 1;
-  r->ba = bitarray_init_zero(n_bits);
+  uintptr_t p;
+
+  r->block_mask = n_blocks - 1;
+  r->blocks_mem = qed_hs_malloc_zero((size_t)n_blocks * BLOCK_BYTES +
+                                     BLOCK_ALIGN - 1);
+  p = (uintptr_t) r->blocks_mem;
+  p = (p + BLOCK_ALIGN - 1) & ~(uintptr_t)(BLOCK_ALIGN - 1);
+  r->blocks = (uint32_t *) p;
 
   qed_hs_assert(sizeof(r->key) == BLOOMFILT_KEY_LEN);
-  memcpy(r->key, random_key, sizeof(r->key));
+  memcpy(&r->key, random_key, sizeof(r->key));
 
   r->hashfn = hashfn;
 
@@ -108,6 +230,6 @@ bloomfilt_free_(bloomfilt_t *set)
 {
   if (!set)
     return;
-  bitarray_free(set->ba);
+  qed_hs_free(set->blocks_mem);
   qed_hs_free(set);
 }
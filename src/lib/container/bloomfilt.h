@@ -16,14 +16,11 @@
 #include "lib/cc/torint.h"
 #include "lib/container/bitarray.h"
 
-/** A set of elements, implemented as a Bloom filter. */
+/** A set of elements, implemented as a blocked Bloom filter. */
 typedef struct bloomfilt_t bloomfilt_t;
 
-/** How many 64-bit siphash values to extract per item. */
-#define BLOOMFILT_N_HASHES 2
-
 /** How much key material do we need to randomize hashes? */
-#define BLOOMFILT_KEY_LEN (BLOOMFILT_N_HASHES * 16)
+#define BLOOMFILT_KEY_LEN 16
 
 struct sipkey;
 typedef uint64_t (*bloomfilt_hash_fn)(const struct sipkey *key,
@@ -32,6 +29,14 @@ typedef uint64_t (*bloomfilt_hash_fn)(const struct sipkey *key,
 void bloomfilt_add(bloomfilt_t *set, const void *item);
 int bloomfilt_probably_contains(const bloomfilt_t *set, const void *item);
 
+uint64_t bloomfilt_hash(const bloomfilt_t *set, const void *item);
+void bloomfilt_add_hash(bloomfilt_t *set, uint64_t hash);
+int bloomfilt_probably_contains_hash(const bloomfilt_t *set, uint64_t hash);
+uint32_t bloomfilt_hash_get_block(const bloomfilt_t *set, uint64_t hash);
+uint32_t bloomfilt_get_n_blocks(const bloomfilt_t *set);
+void bloomfilt_clear_block(bloomfilt_t *set, uint32_t block);
+int bloomfilt_is_sized_for(const bloomfilt_t *set, int max_elements);
+
 bloomfilt_t *bloomfilt_new(int max_elements,
                            bloomfilt_hash_fn hashfn,
                            const uint8_t *random_key);
@@ -0,0 +1,593 @@
+/* Copyright (c) 2007-2024, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file flatmap.c
+ *
+ * \brief Open-addressing implementations of a string-to-void* map, and of
+ * digest-to-void* maps, with the same interface as map.c.
+ *
+ * Each map keeps one array of slots holding the keys (inline, for digests)
+ * and values, and a parallel array of one-byte control tags.  A tag is
+ * either FLATMAP_EMPTY, FLATMAP_DELETED, or the low 7 bits of the hash of
+ * the key in that slot.  To find a key, we look at a group of consecutive
+ * tags at once, starting at a position given by the rest of the hash, and
+ * only compare keys for the slots whose tag matches.  With SSE2 or NEON,
+ * comparing a group of tags is one or two vector instructions; otherwise we
+ * use the same trick on 64-bit words.
+ *
+ * The tag array has FLATMAP_GROUP_WIDTH extra bytes at the end, which
+ * mirror the first ones, so that a group can be loaded at any position
+ * without wrapping around.
+ **/
+
+#include "lib/container/flatmap.h"
+#include "lib/ctime/di_ops.h"
+#include "lib/defs/digest_sizes.h"
+#include "lib/malloc/malloc.h"
+
+#include "lib/log/util_bug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/** Control tag of a slot that has never held an entry. */
+#define FLATMAP_EMPTY ((uint8_t) 0x80)
+/** Control tag of a slot whose entry was removed. Lookups must probe past
+ * it, but inserts may reuse it. */
+#define FLATMAP_DELETED ((uint8_t) 0xfe)
+/** Return true iff the control tag <b>c</b> is for a slot holding an
+ * entry. */
+#define FLATMAP_IS_FULL(c) (((c) & 0x80) == 0)
+
+/** Smallest number of slots in a map that holds anything. */
+#define FLATMAP_MIN_CAPACITY 16
+
+/* A "group mask" has one bit, or one byte, set for each tag of a group that
+ * matches a condition.  Use FLATMAP_MASK_FIRST() to get the position in the
+ * group of the lowest one, and FLATMAP_MASK_CLEAR_FIRST() to clear it. */
+#if defined(__SSE2__)
+#define FLATMAP_GROUP_WIDTH 16
+#define FLATMAP_MASK_SHIFT 0
+typedef uint32_t flatmap_mask_t;
+#else
+#define FLATMAP_GROUP_WIDTH 8
+#define FLATMAP_MASK_SHIFT 3
+typedef uint64_t flatmap_mask_t;
+#endif
+
+#define FLATMAP_MASK_CLEAR_FIRST(m) ((m) & ((m) - 1))
+
+/** Return the index of the lowest set bit of the nonzero <b>m</b>. */
+static inline unsigned
+flatmap_ctz(flatmap_mask_t m)
+{
+#if defined(__GNUC__)
+  return (unsigned) __builtin_ctzll((unsigned long long) m);
+#else
+  unsigned n = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+#define FLATMAP_MASK_FIRST(m) (flatmap_ctz(m) >> FLATMAP_MASK_SHIFT)
+
+#if !defined(__SSE2__)
+/** Byte-wise constants for the 64-bit word versions of the group
+ * functions. */
+#define FLATMAP_LSBS UINT64_C(0x0101010101010101)
+#define FLATMAP_MSBS UINT64_C(0x8080808080808080)
+
+/** Load the group of tags starting at <b>ctrl</b> into a 64-bit word, with
+ * the first tag in the low byte. */
+static inline uint64_t
+flatmap_group_load(const uint8_t *ctrl)
+{
+#if defined(__ARM_NEON)
+  return vget_lane_u64(vreinterpret_u64_u8(vld1_u8(ctrl)), 0);
+#else
+  uint64_t g;
+#ifdef WORDS_BIGENDIAN
+  int i;
+  for (g = 0, i = FLATMAP_GROUP_WIDTH - 1; i >= 0; --i)
+    g = (g << 8) | ctrl[i];
+#else
+  memcpy(&g, ctrl, sizeof(g));
+#endif
+  return g;
+#endif /* defined(__ARM_NEON) */
+}
+#endif /* !defined(__SSE2__) */
+
+/** Return the group mask of the tags starting at <b>ctrl</b> that are equal
+ * to the hash tag <b>h2</b>. */
+static inline flatmap_mask_t
+flatmap_group_match(const uint8_t *ctrl, uint8_t h2)
+{
+#if defined(__SSE2__)
+  __m128i g = _mm_loadu_si128((const __m128i *) ctrl);
+  return (flatmap_mask_t)
+    _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) h2)));
+#elif defined(__ARM_NEON)
+  uint8x8_t eq = vceq_u8(vld1_u8(ctrl), vdup_n_u8(h2));
+  return vget_lane_u64(vreinterpret_u64_u8(eq), 0) & FLATMAP_MSBS;
+#else
+  /* This can report a false match in a byte just above a real one, which
+   * is harmless: we compare the keys of every match anyway. */
+  uint64_t x = flatmap_group_load(ctrl) ^ (FLATMAP_LSBS * h2);
+  return (x - FLATMAP_LSBS) & ~x & FLATMAP_MSBS;
+#endif /* defined(__SSE2__) || ... */
+}
+
+/** Return the group mask of the tags starting at <b>ctrl</b> that are
+ * FLATMAP_EMPTY. */
+static inline flatmap_mask_t
+flatmap_group_match_empty(const uint8_t *ctrl)
+{
+#if defined(__SSE2__)
+  __m128i g = _mm_loadu_si128((const __m128i *) ctrl);
+  return (flatmap_mask_t)
+    _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) FLATMAP_EMPTY)));
+#else
+  /* EMPTY is the only tag with its top bit set and its second-lowest bit
+   * clear. */
+  uint64_t g = flatmap_group_load(ctrl);
+  return g & ~(g << 6) & FLATMAP_MSBS;
+#endif
+}
+
+/** Return the group mask of the tags starting at <b>ctrl</b> that are
+ * FLATMAP_EMPTY or FLATMAP_DELETED. */
+static inline flatmap_mask_t
+flatmap_group_match_free(const uint8_t *ctrl)
+{
+#if defined(__SSE2__)
+  return (flatmap_mask_t)
+    _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+  return flatmap_group_load(ctrl) & FLATMAP_MSBS;
+#endif
+}
+
+/** Set the control tag of slot <b>idx</b> to <b>tag</b>, in a tag array for
+ * <b>capacity</b> slots, keeping the mirrored tags up to date. */
+static inline void
+flatmap_set_ctrl(uint8_t *ctrl, size_t capacity, size_t idx, uint8_t tag)
+{
+  ctrl[idx] = tag;
+  if (idx < FLATMAP_GROUP_WIDTH)
+    ctrl[capacity + idx] = tag;
+}
+
+/** Return a newly allocated tag array for <b>capacity</b> slots, with every
+ * slot empty. */
+static uint8_t *
+flatmap_ctrl_new(size_t capacity)
+{
+  uint8_t *ctrl = qed_hs_malloc(capacity + FLATMAP_GROUP_WIDTH);
+  memset(ctrl, FLATMAP_EMPTY, capacity + FLATMAP_GROUP_WIDTH);
+  return ctrl;
+}
+
+/** Return the number of entries a map with <b>capacity</b> slots may hold,
+ * counting removed entries, before it must be resized.  We keep at least
+ * 1/8 of the slots empty so that unsuccessful lookups stop early. */
+static inline size_t
+flatmap_max_load(size_t capacity)
+{
+  return capacity - capacity / 8;
+}
+
+/** Return the index of the first free slot in the probe sequence for
+ * <b>hash</b>, in a tag array for <b>capacity</b> slots.  There must be at
+ * least one. */
+static size_t
+flatmap_find_free_slot(const uint8_t *ctrl, size_t capacity, uint64_t hash)
+{
+  const size_t mask = capacity - 1;
+  size_t pos = (size_t) (hash >> 7) & mask;
+  size_t step = 0;
+  for (;;) {
+    flatmap_mask_t m = flatmap_group_match_free(ctrl + pos);
+    if (m)
+      return (pos + FLATMAP_MASK_FIRST(m)) & mask;
+    step += FLATMAP_GROUP_WIDTH;
+    pos = (pos + step) & mask;
+  }
+}
+
+/** Helper: Declare the slot and map types of a flat map called
+ * <b>maptype</b>, whose slots hold a key declared as <b>keydecl</b>. */
+#define DEFINE_FLATMAP_STRUCTS(maptype, keydecl, prefix)   \
+  typedef struct prefix ## _slot_t {                       \
+    void *val;                                             \
+    keydecl;                                               \
+  } prefix ## _slot_t;                                     \
+  struct maptype {                                         \
+    /** Array of <b>capacity</b> slots. */                 \
+    prefix ## _slot_t *slots;                              \
+    /** Array of capacity + FLATMAP_GROUP_WIDTH control tags. */ \
+    uint8_t *ctrl;                                         \
+    /** Number of slots: 0, or a power of two at least */  \
+    /** FLATMAP_MIN_CAPACITY. */                           \
+    size_t capacity;                                       \
+    /** Number of entries. */                              \
+    size_t size;                                           \
+    /** Number of FLATMAP_DELETED slots. */                \
+    size_t n_deleted;                                      \
+  }
+
+DEFINE_FLATMAP_STRUCTS(strflatmap_t, char *key, strflatmap);
+DEFINE_FLATMAP_STRUCTS(digestflatmap_t, char key[DIGEST_LEN], digestflatmap);
+DEFINE_FLATMAP_STRUCTS(digest256flatmap_t, uint8_t key[DIGEST256_LEN],
+                       digest256flatmap);
+
+/** Helper: return a hash value for the string <b>key</b>. */
+static inline uint64_t
+strflatmap_key_hash(const char *key)
+{
+  return siphash24g(key, strlen(key));
+}
+/** Helper: return true iff <b>slot</b> holds <b>key</b>. */
+static inline int
+strflatmap_key_eq(const strflatmap_slot_t *slot, const char *key)
+{
+  return !strcmp(slot->key, key);
+}
+static inline void
+strflatmap_assign_key(strflatmap_slot_t *slot, const char *key)
+{
+  slot->key = qed_hs_strdup(key);
+}
+static inline void
+strflatmap_clear_key(strflatmap_slot_t *slot)
+{
+  qed_hs_free(slot->key);
+}
+
+static inline uint64_t
+digestflatmap_key_hash(const char *key)
+{
+  return siphash24g(key, DIGEST_LEN);
+}
+static inline int
+digestflatmap_key_eq(const digestflatmap_slot_t *slot, const char *key)
+{
+  return fast_memeq(slot->key, key, DIGEST_LEN);
+}
+static inline void
+digestflatmap_assign_key(digestflatmap_slot_t *slot, const char *key)
+{
+  memcpy(slot->key, key, DIGEST_LEN);
+}
+static inline void
+digestflatmap_clear_key(digestflatmap_slot_t *slot)
+{
+  (void) slot;
+}
+
+static inline uint64_t
+digest256flatmap_key_hash(const uint8_t *key)
+{
+  return siphash24g(key, DIGEST256_LEN);
+}
+static inline int
+digest256flatmap_key_eq(const digest256flatmap_slot_t *slot,
+                        const uint8_t *key)
+{
+  return fast_memeq(slot->key, key, DIGEST256_LEN);
+}
+static inline void
+digest256flatmap_assign_key(digest256flatmap_slot_t *slot, const uint8_t *key)
+{
+  memcpy(slot->key, key, DIGEST256_LEN);
+}
+static inline void
+digest256flatmap_clear_key(digest256flatmap_slot_t *slot)
+{
+  (void) slot;
+}
+
+/**
+ * Macro: implement all the functions for a map that are declared in
+ * flatmap.h by the DECLARE_FLATMAP_FNS() macro.  You must additionally
+ * define a prefix_key_hash() function to hash a key, a prefix_key_eq()
+ * function to compare a slot's key with a key, a prefix_assign_key()
+ * function to store a copy of a key in a slot, and a prefix_clear_key()
+ * function to release the key stored in a slot.
+ *
+ * The keys are hashed with siphash, as in map.c, since many of them come
+ * from the network.  Slot positions use the high bits of the hash, and the
+ * control tags its low 7 bits.
+ */
+#define IMPLEMENT_FLATMAP_FNS(maptype, keytype, prefix)                 \
+  /** Create and return a new empty map. */                             \
+  MOCK_IMPL(maptype *,                                                  \
+  prefix##_new,(void))                                                  \
+  {                                                                     \
+    return qed_hs_malloc_zero(sizeof(maptype));                         \
+  }                                                                     \
+                                                                        \
+  /** Return the index of the slot of <b>map</b> holding <b>key</b>,   \
+   * whose hash is <b>hash</b>, or -1 if there is none. */              \
+  static inline ssize_t                                                 \
+  prefix##_find(const maptype *map, const keytype key, uint64_t hash)   \
+  {                                                                     \
+    const size_t mask = map->capacity - 1;                              \
+    const uint8_t h2 = (uint8_t) (hash & 0x7f);                         \
+    size_t pos = (size_t) (hash >> 7) & mask;                           \
+    size_t step = 0;                                                    \
+    if (map->capacity == 0)                                             \
+      return -1;                                                        \
+    for (;;) {                                                          \
+      flatmap_mask_t m = flatmap_group_match(map->ctrl + pos, h2);      \
+      while (m) {                                                       \
+        size_t idx = (pos + FLATMAP_MASK_FIRST(m)) & mask;              \
+        if (PREDICT_LIKELY(prefix##_key_eq(&map->slots[idx], key)))     \
+          return (ssize_t) idx;                                         \
+        m = FLATMAP_MASK_CLEAR_FIRST(m);                                \
+      }                                                                 \
+      if (flatmap_group_match_empty(map->ctrl + pos))                   \
+        return -1;                                                      \
+      step += FLATMAP_GROUP_WIDTH;                                      \
+      /* We always find an empty slot before we come back to pos. */   \
+      pos = (pos + step) & mask;                                        \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  /** Move every entry of <b>map</b> into new arrays of                 \
+   * <b>new_capacity</b> slots, dropping the removed ones. */           \
+  static void                                                           \
+  prefix##_rehash(maptype *map, size_t new_capacity)                    \
+  {                                                                     \
+    prefix##_slot_t *new_slots =                                        \
+      qed_hs_calloc(new_capacity, sizeof(prefix##_slot_t));             \
+    uint8_t *new_ctrl = flatmap_ctrl_new(new_capacity);                 \
+    size_t i;                                                           \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      size_t idx;                                                       \
+      uint64_t hash;                                                    \
+      if (!FLATMAP_IS_FULL(map->ctrl[i]))                               \
+        continue;                                                       \
+      hash = prefix##_key_hash(map->slots[i].key);                      \
+      idx = flatmap_find_free_slot(new_ctrl, new_capacity, hash);       \
+      flatmap_set_ctrl(new_ctrl, new_capacity, idx,                     \
+                       (uint8_t) (hash & 0x7f));                        \
+      new_slots[idx] = map->slots[i];                                   \
+    }                                                                   \
+    qed_hs_free(map->slots);                                            \
+    qed_hs_free(map->ctrl);                                             \
+    map->slots = new_slots;                                             \
+    map->ctrl = new_ctrl;                                               \
+    map->capacity = new_capacity;                                       \
+    map->n_deleted = 0;                                                 \
+  }                                                                     \
+                                                                        \
+  /** Return the item from <b>map</b> whose key matches <b>key</b>, or  \
+   * NULL if no such value exists. */                                   \
+  void *                                                                \
+  prefix##_get(const maptype *map, const keytype key)                   \
+  {                                                                     \
+    ssize_t idx;                                                        \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert(key);                                                 \
+    if (map->size == 0)                                                 \
+      return NULL;                                                      \
+    idx = prefix##_find(map, key, prefix##_key_hash(key));              \
+    return (idx < 0) ? NULL : map->slots[idx].val;                      \
+  }                                                                     \
+                                                                        \
+  /** Add an entry to <b>map</b> mapping <b>key</b> to <b>val</b>;      \
+   * return the previous value, or NULL if no such value existed. */     \
+  void *                                                                \
+  prefix##_set(maptype *map, const keytype key, void *val)              \
+  {                                                                     \
+    uint64_t hash;                                                      \
+    ssize_t found;                                                      \
+    size_t idx;                                                         \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert(key);                                                 \
+    qed_hs_assert(val);                                                 \
+    hash = prefix##_key_hash(key);                                      \
+    found = prefix##_find(map, key, hash);                              \
+    if (found >= 0) {                                                   \
+      void *oldval = map->slots[found].val;                             \
+      map->slots[found].val = val;                                      \
+      return oldval;                                                    \
+    }                                                                   \
+    if (map->size + map->n_deleted + 1 > flatmap_max_load(map->capacity)) { \
+      /* Grow if the entries fill more than half of the load we allow, */ \
+      /* else just clear out the removed ones. */                       \
+      size_t new_capacity = map->capacity;                              \
+      if (new_capacity == 0)                                            \
+        new_capacity = FLATMAP_MIN_CAPACITY;                            \
+      else if (map->size + 1 > flatmap_max_load(map->capacity) / 2)     \
+        new_capacity *= 2;                                              \
+      prefix##_rehash(map, new_capacity);                               \
+    }                                                                   \
+    idx = flatmap_find_free_slot(map->ctrl, map->capacity, hash);       \
+    if (map->ctrl[idx] == FLATMAP_DELETED)                              \
+      --map->n_deleted;                                                 \
+    flatmap_set_ctrl(map->ctrl, map->capacity, idx,                     \
+                     (uint8_t) (hash & 0x7f));                          \
+    prefix##_assign_key(&map->slots[idx], key);                         \
+    map->slots[idx].val = val;                                          \
+    ++map->size;                                                        \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Mark the full slot <b>idx</b> of <b>map</b> as removed, and       \
+   * release its key. */                                                \
+  static inline void                                                    \
+  prefix##_remove_slot(maptype *map, size_t idx)                        \
+  {                                                                     \
+    prefix##_clear_key(&map->slots[idx]);                               \
+    memset(&map->slots[idx], 0, sizeof(prefix##_slot_t));               \
+    flatmap_set_ctrl(map->ctrl, map->capacity, idx, FLATMAP_DELETED);   \
+    --map->size;                                                        \
+    ++map->n_deleted;                                                   \
+  }                                                                     \
+                                                                        \
+  /** Remove the value currently associated with <b>key</b> from the map. \
+   * Return the value if one was set, or NULL if there was no entry for \
+   * <b>key</b>.                                                        \
+   *                                                                    \
+   * Note: you must free any storage associated with the returned value. \
+   */                                                                   \
+  void *                                                                \
+  prefix##_remove(maptype *map, const keytype key)                      \
+  {                                                                     \
+    ssize_t idx;                                                        \
+    void *oldval;                                                       \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert(key);                                                 \
+    if (map->size == 0)                                                 \
+      return NULL;                                                      \
+    idx = prefix##_find(map, key, prefix##_key_hash(key));              \
+    if (idx < 0)                                                        \
+      return NULL;                                                      \
+    oldval = map->slots[idx].val;                                       \
+    prefix##_remove_slot(map, (size_t) idx);                            \
+    return oldval;                                                      \
+  }                                                                     \
+                                                                        \
+  /** Return the number of elements in <b>map</b>. */                   \
+  int                                                                   \
+  prefix##_size(const maptype *map)                                     \
+  {                                                                     \
+    return (int) map->size;                                             \
+  }                                                                     \
+                                                                        \
+  /** Return true iff <b>map</b> has no entries. */                     \
+  int                                                                   \
+  prefix##_isempty(const maptype *map)                                  \
+  {                                                                     \
+    return map->size == 0;                                              \
+  }                                                                     \
+                                                                        \
+  /** Assert that <b>map</b> is not corrupt. */                         \
+  void                                                                  \
+  prefix##_assert_ok(const maptype *map)                                \
+  {                                                                     \
+    size_t i, n_full = 0, n_deleted = 0;                                \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert((map->capacity & (map->capacity - 1)) == 0);          \
+    qed_hs_assert(map->size + map->n_deleted <=                         \
+                  flatmap_max_load(map->capacity));                     \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      uint8_t c = map->ctrl[i];                                         \
+      if (i < FLATMAP_GROUP_WIDTH)                                      \
+        qed_hs_assert(map->ctrl[map->capacity + i] == c);               \
+      if (c == FLATMAP_DELETED) {                                       \
+        ++n_deleted;                                                    \
+      } else if (FLATMAP_IS_FULL(c)) {                                  \
+        uint64_t hash = prefix##_key_hash(map->slots[i].key);           \
+        qed_hs_assert(c == (hash & 0x7f));                              \
+        qed_hs_assert(prefix##_find(map, map->slots[i].key, hash) ==    \
+                      (ssize_t) i);                                     \
+        ++n_full;                                                       \
+      } else {                                                          \
+        qed_hs_assert(c == FLATMAP_EMPTY);                              \
+      }                                                                 \
+    }                                                                   \
+    qed_hs_assert(n_full == map->size);                                 \
+    qed_hs_assert(n_deleted == map->n_deleted);                         \
+  }                                                                     \
+                                                                        \
+  /** Remove all entries from <b>map</b>, and deallocate storage for    \
+   * those entries.  If free_val is provided, invoked it every value in \
+   * <b>map</b>. */                                                     \
+  MOCK_IMPL(void,                                                       \
+  prefix##_free_, (maptype *map, void (*free_val)(void*)))              \
+  {                                                                     \
+    size_t i;                                                           \
+    if (!map)                                                           \
+      return;                                                           \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      if (!FLATMAP_IS_FULL(map->ctrl[i]))                               \
+        continue;                                                       \
+      if (free_val)                                                     \
+        free_val(map->slots[i].val);                                    \
+      prefix##_clear_key(&map->slots[i]);                               \
+    }                                                                   \
+    qed_hs_free(map->slots);                                            \
+    qed_hs_free(map->ctrl);                                             \
+    qed_hs_free(map);                                                   \
+  }                                                                     \
+                                                                        \
+  /** Return the first full slot of <b>map</b> at or after slot         \
+   * <b>idx</b>, or NULL if there is none. */                           \
+  static inline prefix##_iter_t *                                       \
+  prefix##_iter_from(maptype *map, size_t idx)                          \
+  {                                                                     \
+    for (; idx < map->capacity; ++idx) {                                \
+      if (FLATMAP_IS_FULL(map->ctrl[idx]))                              \
+        return &map->slots[idx];                                        \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Return an <b>iterator</b> pointer to the front of a map. See      \
+   * map.c for an example. */                                           \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_init(maptype *map)                                      \
+  {                                                                     \
+    qed_hs_assert(map);                                                 \
+    return prefix##_iter_from(map, 0);                                  \
+  }                                                                     \
+                                                                        \
+  /** Advance <b>iter</b> a single step to the next entry, and return   \
+   * its new value. */                                                  \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next(maptype *map, prefix##_iter_t *iter)               \
+  {                                                                     \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert(iter);                                                \
+    return prefix##_iter_from(map, (size_t) (iter - map->slots) + 1);   \
+  }                                                                     \
+  /** Advance <b>iter</b> a single step to the next entry, removing the \
+   * current entry, and return its new value. */                        \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
+  {                                                                     \
+    size_t idx;                                                         \
+    qed_hs_assert(map);                                                 \
+    qed_hs_assert(iter);                                                \
+    idx = (size_t) (iter - map->slots);                                 \
+    qed_hs_assert(FLATMAP_IS_FULL(map->ctrl[idx]));                     \
+    prefix##_remove_slot(map, idx);                                     \
+    return prefix##_iter_from(map, idx + 1);                            \
+  }                                                                     \
+  /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
+   * to by iter. */                                                     \
+  void                                                                  \
+  prefix##_iter_get(prefix##_iter_t *iter, const keytype *keyp,         \
+                    void **valp)                                        \
+  {                                                                     \
+    qed_hs_assert(iter);                                                \
+    qed_hs_assert(keyp);                                                \
+    qed_hs_assert(valp);                                                \
+    *keyp = iter->key;                                                  \
+    *valp = iter->val;                                                  \
+  }                                                                     \
+  /** Return true iff <b>iter</b> has advanced past the last entry of   \
+   * <b>map</b>. */                                                     \
+  int                                                                   \
+  prefix##_iter_done(prefix##_iter_t *iter)                             \
+  {                                                                     \
+    return iter == NULL;                                                \
+  }
+
+IMPLEMENT_FLATMAP_FNS(strflatmap_t, char *, strflatmap)
+IMPLEMENT_FLATMAP_FNS(digestflatmap_t, char *, digestflatmap)
+IMPLEMENT_FLATMAP_FNS(digest256flatmap_t, uint8_t *, digest256flatmap)
@@ -0,0 +1,84 @@
+/* Copyright (c) 2007-2024, The QED Project, Inc. */
+/* See LICENSE for licensing information */
+
+#ifndef QED_HS_FLATMAP_H
+#define QED_HS_FLATMAP_H
+
+/**
+ * \file flatmap.h
+ *
+ * \brief Headers for flatmap.c.
+ **/
+
+#include "lib/testsupport/testsupport.h"
+#include "lib/cc/torint.h"
+
+#include "lib/container/map.h"
+
+/* These maps have the same interface as the ones in map.h, so that a user
+ * of digestmap_t can switch to digestflatmap_t by renaming. They differ in
+ * their implementation: entries are stored inline in one open-addressing
+ * array, and found by comparing a group of one-byte control tags at a time,
+ * instead of being allocated one by one and chained.
+ *
+ * Unlike with map.h, adding an entry can move the others, so an iterator
+ * and the key pointers it returns are only valid until the next
+ * prefix_set() of a new key. Removing entries never moves the others. */
+#define DECLARE_FLATMAP_FNS(mapname_t, keytype, prefix)                 \
+  typedef struct mapname_t mapname_t;                                   \
+  typedef struct prefix##_slot_t prefix##_iter_t;                       \
+  MOCK_DECL(mapname_t*, prefix##_new, (void));                          \
+  void* prefix##_set(mapname_t *map, keytype key, void *val);           \
+  void* prefix##_get(const mapname_t *map, keytype key);                \
+  void* prefix##_remove(mapname_t *map, keytype key);                   \
+  MOCK_DECL(void, prefix##_free_, (mapname_t *map, void (*free_val)(void*))); \
+  int prefix##_isempty(const mapname_t *map);                           \
+  int prefix##_size(const mapname_t *map);                              \
+  prefix##_iter_t *prefix##_iter_init(mapname_t *map);                  \
+  prefix##_iter_t *prefix##_iter_next(mapname_t *map, prefix##_iter_t *iter); \
+  prefix##_iter_t *prefix##_iter_next_rmv(mapname_t *map,               \
+                                          prefix##_iter_t *iter);       \
+  void prefix##_iter_get(prefix##_iter_t *iter, keytype *keyp, void **valp); \
+  int prefix##_iter_done(prefix##_iter_t *iter);                        \
+  void prefix##_assert_ok(const mapname_t *map)
+
+/* Map from const char * to void *. Implemented with a flat hash table. */
+DECLARE_FLATMAP_FNS(strflatmap_t, const char *, strflatmap);
+/* Map from const char[DIGEST_LEN] to void *. Implemented with a flat hash
+ * table. */
+DECLARE_FLATMAP_FNS(digestflatmap_t, const char *, digestflatmap);
+/* Map from const uint8_t[DIGEST256_LEN] to void *. Implemented with a flat
+ * hash table. */
+DECLARE_FLATMAP_FNS(digest256flatmap_t, const uint8_t *, digest256flatmap);
+
+#define strflatmap_free(map, fn) MAP_FREE_AND_NULL(strflatmap, (map), (fn))
+#define digestflatmap_free(map, fn) \
+  MAP_FREE_AND_NULL(digestflatmap, (map), (fn))
+#define digest256flatmap_free(map, fn) \
+  MAP_FREE_AND_NULL(digest256flatmap, (map), (fn))
+
+#undef DECLARE_FLATMAP_FNS
+
+/* MAP_FOREACH(), MAP_FOREACH_MODIFY() and MAP_DEL_CURRENT() from map.h work
+ * with these maps too. These are the shorthands. */
+#define DIGESTFLATMAP_FOREACH(map, keyvar, valtype, valvar)             \
+  MAP_FOREACH(digestflatmap, map, const char *, keyvar, valtype, valvar)
+#define DIGESTFLATMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)      \
+  MAP_FOREACH_MODIFY(digestflatmap, map, const char *,                  \
+                     keyvar, valtype, valvar)
+#define DIGESTFLATMAP_FOREACH_END MAP_FOREACH_END
+
+#define DIGEST256FLATMAP_FOREACH(map, keyvar, valtype, valvar)          \
+  MAP_FOREACH(digest256flatmap, map, const uint8_t *, keyvar, valtype, valvar)
+#define DIGEST256FLATMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)   \
+  MAP_FOREACH_MODIFY(digest256flatmap, map, const uint8_t *,            \
+                     keyvar, valtype, valvar)
+#define DIGEST256FLATMAP_FOREACH_END MAP_FOREACH_END
+
+#define STRFLATMAP_FOREACH(map, keyvar, valtype, valvar)                \
+  MAP_FOREACH(strflatmap, map, const char *, keyvar, valtype, valvar)
+#define STRFLATMAP_FOREACH_MODIFY(map, keyvar, valtype, valvar)         \
+  MAP_FOREACH_MODIFY(strflatmap, map, const char *, keyvar, valtype, valvar)
+#define STRFLATMAP_FOREACH_END MAP_FOREACH_END
+
+#endif /* !defined(QED_HS_FLATMAP_H) */
@@ -102,7 +102,7 @@ static const ed25519_impl_t impl_donna = {
 
   ed25519_donna_open,
   ed25519_donna_sign,
-  NULL, /* Don't use donna's batching code because of #40078 */
+  ed25519_sign_open_batch_donna,
 
   ed25519_donna_blind_secret_key,
   ed25519_donna_blind_public_key,
@@ -319,6 +319,10 @@ ed25519_sign_prefixed,(ed25519_signature_t *signature_out,
  * Check whether if <b>signature</b> is a valid signature for the
  * <b>len</b>-byte message in <b>msg</b> made with the key <b>pubkey</b>.
  *
+ * Both implementations check the cofactored equation 8(SB - hA - R) = 0,
+ * and reject signatures whose R isn't canonically encoded, so this always
+ * agrees with ed25519_checksig_batch().
+ *
  * Return 0 if the signature is valid; -1 if it isn't.
  */
 MOCK_IMPL(int,
@@ -394,7 +398,7 @@ ed25519_checksig_batch,(int *okay_out,
   } else {
     /* ed25519-donna style batch verification available.
      *
-     * Theoretically, this should only be called if n_checkable >= 3, since
+     * Theoretically, this should only be called if n_checkable >= 4, since
      * that's the threshold where the batch verification actually kicks in,
      * but the only difference is a few mallocs/frees.
      */
@@ -13,14 +13,18 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip lookup tables are implemented as sorted arrays of the first
+ * address of each range, next to an array of the country of each range, so
+ * that a lookup is one binary search over packed integers.  Countries are
+ * singleton geoip_country_t objects, also indexed by their names in a
+ * hashtable.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
- * function.  For more information on the file format they read, see that
- * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * function, either by mapping a binary database as it is, or by parsing a
+ * text file and compiling it into the same arrays.  For more information on
+ * the file formats they read, see that function.  See the scripts and the
+ * README file in scripts/maint/geoip for more information about how those
+ * files are generated.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -36,6 +40,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -64,18 +69,52 @@ typedef struct geoip_ipv6_entry_t {
   intptr_t country; /**< An index into geoip_countries */
 } geoip_ipv6_entry_t;
 
+/** A compiled GeoIP table for one address family.
+ *
+ * The table cuts the whole address space into n_ranges ranges, sorted by
+ * their first address, so that the range holding an address is the last one
+ * that starts at or before it.  Addresses that the database does not cover
+ * are in ranges whose country is 0, the unknown country.
+ *
+ * The arrays either point into a mapped binary database, or into one block
+ * of memory that we allocated when compiling a text file. */
+typedef struct geoip_table_t {
+  /** Number of ranges in this table; always at least 1. */
+  uint32_t n_ranges;
+  /** For IPv4 tables, the first address of each range, in host order. */
+  const uint32_t *ipv4_starts;
+  /** For IPv6 tables, the first address of each range, as 16 bytes in
+   * network order. */
+  const uint8_t *ipv6_starts;
+  /** The country of each range, as an index into country_map. */
+  const uint16_t *range_countries;
+  /** Number of entries in country_map. */
+  unsigned n_countries;
+  /** Map from the country numbers in range_countries to indices in
+   * geoip_countries. */
+  country_t *country_map;
+  /** The binary database that the arrays point into, if any. */
+  qed_hs_mmap_t *mapping;
+  /** The memory that holds the arrays, if we allocated it. */
+  void *mem;
+} geoip_table_t;
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** List of all known geoip_ipv4_entry_t sorted
- * by their respective ip_low values. */
+/** List of geoip_ipv4_entry_t parsed from text, in the order we parsed
+ * them, until we compile them into geoip_ipv4_table. */
 static smartlist_t *geoip_ipv4_entries = NULL;
-/** List of all known geoip_ipv6_entry_t, sorted by their respective
- * ip_low values. */
+/** List of geoip_ipv6_entry_t parsed from text, in the order we parsed
+ * them, until we compile them into geoip_ipv6_table. */
 static smartlist_t *geoip_ipv6_entries = NULL;
+/** The IPv4 table that we answer lookups from, or NULL if none is loaded. */
+static geoip_table_t *geoip_ipv4_table = NULL;
+/** The IPv6 table that we answer lookups from, or NULL if none is loaded. */
+static geoip_table_t *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the IPv4 GeoIP file to include in extra-info
  * descriptors. */
@@ -111,20 +150,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const qed_hs_addr_t *low, const qed_hs_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it to the list if it is not there yet. */
+static intptr_t
+geoip_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(qed_hs_addr_family(low) != qed_hs_addr_family(high))
-    return;
-  IF_BUG_ONCE(qed_hs_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -141,6 +174,23 @@ geoip_add_entry(const qed_hs_addr_t *low, const qed_hs_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     qed_hs_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const qed_hs_addr_t *low, const qed_hs_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(qed_hs_addr_family(low) != qed_hs_addr_family(high))
+    return;
+  IF_BUG_ONCE(qed_hs_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_add_country(country);
 
   if (qed_hs_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = qed_hs_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -157,10 +207,10 @@ geoip_add_entry(const qed_hs_addr_t *low, const qed_hs_addr_t *high,
   }
 }
 
-/** Add an entry to the GeoIP table indicated by <b>family</b>,
+/** Add an entry to the list of text entries indicated by <b>family</b>,
  * parsing it from <b>line</b>. The format is as for geoip_load_file(). */
-STATIC int
-geoip_parse_entry(const char *line, sa_family_t family)
+static int
+geoip_parse_line(const char *line, sa_family_t family)
 {
   qed_hs_addr_t low_addr, high_addr;
   char c[3];
@@ -240,22 +290,6 @@ geoip_ipv4_compare_entries_(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv6_entry_t */
 static int
@@ -266,24 +300,6 @@ geoip_ipv6_compare_entries_(const void **_a, const void **_b)
                      sizeof(struct in6_addr));
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
-}
-
 /** Set up a new list of geoip countries with no countries (yet) set in it,
  * except for the unknown country.
  */
@@ -302,11 +318,352 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Release all storage held by the GeoIP table <b>t</b>. */
+static void
+geoip_table_free_(geoip_table_t *t)
+{
+  if (!t)
+    return;
+  if (t->mapping)
+    qed_hs_munmap_file(t->mapping);
+  qed_hs_free(t->mem);
+  qed_hs_free(t->country_map);
+  qed_hs_free(t);
+}
+#define geoip_table_free(t) \
+  FREE_AND_NULL(geoip_table_t, geoip_table_free_, (t))
+
+/** Make <b>t</b> the table that we use for lookups in <b>family</b>,
+ * replacing and freeing the old one. */
+static void
+geoip_set_table(sa_family_t family, geoip_table_t *t)
+{
+  if (family == AF_INET) {
+    geoip_table_free(geoip_ipv4_table);
+    geoip_ipv4_table = t;
+  } else {
+    geoip_table_free(geoip_ipv6_table);
+    geoip_ipv6_table = t;
+  }
+}
+
+/** Allocate a GeoIP table with room for <b>max_ranges</b> ranges of
+ * addresses that are <b>addr_len</b> bytes long.  Its country numbers are
+ * the indices in geoip_countries. */
+static geoip_table_t *
+geoip_table_new(size_t max_ranges, size_t addr_len)
+{
+  geoip_table_t *t = qed_hs_malloc_zero(sizeof(geoip_table_t));
+  uint8_t *mem = qed_hs_malloc(max_ranges * (addr_len + sizeof(uint16_t)));
+
+  if (addr_len == 4)
+    t->ipv4_starts = (const uint32_t *)mem;
+  else
+    t->ipv6_starts = mem;
+  t->range_countries = (const uint16_t *)(mem + max_ranges * addr_len);
+  t->mem = mem;
+
+  t->n_countries = smartlist_len(geoip_countries);
+  t->country_map = qed_hs_calloc(t->n_countries, sizeof(country_t));
+  for (unsigned i = 0; i < t->n_countries; ++i)
+    t->country_map[i] = (country_t)i;
+  return t;
+}
+
+/** Return true iff a range in <b>country</b>, appended to the table
+ * <b>t</b> that we are compiling, would only extend the range before it. */
+static inline int
+geoip_table_extends_last_range(const geoip_table_t *t, intptr_t country)
+{
+  return t->n_ranges && t->range_countries[t->n_ranges - 1] == country;
+}
+
+/** Append a range in <b>country</b> that starts at the IPv4 address
+ * <b>start</b> to the table <b>t</b> that we are compiling. */
+static void
+geoip_table_add_ipv4_range(geoip_table_t *t, uint32_t start,
+                           intptr_t country)
+{
+  if (geoip_table_extends_last_range(t, country))
+    return;
+  ((uint32_t *)t->ipv4_starts)[t->n_ranges] = start;
+  ((uint16_t *)t->range_countries)[t->n_ranges++] = (uint16_t)country;
+}
+
+/** Append a range in <b>country</b> that starts at the IPv6 address
+ * <b>start</b> to the table <b>t</b> that we are compiling. */
+static void
+geoip_table_add_ipv6_range(geoip_table_t *t, const uint8_t *start,
+                           intptr_t country)
+{
+  if (geoip_table_extends_last_range(t, country))
+    return;
+  memcpy((uint8_t *)t->ipv6_starts + 16 * (size_t)t->n_ranges, start, 16);
+  ((uint16_t *)t->range_countries)[t->n_ranges++] = (uint16_t)country;
+}
+
+/** Compile the list of geoip_ipv4_entry_t <b>entries</b> into a new
+ * table, and return it.  Where entries overlap, the one that starts first
+ * wins. */
+static geoip_table_t *
+geoip_ipv4_table_compile(smartlist_t *entries)
+{
+  /* Every entry can add a gap before it, and there can be one at the end. */
+  geoip_table_t *t = geoip_table_new(2 * smartlist_len(entries) + 1, 4);
+  /* The first address that no range covers yet. */
+  uint64_t next = 0;
+
+  smartlist_sort(entries, geoip_ipv4_compare_entries_);
+  SMARTLIST_FOREACH_BEGIN(entries, const geoip_ipv4_entry_t *, ent) {
+    if (ent->ip_high < next)
+      continue;
+    if (ent->ip_low > next)
+      geoip_table_add_ipv4_range(t, (uint32_t)next, 0);
+    geoip_table_add_ipv4_range(t, MAX(ent->ip_low, (uint32_t)next),
+                               ent->country);
+    next = (uint64_t)ent->ip_high + 1;
+  } SMARTLIST_FOREACH_END(ent);
+  if (next <= UINT32_MAX)
+    geoip_table_add_ipv4_range(t, (uint32_t)next, 0);
+
+  return t;
+}
+
+/** Compile the list of geoip_ipv6_entry_t <b>entries</b> into a new
+ * table, and return it.  Where entries overlap, the one that starts first
+ * wins. */
+static geoip_table_t *
+geoip_ipv6_table_compile(smartlist_t *entries)
+{
+  geoip_table_t *t = geoip_table_new(2 * smartlist_len(entries) + 1, 16);
+  /* The first address that no range covers yet, unless <b>full</b> says
+   * that the ranges cover every address. */
+  uint8_t next[16];
+  int full = 0;
+
+  memset(next, 0, sizeof(next));
+  smartlist_sort(entries, geoip_ipv6_compare_entries_);
+  SMARTLIST_FOREACH_BEGIN(entries, const geoip_ipv6_entry_t *, ent) {
+    const uint8_t *low = ent->ip_low.s6_addr, *high = ent->ip_high.s6_addr;
+    if (full || fast_memcmp(high, next, 16) < 0)
+      continue;
+    if (fast_memcmp(low, next, 16) > 0) {
+      geoip_table_add_ipv6_range(t, next, 0);
+      geoip_table_add_ipv6_range(t, low, ent->country);
+    } else {
+      geoip_table_add_ipv6_range(t, next, ent->country);
+    }
+    /* Set next to high+1, noting whether it wraps around. */
+    memcpy(next, high, 16);
+    full = 1;
+    for (int i = 15; i >= 0 && full; --i)
+      full = (++next[i] == 0);
+  } SMARTLIST_FOREACH_END(ent);
+  if (!full)
+    geoip_table_add_ipv6_range(t, next, 0);
+
+  return t;
+}
+
+/** Compile the text entries for <b>family</b> that we have parsed so far
+ * into the table that we use for lookups. */
+static void
+geoip_compile_entries(sa_family_t family)
+{
+  if (family == AF_INET)
+    geoip_set_table(family, geoip_ipv4_table_compile(geoip_ipv4_entries));
+  else
+    geoip_set_table(family, geoip_ipv6_table_compile(geoip_ipv6_entries));
+}
+
+#ifdef QED_HS_UNIT_TESTS
+/** Add an entry to the GeoIP table indicated by <b>family</b>,
+ * parsing it from <b>line</b>. The format is as for geoip_load_file().
+ *
+ * This recompiles the whole table, so it is only for tests: to load a
+ * file, use geoip_load_file(). */
+STATIC int
+geoip_parse_entry(const char *line, sa_family_t family)
+{
+  if (geoip_parse_line(line, family) < 0)
+    return -1;
+  geoip_compile_entries(family);
+  return 0;
+}
+#endif /* defined(QED_HS_UNIT_TESTS) */
+
+/** Free every text entry that we have parsed for <b>family</b>. */
+static void
+geoip_clear_entries(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        qed_hs_free(e));
+      smartlist_free(geoip_ipv4_entries);
+    }
+  } else {
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        qed_hs_free(e));
+      smartlist_free(geoip_ipv6_entries);
+    }
+  }
+}
+
+/** Read a little-endian 16-bit value from <b>cp</b>. */
+static inline uint16_t
+geoip_db_get_u16(const uint8_t *cp)
+{
+  return (uint16_t)(cp[0] | (cp[1] << 8));
+}
+
+/** Read a little-endian 32-bit value from <b>cp</b>. */
+static inline uint32_t
+geoip_db_get_u32(const uint8_t *cp)
+{
+  return ((uint32_t)cp[0]) | ((uint32_t)cp[1] << 8) |
+    ((uint32_t)cp[2] << 16) | ((uint32_t)cp[3] << 24);
+}
+
+/** Return true iff <b>map</b> holds a binary GeoIP database, rather than a
+ * text file. */
+static int
+geoip_db_is_binary(const qed_hs_mmap_t *map)
+{
+  return map->size >= GEOIP_DB_HEADER_LEN &&
+    fast_memeq(map->data, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN);
+}
+
+/** Check the binary GeoIP database for <b>family</b> in <b>map</b>, and
+ * return a table that uses it in place, taking ownership of <b>map</b>.
+ * On failure, log at <b>severity</b> and return NULL. */
+static geoip_table_t *
+geoip_table_new_from_db(sa_family_t family, qed_hs_mmap_t *map,
+                        const char *filename, int severity)
+{
+  const uint8_t *db = (const uint8_t *)map->data;
+  const size_t addr_len = (family == AF_INET) ? 4 : 16;
+  const char *problem = NULL;
+  geoip_table_t *t = NULL;
+  uint32_t n_ranges;
+  unsigned n_countries;
+  const uint8_t *starts, *countries, *codes;
+
+  if (db[GEOIP_DB_MAGIC_LEN] != GEOIP_DB_VERSION) {
+    problem = "unrecognized version";
+    goto err;
+  }
+  if (db[GEOIP_DB_MAGIC_LEN + 1] != addr_len) {
+    problem = "wrong address family";
+    goto err;
+  }
+  n_countries = geoip_db_get_u16(db + GEOIP_DB_MAGIC_LEN + 2);
+  n_ranges = geoip_db_get_u32(db + GEOIP_DB_MAGIC_LEN + 4);
+  if (n_ranges == 0 ||
+      GEOIP_DB_HEADER_LEN + 2 * (uint64_t)n_countries +
+        (addr_len + 2) * (uint64_t)n_ranges != map->size) {
+    problem = "wrong length";
+    goto err;
+  }
+  starts = db + GEOIP_DB_HEADER_LEN;
+  countries = starts + addr_len * n_ranges;
+  codes = countries + 2 * n_ranges;
+
+  for (unsigned i = 0; i < 2 * n_countries; ++i) {
+    if (!QED_HS_ISPRINT(codes[i])) {
+      problem = "bad country code";
+      goto err;
+    }
+  }
+
+  t = qed_hs_malloc_zero(sizeof(geoip_table_t));
+  t->n_ranges = n_ranges;
+  t->n_countries = n_countries + 1;
+
+#ifdef WORDS_BIGENDIAN
+  /* The database is little-endian: we need our own copy of the arrays. */
+  {
+    uint8_t *mem = qed_hs_malloc(n_ranges * (addr_len + 2));
+    uint16_t *cs = (uint16_t *)(mem + addr_len * n_ranges);
+    if (addr_len == 4) {
+      uint32_t *ss = (uint32_t *)mem;
+      for (uint32_t i = 0; i < n_ranges; ++i)
+        ss[i] = geoip_db_get_u32(starts + 4 * i);
+    } else {
+      memcpy(mem, starts, addr_len * n_ranges);
+    }
+    for (uint32_t i = 0; i < n_ranges; ++i)
+      cs[i] = geoip_db_get_u16(countries + 2 * i);
+    t->mem = mem;
+    starts = mem;
+    countries = (const uint8_t *)cs;
+  }
+#endif /* defined(WORDS_BIGENDIAN) */
+  if (addr_len == 4)
+    t->ipv4_starts = (const uint32_t *)starts;
+  else
+    t->ipv6_starts = starts;
+  t->range_countries = (const uint16_t *)countries;
+
+  /* Lookups rely on the ranges starting at 0 and being sorted, and on the
+   * countries being in range: check them once here. */
+  for (uint32_t i = 0; i < n_ranges; ++i) {
+    int in_order;
+    if (addr_len == 4)
+      in_order = i ? t->ipv4_starts[i-1] < t->ipv4_starts[i]
+                   : t->ipv4_starts[0] == 0;
+    else
+      in_order = i ? fast_memcmp(starts + 16*(i-1), starts + 16*i, 16) < 0
+                   : fast_mem_is_zero((const char *)starts, 16);
+    if (!in_order) {
+      problem = "ranges out of order";
+      goto err;
+    }
+    if (t->range_countries[i] >= t->n_countries) {
+      problem = "bad country number";
+      goto err;
+    }
+  }
+
+  /* Only add the countries once we know we'll use the file, so that a bad
+   * file doesn't leave its countries behind. */
+  t->country_map = qed_hs_calloc(t->n_countries, sizeof(country_t));
+  for (unsigned i = 0; i < n_countries; ++i) {
+    char cc[3] = { (char)codes[2*i], (char)codes[2*i+1], '\0' };
+    t->country_map[i + 1] = (country_t)geoip_add_country(cc);
+  }
+
+  t->mapping = map;
+  return t;
+
+ err:
+  log_fn(severity, LD_GENERAL, "Unable to load binary GEOIP %s file %s: %s.",
+         family == AF_INET ? "IPv4" : "IPv6", filename, problem);
+  geoip_table_free(t);
+  qed_hs_munmap_file(map);
+  return NULL;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
  *
- * Recognized line formats for IPv4 are:
+ * The file can be a binary database, which we map into memory and use as
+ * it is.  It is made by geoip-db-tool, and laid out as:
+ *   a GEOIP_DB_HEADER_LEN-byte header: the GEOIP_DB_MAGIC_LEN-byte
+ *     GEOIP_DB_MAGIC, a version byte (GEOIP_DB_VERSION), the length of
+ *     an address (4 or 16), the 16-bit number of country codes N_CC, and
+ *     the 32-bit number of ranges N_RANGES;
+ *   the first address of each of N_RANGES ranges, sorted, starting at
+ *     address 0: 32-bit integers for IPv4, 16-byte addresses in network
+ *     order for IPv6;
+ *   the 16-bit country of each range: 0 for "unknown", or 1..N_CC;
+ *   N_CC 2-byte country codes.
+ * Integers are little-endian.
+ *
+ * Otherwise, the file is text that we parse and compile into the same
+ * form.  Recognized line formats for IPv4 are:
  *   INTIPLOW,INTIPHIGH,CC
  * and
  *   "INTIPLOW","INTIPHIGH","CC","CC3","COUNTRY NAME"
@@ -324,33 +681,46 @@ int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
+  qed_hs_mmap_t *map;
   crypto_digest_t *geoip_digest_env = NULL;
+  char *digest_out;
 
   qed_hs_assert(family == AF_INET || family == AF_INET6);
+  digest_out = (family == AF_INET) ? geoip_digest : geoip6_digest;
+
+  if (!geoip_countries)
+    init_geoip_countries();
+
+  map = qed_hs_mmap_file(filename);
+  if (map && geoip_db_is_binary(map)) {
+    geoip_table_t *t;
+    char digest[DIGEST_LEN];
+    log_notice(LD_GENERAL, "Loading binary GEOIP %s file %s.",
+               (family == AF_INET) ? "IPv4" : "IPv6", filename);
+    /* Compute the digest first: the table takes the mapping. */
+    crypto_digest(digest, map->data, map->size);
+    t = geoip_table_new_from_db(family, map, filename, severity);
+    if (!t)
+      return -1;
+    geoip_clear_entries(family);
+    geoip_set_table(family, t);
+    memcpy(digest_out, digest, DIGEST_LEN);
+    return 0;
+  }
+  if (map)
+    qed_hs_munmap_file(map);
 
   if (!(f = qed_hs_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.",
            filename);
     return -1;
   }
-  if (!geoip_countries)
-    init_geoip_countries();
 
-  if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        qed_hs_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
+  geoip_clear_entries(family);
+  if (family == AF_INET)
     geoip_ipv4_entries = smartlist_new();
-  } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        qed_hs_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
+  else
     geoip_ipv6_entries = smartlist_new();
-  }
   geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
@@ -361,21 +731,16 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
       break;
     crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
     /* FFFF track full country name. */
-    geoip_parse_entry(buf, family);
+    geoip_parse_line(buf, family);
   }
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
-  if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  } else {
-    /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
-  }
+  /* Compile the entries, and remember file digests so that we can include
+   * it in our extra-info descriptors. */
+  geoip_compile_entries(family);
+  geoip_clear_entries(family);
+  crypto_digest_get_digest(geoip_digest_env, digest_out, DIGEST_LEN);
   crypto_digest_free(geoip_digest_env);
 
   return 0;
@@ -390,12 +755,23 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  const geoip_table_t *t = geoip_ipv4_table;
+  const uint32_t *base;
+  uint32_t n;
+
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  /* Find the last range that starts at or before ipaddr.  The first range
+   * starts at 0, so there is always one.  We halve the candidates each
+   * time without a data-dependent branch. */
+  base = t->ipv4_starts;
+  n = t->n_ranges;
+  while (n > 1) {
+    const uint32_t half = n / 2;
+    base = (base[half] <= ipaddr) ? base + half : base;
+    n -= half;
+  }
+  return t->country_map[t->range_countries[base - t->ipv4_starts]];
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -406,13 +782,22 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
+  const geoip_table_t *t = geoip_ipv6_table;
+  uint32_t lo, n;
 
-  if (!geoip_ipv6_entries)
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  /* As in geoip_get_country_by_ipv4(). */
+  lo = 0;
+  n = t->n_ranges;
+  while (n > 1) {
+    const uint32_t half = n / 2;
+    if (fast_memcmp(t->ipv6_starts + 16 * (size_t)(lo + half),
+                    addr->s6_addr, 16) <= 0)
+      lo += half;
+    n -= half;
+  }
+  return t->country_map[t->range_countries[lo]];
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -461,9 +846,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -489,20 +874,12 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      qed_hs_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      qed_hs_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_clear_entries(AF_INET);
+  geoip_clear_entries(AF_INET6);
+  geoip_table_free(geoip_ipv4_table);
+  geoip_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
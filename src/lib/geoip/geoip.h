@@ -19,7 +19,9 @@
 #include "lib/geoip/country.h"
 
 #ifdef GEOIP_PRIVATE
+#ifdef QED_HS_UNIT_TESTS
 STATIC int geoip_parse_entry(const char *line, sa_family_t family);
+#endif /* defined(QED_HS_UNIT_TESTS) */
 STATIC void clear_geoip_db(void);
 
 STATIC int geoip_get_country_by_ipv4(uint32_t ipaddr);
@@ -29,6 +31,15 @@ STATIC int geoip_get_country_by_ipv6(const struct in6_addr *addr);
 struct in6_addr;
 struct qed_hs_addr_t;
 
+/** Bytes at the start of every binary GeoIP database. */
+#define GEOIP_DB_MAGIC "QHSGEOIP"
+/** Length of GEOIP_DB_MAGIC. */
+#define GEOIP_DB_MAGIC_LEN 8
+/** Version of the binary GeoIP database format that we understand. */
+#define GEOIP_DB_VERSION 1
+/** Length of the header of a binary GeoIP database. */
+#define GEOIP_DB_HEADER_LEN 16
+
 /** A per-country GeoIP record. */
 typedef struct geoip_country_t {
   /** A nul-terminated two-letter country-code. */
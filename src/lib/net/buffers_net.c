@@ -25,6 +25,16 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+#define USE_WRITEV_FLUSH
+#endif
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -136,6 +146,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   return (int)total_read;
 }
 
+#ifndef USE_WRITEV_FLUSH
 /** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto file descriptor <b>fd</b>.  Return
  * the number of bytes written on success, 0 on blocking, -1 on failure.
@@ -172,11 +183,74 @@ flush_chunk(qed_hs_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     return (int)write_result;
   }
 }
+#endif /* !defined(USE_WRITEV_FLUSH) */
+
+#ifdef USE_WRITEV_FLUSH
+/** Largest number of chunks we will gather into a single writev() call. */
+#define FLUSH_MAX_IOV 64
+#if defined(IOV_MAX) && IOV_MAX < FLUSH_MAX_IOV
+#undef FLUSH_MAX_IOV
+#define FLUSH_MAX_IOV IOV_MAX
+#endif
+
+/** Helper for buf_flush_to_fd(): try to write up to <b>sz</b> bytes from the
+ * front of <b>buf</b> onto <b>fd</b> with a single writev() spanning as many
+ * chunks as needed (up to FLUSH_MAX_IOV).  Set *<b>attempted_out</b> to the
+ * number of bytes we asked the kernel to take.  Drain only the bytes that
+ * were actually written.  Return the number of bytes written on success, 0
+ * on blocking, -1 on failure.
+ */
+static int
+flush_chunks_iov(qed_hs_socket_t fd, buf_t *buf, size_t sz,
+                 size_t *attempted_out)
+{
+  struct iovec iov[FLUSH_MAX_IOV];
+  int n_iov = 0;
+  size_t attempted = 0;
+  ssize_t write_result;
+  chunk_t *chunk;
+
+  for (chunk = buf->head; chunk && n_iov < FLUSH_MAX_IOV && attempted < sz;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len == 0)
+      continue;
+    if (len > sz - attempted)
+      len = sz - attempted;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    attempted += len;
+  }
+  *attempted_out = attempted;
+  if (n_iov == 0)
+    return 0;
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    qed_hs_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_WRITEV_FLUSH) */
 
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
  * from the buffer.  Return the number of bytes written on success,
  * -1 on failure.  Return 0 if write() would block.
+ *
+ * Where writev() is available, we gather all the chunks we need into as few
+ * system calls as possible; otherwise we write one chunk at a time.
  */
 static int
 buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
@@ -188,6 +262,9 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   int r;
   size_t flushed = 0;
   qed_hs_assert(SOCKET_OK(fd));
+#ifdef USE_WRITEV_FLUSH
+  (void) is_socket;
+#endif
   if (BUG(sz > buf->datalen)) {
     sz = buf->datalen;
   }
@@ -196,12 +273,16 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     qed_hs_assert(buf->head);
+#ifdef USE_WRITEV_FLUSH
+    r = flush_chunks_iov(fd, buf, sz, &flushlen0);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+#endif /* defined(USE_WRITEV_FLUSH) */
     check();
     if (r < 0)
       return r;
@@ -40,12 +40,18 @@
 
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/nodelist/microdesc_st.h"
 
 #include "lib/crypt_ops/digestset.h"
+#include "lib/container/flatmap.h"
 #include "lib/crypt_ops/crypto_init.h"
 
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/hs/hs_pow.h"
+#include "lib/geoip/geoip.h"
+#include "lib/thread/numcpus.h"
+#include "lib/thread/threads.h"
 
 #if defined(__amd64__) || defined(__amd64) || defined(__x86_64__) \
   || defined(_M_X64) || defined(_M_IX86) || defined(__i486)       \
@@ -233,6 +239,8 @@ bench_ed25519_impl(void)
   ed25519_keypair_t kp;
   curve25519_keypair_t curve_kp;
   ed25519_public_key_t pubkey_tmp;
+  const int batch_len = 64;
+  ed25519_checkable_t batch[64];
 
   ed25519_secret_key_generate(&kp.seckey, 0);
   start = perftime();
@@ -259,6 +267,20 @@ bench_ed25519_impl(void)
   printf("Verify signature: %.2f usec\n",
          MICROCOUNT(start, end, iters));
 
+  for (i = 0; i < batch_len; ++i) {
+    batch[i].pubkey = &kp.pubkey;
+    batch[i].signature = sig;
+    batch[i].msg = msg;
+    batch[i].len = sizeof(msg);
+  }
+  start = perftime();
+  for (i = 0; i < iters / batch_len; ++i) {
+    ed25519_checksig_batch(NULL, batch, batch_len);
+  }
+  end = perftime();
+  printf("Verify signature in a batch of %d: %.2f usec\n", batch_len,
+         MICROCOUNT(start, end, (iters / batch_len) * batch_len));
+
   curve25519_keypair_generate(&curve_kp, 0);
   start = perftime();
   for (i = 0; i < iters; ++i) {
@@ -394,6 +416,7 @@ bench_dmap(void)
   char d[20];
   int i,n=0, fp = 0;
   digestmap_t *dm = digestmap_new();
+  digestflatmap_t *dfm = digestflatmap_new();
   digestset_t *ds = digestset_new(elts);
 
   for (i = 0; i < elts; ++i) {
@@ -424,6 +447,22 @@ bench_dmap(void)
   printf("digestmap_get: %.2f ns per element\n",
          NANOCOUNT(pt2, pt3, iters*elts*2));
 
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp,
+                      digestflatmap_set(dfm, cp, (void*)1));
+  }
+  pt2 = perftime();
+  printf("digestflatmap_set: %.2f ns per element\n",
+         NANOCOUNT(pt3, pt2, iters*elts));
+
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp, digestflatmap_get(dfm, cp));
+    SMARTLIST_FOREACH(sl2, const char *, cp, digestflatmap_get(dfm, cp));
+  }
+  pt3 = perftime();
+  printf("digestflatmap_get: %.2f ns per element\n",
+         NANOCOUNT(pt2, pt3, iters*elts*2));
+
   for (i = 0; i < iters; ++i) {
     SMARTLIST_FOREACH(sl, const char *, cp, digestset_add(ds, cp));
   }
@@ -451,6 +490,7 @@ bench_dmap(void)
          (fp/(double)fpostests)*100);
 
   digestmap_free(dm, NULL);
+  digestflatmap_free(dfm, NULL);
   digestset_free(ds);
   SMARTLIST_FOREACH(sl, char *, cp, qed_hs_free(cp));
   SMARTLIST_FOREACH(sl2, char *, cp, qed_hs_free(cp));
@@ -835,6 +875,401 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Append a made-up microdescriptor, with random keys and one of a few
+ * common exit policies, to <b>out</b>. */
+static void
+bench_compress_add_md(smartlist_t *out)
+{
+  static const char *policies[] = {
+    "", "p accept 80,443\n", "p accept 53,80,443,5222-5223,25565\n",
+    "p reject 25,119,135-139,445,563,1214,4661-4666,6346-6429,6699,"
+    "6881-6999\n",
+  };
+  uint8_t key[32];
+  char ntor[BASE64_BUFSIZE(32)], id[BASE64_BUFSIZE(32)];
+  char fam[HEX_DIGEST_LEN+1];
+  const int has_family = crypto_rand_int(3) == 0;
+
+  crypto_rand((char*)key, sizeof(key));
+  base64_encode_nopad(ntor, sizeof(ntor), key, sizeof(key));
+  crypto_rand((char*)key, sizeof(key));
+  base64_encode_nopad(id, sizeof(id), key, sizeof(key));
+  crypto_rand((char*)key, DIGEST_LEN);
+  base16_encode(fam, sizeof(fam), (char*)key, DIGEST_LEN);
+
+  smartlist_add_asprintf(out,
+                         "onion-key\n"
+                         "ntor-onion-key %s\n"
+                         "%s%s%s"
+                         "%s"
+                         "id ed25519 %s\n",
+                         ntor,
+                         has_family ? "family $" : "",
+                         has_family ? fam : "",
+                         has_family ? "\n" : "",
+                         policies[crypto_rand_int(ARRAY_LENGTH(policies))],
+                         id);
+}
+
+/** Add to <b>out</b> copies of up to <b>max</b> microdescriptors, picked
+ * at random from the file named by the QED_HS_BENCH_MICRODESCS environment
+ * variable (such as a directory cache's cached-microdescs file).  Return the
+ * number added. */
+static int
+bench_compress_load_mds(smartlist_t *out, int max)
+{
+  const char *fname = getenv("QED_HS_BENCH_MICRODESCS");
+  char *body;
+  smartlist_t *parsed;
+  int n = 0;
+
+  if (!fname)
+    return 0;
+  body = read_file_to_str(fname, 0, NULL);
+  if (!body) {
+    printf("Couldn't read %s\n", fname);
+    return 0;
+  }
+  parsed = microdescs_parse_from_string(body, NULL, 1, SAVED_NOWHERE, NULL);
+  qed_hs_free(body);
+
+  smartlist_shuffle(parsed);
+  SMARTLIST_FOREACH_BEGIN(parsed, microdesc_t *, md) {
+    if (n < max) {
+      smartlist_add(out, qed_hs_memdup_nulterm(md->body, md->bodylen));
+      ++n;
+    }
+    microdesc_free(md);
+  } SMARTLIST_FOREACH_END(md);
+  smartlist_free(parsed);
+  return n;
+}
+
+/** Compare how well, and how fast, each streaming directory compression
+ * method handles microdescriptors, one at a time and in a typical batch.
+ *
+ * By default we use made-up microdescriptors.  Set QED_HS_BENCH_MICRODESCS
+ * to a cached-microdescs file to measure real ones. */
+static void
+bench_compress_md(void)
+{
+  const compress_method_t methods[] = {
+    ZLIB_METHOD, ZSTD_METHOD
+  };
+  /* A client asks for at most this many microdescriptors at a time. */
+  const int batch_sizes[] = { 1, 92 };
+  const int N = 2000;
+  smartlist_t *mds = smartlist_new();
+  int i;
+
+  if (bench_compress_load_mds(mds, 92) < 92) {
+    SMARTLIST_FOREACH(mds, char *, cp, qed_hs_free(cp));
+    smartlist_clear(mds);
+    printf("Using synthetic microdescriptors; set QED_HS_BENCH_MICRODESCS "
+           "to a cached-microdescs file\nfor realistic numbers.\n");
+    for (i = 0; i < 92; ++i)
+      bench_compress_add_md(mds);
+  }
+
+  for (unsigned b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    smartlist_t *batch = smartlist_new();
+    for (i = 0; i < batch_sizes[b]; ++i)
+      smartlist_add(batch, smartlist_get(mds, i));
+    size_t in_len;
+    char *in = smartlist_join_strings(batch, "", 0, &in_len);
+    smartlist_free(batch);
+
+    for (unsigned m = 0; m < ARRAY_LENGTH(methods); ++m) {
+      const compress_method_t method = methods[m];
+      const char *name = compression_method_get_name(method);
+      char *out = NULL, *back = NULL;
+      size_t out_len = 0, back_len = 0;
+      uint64_t start, mid, end;
+
+      if (!qed_hs_compress_supports_method(method)) {
+        printf("%d microdescs, %s: not supported\n", batch_sizes[b], name);
+        continue;
+      }
+
+      reset_perftime();
+      start = perftime();
+      for (i = 0; i < N; ++i) {
+        qed_hs_free(out);
+        qed_hs_compress(&out, &out_len, in, in_len, method);
+      }
+      mid = perftime();
+      for (i = 0; i < N; ++i) {
+        qed_hs_free(back);
+        qed_hs_uncompress(&back, &back_len, out, out_len, method, 1,
+                          LOG_WARN);
+      }
+      end = perftime();
+      qed_hs_assert(back_len == in_len);
+
+      printf("%d microdescs, %s: %d -> %d bytes (%.1f%%); "
+             "compress %.2f usec, decompress %.2f usec\n",
+             batch_sizes[b], name, (int)in_len, (int)out_len,
+             100.0 * out_len / in_len,
+             MICROCOUNT(start, mid, N), MICROCOUNT(mid, end, N));
+      qed_hs_free(out);
+      qed_hs_free(back);
+    }
+    qed_hs_free(in);
+  }
+
+  SMARTLIST_FOREACH(mds, char *, cp, qed_hs_free(cp));
+  smartlist_free(mds);
+}
+
+/** Write a GeoIP database for <b>n</b> IPv4 ranges, with the first
+ * address of each range in <b>starts</b> and its country in
+ * <b>countries</b>, to <b>fname</b>: in the text format if <b>binary</b> is
+ * false, else in the binary format. */
+static void
+bench_geoip_write_db(const char *fname, int binary, const uint32_t *starts,
+                     const uint16_t *countries, int n, const char *codes,
+                     int n_codes)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *db;
+  size_t db_len;
+
+  if (binary) {
+    uint8_t *cp;
+    db_len = GEOIP_DB_HEADER_LEN + 6 * n + 2 * n_codes;
+    db = qed_hs_malloc_zero(db_len);
+    cp = (uint8_t *)db;
+    memcpy(cp, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN);
+    cp[GEOIP_DB_MAGIC_LEN] = GEOIP_DB_VERSION;
+    cp[GEOIP_DB_MAGIC_LEN + 1] = 4;
+    cp[GEOIP_DB_MAGIC_LEN + 2] = n_codes & 0xff;
+    cp[GEOIP_DB_MAGIC_LEN + 3] = n_codes >> 8;
+    for (int j = 0; j < 4; ++j)
+      cp[GEOIP_DB_MAGIC_LEN + 4 + j] = (n >> (8 * j)) & 0xff;
+    cp += GEOIP_DB_HEADER_LEN;
+    for (int i = 0; i < n; ++i) {
+      /* Little-endian starts, then countries, numbered from 1. */
+      for (int j = 0; j < 4; ++j)
+        cp[4*i + j] = (starts[i] >> (8 * j)) & 0xff;
+      cp[4*n + 2*i] = (countries[i] + 1) & 0xff;
+      cp[4*n + 2*i + 1] = (countries[i] + 1) >> 8;
+    }
+    memcpy(cp + 6 * n, codes, 2 * n_codes);
+  } else {
+    for (int i = 0; i < n; ++i) {
+      uint32_t high = (i + 1 < n) ? starts[i + 1] - 1 : UINT32_MAX;
+      smartlist_add_asprintf(chunks, "%u,%u,%c%c\n", starts[i], high,
+                             codes[2*countries[i]],
+                             codes[2*countries[i] + 1]);
+    }
+    db = smartlist_join_strings(chunks, "", 0, &db_len);
+  }
+  write_bytes_to_file(fname, db, db_len, 1);
+
+  qed_hs_free(db);
+  SMARTLIST_FOREACH(chunks, void *, cp, qed_hs_free(cp));
+  smartlist_free(chunks);
+}
+
+/** Time loading an IPv4 GeoIP database about as big as the one we ship,
+ * from text and from the binary format, and looking addresses up in it. */
+static void
+bench_geoip(void)
+{
+  /* The IPv4 database that we ship has about this many ranges. */
+  const int N_RANGES = 250000, N_CODES = 250, N_ADDRS = 4096;
+  const int N = 4000000;
+  uint32_t *starts = qed_hs_calloc(N_RANGES, sizeof(uint32_t));
+  uint16_t *countries = qed_hs_calloc(N_RANGES, sizeof(uint16_t));
+  qed_hs_addr_t *addrs = qed_hs_calloc(N_ADDRS, sizeof(qed_hs_addr_t));
+  char codes[2 * 250];
+  char *fname = NULL;
+  uint64_t start, end;
+  int i, total = 0;
+
+  for (i = 0; i < N_CODES; ++i) {
+    codes[2*i] = 'a' + i / 26;
+    codes[2*i + 1] = 'a' + i % 26;
+  }
+  /* Ranges that cover the whole address space, in random countries. */
+  for (i = 1; i < N_RANGES; ++i) {
+    starts[i] = starts[i-1] + 1 +
+      crypto_rand_int((int)(UINT32_MAX / N_RANGES - 1));
+    countries[i] = crypto_rand_int(N_CODES);
+  }
+  for (i = 0; i < N_ADDRS; ++i)
+    qed_hs_addr_from_ipv4h(&addrs[i], crypto_rand_u32());
+
+  qed_hs_asprintf(&fname, "%s/qed-hs-bench-geoip.%d",
+                  getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+                  (int)getpid());
+  for (int binary = 0; binary <= 1; ++binary) {
+    bench_geoip_write_db(fname, binary, starts, countries, N_RANGES, codes,
+                         N_CODES);
+    reset_perftime();
+    start = perftime();
+    if (geoip_load_file(AF_INET, fname, LOG_WARN) < 0) {
+      printf("Couldn't load %s\n", fname);
+      break;
+    }
+    end = perftime();
+    printf("Load %d ranges from %s: %.2f msec\n", N_RANGES,
+           binary ? "binary" : "text", NANOCOUNT(start, end, 1) / 1e6);
+
+    start = perftime();
+    for (i = 0; i < N; ++i)
+      total += geoip_get_country_by_addr(&addrs[i % N_ADDRS]);
+    end = perftime();
+    printf("Look up IPv4 addresses: %.2f nsec per lookup, "
+           "%.1f million lookups/sec\n",
+           NANOCOUNT(start, end, N), 1e3 / NANOCOUNT(start, end, N));
+  }
+  qed_hs_unlink(fname);
+  geoip_free_all();
+
+  qed_hs_free(fname);
+  qed_hs_free(starts);
+  qed_hs_free(countries);
+  qed_hs_free(addrs);
+  /* Keep the lookups from being optimized away. */
+  if (total == -1)
+    puts("");
+}
+
+#ifdef HAVE_MODULE_POW
+/** State shared between the threads solving one PoW puzzle in
+ * bench_hs_pow_solve(). */
+typedef struct bench_pow_solve_t {
+  hs_pow_solver_inputs_t inputs;
+  atomic_counter_t solved;
+  qed_hs_mutex_t lock;
+  qed_hs_cond_t cond;
+  int n_running;
+} bench_pow_solve_t;
+
+/** Thread function for bench_hs_pow_solve(): race the other threads to
+ * solve the puzzle in <b>arg</b>. */
+static void
+bench_pow_solve_thread(void *arg)
+{
+  bench_pow_solve_t *bench = arg;
+  hs_pow_solution_t solution;
+
+  hs_pow_solve_cancellable(&bench->inputs, &bench->solved, &solution);
+
+  qed_hs_mutex_acquire(&bench->lock);
+  if (--bench->n_running == 0)
+    qed_hs_cond_signal_one(&bench->cond);
+  qed_hs_mutex_release(&bench->lock);
+}
+
+/** Measure how long it takes to solve a PoW puzzle when the nonce space is
+ * split across increasing numbers of threads, as hs_pow_queue_work() does
+ * across cpuworkers. */
+static void
+bench_hs_pow_solve(void)
+{
+  const int N = 8;
+  const uint32_t effort = 100;
+  int max_threads = MIN(compute_num_cpus(), 16);
+  bench_pow_solve_t bench;
+
+  memset(&bench, 0, sizeof(bench));
+  qed_hs_mutex_init(&bench.lock);
+  qed_hs_cond_init(&bench.cond);
+  bench.inputs.effort = effort;
+  bench.inputs.CompiledProofOfWorkHash = -1;
+
+  for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    uint64_t start, end;
+    reset_perftime();
+    start = perftime();
+    for (int i = 0; i < N; ++i) {
+      crypto_rand((char *) bench.inputs.seed, sizeof(bench.inputs.seed));
+      crypto_rand((char *) bench.inputs.service_blinded_id.pubkey,
+                  sizeof(bench.inputs.service_blinded_id.pubkey));
+      atomic_counter_init(&bench.solved);
+
+      qed_hs_mutex_acquire(&bench.lock);
+      bench.n_running = n_threads;
+      for (int t = 0; t < n_threads; ++t) {
+        if (spawn_func(bench_pow_solve_thread, &bench) < 0) {
+          printf("Couldn't spawn a thread.\n");
+          exit(1);
+        }
+      }
+      while (bench.n_running > 0)
+        qed_hs_cond_wait(&bench.cond, &bench.lock, NULL);
+      qed_hs_mutex_release(&bench.lock);
+
+      atomic_counter_destroy(&bench.solved);
+    }
+    end = perftime();
+    printf("Solve PoW (effort %u, %d threads): %.2f msec\n",
+           (unsigned) effort, n_threads,
+           NANOCOUNT(start, end, N) / 1e6);
+  }
+
+  qed_hs_cond_uninit(&bench.cond);
+  qed_hs_mutex_uninit(&bench.lock);
+}
+
+/** Measure how long it takes to verify a PoW solution, with and without
+ * reusing verification contexts, for each hash implementation. */
+static void
+bench_hs_pow_verify(void)
+{
+  const int N = 4000;
+  const int n_puzzles = 4;
+  hs_pow_verifier_inputs_t inputs[4];
+  hs_pow_solution_t solutions[4];
+
+  for (int i = 0; i < n_puzzles; ++i) {
+    hs_pow_solver_inputs_t solver_inputs;
+    memset(&solver_inputs, 0, sizeof(solver_inputs));
+    solver_inputs.effort = 1;
+    solver_inputs.CompiledProofOfWorkHash = -1;
+    crypto_rand((char *) solver_inputs.seed, sizeof(solver_inputs.seed));
+    crypto_rand((char *) solver_inputs.service_blinded_id.pubkey,
+                sizeof(solver_inputs.service_blinded_id.pubkey));
+    if (hs_pow_solve(&solver_inputs, &solutions[i]) < 0) {
+      printf("Couldn't solve a PoW puzzle.\n");
+      exit(1);
+    }
+    memset(&inputs[i], 0, sizeof(inputs[i]));
+    memcpy(&inputs[i].service_blinded_id, &solver_inputs.service_blinded_id,
+           sizeof(inputs[i].service_blinded_id));
+    memcpy(inputs[i].seed_current, solver_inputs.seed,
+           sizeof(inputs[i].seed_current));
+  }
+
+  for (int reuse = 0; reuse <= 1; ++reuse) {
+    if (reuse)
+      hs_pow_init();
+    for (int compiled = 0; compiled <= 1; ++compiled) {
+      uint64_t start, end;
+      int n_failed = 0;
+      reset_perftime();
+      start = perftime();
+      for (int i = 0; i < N; ++i) {
+        hs_pow_verifier_inputs_t *in = &inputs[i % n_puzzles];
+        in->CompiledProofOfWorkHash = compiled;
+        if (hs_pow_verify_solution(in, &solutions[i % n_puzzles]) < 0)
+          ++n_failed;
+      }
+      end = perftime();
+      printf("Verify PoW (%s, %s contexts): %.2f usec%s\n",
+             compiled ? "compiled" : "interpreted",
+             reuse ? "reused" : "fresh",
+             NANOCOUNT(start, end, N) / 1e3,
+             n_failed ? " (FAILED)" : "");
+    }
+    if (reuse)
+      hs_pow_free_all();
+  }
+}
+#endif /* defined(HAVE_MODULE_POW) */
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -866,6 +1301,12 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(compress_md),
+  ENT(geoip),
+#ifdef HAVE_MODULE_POW
+  ENT(hs_pow_solve),
+  ENT(hs_pow_verify),
+#endif
   {NULL,NULL,0}
 };
 
@@ -906,10 +1347,26 @@ main(int argc, const char **argv)
     }
     size_t f1len = strlen(f1);
     size_t f2len = strlen(f2);
+    uint64_t start, end;
+    reset_perftime();
+    start = perftime();
     for (i = 0; i < N; ++i) {
       char *diff = consensus_diff_generate(f1, f1len, f2, f2len);
       qed_hs_free(diff);
     }
+    end = perftime();
+    fprintf(stderr, "consensus_diff_generate: %.2f usec per diff\n",
+            NANOCOUNT(start, end, N)/1000);
+    start = perftime();
+    consensus_diff_target_t *target = consensus_diff_target_new(f2, f2len);
+    for (i = 0; i < N; ++i) {
+      char *diff = consensus_diff_generate_to_target(f1, f1len, target);
+      qed_hs_free(diff);
+    }
+    consensus_diff_target_free(target);
+    end = perftime();
+    fprintf(stderr, "consensus_diff_generate_to_target: %.2f usec per diff "
+            "with a shared target\n", NANOCOUNT(start, end, N)/1000);
     char *diff = consensus_diff_generate(f1, f1len, f2, f2len);
     printf("%s", diff);
     qed_hs_free(f1);
@@ -34,10 +34,12 @@
 #define CIRCUITLIST_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
+#define CPUWORKER_PRIVATE
 
 #include "core/or/or.h"
 #include "lib/err/backtrace.h"
 #include "lib/buf/buffers.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
 #include "lib/compress/compress.h"
@@ -45,19 +47,24 @@
 #include "core/or/connection_edge.h"
 #include "core/or/extendinfo.h"
 #include "test/test.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
 #include "core/crypto/onion_ntor.h"
 #include "core/crypto/onion_fast.h"
 #include "core/or/policies.h"
+#include "core/or/scheduler.h"
 #include "lib/sandbox/sandbox.h"
 #include "app/config/statefile.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/evloop/workqueue.h"
+#include "test/fakechans.h"
 
 #include "core/or/extend_info_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
 #include "feature/relay/onion_queue.h"
 
 static void
@@ -305,6 +312,271 @@ test_onion_queue_order(void *arg)
   qed_hs_free(create_v3ntor2);
 }
 
+/* The onionskin jobs that the code under test has handed to the
+ * cpuworkers, in order.  The tests run them by hand. */
+static smartlist_t *fake_onion_jobs = NULL;
+typedef struct fake_onion_job_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+  /** True if a worker has "started" on this job, so that it can't be
+   * cancelled any more. */
+  int started;
+} fake_onion_job_t;
+
+static workqueue_entry_t *
+mock_onion_cpuworker_queue_work(workqueue_priority_t prio,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void *arg)
+{
+  fake_onion_job_t *job = qed_hs_malloc_zero(sizeof(*job));
+  (void) prio;
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(fake_onion_jobs, job);
+  return (workqueue_entry_t *) job;
+}
+
+static void *
+mock_onion_cpuworker_cancel_work(workqueue_entry_t *ent)
+{
+  fake_onion_job_t *job = (fake_onion_job_t *) ent;
+  void *arg;
+  if (job->started)
+    return NULL;
+  smartlist_remove_keeporder(fake_onion_jobs, job);
+  arg = job->arg;
+  qed_hs_free(job);
+  return arg;
+}
+
+/* Run the queued job for <b>circ</b> on a "worker", then handle its reply
+ * on the "main thread".  Return 0 on success, -1 if there is no such job. */
+static int
+run_fake_onion_job(or_circuit_t *circ)
+{
+  worker_state_t ws;
+  fake_onion_job_t *job = (fake_onion_job_t *) circ->workqueue_entry;
+  if (!job || !smartlist_contains(fake_onion_jobs, job))
+    return -1;
+  smartlist_remove_keeporder(fake_onion_jobs, job);
+  /* CREATE_FAST handshakes don't need any onion keys. */
+  memset(&ws, 0, sizeof(ws));
+  job->fn(&ws, job->arg);
+  job->reply_fn(job->arg);
+  qed_hs_free(job);
+  return 0;
+}
+
+/* Return a new circuit from a client on <b>chan</b>, with a create cell in
+ * *<b>create_out</b>.  If <b>valid</b> is true, the cell is a CREATE_FAST
+ * that will succeed.  Otherwise, it is a truncated ntor handshake that the
+ * worker will reject; unlike CREATE_FAST, it can wait in the onion queue. */
+static or_circuit_t *
+new_onion_circ(channel_t *chan, circid_t id, int valid,
+               create_cell_t **create_out)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN];
+  or_circuit_t *circ = or_circuit_new(id, chan);
+  create_cell_t *cc = qed_hs_malloc_zero(sizeof(create_cell_t));
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_OR;
+  crypto_rand((char *) buf, sizeof(buf));
+  if (valid)
+    create_cell_init(cc, CELL_CREATE_FAST, ONION_HANDSHAKE_TYPE_FAST,
+                     CREATE_FAST_LEN, buf);
+  else
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN - 1, buf);
+  *create_out = cc;
+  return circ;
+}
+
+/* Set up the cpuworker code to take at most <b>max</b> pending onionskins,
+ * and to send them to our fake queue. */
+static void
+setup_fake_onion_cpuworkers(int max)
+{
+  networkstatus_t ns;
+  char param[64];
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  qed_hs_snprintf(param, sizeof(param), "max_pending_tasks_per_cpu=%d", max);
+  smartlist_add(ns.net_params, param);
+  get_options_mutable()->NumCPUs = 1;
+  /* Don't let the OOM handler kill circuits with a cell queued. */
+  get_options_mutable()->MaxMemInQueues = 256*1024*1024;
+  cpuworker_consensus_has_changed(&ns);
+  smartlist_free(ns.net_params);
+
+  fake_onion_jobs = smartlist_new();
+  MOCK(cpuworker_queue_work, mock_onion_cpuworker_queue_work);
+  MOCK(cpuworker_cancel_work, mock_onion_cpuworker_cancel_work);
+}
+
+static void
+teardown_fake_onion_cpuworkers(void)
+{
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(cpuworker_cancel_work);
+  if (fake_onion_jobs) {
+    SMARTLIST_FOREACH(fake_onion_jobs, fake_onion_job_t *, j, qed_hs_free(j));
+    smartlist_free(fake_onion_jobs);
+  }
+  clear_pending_onions();
+  circuit_free_all();
+}
+
+/** Make sure that each onionskin goes to the cpuworkers as a job of its
+ * own, that onionskins wait in the onion queue while the workers are
+ * busy, and that each reply lets the next one through. */
+static void
+test_cpuworker_onion_queue(void *arg)
+{
+  channel_t *chan = new_fake_channel();
+  or_circuit_t *circ[3];
+  create_cell_t *cc;
+  int i;
+  (void)arg;
+
+  setup_fake_onion_cpuworkers(2);
+
+  for (i = 0; i < 3; ++i) {
+    circ[i] = new_onion_circ(chan, 100+i, 0, &cc);
+    tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(circ[i], cc));
+  }
+
+  /* Two went to the workers, one job each; the third one waits. */
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 2);
+  tt_ptr_op(circ[0]->workqueue_entry, OP_EQ,
+            smartlist_get(fake_onion_jobs, 0));
+  tt_ptr_op(circ[1]->workqueue_entry, OP_EQ,
+            smartlist_get(fake_onion_jobs, 1));
+  tt_ptr_op(circ[2]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circ[2]->onionqueue_entry, OP_NE, NULL);
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 1);
+
+  /* When the first reply comes back, the third onionskin goes out. */
+  tt_int_op(0, OP_EQ, run_fake_onion_job(circ[0]));
+  tt_ptr_op(circ[0]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(TO_CIRCUIT(circ[0])->marked_for_close);
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 2);
+  tt_ptr_op(circ[2]->onionqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circ[2]->workqueue_entry, OP_EQ,
+            smartlist_get(fake_onion_jobs, 1));
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 0);
+
+  /* The others can finish in any order. */
+  tt_int_op(0, OP_EQ, run_fake_onion_job(circ[2]));
+  tt_int_op(0, OP_EQ, run_fake_onion_job(circ[1]));
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 0);
+
+ done:
+  teardown_fake_onion_cpuworkers();
+  free_fake_channel(chan);
+}
+
+static void
+mock_scheduler_channel_has_waiting_cells(channel_t *chan)
+{
+  (void) chan;
+}
+
+/** Make sure that each reply from the cpuworkers reaches its own circuit,
+ * whether the handshake succeeded or not. */
+static void
+test_cpuworker_onion_reply(void *arg)
+{
+  channel_t *chan = new_fake_channel();
+  or_circuit_t *good, *bad;
+  create_cell_t *cc;
+  (void)arg;
+
+  setup_fake_onion_cpuworkers(4);
+  MOCK(scheduler_channel_has_waiting_cells,
+       mock_scheduler_channel_has_waiting_cells);
+
+  good = new_onion_circ(chan, 100, 1, &cc);
+  tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(good, cc));
+  bad = new_onion_circ(chan, 101, 0, &cc);
+  tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(bad, cc));
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 2);
+
+  tt_int_op(0, OP_EQ, run_fake_onion_job(bad));
+  tt_assert(TO_CIRCUIT(bad)->marked_for_close);
+  tt_assert(! TO_CIRCUIT(good)->marked_for_close);
+  tt_ptr_op(good->workqueue_entry, OP_NE, NULL);
+
+  tt_int_op(0, OP_EQ, run_fake_onion_job(good));
+  tt_assert(! TO_CIRCUIT(good)->marked_for_close);
+  tt_int_op(TO_CIRCUIT(good)->state, OP_EQ, CIRCUIT_STATE_OPEN);
+  tt_ptr_op(good->workqueue_entry, OP_EQ, NULL);
+  /* The CREATED_FAST cell is waiting to go out. */
+  tt_int_op(good->p_chan_cells.n, OP_EQ, 1);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  teardown_fake_onion_cpuworkers();
+  free_fake_channel(chan);
+}
+
+/** Make sure that freeing a circuit whose onionskin is with the cpuworkers
+ * cancels the job if no worker has started on it, and otherwise leaves the
+ * circuit for the reply to free. */
+static void
+test_cpuworker_onion_free_pending(void *arg)
+{
+  channel_t *chan = new_fake_channel();
+  or_circuit_t *queued, *started, *circ;
+  create_cell_t *cc;
+  fake_onion_job_t *job;
+  worker_state_t ws;
+  int i;
+  (void)arg;
+
+  memset(&ws, 0, sizeof(ws));
+  setup_fake_onion_cpuworkers(2);
+
+  queued = new_onion_circ(chan, 100, 1, &cc);
+  tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(queued, cc));
+  started = new_onion_circ(chan, 101, 1, &cc);
+  tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(started, cc));
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 2);
+  job = (fake_onion_job_t *) started->workqueue_entry;
+  job->started = 1;
+
+  /* The job that hasn't started gets cancelled, and the circuit freed. */
+  onion_pending_remove(queued);
+  tt_ptr_op(queued->workqueue_entry, OP_EQ, NULL);
+  circuit_free_(TO_CIRCUIT(queued));
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 1);
+
+  /* The one that has started has to run to the end: the circuit stays
+   * allocated until its reply comes back. */
+  onion_pending_remove(started);
+  tt_ptr_op(started->workqueue_entry, OP_EQ, job);
+  circuit_free_(TO_CIRCUIT(started));
+  tt_uint_op(TO_CIRCUIT(started)->magic, OP_EQ, DEAD_CIRCUIT_MAGIC);
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 1);
+  smartlist_remove(fake_onion_jobs, job);
+  job->fn(&ws, job->arg);
+  job->reply_fn(job->arg); /* frees the circuit */
+  qed_hs_free(job);
+
+  /* Both slots are free again. */
+  for (i = 0; i < 2; ++i) {
+    circ = new_onion_circ(chan, 102+i, 1, &cc);
+    tt_int_op(0, OP_EQ, assign_onionskin_to_cpuworker(circ, cc));
+    tt_ptr_op(circ->workqueue_entry, OP_NE, NULL);
+  }
+  tt_int_op(smartlist_len(fake_onion_jobs), OP_EQ, 2);
+
+ done:
+  teardown_fake_onion_cpuworkers();
+  free_fake_channel(chan);
+}
+
 static int32_t cbtnummodes = 10;
 
 static int32_t
@@ -576,6 +848,9 @@ test_circuit_timeout(void *arg)
 static struct testcase_t test_array[] = {
   ENT(onion_queues),
   ENT(onion_queue_order),
+  FORK(cpuworker_onion_queue),
+  FORK(cpuworker_onion_reply),
+  FORK(cpuworker_onion_free_pending),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
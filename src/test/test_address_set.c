@@ -182,6 +182,14 @@ test_nodelist(void *arg)
   ret = nodelist_probably_contains_address(&dummy_addr);
   tt_int_op(ret, OP_EQ, 0);
 
+  /* Drop the relay from the consensus: its addresses should go away. */
+  smartlist_clear(dummy_ns->routerstatus_list);
+  nodelist_set_consensus(dummy_ns);
+  ret = nodelist_probably_contains_address(&addr_v4);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = nodelist_probably_contains_address(&addr_v6);
+  tt_int_op(ret, OP_EQ, 0);
+
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
   smartlist_clear(dummy_ns->routerstatus_list);
@@ -194,6 +202,75 @@ test_nodelist(void *arg)
   testing_disable_deterministic_rng();
 }
 
+/* Count how many of the IPv4 addresses <b>base</b> + <b>first</b>,
+ * <b>first</b> + 2, ... below <b>base</b> + <b>n</b> are in <b>set</b>. */
+static int
+count_ipv4_in_set(const address_set_t *set, uint32_t base, int first, int n)
+{
+  int i, count = 0;
+  for (i = first; i < n; i += 2) {
+    qed_hs_addr_t a;
+    qed_hs_addr_from_ipv4h(&a, base + i);
+    count += address_set_probably_contains(set, &a);
+  }
+  return count;
+}
+
+static void
+test_update(void *arg)
+{
+  address_set_t *set = NULL;
+  const uint32_t base = 0x0a000000; /* 10.0.0.0 */
+  const uint32_t new_base = 0x0b000000; /* 11.0.0.0 */
+  const int n = 400;
+  int i;
+
+  (void) arg;
+
+  testing_enable_deterministic_rng();
+
+  set = address_set_new(1024);
+  for (i = 0; i < n; ++i) {
+    /* Add everything twice, like a nodelist with repeated descriptors. */
+    address_set_add_ipv4h(set, base + i);
+    address_set_add_ipv4h(set, base + i);
+  }
+  tt_int_op(count_ipv4_in_set(set, base, 0, n), OP_EQ, n/2);
+  tt_int_op(count_ipv4_in_set(set, base, 1, n), OP_EQ, n/2);
+
+  /* Keep the even addresses only.  Until the update ends, we still see the
+   * odd ones. */
+  address_set_begin_update(set, 1024);
+  for (i = 0; i < n; i += 2)
+    address_set_add_ipv4h(set, base + i);
+  tt_int_op(count_ipv4_in_set(set, base, 1, n), OP_EQ, n/2);
+  address_set_end_update(set);
+  tt_int_op(count_ipv4_in_set(set, base, 0, n), OP_EQ, n/2);
+  tt_int_op(count_ipv4_in_set(set, base, 1, n), OP_LT, 3);
+
+  /* An update that changes the size of the set replaces the whole filter,
+   * but we still see the old addresses until it ends. */
+  address_set_begin_update(set, 1 << 16);
+  for (i = 0; i < n; ++i)
+    address_set_add_ipv4h(set, new_base + i);
+  tt_int_op(count_ipv4_in_set(set, base, 0, n), OP_EQ, n/2);
+  tt_int_op(count_ipv4_in_set(set, new_base, 0, n), OP_EQ, n/2);
+  address_set_end_update(set);
+  tt_int_op(count_ipv4_in_set(set, new_base, 0, n), OP_EQ, n/2);
+  tt_int_op(count_ipv4_in_set(set, new_base, 1, n), OP_EQ, n/2);
+  tt_int_op(count_ipv4_in_set(set, base, 0, n), OP_LT, 3);
+
+  /* An update that adds nothing back empties the set. */
+  address_set_begin_update(set, 1 << 16);
+  address_set_end_update(set);
+  tt_int_op(count_ipv4_in_set(set, new_base, 0, n), OP_EQ, 0);
+  tt_int_op(count_ipv4_in_set(set, new_base, 1, n), OP_EQ, 0);
+
+ done:
+  address_set_free(set);
+  testing_disable_deterministic_rng();
+}
+
 /** Test that the no-reentry exit filter works as intended */
 static void
 test_exit_no_reentry(void *arg)
@@ -278,6 +355,8 @@ struct testcase_t address_set_tests[] = {
     NULL, NULL },
   { "nodelist", test_nodelist, TT_FORK,
     NULL, NULL },
+  { "update", test_update, TT_FORK,
+    NULL, NULL },
   { "exit_no_reentry", test_exit_no_reentry, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
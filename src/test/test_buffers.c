@@ -7,6 +7,7 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -430,6 +431,102 @@ test_buffer_copy(void *arg)
     buf_free(buf2);
 }
 
+/** Helper for test_buffer_external: count releases of external memory. */
+static void
+count_external_free(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffer_external(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *mem = qed_hs_malloc(10000);
+  char *out = qed_hs_malloc(10000);
+  const char *cp;
+  size_t sz;
+  int n_freed = 0, n_freed2 = 0;
+  (void)arg;
+
+  crypto_rand(mem, 10000);
+  buf = buf_new();
+
+  /* Empty adds are released at once. */
+  tt_int_op(buf_add_external(buf, mem, 0, count_external_free, &n_freed),
+            OP_EQ, 0);
+  tt_int_op(n_freed, OP_EQ, 1);
+  n_freed = 0;
+
+  /* External memory is not copied, and has no slack. */
+  buf_add(buf, "abc", 3);
+  tt_int_op(buf_add_external(buf, mem, 5000, count_external_free, &n_freed),
+            OP_EQ, 5003);
+  tt_ptr_op(buf->tail->data, OP_EQ, mem);
+  tt_int_op(buf_slack(buf), OP_EQ, 0);
+  buf_assert_ok(buf);
+  /* Adding more after it makes a new chunk. */
+  buf_add(buf, "xyz", 3);
+  tt_ptr_op(buf->tail->data, OP_NE, mem);
+  tt_int_op(buf_datalen(buf), OP_EQ, 5006);
+  buf_assert_ok(buf);
+
+  /* Copies don't share the external memory. */
+  tt_int_op(0, OP_EQ, buf_set_to_copy(&buf2, buf));
+  buf_get_bytes(buf2, out, 5006);
+  tt_mem_op(out, OP_EQ, "abc", 3);
+  tt_mem_op(out+3, OP_EQ, mem, 5000);
+  tt_mem_op(out+5003, OP_EQ, "xyz", 3);
+  buf_free(buf2);
+  tt_int_op(n_freed, OP_EQ, 0);
+
+  /* Draining part of the external chunk keeps it. */
+  buf_drain(buf, 1000);
+  tt_int_op(n_freed, OP_EQ, 0);
+  tt_ptr_op(buf->head->data, OP_EQ, mem + 997);
+  buf_assert_ok(buf);
+  /* Draining all of it releases it. */
+  buf_drain(buf, 4003);
+  tt_int_op(n_freed, OP_EQ, 1);
+  tt_int_op(buf_datalen(buf), OP_EQ, 3);
+  buf_clear(buf);
+
+  /* Pulling up an external head replaces it with a copy. */
+  n_freed = 0;
+  buf_add_external(buf, mem, 100, count_external_free, &n_freed);
+  buf_add_external(buf, mem + 100, 9900, count_external_free, &n_freed2);
+  buf_pullup(buf, 200, &cp, &sz);
+  tt_int_op(sz, OP_GE, 200);
+  tt_ptr_op(cp, OP_NE, mem);
+  tt_mem_op(cp, OP_EQ, mem, 200);
+  tt_int_op(n_freed, OP_EQ, 1);
+  tt_int_op(n_freed2, OP_EQ, 0);
+  buf_assert_ok(buf);
+
+  /* Moving chunks moves ownership. */
+  buf2 = buf_new();
+  buf_move_all(buf2, buf);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 10000);
+  buf_free(buf);
+  tt_int_op(n_freed2, OP_EQ, 0);
+  buf_get_bytes(buf2, out, 10000);
+  tt_mem_op(out, OP_EQ, mem, 10000);
+  tt_int_op(n_freed2, OP_EQ, 1);
+
+  /* Freeing a buffer releases what it still holds. */
+  n_freed = 0;
+  buf = buf_new();
+  buf_add_external(buf, mem, 10, count_external_free, &n_freed);
+  buf_free(buf);
+  tt_int_op(n_freed, OP_EQ, 1);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  qed_hs_free(mem);
+  qed_hs_free(out);
+}
+
 static void
 test_buffer_allocation_tracking(void *arg)
 {
@@ -768,6 +865,69 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static void
+test_buffers_flush_to_socket_multichunk(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  qed_hs_socket_t fds[2] = { QED_HS_INVALID_SOCKET, QED_HS_INVALID_SOCKET };
+  char *data = NULL, *out = NULL;
+  const size_t total = 256*1024;
+  size_t sent = 0, received = 0;
+  int n_chunks = 0, eof = 0, r;
+  chunk_t *ch;
+  (void)arg;
+
+  tt_int_op(0, OP_EQ, qed_hs_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  data = qed_hs_malloc(total);
+  out = qed_hs_malloc(total);
+  crypto_rand(data, total);
+
+  /* Add the data in small pieces so that it spans many chunks. */
+  buf = buf_new_with_capacity(1024);
+  for (size_t off = 0; off < total; off += 3000) {
+    size_t n = MIN(3000, total - off);
+    buf_add(buf, data + off, n);
+  }
+  for (ch = buf->head; ch; ch = ch->next)
+    ++n_chunks;
+  tt_int_op(n_chunks, OP_GT, 2);
+
+  /* The socket buffer is smaller than the data, so we should see partial
+   * writes; make sure we only ever drain what was actually written. */
+  buf2 = buf_new();
+  while (received < total) {
+    if (buf_datalen(buf)) {
+      size_t before = buf_datalen(buf);
+      r = buf_flush_to_socket(buf, fds[0], before);
+      tt_int_op(r, OP_GE, 0);
+      tt_uint_op(buf_datalen(buf), OP_EQ, before - r);
+      sent += r;
+    }
+    r = buf_read_from_socket(buf2, fds[1], total, &eof, NULL);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    received += r;
+    tt_uint_op(received, OP_LE, sent);
+  }
+  tt_uint_op(buf_datalen(buf), OP_EQ, 0);
+  tt_uint_op(buf_datalen(buf2), OP_EQ, total);
+  buf_get_bytes(buf2, out, total);
+  tt_mem_op(out, OP_EQ, data, total);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    qed_hs_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    qed_hs_close_socket(fds[1]);
+  buf_free(buf);
+  buf_free(buf2);
+  qed_hs_free(data);
+  qed_hs_free(out);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -863,12 +1023,15 @@ struct testcase_t buffer_tests[] = {
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "move_all", test_buffers_move_all, 0, NULL, NULL },
+  { "external", test_buffer_external, 0, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "flush_to_socket_multichunk", test_buffers_flush_to_socket_multichunk,
+    TT_FORK, NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
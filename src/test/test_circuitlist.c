@@ -4,9 +4,11 @@
 #define CHANNEL_OBJECT_PRIVATE
 #define CIRCUITBUILD_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define CIRCID_MAP_PRIVATE
 #define HS_CIRCUITMAP_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
+#include "core/or/circid_map.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
@@ -18,6 +20,7 @@
 #include "core/or/origin_circuit_st.h"
 
 #include "lib/container/bitarray.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 static channel_t *
 new_fake_channel(void)
@@ -169,12 +172,18 @@ test_clist_maps(void *arg)
     circuit_free_(TO_CIRCUIT(or_c1));
   if (or_c2)
     circuit_free_(TO_CIRCUIT(or_c2));
-  if (ch1)
+  if (ch1) {
     qed_hs_free(ch1->cmux);
-  if (ch2)
+    circid_map_free(ch1->circid_map);
+  }
+  if (ch2) {
     qed_hs_free(ch2->cmux);
-  if (ch3)
+    circid_map_free(ch2->circid_map);
+  }
+  if (ch3) {
     qed_hs_free(ch3->cmux);
+    circid_map_free(ch3->circid_map);
+  }
   qed_hs_free(ch1);
   qed_hs_free(ch2);
   qed_hs_free(ch3);
@@ -394,6 +403,8 @@ test_pick_circid(void *arg)
  done:
   circuitmux_free(chan1->cmux);
   circuitmux_free(chan2->cmux);
+  circid_map_free(chan1->circid_map);
+  circid_map_free(chan2->circid_map);
   qed_hs_free(chan1);
   qed_hs_free(chan2);
   bitarray_free(ba);
@@ -484,10 +495,78 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+static void
+test_circid_map(void *arg)
+{
+  circid_map_t *map = circid_map_new();
+  circuit_t *fake_circs = qed_hs_calloc(4096, sizeof(circuit_t));
+  bitarray_t *present = bitarray_init_zero(1<<16);
+  circid_map_ent_t *ent, removed;
+  circid_t id;
+  int i, n = 0;
+
+  (void)arg;
+
+  tt_ptr_op(circid_map_find(NULL, 5), OP_EQ, NULL);
+  tt_ptr_op(circid_map_find(map, 5), OP_EQ, NULL);
+  tt_int_op(circid_map_remove(map, 5, NULL), OP_EQ, 0);
+
+  /* Insert and remove lots of IDs, checking against a bitarray. */
+  for (i = 0; i < 50000; ++i) {
+    id = crypto_rand_int(1<<16);
+    if (crypto_rand_int(3)) {
+      ent = circid_map_find_or_insert(map, id);
+      tt_assert(ent);
+      tt_uint_op(ent->circ_id, OP_EQ, id);
+      if (!bitarray_is_set(present, id)) {
+        tt_ptr_op(ent->circuit, OP_EQ, NULL);
+        bitarray_set(present, id);
+        ++n;
+      }
+      ent->circuit = &fake_circs[id % 4096];
+    } else {
+      int r = circid_map_remove(map, id, &removed);
+      tt_int_op(r, OP_EQ, !!bitarray_is_set(present, id));
+      if (r) {
+        tt_uint_op(removed.circ_id, OP_EQ, id);
+        tt_ptr_op(removed.circuit, OP_EQ, &fake_circs[id % 4096]);
+        bitarray_clear(present, id);
+        --n;
+      }
+    }
+    tt_uint_op(circid_map_size(map), OP_EQ, n);
+    tt_uint_op(map->n_ents * 8, OP_LE, map->capacity * 7);
+  }
+
+  for (i = 0; i < (1<<16); ++i) {
+    ent = circid_map_find(map, i);
+    if (bitarray_is_set(present, i)) {
+      tt_assert(ent);
+      tt_ptr_op(ent->circuit, OP_EQ, &fake_circs[i % 4096]);
+    } else {
+      tt_ptr_op(ent, OP_EQ, NULL);
+    }
+  }
+
+  /* Remove everything; the table should shrink back down. */
+  for (i = 0; i < (1<<16); ++i) {
+    if (bitarray_is_set(present, i))
+      tt_int_op(circid_map_remove(map, i, NULL), OP_EQ, 1);
+  }
+  tt_uint_op(circid_map_size(map), OP_EQ, 0);
+  tt_uint_op(map->capacity, OP_EQ, CIRCID_MAP_MIN_CAPACITY);
+
+ done:
+  circid_map_free(map);
+  qed_hs_free(fake_circs);
+  bitarray_free(present);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "circid_map", test_circid_map, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -185,6 +185,171 @@ test_cmux_ewma_policy_data(void *arg)
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_calq_bucket(void *arg)
+{
+  (void) arg;
+
+  /* Zero, negative and tiny counts go in the first bucket. */
+  tt_int_op(ewma_calq_bucket_for_count(0.0), OP_EQ, 0);
+  tt_int_op(ewma_calq_bucket_for_count(-1.0), OP_EQ, 0);
+  tt_int_op(ewma_calq_bucket_for_count(1e-30), OP_EQ, 0);
+  /* Huge ones go in the last. */
+  tt_int_op(ewma_calq_bucket_for_count(1e300), OP_EQ,
+            EWMA_CALQ_N_BUCKETS - 1);
+
+  /* Each doubling moves us up by a fixed number of buckets. */
+  tt_int_op(ewma_calq_bucket_for_count(2.0) -
+            ewma_calq_bucket_for_count(1.0), OP_EQ,
+            EWMA_CALQ_BUCKETS_PER_OCTAVE);
+  tt_int_op(ewma_calq_bucket_for_count(1024.0) -
+            ewma_calq_bucket_for_count(512.0), OP_EQ,
+            EWMA_CALQ_BUCKETS_PER_OCTAVE);
+
+  /* Bucket order follows count order. */
+  for (double c = 1e-4; c < 1e12; c *= 1.1) {
+    tt_int_op(ewma_calq_bucket_for_count(c), OP_LE,
+              ewma_calq_bucket_for_count(c * 1.1));
+  }
+
+ done:
+  ;
+}
+
+static void
+test_cmux_ewma_calq_pick(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ[3]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[3] = { NULL, NULL, NULL };
+  ewma_calq_policy_data_t *calq_pol_data;
+  ewma_policy_circ_data_t *ewma_data;
+  int i;
+
+  (void) arg;
+
+  pol_data = ewma_calq_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  tt_uint_op(pol_data->magic, OP_EQ, EWMA_CALQ_POL_DATA_MAGIC);
+  calq_pol_data = TO_EWMA_CALQ_POL_DATA(pol_data);
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            NULL);
+
+  for (i = 0; i < 3; ++i) {
+    circ_data[i] = ewma_calq_policy.alloc_circ_data(&cmux, pol_data,
+                                                    &circ[i],
+                                                    CELL_DIRECTION_OUT, 42);
+    tt_assert(circ_data[i]);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_int_op(ewma_data->cell_ewma.calq_bucket, OP_EQ, -1);
+    /* Give them counts far enough apart to land in different buckets. */
+    ewma_data->cell_ewma.last_adjusted_tick = calq_pol_data->epoch_tick;
+    ewma_data->cell_ewma.cell_count = 1000.0 / (1 << (4 * i));
+  }
+  for (i = 0; i < 3; ++i) {
+    ewma_calq_policy.notify_circ_active(&cmux, pol_data, &circ[i],
+                                        circ_data[i]);
+  }
+  tt_int_op(calq_pol_data->n_active, OP_EQ, 3);
+
+  /* The quietest circuit comes first. */
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            &circ[2]);
+
+  /* Remove it; now the next quietest. */
+  ewma_calq_policy.notify_circ_inactive(&cmux, pol_data, &circ[2],
+                                        circ_data[2]);
+  tt_int_op(calq_pol_data->n_active, OP_EQ, 2);
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            &circ[1]);
+
+  /* Sending lots of cells on it should push it behind circ[0]. */
+  ewma_calq_policy.notify_xmit_cells(&cmux, pol_data, &circ[1],
+                                     circ_data[1], 10000);
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            &circ[0]);
+
+  ewma_calq_policy.notify_circ_inactive(&cmux, pol_data, &circ[0],
+                                        circ_data[0]);
+  ewma_calq_policy.notify_circ_inactive(&cmux, pol_data, &circ[1],
+                                        circ_data[1]);
+  tt_int_op(calq_pol_data->n_active, OP_EQ, 0);
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            NULL);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (circ_data[i])
+      ewma_calq_policy.free_circ_data(&cmux, pol_data, &circ[i],
+                                      circ_data[i]);
+  }
+  ewma_calq_policy.free_cmux_data(&cmux, pol_data);
+}
+
+static void
+test_cmux_ewma_calq_renormalize(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ[2]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[2] = { NULL, NULL };
+  ewma_calq_policy_data_t *calq_pol_data;
+  ewma_policy_circ_data_t *ewma_data[2];
+  unsigned old_epoch;
+  int i;
+
+  (void) arg;
+
+  pol_data = ewma_calq_policy.alloc_cmux_data(&cmux);
+  calq_pol_data = TO_EWMA_CALQ_POL_DATA(pol_data);
+
+  for (i = 0; i < 2; ++i) {
+    circ_data[i] = ewma_calq_policy.alloc_circ_data(&cmux, pol_data,
+                                                    &circ[i],
+                                                    CELL_DIRECTION_OUT, 42);
+    ewma_data[i] = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    ewma_calq_policy.notify_circ_active(&cmux, pol_data, &circ[i],
+                                        circ_data[i]);
+  }
+
+  /* Pretend the epoch is far in the past, so that the next transmission
+   * has to renormalize every active circuit. */
+  calq_pol_data->epoch_tick -= 10000;
+  for (i = 0; i < 2; ++i) {
+    ewma_data[i]->cell_ewma.last_adjusted_tick = calq_pol_data->epoch_tick;
+    ewma_data[i]->cell_ewma.cell_count = 1e6;
+  }
+  old_epoch = calq_pol_data->epoch_tick;
+
+  circuit_t *first = ewma_calq_policy.pick_active_circuit(&cmux, pol_data);
+  i = (first == &circ[0]) ? 0 : 1;
+  ewma_calq_policy.notify_xmit_cells(&cmux, pol_data, first, circ_data[i],
+                                     1);
+  tt_uint_op(calq_pol_data->epoch_tick, OP_NE, old_epoch);
+  tt_uint_op(ewma_data[0]->cell_ewma.last_adjusted_tick, OP_EQ,
+             calq_pol_data->epoch_tick);
+  tt_uint_op(ewma_data[1]->cell_ewma.last_adjusted_tick, OP_EQ,
+             calq_pol_data->epoch_tick);
+  /* The old counts have decayed away; the new cell dominates. */
+  tt_double_op(ewma_data[1-i]->cell_ewma.cell_count, OP_LT, 1.0);
+  tt_double_op(ewma_data[i]->cell_ewma.cell_count, OP_GE, 1.0);
+  tt_int_op(calq_pol_data->n_active, OP_EQ, 2);
+  tt_ptr_op(ewma_calq_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            &circ[1-i]);
+
+ done:
+  for (i = 0; i < 2; ++i) {
+    if (circ_data[i]) {
+      ewma_calq_policy.notify_circ_inactive(&cmux, pol_data, &circ[i],
+                                            circ_data[i]);
+      ewma_calq_policy.free_circ_data(&cmux, pol_data, &circ[i],
+                                      circ_data[i]);
+    }
+  }
+  ewma_calq_policy.free_cmux_data(&cmux, pol_data);
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +388,9 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(calq_bucket),
+  TEST_CMUX_EWMA(calq_pick),
+  TEST_CMUX_EWMA(calq_renormalize),
 
   END_OF_TESTCASES
 };
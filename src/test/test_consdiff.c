@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -106,18 +107,38 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
   memarea_drop_all(area);
 }
 
+/** Return the length of the longest common subsequence of the lines in
+ * <b>slice1</b> and <b>slice2</b>, computed the slow and obvious way. */
+static int
+slow_lcs_length(const smartlist_slice_t *slice1,
+                const smartlist_slice_t *slice2)
+{
+  int n = slice1->len, m = slice2->len;
+  int *lens = qed_hs_calloc((n+1)*(m+1), sizeof(int));
+  for (int i = n-1; i >= 0; --i) {
+    for (int j = m-1; j >= 0; --j) {
+      const cdline_t *line1 = smartlist_get(slice1->list, slice1->offset+i);
+      const cdline_t *line2 = smartlist_get(slice2->list, slice2->offset+j);
+      if (lines_eq(line1, line2))
+        lens[i*(m+1)+j] = lens[(i+1)*(m+1)+j+1] + 1;
+      else
+        lens[i*(m+1)+j] = MAX(lens[(i+1)*(m+1)+j], lens[i*(m+1)+j+1]);
+    }
+  }
+  int result = lens[0];
+  qed_hs_free(lens);
+  return result;
+}
+
 static void
-test_consdiff_lcs_lengths(void *arg)
+test_consdiff_find_middle_snake(void *arg)
 {
   smartlist_t *sl1 = smartlist_new();
   smartlist_t *sl2 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2;
-  int *lengths1, *lengths2;
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  smartlist_slice_t *top = NULL, *bot = NULL, *left = NULL, *right = NULL;
   memarea_t *area = memarea_new();
-
-  /* Expected lcs lengths in regular and reverse order. */
-  int e_lengths1[] = { 0, 1, 2, 3, 3, 4 };
-  int e_lengths2[] = { 0, 1, 1, 2, 3, 4 };
+  int mid1 = -1, mid2 = -1;
 
   (void)arg;
   consensus_split_lines_(sl1, "a\nb\nc\nd\ne\n", area);
@@ -126,16 +147,34 @@ test_consdiff_lcs_lengths(void *arg)
   sls1 = smartlist_slice(sl1, 0, -1);
   sls2 = smartlist_slice(sl2, 0, -1);
 
-  lengths1 = lcs_lengths(sls1, sls2, 1);
-  lengths2 = lcs_lengths(sls1, sls2, -1);
-  tt_mem_op(e_lengths1, OP_EQ, lengths1, sizeof(int) * 6);
-  tt_mem_op(e_lengths2, OP_EQ, lengths2, sizeof(int) * 6);
+  /* The split point must be one that a shortest diff goes through. */
+  tt_int_op(0, OP_EQ, find_middle_snake(sls1, sls2, &mid1, &mid2));
+  tt_int_op(mid1, OP_GE, 0);
+  tt_int_op(mid1, OP_LE, 5);
+  tt_int_op(mid2, OP_GE, 0);
+  tt_int_op(mid2, OP_LE, 5);
+  top = smartlist_slice(sl1, 0, mid1);
+  bot = smartlist_slice(sl1, mid1, -1);
+  left = smartlist_slice(sl2, 0, mid2);
+  right = smartlist_slice(sl2, mid2, -1);
+  tt_int_op(4, OP_EQ, slow_lcs_length(sls1, sls2));
+  tt_int_op(4, OP_EQ,
+            slow_lcs_length(top, left) + slow_lcs_length(bot, right));
+
+  /* Nothing in common. */
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl2, "x\ny\nz\n", area);
+  qed_hs_free(sls2);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  tt_int_op(-1, OP_EQ, find_middle_snake(sls1, sls2, &mid1, &mid2));
 
  done:
-  qed_hs_free(lengths1);
-  qed_hs_free(lengths2);
   qed_hs_free(sls1);
   qed_hs_free(sls2);
+  qed_hs_free(top);
+  qed_hs_free(bot);
+  qed_hs_free(left);
+  qed_hs_free(right);
   smartlist_free(sl1);
   smartlist_free(sl2);
   memarea_drop_all(area);
@@ -343,6 +382,84 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_calc_changes_random(void *arg)
+{
+  static const char *alphabet[] = { "a", "b", "c", "d" };
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+  memarea_t *area = memarea_new();
+
+  (void)arg;
+  for (int iter = 0; iter < 200; ++iter) {
+    int len1 = crypto_rand_int(40), len2 = crypto_rand_int(40);
+    int use_ids = iter & 1;
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    qed_hs_free(ids1);
+    qed_hs_free(ids2);
+    ids1 = qed_hs_calloc(len1+1, sizeof(uint32_t));
+    ids2 = qed_hs_calloc(len2+1, sizeof(uint32_t));
+    for (int i = 0; i < len1; ++i) {
+      int c = crypto_rand_int(ARRAY_LENGTH(alphabet));
+      smartlist_add_linecpy(sl1, area, alphabet[c]);
+      /* Lines that only appear in the base get identifier 0. */
+      ids1[i] = (c == 3) ? 0 : c + 1;
+    }
+    for (int i = 0; i < len2; ++i) {
+      int c = crypto_rand_int(ARRAY_LENGTH(alphabet)-1);
+      smartlist_add_linecpy(sl2, area, alphabet[c]);
+      ids2[i] = c + 1;
+    }
+
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    changed1 = bitarray_init_zero(len1);
+    changed2 = bitarray_init_zero(len2);
+    qed_hs_free(sls1);
+    qed_hs_free(sls2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    int lcs = slow_lcs_length(sls1, sls2);
+    if (use_ids) {
+      sls1->ids = ids1;
+      sls2->ids = ids2;
+    }
+    calc_changes(sls1, sls2, changed1, changed2);
+
+    /* The unchanged lines must be the same in both lists, and there must be
+     * as many of them as in a longest common subsequence. */
+    int i1 = 0, i2 = 0, kept = 0;
+    while (1) {
+      while (i1 < len1 && bitarray_is_set(changed1, i1))
+        ++i1;
+      while (i2 < len2 && bitarray_is_set(changed2, i2))
+        ++i2;
+      if (i1 == len1 || i2 == len2)
+        break;
+      tt_assert(lines_eq(smartlist_get(sl1, i1), smartlist_get(sl2, i2)));
+      ++kept; ++i1; ++i2;
+    }
+    tt_int_op(i1, OP_EQ, len1);
+    tt_int_op(i2, OP_EQ, len2);
+    tt_int_op(kept, OP_EQ, lcs);
+  }
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  qed_hs_free(ids1);
+  qed_hs_free(ids2);
+  qed_hs_free(sls1);
+  qed_hs_free(sls2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -489,7 +606,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "r name ccccccccccccccccccccccccccc etc");
   smartlist_add_linecpy(cons2, area, "bar");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
@@ -497,7 +614,7 @@ test_consdiff_gen_ed_diff(void *arg)
 
   /* Same, but now with the second consensus. */
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, NULL, cons1, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the target consensus doesn't have its router entries sorted "
@@ -509,14 +626,14 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons1, area, "r name aaaaaaaaaaaaaaaaaaaaaaaaaaa etc");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
          "properly.");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, NULL, cons1, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the target consensus doesn't have its router entries sorted "
@@ -531,7 +648,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons1, area, "bar");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
@@ -549,7 +666,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "foo2");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Cannot generate consensus diff "
          "because one of the lines to be added is \".\".");
@@ -563,7 +680,7 @@ test_consdiff_gen_ed_diff(void *arg)
   for (i=0; i < MAX_LINE_COUNT; ++i) smartlist_add_linecpy(cons1, area, "b");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
 
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
@@ -582,7 +699,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, ".");
   smartlist_add_linecpy(cons2, area, "foo2");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   smartlist_free(diff);
 
@@ -590,7 +707,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons1);
   smartlist_clear(cons2);
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(0, OP_EQ, smartlist_len(diff));
   smartlist_free(diff);
@@ -601,7 +718,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "foo");
   smartlist_add_linecpy(cons2, area, "bar");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(0, OP_EQ, smartlist_len(diff));
   smartlist_free(diff);
@@ -609,7 +726,7 @@ test_consdiff_gen_ed_diff(void *arg)
   /* Everything is deleted. */
   smartlist_clear(cons2);
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(1, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("1,2d", smartlist_get(diff, 0));
@@ -617,7 +734,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_free(diff);
 
   /* Everything is added. */
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, NULL, cons1, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(4, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("0a", smartlist_get(diff, 0));
@@ -630,7 +747,7 @@ test_consdiff_gen_ed_diff(void *arg)
   /* Everything is changed. */
   smartlist_add_linecpy(cons2, area, "foo2");
   smartlist_add_linecpy(cons2, area, "bar2");
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(4, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("1,2c", smartlist_get(diff, 0));
@@ -645,7 +762,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons2);
   consensus_split_lines_(cons1, "A\nB\nC\nD\nE\n", area);
   consensus_split_lines_(cons2, "A\nC\nO\nE\nU\n", area);
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(7, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("5a", smartlist_get(diff, 0));
@@ -662,7 +779,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons2);
   consensus_split_lines_(cons1, "B\n", area);
   consensus_split_lines_(cons2, "A\nB\n", area);
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, NULL, cons2, NULL, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(3, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("0a", smartlist_get(diff, 0));
@@ -958,7 +1075,7 @@ test_consdiff_gen_diff(void *arg)
   consensus_split_lines_(cons1, cons1_str, area);
   consensus_split_lines_(cons2, cons2_str, area);
 
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, NULL, cons2, NULL, &digests1, &digests2, area);
   tt_ptr_op(NULL, OP_EQ, diff);
 
   /* Check that the headers are done properly. */
@@ -973,7 +1090,7 @@ test_consdiff_gen_diff(void *arg)
       consensus_compute_digest_as_signed_(cons1_str, &digests1));
   smartlist_clear(cons1);
   consensus_split_lines_(cons1, cons1_str, area);
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, NULL, cons2, NULL, &digests1, &digests2, area);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(11, OP_EQ, smartlist_len(diff));
   tt_assert(line_str_eq(smartlist_get(diff, 0),
@@ -1005,12 +1122,67 @@ test_consdiff_gen_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_diff_target(void *arg)
+{
+  consensus_diff_target_t *target = NULL;
+  char *diff1 = NULL, *diff2 = NULL, *diff3 = NULL, *cons2_out = NULL;
+  const char *cons1_str =
+      "network-status-version foo\n"
+      "r name bbbbbbbbbbbbbbbbb etc\nfoo\n"
+      "r name ccccccccccccccccc etc\nbar\n"
+      "directory-signature foo bar\nbar\n";
+  const char *cons1b_str =
+      "network-status-version foo\n"
+      "r name ccccccccccccccccc etc\nfoo\n"
+      "directory-signature foo bar\nbaz\n";
+  const char *cons2_str =
+      "network-status-version foo\n"
+      "r name aaaaaaaaaaaaaaaaa etc\nfoo\n"
+      "r name ccccccccccccccccc etc\nbar\nbaz\n"
+      "directory-signature foo bar\nbar\n";
+  (void)arg;
+
+  tt_ptr_op(NULL, OP_EQ, consensus_diff_target_new("no newline", 10));
+
+  target = consensus_diff_target_new(cons2_str, strlen(cons2_str));
+  tt_assert(target);
+
+  /* The same target can be used for several diffs, and gives the same
+   * results as consensus_diff_generate. */
+  diff1 = consensus_diff_generate_to_target(cons1_str, strlen(cons1_str),
+                                            target);
+  diff2 = consensus_diff_generate(cons1_str, strlen(cons1_str),
+                                  cons2_str, strlen(cons2_str));
+  tt_assert(diff1);
+  tt_str_op(diff1, OP_EQ, diff2);
+  diff3 = consensus_diff_generate_to_target(cons1b_str, strlen(cons1b_str),
+                                            target);
+  tt_assert(diff3);
+
+  cons2_out = consensus_diff_apply(cons1_str, strlen(cons1_str),
+                                   diff1, strlen(diff1));
+  tt_str_op(cons2_out, OP_EQ, cons2_str);
+  qed_hs_free(cons2_out);
+  cons2_out = consensus_diff_apply(cons1b_str, strlen(cons1b_str),
+                                   diff3, strlen(diff3));
+  tt_str_op(cons2_out, OP_EQ, cons2_str);
+
+ done:
+  consensus_diff_target_free(target);
+  qed_hs_free(diff1);
+  qed_hs_free(diff2);
+  qed_hs_free(diff3);
+  qed_hs_free(cons2_out);
+}
+
 static void
 test_consdiff_apply_diff(void *arg)
 {
   smartlist_t *cons1=NULL, *diff=NULL;
   char *cons1_str=NULL, *cons2 = NULL;
   consensus_digest_t digests1;
+  consensus_diff_unchanged_t *unchanged = NULL;
   (void)arg;
   memarea_t *area = memarea_new();
   cons1 = smartlist_new();
@@ -1028,7 +1200,7 @@ test_consdiff_apply_diff(void *arg)
   consensus_split_lines_(cons1, cons1_str, area);
 
   /* diff doesn't have enough lines. */
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("too short");
 
@@ -1036,7 +1208,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "foo-bar");
   smartlist_add_linecpy(diff, area, "header-line");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("format is not known");
 
@@ -1046,7 +1218,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "word a b");
   smartlist_add_linecpy(diff, area, "x");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests");
 
@@ -1055,7 +1227,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash a b c");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests");
 
@@ -1064,7 +1236,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash aaa bbb");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes base16-encoded digests of "
                                    "incorrect size");
@@ -1076,7 +1248,7 @@ test_consdiff_apply_diff(void *arg)
       " ????????????????????????????????????????????????????????????????"
       " ----------------------------------------------------------------");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes malformed digests");
 
@@ -1092,7 +1264,7 @@ test_consdiff_apply_diff(void *arg)
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   smartlist_add_linecpy(diff, area, "foobar");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("because an ed command was missing a line "
                                    "number");
@@ -1106,7 +1278,7 @@ test_consdiff_apply_diff(void *arg)
       /* sha256 of cons2. */
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("base consensus doesn't match the digest "
                             "as found");
@@ -1120,7 +1292,7 @@ test_consdiff_apply_diff(void *arg)
       /* bogus sha3. */
       " 3333333333333333333333333333333333333333333333333333333333333333");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("resulting consensus doesn't match the "
                             "digest as found");
@@ -1137,7 +1309,7 @@ test_consdiff_apply_diff(void *arg)
       " 3333333333333333333333333333333333333333333333333333333333333333");
   smartlist_add_linecpy(diff, area, "1,2d"); // remove starting line
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("Could not compute digests of the consensus "
                             "resulting from applying a consensus diff.");
@@ -1154,7 +1326,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, &unchanged);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1162,6 +1334,17 @@ test_consdiff_apply_diff(void *arg)
       "r name eeeeeeeeeeeeeeeee etc\nbar\n"
       "directory-signature foo bar\nbar\n", OP_EQ,
       cons2);
+  /* Everything but the "sample" line came from cons1. */
+  tt_assert(unchanged);
+  tt_mem_op(unchanged->base_digest, OP_EQ, digests1.sha3_256,
+            DIGEST256_LEN);
+  tt_int_op(unchanged->n_ranges, OP_EQ, 2);
+  tt_u64_op(unchanged->ranges[0].start, OP_EQ, 0);
+  tt_u64_op(unchanged->ranges[0].end, OP_EQ, strstr(cons2, "sample") - cons2);
+  tt_u64_op(unchanged->ranges[1].start, OP_EQ,
+            strstr(cons2, "sample") + 7 - cons2);
+  tt_u64_op(unchanged->ranges[1].end, OP_EQ, strlen(cons2));
+  consensus_diff_unchanged_free(unchanged);
   qed_hs_free(cons2);
 
   /* Check that lowercase letters in base16-encoded digests work too. */
@@ -1175,7 +1358,7 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1, diff, &digests1, NULL);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1189,6 +1372,7 @@ test_consdiff_apply_diff(void *arg)
 
  done:
   teardown_capture_of_logs();
+  consensus_diff_unchanged_free(unchanged);
   qed_hs_free(cons1_str);
   smartlist_free(cons1);
   smartlist_free(diff);
@@ -1201,10 +1385,11 @@ test_consdiff_apply_diff(void *arg)
 struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(smartlist_slice),
   CONSDIFF_LEGACY(smartlist_slice_string_pos),
-  CONSDIFF_LEGACY(lcs_lengths),
+  CONSDIFF_LEGACY(find_middle_snake),
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_random),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
@@ -1212,6 +1397,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(gen_ed_diff),
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
+  CONSDIFF_LEGACY(diff_target),
   CONSDIFF_LEGACY(apply_diff),
   END_OF_TESTCASES
 };
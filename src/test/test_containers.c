@@ -10,6 +10,7 @@
 #include "test/test.h"
 
 #include "lib/container/bitarray.h"
+#include "lib/container/flatmap.h"
 #include "lib/container/order.h"
 #include "lib/crypt_ops/digestset.h"
 
@@ -971,6 +972,154 @@ test_container_strmap(void *arg)
   qed_hs_free(v105);
 }
 
+/** Run unit tests for the string-to-void* flat map functions. */
+static void
+test_container_strflatmap(void *arg)
+{
+  strflatmap_t *map = NULL;
+  strflatmap_iter_t *iter;
+  const char *k;
+  void *v;
+  char *visited = NULL;
+  smartlist_t *found_keys = NULL;
+  int v1 = 1, v2 = 2, v3 = 3, v4 = 4;
+
+  (void)arg;
+  map = strflatmap_new();
+  tt_assert(map);
+  tt_int_op(strflatmap_size(map), OP_EQ, 0);
+  tt_assert(strflatmap_isempty(map));
+  tt_ptr_op(strflatmap_get(map, "K1"), OP_EQ, NULL);
+  tt_ptr_op(strflatmap_remove(map, "K1"), OP_EQ, NULL);
+  strflatmap_assert_ok(map);
+
+  tt_ptr_op(strflatmap_set(map, "K1", &v1), OP_EQ, NULL);
+  tt_ptr_op(strflatmap_set(map, "K2", &v2), OP_EQ, NULL);
+  tt_ptr_op(strflatmap_set(map, "K1", &v3), OP_EQ, &v1);
+  tt_ptr_op(strflatmap_get(map, "K1"), OP_EQ, &v3);
+  tt_ptr_op(strflatmap_get(map, "K2"), OP_EQ, &v2);
+  tt_ptr_op(strflatmap_get(map, "K-not-there"), OP_EQ, NULL);
+  tt_int_op(strflatmap_size(map), OP_EQ, 2);
+  strflatmap_assert_ok(map);
+
+  tt_ptr_op(strflatmap_remove(map, "K2"), OP_EQ, &v2);
+  tt_ptr_op(strflatmap_get(map, "K2"), OP_EQ, NULL);
+  tt_ptr_op(strflatmap_remove(map, "K2"), OP_EQ, NULL);
+  strflatmap_assert_ok(map);
+
+  strflatmap_set(map, "K2", &v2);
+  strflatmap_set(map, "K3", &v3);
+  strflatmap_set(map, "K4", &v4);
+  tt_int_op(strflatmap_size(map), OP_EQ, 4);
+
+  /* Test iterator, removing K2 as we go. */
+  found_keys = smartlist_new();
+  for (iter = strflatmap_iter_init(map); !strflatmap_iter_done(iter); ) {
+    strflatmap_iter_get(iter, &k, &v);
+    smartlist_add_strdup(found_keys, k);
+    tt_ptr_op(v, OP_EQ, strflatmap_get(map, k));
+    if (!strcmp(k, "K2")) {
+      iter = strflatmap_iter_next_rmv(map, iter);
+    } else {
+      iter = strflatmap_iter_next(map, iter);
+    }
+  }
+  tt_ptr_op(strflatmap_get(map, "K2"), OP_EQ, NULL);
+  tt_ptr_op(strflatmap_get(map, "K4"), OP_EQ, &v4);
+  smartlist_sort_strings(found_keys);
+  visited = smartlist_join_strings(found_keys, ":", 0, NULL);
+  tt_str_op(visited, OP_EQ, "K1:K2:K3:K4");
+  strflatmap_assert_ok(map);
+
+ done:
+  strflatmap_free(map, NULL);
+  if (found_keys) {
+    SMARTLIST_FOREACH(found_keys, char *, cp, qed_hs_free(cp));
+    smartlist_free(found_keys);
+  }
+  qed_hs_free(visited);
+}
+
+/** Run random operations on digest flat maps, and check that they give the
+ * same results as on the ht.h-based digest maps. */
+static void
+test_container_digestflatmap(void *arg)
+{
+  digestflatmap_t *fmap = NULL;
+  digestmap_t *map = NULL;
+  digest256flatmap_t *fmap256 = NULL;
+  digest256map_t *map256 = NULL;
+  char *keys = NULL;
+  const int n_keys = 3000;
+  int i, n_visited = 0;
+
+  (void)arg;
+  fmap = digestflatmap_new();
+  map = digestmap_new();
+  fmap256 = digest256flatmap_new();
+  map256 = digest256map_new();
+  keys = qed_hs_malloc(n_keys * DIGEST256_LEN);
+  crypto_rand(keys, n_keys * DIGEST256_LEN);
+
+  /* Values are never NULL, so use pointers into keys, offset by one. */
+  for (i = 0; i < 50000; ++i) {
+    int idx = crypto_rand_int(n_keys);
+    const char *key = keys + idx * DIGEST256_LEN;
+    void *val = (void *) (key + 1 + crypto_rand_int(8));
+    switch (crypto_rand_int(3)) {
+      case 0:
+        tt_ptr_op(digestflatmap_set(fmap, key, val), OP_EQ,
+                  digestmap_set(map, key, val));
+        tt_ptr_op(digest256flatmap_set(fmap256, (const uint8_t *) key, val),
+                  OP_EQ, digest256map_set(map256, (const uint8_t *) key, val));
+        break;
+      case 1:
+        tt_ptr_op(digestflatmap_remove(fmap, key), OP_EQ,
+                  digestmap_remove(map, key));
+        tt_ptr_op(digest256flatmap_remove(fmap256, (const uint8_t *) key),
+                  OP_EQ, digest256map_remove(map256, (const uint8_t *) key));
+        break;
+      default:
+        tt_ptr_op(digestflatmap_get(fmap, key), OP_EQ,
+                  digestmap_get(map, key));
+        tt_ptr_op(digest256flatmap_get(fmap256, (const uint8_t *) key),
+                  OP_EQ, digest256map_get(map256, (const uint8_t *) key));
+        break;
+    }
+    if ((i % 5000) == 0) {
+      digestflatmap_assert_ok(fmap);
+      digest256flatmap_assert_ok(fmap256);
+    }
+  }
+  tt_int_op(digestflatmap_size(fmap), OP_EQ, digestmap_size(map));
+  tt_int_op(digest256flatmap_size(fmap256), OP_EQ, digest256map_size(map256));
+  digestflatmap_assert_ok(fmap);
+  digest256flatmap_assert_ok(fmap256);
+
+  /* Every entry is visited once, and we can remove as we go. */
+  DIGESTFLATMAP_FOREACH_MODIFY(fmap, k, void *, v) {
+    tt_ptr_op(v, OP_EQ, digestmap_remove(map, k));
+    ++n_visited;
+    if (n_visited % 2)
+      MAP_DEL_CURRENT(k);
+    else
+      digestmap_set(map, k, v);
+  } DIGESTFLATMAP_FOREACH_END;
+  tt_int_op(digestflatmap_size(fmap), OP_EQ, n_visited / 2);
+  tt_int_op(digestmap_size(map), OP_EQ, n_visited / 2);
+  DIGESTFLATMAP_FOREACH(fmap, k, void *, v) {
+    tt_ptr_op(v, OP_EQ, digestmap_get(map, k));
+  } DIGESTFLATMAP_FOREACH_END;
+  digestflatmap_assert_ok(fmap);
+
+ done:
+  digestflatmap_free(fmap, NULL);
+  digestmap_free(map, NULL);
+  digest256flatmap_free(fmap256, NULL);
+  digest256map_free(map256, NULL);
+  qed_hs_free(keys);
+}
+
 static void
 test_container_smartlist_remove(void *arg)
 {
@@ -1380,6 +1529,8 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
   CONTAINER_LEGACY(strmap),
+  CONTAINER(strflatmap, 0),
+  CONTAINER(digestflatmap, 0),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
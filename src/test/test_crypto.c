@@ -3164,6 +3164,97 @@ test_crypto_ed25519_validation(void *arg)
  done: ;
 }
 
+/** Test that single and batch signature checking use the same cofactored
+ * verification equation, and reject the same malformed signatures. */
+static void
+test_crypto_ed25519_cofactor(void *arg)
+{
+  ed25519_keypair_t kp, torsion_kp;
+  ed25519_public_key_t ident;
+  ed25519_signature_t sig[4], ident_sig, bad_sig[3];
+  ed25519_checkable_t ch[8];
+  int okay[8];
+  const uint8_t *msg = (const uint8_t *)"Fourscore and seven years ago";
+  /* 2^255 - 19, the field prime. */
+  static const uint8_t p25519[32] = {
+    0xed, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f,
+  };
+  /* 8 times the group order: zero mod the order, but too big to be S. */
+  static const uint8_t eight_l[32] = {
+    0x68, 0x9f, 0xae, 0xe7, 0xd2, 0x18, 0x93, 0xc0,
+    0xb2, 0xe6, 0xbc, 0x17, 0xf5, 0xce, 0xf7, 0xa6,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+  };
+  int i, borrow = 0;
+
+  (void)arg;
+
+  /* Add the point of order 2, (0,-1), to a public key by negating both of
+   * its coordinates.  Signatures made with the result are only valid under
+   * the cofactored equation. */
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp, 0));
+  memcpy(&torsion_kp, &kp, sizeof(kp));
+  for (i = 0; i < 32; ++i) {
+    int y = kp.pubkey.pubkey[i] & (i == 31 ? 0x7f : 0xff);
+    int v = p25519[i] - y - borrow;
+    borrow = v < 0;
+    torsion_kp.pubkey.pubkey[i] = (uint8_t)v;
+  }
+  torsion_kp.pubkey.pubkey[31] |= ~kp.pubkey.pubkey[31] & 0x80;
+
+  for (i = 0; i < 4; ++i) {
+    tt_int_op(0, OP_EQ, ed25519_sign(&sig[i], msg, i + 1, &torsion_kp));
+    tt_int_op(0, OP_EQ,
+              ed25519_checksig(&sig[i], msg, i + 1, &torsion_kp.pubkey));
+    ch[i].pubkey = &torsion_kp.pubkey;
+    ch[i].signature = sig[i];
+    ch[i].msg = msg;
+    ch[i].len = i + 1;
+  }
+
+  /* With the identity as the public key, R = identity and S = 0 satisfy the
+   * equation for any message... */
+  memset(&ident, 0, sizeof(ident));
+  ident.pubkey[0] = 1;
+  memset(&ident_sig, 0, sizeof(ident_sig));
+  ident_sig.sig[0] = 1;
+  tt_int_op(0, OP_EQ, ed25519_checksig(&ident_sig, msg, 10, &ident));
+  /* ...but not with the identity encoded non-canonically as y = p + 1... */
+  memset(&bad_sig[0], 0, sizeof(bad_sig[0]));
+  memcpy(bad_sig[0].sig, p25519, 32);
+  bad_sig[0].sig[0] = 0xee;
+  /* ...or with x = 0 and its sign bit set... */
+  memcpy(&bad_sig[1], &ident_sig, sizeof(ident_sig));
+  bad_sig[1].sig[31] = 0x80;
+  /* ...or with an S that is congruent to 0 but out of range. */
+  memcpy(&bad_sig[2], &ident_sig, sizeof(ident_sig));
+  memcpy(bad_sig[2].sig + 32, eight_l, 32);
+
+  ch[4].pubkey = &ident;
+  ch[4].signature = ident_sig;
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(-1, OP_EQ, ed25519_checksig(&bad_sig[i], msg, 10, &ident));
+    ch[5+i].pubkey = &ident;
+    ch[5+i].signature = bad_sig[i];
+  }
+  for (i = 4; i < 8; ++i) {
+    ch[i].msg = msg;
+    ch[i].len = 10;
+  }
+
+  /* The batch must agree with the single checks. */
+  tt_int_op(-3, OP_EQ, ed25519_checksig_batch(okay, ch, 8));
+  for (i = 0; i < 8; ++i)
+    tt_int_op(okay[i], OP_EQ, i < 5);
+  tt_int_op(0, OP_EQ, ed25519_checksig_batch(okay, ch, 5));
+
+ done: ;
+}
+
 static void
 test_crypto_failure_modes(void *arg)
 {
@@ -3492,6 +3583,7 @@ struct testcase_t crypto_tests[] = {
   ED25519_TEST(blinding_fail, 0),
   ED25519_TEST(testvectors, 0),
   ED25519_TEST(validation, 0),
+  ED25519_TEST(cofactor, 0),
   { "ed25519_storage", test_crypto_ed25519_storage, 0, NULL, NULL },
   { "siphash", test_crypto_siphash, 0, NULL, NULL },
   { "blake2b", test_crypto_blake2b, 0, NULL, NULL },
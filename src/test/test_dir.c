@@ -8,6 +8,7 @@
 
 #define BWAUTH_PRIVATE
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 #define CONTROL_GETINFO_PRIVATE
 #define DIRAUTH_SYS_PRIVATE
 #define DIRCACHE_PRIVATE
@@ -30,6 +31,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/relay.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
@@ -48,6 +50,7 @@
 #include "feature/dircache/dirserv.h"
 #include "feature/dirclient/dirclient.h"
 #include "feature/dirclient/dlstatus.h"
+#include "feature/dircommon/consdiff.h"
 #include "feature/dircommon/directory.h"
 #include "feature/dircommon/fp_pair.h"
 #include "feature/dirauth/voting_schedule.h"
@@ -58,6 +61,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
@@ -79,9 +83,11 @@
 #include "test/opts_test_helpers.h"
 #include "test/test.h"
 #include "test/test_dir_common.h"
+#include "test/test_helpers.h"
 
 #include "core/or/addr_policy_st.h"
 #include "feature/dirauth/dirauth_options_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/authority_cert_st.h"
 #include "feature/nodelist/document_signature_st.h"
 #include "feature/nodelist/extrainfo_st.h"
@@ -92,6 +98,7 @@
 #include "core/or/port_cfg_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerlist_st.h"
+#include "feature/nodelist/routerstatus_st.h"
 #include "core/or/tor_version_st.h"
 #include "feature/dirauth/vote_microdesc_hash_st.h"
 #include "feature/nodelist/vote_routerstatus_st.h"
@@ -128,6 +135,145 @@ networkstatus_parse_vote_from_string_(const char *s,
   return result;
 }
 
+/** Check that the consensuses <b>con</b> and <b>con2</b> have the same
+ * routerstatus entries. */
+static void
+check_same_routerstatus_entries(const networkstatus_t *con,
+                                const networkstatus_t *con2)
+{
+  int i;
+  tt_int_op(smartlist_len(con->routerstatus_list), OP_EQ,
+            smartlist_len(con2->routerstatus_list));
+  for (i = 0; i < smartlist_len(con->routerstatus_list); ++i) {
+    const routerstatus_t *a = smartlist_get(con->routerstatus_list, i);
+    const routerstatus_t *b = smartlist_get(con2->routerstatus_list, i);
+    tt_assert(!routerstatus_has_visibly_changed(a, b));
+    tt_mem_op(a->descriptor_digest, OP_EQ, b->descriptor_digest,
+              DIGEST256_LEN);
+    tt_mem_op(&a->pv, OP_EQ, &b->pv, sizeof(a->pv));
+    tt_int_op(a->has_bandwidth, OP_EQ, b->has_bandwidth);
+    tt_int_op(a->bw_is_unmeasured, OP_EQ, b->bw_is_unmeasured);
+    tt_int_op(a->has_guardfraction, OP_EQ, b->has_guardfraction);
+    tt_int_op(a->guardfraction_percentage, OP_EQ,
+              b->guardfraction_percentage);
+    tt_assert(bool_eq(a->exitsummary, b->exitsummary));
+    if (a->exitsummary)
+      tt_str_op(a->exitsummary, OP_EQ, b->exitsummary);
+  }
+ done:
+  ;
+}
+
+/** Make a snapshot of the consensus <b>con</b>, which we parsed from
+ * <b>text</b>, and check that parsing <b>text</b> again with it gives the
+ * same routerstatus entries, and that we ignore snapshots that don't
+ * match. */
+static void
+check_consensus_snapshot(const char *text, const networkstatus_t *con)
+{
+  size_t snap_len = 0, text_len = strlen(text);
+  uint8_t *snap = ns_snapshot_encode(con, &snap_len);
+  networkstatus_t *con2 = NULL;
+  int used = -1;
+
+  tt_assert(snap);
+  con2 = networkstatus_parse_consensus_with_snapshot(text, text_len,
+                                                     snap, snap_len, &used);
+  tt_assert(con2);
+  tt_int_op(used, OP_EQ, 1);
+  tt_mem_op(&con->digests, OP_EQ, &con2->digests, sizeof(common_digests_t));
+  check_same_routerstatus_entries(con, con2);
+  networkstatus_vote_free(con2);
+
+  /* A snapshot of some other document gets ignored. */
+  snap[40] ^= 1;
+  con2 = networkstatus_parse_consensus_with_snapshot(text, text_len,
+                                                     snap, snap_len, &used);
+  tt_assert(con2);
+  tt_int_op(used, OP_EQ, 0);
+  tt_int_op(smartlist_len(con->routerstatus_list), OP_EQ,
+            smartlist_len(con2->routerstatus_list));
+  networkstatus_vote_free(con2);
+  snap[40] ^= 1;
+
+  /* So does a truncated one. */
+  con2 = networkstatus_parse_consensus_with_snapshot(text, text_len,
+                                                     snap, snap_len - 1,
+                                                     &used);
+  tt_assert(con2);
+  tt_int_op(used, OP_EQ, 0);
+
+ done:
+  networkstatus_vote_free(con2);
+  qed_hs_free(snap);
+}
+
+/** Change the bandwidth of one router in the consensus <b>text</b>, parsed
+ * as <b>con</b>, and make sure that when we apply the diff, we reuse every
+ * other routerstatus entry from <b>con</b>.  <b>other</b> is a consensus of
+ * another flavor, from which we must not reuse anything. */
+static void
+check_consensus_diff_reuse(const char *text, const networkstatus_t *con,
+                           const networkstatus_t *other)
+{
+  char *text2 = qed_hs_strdup(text), *diff = NULL, *applied = NULL;
+  consensus_diff_unchanged_t *unchanged = NULL;
+  networkstatus_t *con2 = NULL, *con3 = NULL;
+  const size_t len = strlen(text);
+  int n_reused = -1;
+
+  /* Change the first digit of the second "w" line. */
+  char *w = strstr(text2, "\nw Bandwidth=");
+  tt_assert(w);
+  w = strstr(w + 1, "\nw Bandwidth=");
+  tt_assert(w);
+  const size_t w_start = w + 1 - text2;
+  const size_t w_end = strchr(w + 1, '\n') + 1 - text2;
+  w += strlen("\nw Bandwidth=");
+  *w = (*w == '9') ? '8' : '9';
+
+  diff = consensus_diff_generate(text, len, text2, len);
+  tt_assert(diff);
+  applied = consensus_diff_apply_tracking(text, len, diff, strlen(diff),
+                                          &unchanged);
+  tt_str_op(applied, OP_EQ, text2);
+  tt_assert(unchanged);
+  tt_mem_op(unchanged->base_digest, OP_EQ, con->digest_sha3_as_signed,
+            DIGEST256_LEN);
+  tt_int_op(unchanged->n_ranges, OP_EQ, 2);
+  tt_u64_op(unchanged->ranges[0].start, OP_EQ, 0);
+  tt_u64_op(unchanged->ranges[0].end, OP_EQ, w_start);
+  tt_u64_op(unchanged->ranges[1].start, OP_EQ, w_end);
+  /* The signatures aren't part of the diff; it replaces all of them. */
+  tt_u64_op(unchanged->ranges[1].end, OP_EQ,
+            strstr(text2, "\ndirectory-signature ") + 1 - text2);
+
+  con2 = networkstatus_parse_consensus_reusing(applied, len, con, unchanged,
+                                               &n_reused);
+  tt_assert(con2);
+  tt_int_op(n_reused, OP_EQ, smartlist_len(con->routerstatus_list) - 1);
+  con3 = networkstatus_parse_vote_from_string(applied, len, NULL,
+                                              NS_TYPE_CONSENSUS);
+  tt_assert(con3);
+  check_same_routerstatus_entries(con2, con3);
+  networkstatus_vote_free(con2);
+
+  /* Nothing gets reused from a consensus of another flavor. */
+  con2 = networkstatus_parse_consensus_reusing(applied, len, other,
+                                               unchanged, &n_reused);
+  tt_assert(con2);
+  tt_int_op(n_reused, OP_EQ, 0);
+  check_same_routerstatus_entries(con2, con3);
+
+ done:
+  networkstatus_vote_free(con2);
+  networkstatus_vote_free(con3);
+  consensus_diff_unchanged_free(unchanged);
+  qed_hs_free(applied);
+  qed_hs_free(diff);
+  qed_hs_free(text2);
+}
+
 static void
 test_dir_nicknames(void *arg)
 {
@@ -1334,6 +1480,70 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+static int mock_checksig_batch_calls = 0;
+static int mock_checksig_batch_n = 0;
+
+/* Check the signatures for real, then call the last three bad: those are
+ * the Ed25519 signatures from the second router descriptor in a list of
+ * two. */
+static int
+mock_ed25519_checksig_batch(int *okay_out,
+                            const ed25519_checkable_t *checkable,
+                            int n_checkable)
+{
+  int r;
+  ++mock_checksig_batch_calls;
+  mock_checksig_batch_n = n_checkable;
+  r = ed25519_checksig_batch__real(okay_out, checkable, n_checkable);
+  if (r < 0 || n_checkable < 6)
+    return r;
+  for (int i = n_checkable - 3; i < n_checkable; ++i)
+    okay_out[i] = 0;
+  return -3;
+}
+
+/* Router descriptor lists get their Ed25519 signatures checked in a single
+ * batch, and routers whose signatures fail that check are dropped. */
+static void
+test_dir_parse_router_list_ed_batch(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  char d[DIGEST_LEN];
+
+  MOCK(ed25519_checksig_batch, mock_ed25519_checksig_batch);
+
+  qed_hs_asprintf(&list, "%s%s", EX_RI_MINIMAL, EX_RI_MAXIMAL);
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_ptr_op(cp, OP_EQ, list + strlen(list));
+  tt_int_op(mock_checksig_batch_calls, OP_EQ, 1);
+  tt_int_op(mock_checksig_batch_n, OP_EQ, 6);
+
+  tt_int_op(1, OP_EQ, smartlist_len(dest));
+  routerinfo_t *r = smartlist_get(dest, 0);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL, strlen(EX_RI_MINIMAL));
+
+  tt_int_op(1, OP_EQ, smartlist_len(invalid));
+  tt_int_op(0, OP_EQ,
+            router_get_router_hash(EX_RI_MAXIMAL, strlen(EX_RI_MAXIMAL), d));
+  tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+
+ done:
+  UNMOCK(ed25519_checksig_batch);
+  qed_hs_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, qed_hs_free(dig));
+  smartlist_free(invalid);
+}
+
 /* Made with chutney and a patched tor: Has no onion-key or
  * onion-key-crosscert */
 static const char ROUTERDESC_NO_ONION_KEY[] =
@@ -3683,6 +3893,23 @@ test_a_networkstatus(
                   smartlist_get(v3->voters, 0));
 
   consensus_test(con, now);
+  check_consensus_snapshot(consensus_text, con);
+  check_consensus_snapshot(consensus_text_md, con_md);
+  check_consensus_diff_reuse(consensus_text, con, con_md);
+  check_consensus_diff_reuse(consensus_text_md, con_md, con);
+
+  /* The entries live in one block, with one copy of each exit summary. */
+  tt_ptr_op(con->routerstatus_block, OP_NE, NULL);
+  tt_int_op(con->n_routerstatus_block, OP_EQ,
+            smartlist_len(con->routerstatus_list));
+  SMARTLIST_FOREACH_BEGIN(con->routerstatus_list, routerstatus_t *, r) {
+    tt_ptr_op(r, OP_EQ, &con->routerstatus_block[r_sl_idx]);
+    if (r_sl_idx && r->exitsummary) {
+      const routerstatus_t *prev_r = &con->routerstatus_block[r_sl_idx-1];
+      if (prev_r->exitsummary && !strcmp(prev_r->exitsummary, r->exitsummary))
+        tt_ptr_op(prev_r->exitsummary, OP_EQ, r->exitsummary);
+    }
+  } SMARTLIST_FOREACH_END(r);
 
   /* Check the routerstatuses. */
   n_rs = smartlist_len(con->routerstatus_list);
@@ -4043,6 +4270,81 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_random_weighted_alias(void *testdata)
+{
+  const double vals[10] = {3,1,2,4,6,0,7,5,8,9};
+  const double zeros[5] = {0,0,0,0,0};
+  double mass[10];
+  int histogram[10];
+  weighted_alias_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  tt_ptr_op(weighted_alias_new(vals, 0), OP_EQ, NULL);
+
+  /* Every column must hand out its units so that each index gets exactly
+   * its share of the total. */
+  table = weighted_alias_new(vals, 10);
+  tt_assert(table);
+  memset(mass, 0, sizeof(mass));
+  for (i = 0; i < 10; ++i) {
+    tt_u64_op(table->threshold[i], OP_LE, table->total);
+    tt_int_op(table->alias[i], OP_GE, 0);
+    tt_int_op(table->alias[i], OP_LT, 10);
+    mass[i] += (double) table->threshold[i];
+    mass[table->alias[i]] += (double) (table->total - table->threshold[i]);
+  }
+  for (i = 0; i < 10; ++i) {
+    double expected = vals[i] / 45.0;
+    tt_double_op(fabs(mass[i] / (10.0 * table->total) - expected),
+                 OP_LT, 1e-9);
+  }
+
+  memset(histogram, 0, sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    choice = weighted_alias_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+  max_sq_error = 0;
+  for (i = 0; i < 10; ++i) {
+    int expected = (int)(n*vals[i]/45);
+    double frac_diff = 0, sq;
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+  weighted_alias_free(table);
+
+  /* A singleton is always chosen. */
+  table = weighted_alias_new(vals, 1);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(weighted_alias_choose(table), OP_EQ, 0);
+  weighted_alias_free(table);
+
+  /* All zeros: choose uniformly. */
+  table = weighted_alias_new(zeros, 5);
+  memset(histogram, 0, sizeof(histogram));
+  for (i = 0; i < n; ++i)
+    histogram[weighted_alias_choose(table)]++;
+  for (i = 0; i < 5; ++i) {
+    double frac_diff = (histogram[i] - n/5) / ((double)(n/5));
+    tt_double_op(frac_diff * frac_diff, OP_LT, .05);
+  }
+
+ done:
+  weighted_alias_free(table);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -5022,6 +5324,279 @@ test_dir_fetch_type(void *arg)
   teardown_capture_of_logs();
 }
 
+/** The responses that mock_dir_client_handle_response() was given, and the
+ * requests that mock_dir_client_request_failed() was told about, as
+ * "purpose resource[ body]" strings. */
+static smartlist_t *handled_dir_responses = NULL;
+static smartlist_t *failed_dir_requests = NULL;
+
+static int
+mock_dir_client_handle_response(dir_connection_t *conn,
+                                char *headers, char *body,
+                                size_t body_len, size_t received_bytes)
+{
+  (void) received_bytes;
+  smartlist_add_asprintf(handled_dir_responses, "%s %s %.*s",
+                         dir_conn_purpose_to_string(conn->base_.purpose),
+                         conn->requested_resource, (int) body_len, body);
+  qed_hs_free(headers);
+  qed_hs_free(body);
+  return 0;
+}
+
+static void
+mock_dir_client_request_failed(dir_connection_t *conn)
+{
+  smartlist_add_asprintf(failed_dir_requests, "%s %s",
+                         dir_conn_purpose_to_string(conn->base_.purpose),
+                         conn->requested_resource);
+}
+
+/** Helper: return a new client directory connection to the relay with
+ * identity <b>digest</b>, which has agreed to keep the connection open and
+ * is answering a <b>purpose</b> request for <b>resource</b>.  Add it to the
+ * global connection list. */
+static dir_connection_t *
+new_keep_alive_dir_conn(const char *digest, uint8_t purpose,
+                        const char *resource)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  qed_hs_addr_parse(&conn->base_.addr, "1.2.3.4");
+  conn->base_.address = qed_hs_strdup("1.2.3.4");
+  conn->base_.port = 9001;
+  memcpy(conn->identity_digest, digest, DIGEST_LEN);
+  conn->base_.purpose = purpose;
+  conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
+  conn->requested_resource = qed_hs_strdup(resource);
+  conn->wants_keep_alive = conn->keep_alive = 1;
+  smartlist_add(get_connection_array(), TO_CONN(conn));
+  return conn;
+}
+
+/** Helper: remove <b>conn</b> from the global connection list and free
+ * it. */
+static void
+free_keep_alive_dir_conn(dir_connection_t *conn)
+{
+  if (!conn)
+    return;
+  smartlist_remove(get_connection_array(), TO_CONN(conn));
+  connection_free_minimal(TO_CONN(conn));
+}
+
+/** Helper: launch a begindir request for <b>resource</b> with
+ * <b>purpose</b> to the relay with identity <b>digest</b>.  The caller must
+ * make sure that there is a kept-alive connection that it can go on. */
+static void
+launch_keep_alive_dir_request(const char *digest, uint8_t purpose,
+                              const char *resource)
+{
+  directory_request_t *req = directory_request_new(purpose);
+  qed_hs_addr_port_t or_ap;
+  qed_hs_addr_parse(&or_ap.addr, "1.2.3.4");
+  or_ap.port = 9001;
+  directory_request_set_or_addr_port(req, &or_ap);
+  directory_request_set_directory_id_digest(req, digest);
+  directory_request_set_indirection(req, DIRIND_ONEHOP);
+  directory_request_set_resource(req, resource);
+  directory_initiate_request(req);
+  directory_request_free(req);
+}
+
+static void
+test_dir_keep_alive_find_conn(void *arg)
+{
+  (void) arg;
+  char digest[DIGEST_LEN], other_digest[DIGEST_LEN];
+  dir_connection_t *busy = NULL, *idle = NULL;
+  directory_request_t *req = NULL;
+  char *sent = NULL;
+  size_t sent_len;
+
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+  memset(digest, 'A', DIGEST_LEN);
+  memset(other_digest, 'B', DIGEST_LEN);
+
+  /* Only plain fetches, without a body, can share a connection. */
+  req = directory_request_new(DIR_PURPOSE_FETCH_MICRODESC);
+  tt_int_op(dir_request_can_keep_alive(req), OP_EQ, 1);
+  directory_request_free(req);
+  req = directory_request_new(DIR_PURPOSE_FETCH_CONSENSUS);
+  tt_int_op(dir_request_can_keep_alive(req), OP_EQ, 1);
+  directory_request_free(req);
+  req = directory_request_new(DIR_PURPOSE_FETCH_HSDESC);
+  tt_int_op(dir_request_can_keep_alive(req), OP_EQ, 0);
+  directory_request_free(req);
+  req = directory_request_new(DIR_PURPOSE_UPLOAD_DIR);
+  directory_request_set_payload(req, "x", 1);
+  tt_int_op(dir_request_can_keep_alive(req), OP_EQ, 0);
+  directory_request_free(req);
+  req = NULL;
+
+  /* A busy connection takes more requests, up to a limit, unless it or the
+   * new request is a consensus fetch. */
+  busy = new_keep_alive_dir_conn(digest, DIR_PURPOSE_FETCH_MICRODESC, "d/A");
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, busy);
+  tt_ptr_op(dir_conn_find_keep_alive(other_digest,
+                                     DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, NULL);
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_CONSENSUS),
+            OP_EQ, NULL);
+  busy->base_.purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, NULL);
+  busy->base_.purpose = DIR_PURPOSE_FETCH_MICRODESC;
+  for (int i = 0; i < MAX_PIPELINED_DIR_REQUESTS; ++i) {
+    tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+              OP_EQ, busy);
+    launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_MICRODESC,
+                                  "d/B");
+  }
+  tt_int_op(smartlist_len(busy->pipelined_requests), OP_EQ,
+            MAX_PIPELINED_DIR_REQUESTS);
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, NULL);
+
+  /* Connections that the server hasn't agreed to keep open don't count. */
+  idle = new_keep_alive_dir_conn(digest, DIR_PURPOSE_FETCH_MICRODESC, "d/C");
+  idle->base_.state = DIR_CONN_STATE_CLIENT_FINISHED;
+  idle->keep_alive = 0;
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, NULL);
+
+  /* An idle connection is preferred, even for a consensus fetch, and goes
+   * back to sending when we reuse it. */
+  idle->keep_alive = 1;
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_CONSENSUS),
+            OP_EQ, idle);
+  launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_SERVERDESC,
+                                "d/D");
+  tt_int_op(idle->base_.state, OP_EQ, DIR_CONN_STATE_CLIENT_SENDING);
+  tt_int_op(idle->base_.purpose, OP_EQ, DIR_PURPOSE_FETCH_SERVERDESC);
+  tt_str_op(idle->requested_resource, OP_EQ, "d/D");
+  tt_ptr_op(idle->pipelined_requests, OP_EQ, NULL);
+  sent = buf_get_contents(idle->base_.outbuf, &sent_len);
+  tt_assert(sent);
+  tt_assert(strstr(sent, "GET /qed-hs/server/d/D"));
+  tt_assert(strstr(sent, "\r\nConnection: keep-alive\r\n"));
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  directory_request_free(req);
+  free_keep_alive_dir_conn(busy);
+  free_keep_alive_dir_conn(idle);
+  qed_hs_free(sent);
+}
+
+static void
+test_dir_keep_alive_pipeline(void *arg)
+{
+  (void) arg;
+  char digest[DIGEST_LEN];
+  dir_connection_t *conn = NULL;
+
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+  MOCK(connection_dir_client_handle_response,
+       mock_dir_client_handle_response);
+  handled_dir_responses = smartlist_new();
+  memset(digest, 'A', DIGEST_LEN);
+
+  conn = new_keep_alive_dir_conn(digest, DIR_PURPOSE_FETCH_MICRODESC, "d/A");
+  launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_SERVERDESC, "d/B");
+  launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_MICRODESC, "d/C");
+  tt_int_op(smartlist_len(conn->pipelined_requests), OP_EQ, 2);
+
+  /* The first response, and the start of the second. */
+  buf_add_string(conn->base_.inbuf,
+                 "HTTP/1.1 200 OK\r\n"
+                 "Connection: keep-alive\r\n"
+                 "Content-Length: 5\r\n\r\n"
+                 "first"
+                 "HTTP/1.1 200 OK\r\n"
+                 "Connection: keep-alive\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n"
+                 "3\r\nsec\r\n");
+  tt_int_op(connection_dir_process_inbuf(conn), OP_EQ, 0);
+  tt_int_op(smartlist_len(handled_dir_responses), OP_EQ, 1);
+  tt_str_op(smartlist_get(handled_dir_responses, 0), OP_EQ,
+            "microdescriptor fetch d/A first");
+  tt_int_op(conn->base_.state, OP_EQ, DIR_CONN_STATE_CLIENT_READING);
+  tt_int_op(conn->base_.purpose, OP_EQ, DIR_PURPOSE_FETCH_SERVERDESC);
+  tt_str_op(conn->requested_resource, OP_EQ, "d/B");
+
+  /* The rest of the second response, and all of the third. */
+  buf_add_string(conn->base_.inbuf,
+                 "3\r\nond\r\n0\r\n\r\n"
+                 "HTTP/1.1 200 OK\r\n"
+                 "Connection: keep-alive\r\n"
+                 "Content-Length: 5\r\n\r\n"
+                 "third");
+  tt_int_op(connection_dir_process_inbuf(conn), OP_EQ, 0);
+  tt_int_op(smartlist_len(handled_dir_responses), OP_EQ, 3);
+  tt_str_op(smartlist_get(handled_dir_responses, 1), OP_EQ,
+            "server descriptor fetch d/B second");
+  tt_str_op(smartlist_get(handled_dir_responses, 2), OP_EQ,
+            "microdescriptor fetch d/C third");
+  tt_int_op(smartlist_len(conn->pipelined_requests), OP_EQ, 0);
+  tt_int_op(buf_datalen(conn->base_.inbuf), OP_EQ, 0);
+
+  /* With nothing left to wait for, the connection is idle. */
+  tt_int_op(conn->base_.state, OP_EQ, DIR_CONN_STATE_CLIENT_FINISHED);
+  tt_ptr_op(dir_conn_find_keep_alive(digest, DIR_PURPOSE_FETCH_MICRODESC),
+            OP_EQ, conn);
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  UNMOCK(connection_dir_client_handle_response);
+  free_keep_alive_dir_conn(conn);
+  SMARTLIST_FOREACH(handled_dir_responses, char *, cp, qed_hs_free(cp));
+  smartlist_free(handled_dir_responses);
+}
+
+static void
+test_dir_keep_alive_close(void *arg)
+{
+  (void) arg;
+  char digest[DIGEST_LEN];
+  dir_connection_t *conn = NULL;
+
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+  MOCK(connection_dir_client_request_failed, mock_dir_client_request_failed);
+  failed_dir_requests = smartlist_new();
+  memset(digest, 'A', DIGEST_LEN);
+
+  conn = new_keep_alive_dir_conn(digest, DIR_PURPOSE_FETCH_MICRODESC, "d/A");
+  launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_SERVERDESC, "d/B");
+  launch_keep_alive_dir_request(digest, DIR_PURPOSE_FETCH_EXTRAINFO, "d/C");
+
+  /* Closing the connection fails the request it was answering, and then
+   * every request queued behind it, in order. */
+  connection_dir_about_to_close(conn);
+  tt_int_op(smartlist_len(failed_dir_requests), OP_EQ, 3);
+  tt_str_op(smartlist_get(failed_dir_requests, 0), OP_EQ,
+            "microdescriptor fetch d/A");
+  tt_str_op(smartlist_get(failed_dir_requests, 1), OP_EQ,
+            "server descriptor fetch d/B");
+  tt_str_op(smartlist_get(failed_dir_requests, 2), OP_EQ,
+            "extra-info fetch d/C");
+  tt_ptr_op(conn->pipelined_requests, OP_EQ, NULL);
+
+  /* An idle connection has no requests to fail. */
+  SMARTLIST_FOREACH(failed_dir_requests, char *, cp, qed_hs_free(cp));
+  smartlist_clear(failed_dir_requests);
+  conn->base_.state = DIR_CONN_STATE_CLIENT_FINISHED;
+  connection_dir_about_to_close(conn);
+  tt_int_op(smartlist_len(failed_dir_requests), OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  UNMOCK(connection_dir_client_request_failed);
+  free_keep_alive_dir_conn(conn);
+  SMARTLIST_FOREACH(failed_dir_requests, char *, cp, qed_hs_free(cp));
+  smartlist_free(failed_dir_requests);
+}
+
 static void
 test_dir_packages(void *arg)
 {
@@ -7447,6 +8022,7 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_batch, TT_FORK),
   DIR(parse_no_onion_keyrouter_list, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
@@ -7463,6 +8039,7 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(random_weighted_alias, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -7475,6 +8052,9 @@ struct testcase_t dir_tests[] = {
   DIR(purpose_needs_anonymity_ret_false_for_non_sensitive_conn, 0),
   DIR(post_parsing, 0),
   DIR(fetch_type, 0),
+  DIR(keep_alive_find_conn, TT_FORK),
+  DIR(keep_alive_pipeline, TT_FORK),
+  DIR(keep_alive_close, TT_FORK),
   DIR(packages, 0),
   DIR(download_status_random_backoff, 0),
   DIR(download_status_random_backoff_ranges, 0),
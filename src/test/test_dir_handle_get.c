@@ -389,6 +389,77 @@ test_dir_handle_get_micro_d(void *data)
     microdesc_free_all();
 }
 
+static void
+test_dir_handle_get_micro_d_keep_alive(void *data)
+{
+  dir_connection_t *conn = NULL;
+  microdesc_cache_t *mc = NULL ;
+  smartlist_t *list = NULL;
+  char digest[DIGEST256_LEN];
+  char digest_base64[128];
+  char path[160];
+  char *header = NULL;
+  buf_t *body = NULL;
+  char *body_str = NULL;
+  size_t body_len = 0, chunk_left = 0;
+  int chunked = 0;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+
+  /* SETUP */
+  init_mock_options();
+
+  crypto_digest256(digest, microdesc, strlen(microdesc), DIGEST_SHA256);
+  base64_encode_nopad(digest_base64, sizeof(digest_base64),
+                      (uint8_t *) digest, DIGEST256_LEN);
+
+  mc = get_microdesc_cache();
+  list = microdescs_add_to_cache(mc, microdesc, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list));
+
+  /* Make the request over a (pretend) BEGIN_DIR stream. */
+  conn = new_dir_conn();
+  TO_CONN(conn)->linked = 1;
+
+  qed_hs_snprintf(path, sizeof(path),
+                  "GET /qed-hs/micro/d/%s HTTP/1.1\r\n"
+                  "Connection: keep-alive\r\n\r\n", digest_base64);
+  tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+  tt_assert(conn->keep_alive);
+
+  tt_int_op(fetch_from_buf_http_keep_alive(TO_CONN(conn)->outbuf, &header,
+                                           MAX_HEADERS_SIZE, &chunked,
+                                           &body_len), OP_EQ, 1);
+  tt_ptr_op(strstr(header, "HTTP/1.1 200 OK\r\n"), OP_EQ, header);
+  tt_assert(strstr(header, "Transfer-Encoding: chunked\r\n"));
+  tt_assert(strstr(header, "Connection: keep-alive\r\n"));
+  tt_int_op(chunked, OP_EQ, 1);
+
+  /* The body is the microdescriptor, and then the last chunk. */
+  body = buf_new();
+  tt_int_op(buf_http_dechunk(TO_CONN(conn)->outbuf, body, &chunk_left,
+                             10000), OP_EQ, 1);
+  tt_int_op(buf_datalen(TO_CONN(conn)->outbuf), OP_EQ, 0);
+  body_str = buf_extract(body, &body_len);
+  tt_str_op(body_str, OP_EQ, microdesc);
+  tt_int_op(conn->chunked, OP_EQ, 0);
+
+  done:
+    UNMOCK(get_options);
+    UNMOCK(connection_write_to_buf_impl_);
+
+    or_options_free(mock_options); mock_options = NULL;
+    connection_free_minimal(TO_CONN(conn));
+    qed_hs_free(header);
+    qed_hs_free(body_str);
+    buf_free(body);
+    smartlist_free(list);
+    microdesc_free_all();
+}
+
 static void
 test_dir_handle_get_micro_d_server_busy(void *data)
 {
@@ -2744,6 +2815,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(micro_d_not_found, 0),
   DIR_HANDLE_CMD(micro_d_server_busy, 0),
   DIR_HANDLE_CMD(micro_d, 0),
+  DIR_HANDLE_CMD(micro_d_keep_alive, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_without_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_wrong_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges, 0),
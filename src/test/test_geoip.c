@@ -380,10 +380,6 @@ test_geoip_with_pt(void *arg)
   qed_hs_free(s);
 }
 
-#undef SET_TEST_ADDRESS
-#undef SET_TEST_IPV6
-#undef CHECK_COUNTRY
-
 static const char GEOIP_CONTENT[] =
   "134445936,134445939,MP\n"
   "134445940,134447103,GU\n"
@@ -564,6 +560,170 @@ test_geoip_load_2nd_file(void *arg)
   qed_hs_free(fname_empty);
 }
 
+/** Write a binary GeoIP database to <b>fname</b>, with <b>n_ranges</b>
+ * ranges of <b>addr_len</b>-byte addresses starting at <b>starts</b> (in
+ * the file's byte order), in <b>countries</b>, with the 2-byte country codes
+ * in <b>codes</b>.  Write only the first <b>len</b> bytes if it is
+ * positive.  Return 0 on success. */
+static int
+write_geoip_db(const char *fname, int addr_len, const uint8_t *starts,
+               const uint16_t *countries, int n_ranges, const char *codes,
+               ssize_t len)
+{
+  const size_t n_cc = strlen(codes) / 2;
+  const size_t db_len = GEOIP_DB_HEADER_LEN + (addr_len + 2) * n_ranges +
+    2 * n_cc;
+  uint8_t *db = qed_hs_malloc_zero(db_len);
+  uint8_t *cp = db;
+  int r;
+
+  memcpy(cp, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN);
+  cp += GEOIP_DB_MAGIC_LEN;
+  *cp++ = GEOIP_DB_VERSION;
+  *cp++ = addr_len;
+  *cp++ = n_cc & 0xff;
+  *cp++ = n_cc >> 8;
+  *cp++ = n_ranges & 0xff;
+  *cp++ = (n_ranges >> 8) & 0xff;
+  cp += 2;
+  memcpy(cp, starts, addr_len * n_ranges);
+  cp += addr_len * n_ranges;
+  for (int i = 0; i < n_ranges; ++i) {
+    *cp++ = countries[i] & 0xff;
+    *cp++ = countries[i] >> 8;
+  }
+  memcpy(cp, codes, 2 * n_cc);
+
+  r = write_bytes_to_file(fname, (const char *)db,
+                          len > 0 ? (size_t)len : db_len, 1);
+  qed_hs_free(db);
+  return r;
+}
+
+/* Little-endian IPv4 range starts: 0, 10, 51, 100. */
+static const uint8_t geoip_db_starts[] = {
+  0, 0, 0, 0,  10, 0, 0, 0,  51, 0, 0, 0,  100, 0, 0, 0,
+};
+/* IPv6 range starts: ::, ::a, ::33, ::64. */
+static const uint8_t geoip6_db_starts[] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 51,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 100,
+};
+/* "??", "ab", "xy", "??" */
+static const uint16_t geoip_db_countries[] = { 0, 1, 2, 0 };
+
+static void
+test_geoip_load_binary_file(void *arg)
+{
+  (void)arg;
+  struct in6_addr in6;
+  char *contents = NULL;
+  char *dhex = NULL;
+  struct stat st;
+
+  char *fname = qed_hs_strdup(get_fname("geoip.bin"));
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, geoip_db_starts,
+                                     geoip_db_countries, 4, "ABXY", 0));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  const char *fname6 = get_fname("geoip6.bin");
+  tt_int_op(0, OP_EQ, write_geoip_db(fname6, 16, geoip6_db_starts,
+                                     geoip_db_countries, 4, "ABXY", 0));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname6, LOG_WARN));
+
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_assert(geoip_is_loaded(AF_INET6));
+  tt_int_op(3, OP_EQ, geoip_get_n_countries());
+
+  memset(&in6, 0, sizeof(in6));
+  CHECK_COUNTRY("??", 0);
+  CHECK_COUNTRY("??", 9);
+  CHECK_COUNTRY("ab", 10);
+  CHECK_COUNTRY("ab", 50);
+  CHECK_COUNTRY("xy", 51);
+  CHECK_COUNTRY("xy", 99);
+  CHECK_COUNTRY("??", 100);
+  CHECK_COUNTRY("??", 0xffffffff);
+  memset(&in6, 0xff, sizeof(in6));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv6(&in6));
+
+  /* The digest is of the whole file. */
+  contents = read_file_to_str(fname, RFTS_BIN, &st);
+  uint8_t d[DIGEST_LEN];
+  crypto_digest((char*)d, contents, st.st_size);
+  dhex = qed_hs_strdup(hex_str((char*)d, DIGEST_LEN));
+  tt_str_op(dhex, OP_EQ, geoip_db_digest(AF_INET));
+
+  /* Loading a text file replaces the binary one. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  tt_str_op("??", OP_EQ, geoip_get_country_name(
+                                       geoip_get_country_by_ipv4(10)));
+  tt_str_op("us", OP_EQ, geoip_get_country_name(
+                                       geoip_get_country_by_ipv4(0x08080808)));
+
+ done:
+  qed_hs_free(fname);
+  qed_hs_free(contents);
+  qed_hs_free(dhex);
+}
+
+static void
+test_geoip_load_bad_binary_file(void *arg)
+{
+  (void)arg;
+  const char *fname = get_fname("geoip.bin");
+  uint8_t starts[sizeof(geoip_db_starts)];
+  uint16_t countries[ARRAY_LENGTH(geoip_db_countries)];
+
+  /* The wrong address family. */
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 16, geoip6_db_starts,
+                                     geoip_db_countries, 4, "ABXY", 0));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  /* Truncated. */
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, geoip_db_starts,
+                                     geoip_db_countries, 4, "ABXY", 30));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  /* Not starting at 0. */
+  memcpy(starts, geoip_db_starts, sizeof(starts));
+  starts[0] = 1;
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, starts,
+                                     geoip_db_countries, 4, "ABXY", 0));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  /* Out of order. */
+  starts[0] = 0;
+  starts[8] = 200;
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, starts,
+                                     geoip_db_countries, 4, "ABXY", 0));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+  /* A country that isn't in the list. */
+  memcpy(countries, geoip_db_countries, sizeof(countries));
+  countries[3] = 3;
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, geoip_db_starts,
+                                     countries, 4, "ABXY", 0));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+
+  /* A country code that isn't printable. */
+  tt_int_op(0, OP_EQ, write_geoip_db(fname, 4, geoip_db_starts,
+                                     geoip_db_countries, 4, "ABX\n", 0));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_INFO));
+
+  /* None of these loaded anything, or added any countries. */
+  tt_assert(!geoip_is_loaded(AF_INET));
+  tt_int_op(1, OP_EQ, geoip_get_n_countries());
+  tt_int_op(-1, OP_EQ, geoip_get_country_by_ipv4(10));
+  tt_str_op("0000000000000000000000000000000000000000", OP_EQ,
+            geoip_db_digest(AF_INET));
+
+ done:
+  ;
+}
+
+#undef SET_TEST_ADDRESS
+#undef SET_TEST_IPV6
+#undef CHECK_COUNTRY
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +735,9 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_binary_file", test_geoip_load_binary_file, TT_FORK, NULL, NULL },
+  { "load_bad_binary_file", test_geoip_load_bad_binary_file, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -754,6 +754,165 @@ test_client_cache_remove(void *arg)
   UNMOCK(networkstatus_get_reasonably_live_consensus);
 }
 
+/** Test that a descriptor stored without being decrypted is decrypted the
+ * first time it is looked up, and that a newer one still replaces it. */
+static void
+test_client_cache_lazy_decode(void *arg)
+{
+  int ret;
+  ed25519_keypair_t service_kp;
+  hs_descriptor_t *desc = NULL;
+  char *encoded = NULL;
+  const hs_descriptor_t *search_desc;
+  size_t undecoded_size;
+
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+
+  parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                     &mock_ns.valid_after);
+  parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                     &mock_ns.fresh_until);
+  parse_rfc1123_time("Sat, 26 Oct 1985 16:00:00 UTC",
+                     &mock_ns.valid_until);
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&service_kp, 0));
+
+  desc = hs_helper_build_hs_desc_with_ip(&service_kp);
+  tt_assert(desc);
+  desc->plaintext_data.revision_counter = 42;
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* Store it without decrypting it: only the encoded form is accounted. */
+  ret = hs_cache_store_undecoded_as_client(encoded, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  tt_str_op(hs_cache_lookup_encoded_as_client(&service_kp.pubkey), OP_EQ,
+            encoded);
+  undecoded_size = hs_cache_get_total_allocation();
+
+  /* The lookup decrypts it, and its size is now accounted for. */
+  search_desc = hs_cache_lookup_as_client(&service_kp.pubkey);
+  tt_assert(search_desc);
+  tt_u64_op(search_desc->plaintext_data.revision_counter, OP_EQ, 42);
+  tt_int_op(smartlist_len(search_desc->encrypted_data.intro_points), OP_GT,
+            0);
+  tt_u64_op(hs_cache_get_total_allocation(), OP_GT, undecoded_size);
+  tt_ptr_op(hs_cache_lookup_as_client(&service_kp.pubkey), OP_EQ,
+            search_desc);
+
+  /* An older undecoded descriptor doesn't replace the one we have, since we
+   * know its revision counter from the plaintext layer. */
+  qed_hs_free(encoded);
+  desc->plaintext_data.revision_counter = 41;
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_store_undecoded_as_client(encoded, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  tt_ptr_op(hs_cache_lookup_as_client(&service_kp.pubkey), OP_EQ,
+            search_desc);
+
+  /* A newer one does. */
+  qed_hs_free(encoded);
+  desc->plaintext_data.revision_counter = 43;
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_store_undecoded_as_client(encoded, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  search_desc = hs_cache_lookup_as_client(&service_kp.pubkey);
+  tt_assert(search_desc);
+  tt_u64_op(search_desc->plaintext_data.revision_counter, OP_EQ, 43);
+
+  /* A descriptor that isn't signed by the service is rejected before we
+   * store it. */
+  {
+    ed25519_keypair_t other_kp;
+    tt_int_op(0, OP_EQ, ed25519_keypair_generate(&other_kp, 0));
+    ret = hs_cache_store_undecoded_as_client(encoded, &other_kp.pubkey);
+    tt_int_op(ret, OP_EQ, HS_DESC_DECODE_GENERIC_ERROR);
+    tt_assert(!hs_cache_lookup_encoded_as_client(&other_kp.pubkey));
+  }
+
+ done:
+  qed_hs_free(encoded);
+  hs_descriptor_free(desc);
+  hs_free_all();
+
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+}
+
+static int n_decode_plaintext = 0;
+
+static hs_desc_decode_status_t
+mock_hs_desc_decode_plaintext(const char *encoded,
+                              hs_desc_plaintext_data_t *plaintext)
+{
+  n_decode_plaintext++;
+  return hs_desc_decode_plaintext__real(encoded, plaintext);
+}
+
+/** Test that storing a descriptor and decrypting it right away decodes and
+ * checks its plaintext layer only once. */
+static void
+test_client_cache_decode_plaintext_once(void *arg)
+{
+  int ret;
+  ed25519_keypair_t service_kp;
+  hs_descriptor_t *desc = NULL;
+  char *encoded = NULL;
+  const hs_descriptor_t *search_desc;
+
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+  MOCK(hs_desc_decode_plaintext, mock_hs_desc_decode_plaintext);
+
+  parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                     &mock_ns.valid_after);
+  parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                     &mock_ns.fresh_until);
+  parse_rfc1123_time("Sat, 26 Oct 1985 16:00:00 UTC",
+                     &mock_ns.valid_until);
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&service_kp, 0));
+
+  desc = hs_helper_build_hs_desc_with_ip(&service_kp);
+  tt_assert(desc);
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+
+  n_decode_plaintext = 0;
+  ret = hs_cache_store_as_client(encoded, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  tt_int_op(n_decode_plaintext, OP_EQ, 1);
+
+  /* The descriptor is fully decoded, with the plaintext layer we checked. */
+  search_desc = hs_cache_lookup_as_client(&service_kp.pubkey);
+  tt_assert(search_desc);
+  tt_int_op(n_decode_plaintext, OP_EQ, 1);
+  tt_assert(search_desc->plaintext_data.signing_key_cert);
+  tt_assert(search_desc->plaintext_data.superencrypted_blob);
+  tt_mem_op(&search_desc->plaintext_data.blinded_pubkey, OP_EQ,
+            &desc->plaintext_data.blinded_pubkey, ED25519_PUBKEY_LEN);
+  tt_int_op(smartlist_len(search_desc->encrypted_data.intro_points), OP_EQ,
+            smartlist_len(desc->encrypted_data.intro_points));
+
+ done:
+  qed_hs_free(encoded);
+  hs_descriptor_free(desc);
+  hs_free_all();
+
+  UNMOCK(hs_desc_decode_plaintext);
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+}
+
 struct testcase_t hs_cache[] = {
   /* Encoding tests. */
   { "directory", test_directory, TT_FORK,
@@ -772,6 +931,10 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "client_cache_remove", test_client_cache_remove, TT_FORK,
     NULL, NULL },
+  { "client_cache_lazy_decode", test_client_cache_lazy_decode, TT_FORK,
+    NULL, NULL },
+  { "client_cache_decode_plaintext_once",
+    test_client_cache_decode_plaintext_once, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
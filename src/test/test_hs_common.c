@@ -683,6 +683,61 @@ test_disaster_srv(void *arg)
   ;
 }
 
+/** Test that the blinded keys cache keeps two time periods per service, so
+ * that alternating between them doesn't recompute anything. */
+static void
+test_blinded_keys_cache(void *arg)
+{
+  ed25519_keypair_t kp;
+  ed25519_public_key_t blinded_pk, expected_pk;
+  hs_subcredential_t subcred, expected_subcred;
+  const struct hs_blinded_keys_t *cur_keys, *next_keys;
+  uint64_t tp = hs_get_time_period_num(0);
+
+  (void) arg;
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp, 0));
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp), OP_EQ, NULL);
+
+  /* The cached values are the ones we would build ourselves. */
+  hs_get_blinded_keys_cached(&kp.pubkey, tp, &blinded_pk, &subcred);
+  hs_build_blinded_pubkey(&kp.pubkey, NULL, 0, tp, &expected_pk);
+  hs_get_subcredential(&kp.pubkey, &expected_pk, &expected_subcred);
+  tt_mem_op(&blinded_pk, OP_EQ, &expected_pk, ED25519_PUBKEY_LEN);
+  tt_mem_op(&subcred, OP_EQ, &expected_subcred, sizeof(subcred));
+  cur_keys = hs_blinded_keys_cache_lookup(&kp.pubkey, tp);
+  tt_assert(cur_keys);
+
+  /* Asking for the next time period keeps the current one around. */
+  hs_get_blinded_keys_cached(&kp.pubkey, tp + 1, &blinded_pk, NULL);
+  hs_build_blinded_pubkey(&kp.pubkey, NULL, 0, tp + 1, &expected_pk);
+  tt_mem_op(&blinded_pk, OP_EQ, &expected_pk, ED25519_PUBKEY_LEN);
+  next_keys = hs_blinded_keys_cache_lookup(&kp.pubkey, tp + 1);
+  tt_assert(next_keys);
+  tt_ptr_op(next_keys, OP_NE, cur_keys);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp), OP_EQ, cur_keys);
+
+  /* Going back and forth hits the cache. */
+  hs_get_blinded_keys_cached(&kp.pubkey, tp, &blinded_pk, &subcred);
+  tt_mem_op(&subcred, OP_EQ, &expected_subcred, sizeof(subcred));
+  hs_get_blinded_keys_cached(&kp.pubkey, tp + 1, &blinded_pk, NULL);
+  tt_mem_op(&blinded_pk, OP_EQ, &expected_pk, ED25519_PUBKEY_LEN);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp), OP_EQ, cur_keys);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp + 1), OP_EQ,
+            next_keys);
+
+  /* A new time period replaces the oldest one. */
+  hs_get_blinded_keys_cached(&kp.pubkey, tp + 2, &blinded_pk, NULL);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp), OP_EQ, NULL);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp + 1), OP_EQ,
+            next_keys);
+  tt_ptr_op(hs_blinded_keys_cache_lookup(&kp.pubkey, tp + 2), OP_EQ,
+            cur_keys);
+
+ done:
+  hs_blinded_keys_cache_free_all();
+}
+
 /** Test our HS descriptor request tracker by making various requests and
  *  checking whether they get tracked properly. */
 static void
@@ -1932,6 +1987,8 @@ struct testcase_t hs_common_tests[] = {
     NULL, NULL },
   { "disaster_srv", test_disaster_srv, TT_FORK,
     NULL, NULL },
+  { "blinded_keys_cache", test_blinded_keys_cache, TT_FORK,
+    NULL, NULL },
   { "hid_serv_request_tracker", test_hid_serv_request_tracker, TT_FORK,
     NULL, NULL },
   { "parse_extended_hostname", test_parse_extended_hostname, TT_FORK,
@@ -238,6 +238,50 @@ test_encode_descriptor(void *arg)
   hs_descriptor_free(desc);
 }
 
+/** Test that a copy of a descriptor encodes to the same descriptor, even
+ * after the original is gone. */
+static void
+test_descriptor_dup(void *arg)
+{
+  int ret;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL, *dup = NULL, *decoded = NULL;
+  char *encoded = NULL;
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  tt_assert(desc);
+
+  dup = hs_descriptor_dup(desc);
+  tt_assert(dup);
+  tt_ptr_op(dup->plaintext_data.signing_key_cert, OP_NE,
+            desc->plaintext_data.signing_key_cert);
+  tt_ptr_op(dup->encrypted_data.intro_points, OP_NE,
+            desc->encrypted_data.intro_points);
+  hs_helper_desc_equal(desc, dup);
+
+  /* The copy must not share anything with the original. */
+  hs_descriptor_free(desc);
+
+  ret = hs_desc_encode_descriptor(dup, &signing_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_assert(encoded);
+  ret = hs_desc_decode_descriptor(encoded, &dup->subcredential, NULL,
+                                  &decoded);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  tt_assert(decoded);
+  hs_helper_desc_equal(dup, decoded);
+
+ done:
+  hs_descriptor_free(desc);
+  hs_descriptor_free(dup);
+  hs_descriptor_free(decoded);
+  qed_hs_free(encoded);
+}
+
 static void
 test_decode_descriptor(void *arg)
 {
@@ -946,6 +990,8 @@ struct testcase_t hs_descriptor[] = {
     NULL, NULL },
   { "encode_descriptor", test_encode_descriptor, TT_FORK,
     NULL, NULL },
+  { "descriptor_dup", test_descriptor_dup, TT_FORK,
+    NULL, NULL },
   { "descriptor_padding", test_descriptor_padding, TT_FORK,
     NULL, NULL },
 
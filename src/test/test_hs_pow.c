@@ -8,6 +8,7 @@
 
 #define HS_SERVICE_PRIVATE
 #define HS_CIRCUIT_PRIVATE
+#define HS_POW_PRIVATE
 
 #include "lib/cc/compat_compiler.h"
 #include "lib/cc/torint.h"
@@ -20,13 +21,16 @@
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "feature/hs/hs_cell.h"
 #include "feature/hs/hs_circuit.h"
+#include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_metrics.h"
 #include "feature/hs/hs_pow.h"
 #include "feature/hs/hs_service.h"
 #include "feature/nodelist/nodelist.h"
+#include "lib/evloop/workqueue.h"
 
 #include "core/or/crypt_path_st.h"
 #include "core/or/origin_circuit_st.h"
@@ -493,8 +497,186 @@ test_hs_pow_vectors(void *arg)
   hs_pow_remove_seed_from_cache(NULL);
 }
 
+/* Verifying a solution off the main thread, then noting it on the main
+ * thread, must accept what hs_pow_verify() accepts and catch replays and
+ * seed rotation in between. */
+static void
+test_hs_pow_verify_split(void *arg)
+{
+  (void)arg;
+  hs_pow_verifier_inputs_t inputs;
+  hs_pow_solution_t solution;
+  hs_pow_service_state_t *pow_state = NULL;
+
+  /* The valid zero-effort solution from test_hs_pow_vectors. */
+  memset(&inputs, 0, sizeof(inputs));
+  memset(&solution, 0, sizeof(solution));
+  memset(inputs.service_blinded_id.pubkey, 0x11, HS_POW_ID_LEN);
+  memset(inputs.seed_previous, 0xaa, HS_POW_SEED_LEN);
+  inputs.CompiledProofOfWorkHash = 0;
+  memset(solution.nonce, 0x55, HS_POW_NONCE_LEN);
+  memcpy(solution.seed_head, inputs.seed_previous, HS_POW_SEED_HEAD_LEN);
+  tt_int_op(base16_decode((char*)solution.equix_solution, HS_POW_EQX_SOL_LEN,
+                          "4312f87ceab844c78e1c793a913812d7",
+                          2 * HS_POW_EQX_SOL_LEN), OP_EQ, HS_POW_EQX_SOL_LEN);
+
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+  /* Verifying doesn't touch the replay cache, so it can be repeated. */
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+
+  /* A solution for a seed we don't have fails. */
+  solution.seed_head[0] ^= 1;
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, -1);
+  solution.seed_head[0] ^= 1;
+
+  pow_state = qed_hs_malloc_zero(sizeof(hs_pow_service_state_t));
+  memcpy(pow_state->seed_previous, inputs.seed_previous, HS_POW_SEED_LEN);
+
+  /* Noting it succeeds once, then it's a replay. */
+  tt_int_op(hs_pow_note_verified_solution(pow_state, &solution), OP_EQ, 0);
+  tt_int_op(hs_pow_note_verified_solution(pow_state, &solution), OP_EQ, -1);
+
+  /* If the seed rotated out while we were verifying, we reject it. */
+  solution.nonce[0] ^= 1;
+  memset(pow_state->seed_previous, 0xbb, HS_POW_SEED_LEN);
+  tt_int_op(hs_pow_note_verified_solution(pow_state, &solution), OP_EQ, -1);
+
+ done:
+  qed_hs_free(pow_state);
+  hs_pow_remove_seed_from_cache(NULL);
+}
+
+/* Verification contexts are reused once the pool is set up, including
+ * after a bad solution, and are replaced if the hash option changes. */
+static void
+test_hs_pow_verify_ctx_reuse(void *arg)
+{
+  (void)arg;
+  hs_pow_verifier_inputs_t inputs;
+  hs_pow_solution_t solution;
+
+  /* The valid zero-effort solution from test_hs_pow_vectors. */
+  memset(&inputs, 0, sizeof(inputs));
+  memset(&solution, 0, sizeof(solution));
+  memset(inputs.service_blinded_id.pubkey, 0x11, HS_POW_ID_LEN);
+  memset(inputs.seed_current, 0xaa, HS_POW_SEED_LEN);
+  inputs.CompiledProofOfWorkHash = 0;
+  memset(solution.nonce, 0x55, HS_POW_NONCE_LEN);
+  memcpy(solution.seed_head, inputs.seed_current, HS_POW_SEED_HEAD_LEN);
+  tt_int_op(base16_decode((char*)solution.equix_solution, HS_POW_EQX_SOL_LEN,
+                          "4312f87ceab844c78e1c793a913812d7",
+                          2 * HS_POW_EQX_SOL_LEN), OP_EQ, HS_POW_EQX_SOL_LEN);
+
+  hs_pow_init();
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+  solution.equix_solution[0] ^= 1;
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, -1);
+  solution.equix_solution[0] ^= 1;
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+
+  inputs.CompiledProofOfWorkHash = -1;
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+  inputs.CompiledProofOfWorkHash = 0;
+  tt_int_op(hs_pow_verify_solution(&inputs, &solution), OP_EQ, 0);
+
+ done:
+  hs_pow_free_all();
+}
+
+static unsigned int mock_n_threads = 0;
+static smartlist_t *queued_solver_jobs = NULL;
+static void (*queued_solver_reply_fn)(void *) = NULL;
+
+static unsigned int
+mock_cpuworker_get_n_threads(void)
+{
+  return mock_n_threads;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) priority;
+  (void) fn;
+
+  queued_solver_reply_fn = reply_fn;
+  smartlist_add(queued_solver_jobs, arg);
+  /* Callers only check this for NULL. */
+  return (workqueue_entry_t *) arg;
+}
+
+/* Helper: hand every queued solver job back to the main thread, unsolved. */
+static void
+reply_to_solver_jobs(void)
+{
+  SMARTLIST_FOREACH(queued_solver_jobs, void *, job,
+                    queued_solver_reply_fn(job));
+  smartlist_clear(queued_solver_jobs);
+}
+
+/* Solver jobs leave one cpuworker thread free, and share the others among
+ * all the puzzles being solved at once. */
+static void
+test_hs_pow_solver_job_cap(void *arg)
+{
+  (void)arg;
+  hs_pow_solver_inputs_t inputs;
+  const uint8_t cookie[HS_REND_COOKIE_LEN] = {0};
+
+  memset(&inputs, 0, sizeof(inputs));
+  memset(inputs.service_blinded_id.pubkey, 0x11, HS_POW_ID_LEN);
+  inputs.effort = 100;
+
+  hs_circuitmap_init();
+  queued_solver_jobs = smartlist_new();
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  setup_full_capture_of_logs(LOG_WARN);
+
+  mock_n_threads = 4;
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 3);
+  tt_int_op(hs_pow_queue_work(1, cookie, &inputs), OP_EQ, 0);
+  tt_int_op(smartlist_len(queued_solver_jobs), OP_EQ, 3);
+
+  /* Every thread we'll use is busy, but a new puzzle still gets a job. */
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 1);
+  tt_int_op(hs_pow_queue_work(2, cookie, &inputs), OP_EQ, 0);
+  tt_int_op(smartlist_len(queued_solver_jobs), OP_EQ, 4);
+
+  /* Once the jobs are done, their threads are available again. */
+  reply_to_solver_jobs();
+  expect_log_msg_containing("PoW cpuworker returned with no solution");
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 3);
+
+  /* With one or two threads, we only queue one job. */
+  mock_n_threads = 2;
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 1);
+  mock_n_threads = 1;
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 1);
+  tt_int_op(hs_pow_queue_work(3, cookie, &inputs), OP_EQ, 0);
+  tt_int_op(smartlist_len(queued_solver_jobs), OP_EQ, 1);
+  reply_to_solver_jobs();
+
+  /* And never more than the most we'll use for a single puzzle. */
+  mock_n_threads = 64;
+  tt_uint_op(hs_pow_get_n_solver_jobs(), OP_EQ, 16);
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  smartlist_free(queued_solver_jobs);
+  hs_circuitmap_free_all();
+}
+
 struct testcase_t hs_pow_tests[] = {
   { "unsolicited", test_hs_pow_unsolicited, TT_FORK, NULL, NULL },
   { "vectors", test_hs_pow_vectors, TT_FORK, NULL, NULL },
+  { "verify_split", test_hs_pow_verify_split, TT_FORK, NULL, NULL },
+  { "verify_ctx_reuse", test_hs_pow_verify_ctx_reuse, TT_FORK, NULL, NULL },
+  { "solver_job_cap", test_hs_pow_solver_job_cap, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
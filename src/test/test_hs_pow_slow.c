@@ -267,7 +267,40 @@ test_hs_pow_vectors(void *arg)
   hs_pow_remove_seed_from_cache(NULL);
 }
 
+/* A cancellable solver gives up once another solver has won, and tells the
+ * others when it wins itself. */
+static void
+test_hs_pow_solve_cancellable(void *arg)
+{
+  (void)arg;
+  hs_pow_solver_inputs_t input;
+  hs_pow_solution_t output;
+  atomic_counter_t cancel;
+
+  memset(&input, 0, sizeof(input));
+  memset(input.service_blinded_id.pubkey, 0x11, HS_POW_ID_LEN);
+  memset(input.seed, 0xaa, HS_POW_SEED_LEN);
+  input.effort = 4;
+  input.CompiledProofOfWorkHash = -1;
+  atomic_counter_init(&cancel);
+
+  /* Somebody else already solved it. */
+  atomic_counter_add(&cancel, 1);
+  tt_int_op(hs_pow_solve_cancellable(&input, &cancel, &output), OP_EQ, 1);
+
+  /* We solve it, and let everybody else know. */
+  atomic_counter_exchange(&cancel, 0);
+  tt_int_op(hs_pow_solve_cancellable(&input, &cancel, &output), OP_EQ, 0);
+  tt_uint_op(atomic_counter_get(&cancel), OP_NE, 0);
+  tt_uint_op(output.effort, OP_EQ, input.effort);
+  tt_mem_op(output.seed_head, OP_EQ, input.seed, HS_POW_SEED_HEAD_LEN);
+
+ done:
+  atomic_counter_destroy(&cancel);
+}
+
 struct testcase_t slow_hs_pow_tests[] = {
   { "vectors", test_hs_pow_vectors, 0, NULL, NULL },
+  { "solve_cancellable", test_hs_pow_solve_cancellable, 0, NULL, NULL },
   END_OF_TESTCASES
 };
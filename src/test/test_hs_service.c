@@ -33,6 +33,7 @@
 #include "app/config/statefile.h"
 #include "core/crypto/hs_ntor.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -58,6 +59,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/fs/dir.h"
 
 #include "core/or/cpath_build_state_st.h"
@@ -2275,6 +2277,8 @@ mock_build_state_get_exit_node(cpath_build_state_t *state)
   return fake_node;
 }
 
+static int n_rend_launches = 0;
+
 static void
 mock_launch_rendezvous_point_circuit(const hs_service_t *service,
                              const ed25519_public_key_t *ip_auth_pubkey,
@@ -2287,6 +2291,7 @@ mock_launch_rendezvous_point_circuit(const hs_service_t *service,
   (void) ip_enc_key_kp;
   (void) rdv_data;
   (void) now;
+  n_rend_launches++;
   return;
 }
 
@@ -2624,6 +2629,218 @@ test_intro2_handling(void *arg)
   UNMOCK(launch_rendezvous_point_circuit);
 }
 
+static unsigned int
+mock_cpuworker_get_n_threads(void)
+{
+  return 1;
+}
+
+static workqueue_reply_t (*queued_fn)(void *, void *) = NULL;
+static void (*queued_reply_fn)(void *) = NULL;
+static void *queued_arg = NULL;
+static int queue_work_should_fail = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) priority;
+
+  if (queue_work_should_fail)
+    return NULL;
+  tt_ptr_op(queued_arg, OP_EQ, NULL);
+  queued_fn = fn;
+  queued_reply_fn = reply_fn;
+  queued_arg = arg;
+ done:
+  /* Callers only check this for NULL. */
+  return (workqueue_entry_t *) &queued_arg;
+}
+
+/* Helper: run the INTRODUCE2 job that was last queued, as a cpuworker and
+ * then the main thread would. */
+static void
+run_queued_introduce2_job(void)
+{
+  void *arg = queued_arg;
+
+  tt_assert(arg);
+  queued_arg = NULL;
+  tt_int_op(queued_fn(NULL, arg), OP_EQ, WQ_RPL_REPLY);
+  queued_reply_fn(arg);
+ done:
+  ;
+}
+
+/** Test that INTRODUCE2 cells queued on the cpuworkers count against the
+ * intro point when they are queued, and give their slot back if they turn
+ * out to be invalid. */
+static void
+test_intro2_offload(void *arg)
+{
+  int retval;
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  hs_desc_intro_point_t *alice_ip = NULL;
+  origin_circuit_t *intro_circ = NULL;
+  origin_circuit_t rend_circ;
+  const hs_subcredential_t *subcred;
+
+  (void) arg;
+
+  MOCK(build_state_get_exit_node, mock_build_state_get_exit_node);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(node_get_link_specifier_smartlist,
+       mock_node_get_link_specifier_smartlist);
+  MOCK(launch_rendezvous_point_circuit, mock_launch_rendezvous_point_circuit);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  hs_init();
+  n_rend_launches = 0;
+  update_approx_time(time(NULL));
+
+  /* A registered service with one intro point, so that the reply can find
+   * them again. */
+  service = helper_create_service();
+  memset(service->desc_current->desc->subcredential.subcred, 'S',
+         SUBCRED_LEN);
+  subcred = &service->desc_current->desc->subcredential;
+  {
+    curve25519_secret_key_t seckey;
+    curve25519_public_key_t pkey;
+    curve25519_secret_key_generate(&seckey, 0);
+    curve25519_public_key_generate(&pkey, &seckey);
+
+    node_t intro_node;
+    memset(&intro_node, 0, sizeof(intro_node));
+    routerinfo_t ri;
+    memset(&ri, 0, sizeof(routerinfo_t));
+    ri.onion_curve25519_pkey = &pkey;
+    intro_node.ri = &ri;
+
+    ip = service_intro_point_new(&intro_node);
+  }
+  service_intro_point_add(service->desc_current->intro_points.map, ip);
+
+  ed25519_keypair_t signing_kp;
+  ed25519_keypair_generate(&signing_kp, 0);
+  alice_ip = hs_helper_build_intro_point(&signing_kp, approx_time(),
+                                         "1.2.3.4", 0,
+                                         &ip->auth_key_kp, &ip->enc_key_kp);
+  intro_circ = origin_circuit_new();
+  TO_CIRCUIT(intro_circ)->purpose = CIRCUIT_PURPOSE_S_INTRO;
+  intro_circ->cpath = qed_hs_malloc_zero(sizeof(crypt_path_t));
+  intro_circ->cpath->prev = intro_circ->cpath;
+  intro_circ->hs_ident = qed_hs_malloc_zero(sizeof(*intro_circ->hs_ident));
+  memset(&rend_circ, 0, sizeof(rend_circ));
+  rend_circ.hs_ident = qed_hs_malloc_zero(sizeof(*rend_circ.hs_ident));
+  memset(rend_circ.hs_ident->rendezvous_cookie, 'r', HS_REND_COOKIE_LEN);
+
+  /* A valid cell is counted as soon as it is queued, and the reply launches
+   * the rendezvous circuit without counting it again. Each cell uses a new
+   * client key, so that the intro point's replay cache lets it through. */
+  curve25519_keypair_generate(&rend_circ.hs_ident->rendezvous_client_kp, 0);
+  retval = hs_circ_send_introduce1(intro_circ, &rend_circ, alice_ip,
+                                   subcred, NULL);
+  tt_int_op(retval, OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, intro_circ, ip, subcred,
+                                     (uint8_t *) relay_payload,
+                                     relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(ip->introduce2_count, OP_EQ, 1);
+  tt_int_op(n_rend_launches, OP_EQ, 0);
+  run_queued_introduce2_job();
+  tt_int_op(ip->introduce2_count, OP_EQ, 1);
+  tt_int_op(n_rend_launches, OP_EQ, 1);
+
+  /* A new cell with the same rendezvous cookie is queued, then found to be
+   * a replay: its slot is given back. */
+  curve25519_keypair_generate(&rend_circ.hs_ident->rendezvous_client_kp, 0);
+  retval = hs_circ_send_introduce1(intro_circ, &rend_circ, alice_ip,
+                                   subcred, NULL);
+  tt_int_op(retval, OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, intro_circ, ip, subcred,
+                                     (uint8_t *) relay_payload,
+                                     relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(ip->introduce2_count, OP_EQ, 2);
+  run_queued_introduce2_job();
+  tt_int_op(ip->introduce2_count, OP_EQ, 1);
+  tt_int_op(n_rend_launches, OP_EQ, 1);
+
+  /* Same for a cell that the worker fails to decrypt. */
+  memset(rend_circ.hs_ident->rendezvous_cookie, 's', HS_REND_COOKIE_LEN);
+  curve25519_keypair_generate(&rend_circ.hs_ident->rendezvous_client_kp, 0);
+  retval = hs_circ_send_introduce1(intro_circ, &rend_circ, alice_ip,
+                                   subcred, NULL);
+  tt_int_op(retval, OP_EQ, 0);
+  relay_payload[relay_payload_len - 1] ^= 1;
+  retval = hs_circ_handle_introduce2(service, intro_circ, ip, subcred,
+                                     (uint8_t *) relay_payload,
+                                     relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(ip->introduce2_count, OP_EQ, 2);
+  run_queued_introduce2_job();
+  tt_int_op(ip->introduce2_count, OP_EQ, 1);
+  tt_int_op(n_rend_launches, OP_EQ, 1);
+
+  /* A cell that can't be queued is not counted. */
+  queue_work_should_fail = 1;
+  curve25519_keypair_generate(&rend_circ.hs_ident->rendezvous_client_kp, 0);
+  retval = hs_circ_send_introduce1(intro_circ, &rend_circ, alice_ip,
+                                   subcred, NULL);
+  tt_int_op(retval, OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, intro_circ, ip, subcred,
+                                     (uint8_t *) relay_payload,
+                                     relay_payload_len);
+  tt_int_op(retval, OP_EQ, -1);
+  tt_int_op(ip->introduce2_count, OP_EQ, 1);
+  queue_work_should_fail = 0;
+
+  /* A cell in flight already counts towards introduce2_max, so the intro
+   * point expires before its reply arrives. */
+  ip->introduce2_max = 2;
+  memset(rend_circ.hs_ident->rendezvous_cookie, 't', HS_REND_COOKIE_LEN);
+  curve25519_keypair_generate(&rend_circ.hs_ident->rendezvous_client_kp, 0);
+  retval = hs_circ_send_introduce1(intro_circ, &rend_circ, alice_ip,
+                                   subcred, NULL);
+  tt_int_op(retval, OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, intro_circ, ip, subcred,
+                                     (uint8_t *) relay_payload,
+                                     relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(intro_point_should_expire(ip, approx_time()), OP_EQ, 1);
+  run_queued_introduce2_job();
+  tt_int_op(ip->introduce2_count, OP_EQ, 2);
+  tt_int_op(n_rend_launches, OP_EQ, 2);
+
+ done:
+  if (queued_arg)
+    run_queued_introduce2_job();
+  queue_work_should_fail = 0;
+  hs_desc_intro_point_free(alice_ip);
+  qed_hs_free(rend_circ.hs_ident);
+  circuit_free_(TO_CIRCUIT(intro_circ));
+  hs_free_all();
+
+  if (fake_node) {
+    qed_hs_free(fake_node->ri->onion_curve25519_pkey);
+    qed_hs_free(fake_node->ri);
+    qed_hs_free(fake_node);
+    fake_node = NULL;
+  }
+
+  UNMOCK(build_state_get_exit_node);
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(node_get_link_specifier_smartlist);
+  UNMOCK(launch_rendezvous_point_circuit);
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+}
+
 static void
 test_cannot_upload_descriptors(void *arg)
 {
@@ -2812,6 +3029,7 @@ struct testcase_t hs_service_tests[] = {
   { "export_client_circuit_id", test_export_client_circuit_id, TT_FORK,
     NULL, NULL },
   { "intro2_handling", test_intro2_handling, TT_FORK, NULL, NULL },
+  { "intro2_offload", test_intro2_offload, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -5,7 +5,10 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define MICRODESC_PARSE_PRIVATE
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/policies.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/dirparse/routerparse.h"
@@ -14,6 +17,7 @@
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
+#include "lib/evloop/workqueue.h"
 
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -664,7 +668,8 @@ test_md_parse(void *arg)
   tt_int_op(md->no_save, OP_EQ, 0);
   tt_uint_op(md->held_in_map, OP_EQ, 0);
   tt_uint_op(md->held_by_nodes, OP_EQ, 0);
-  tt_assert(md->onion_curve25519_pkey);
+  tt_ptr_op(md->onion_curve25519_pkey, OP_EQ,
+            &md->onion_curve25519_pkey_storage);
 
   md = smartlist_get(mds, 6);
   test_memeq_hex(md->digest,
@@ -708,6 +713,204 @@ test_md_parse(void *arg)
   qed_hs_free(mem_op_hex_tmp);
 }
 
+/** Splitting a document into chunks, as we do when parsing it on several
+ * threads, must give the same result as parsing it in one pass. */
+static void
+test_md_parse_in_chunks(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *invalid_chunked = smartlist_new();
+  smartlist_t *mds = NULL, *mds_chunked = NULL;
+  const char *eos = MD_PARSE_TEST_DATA + strlen(MD_PARSE_TEST_DATA);
+  const size_t chunk_sizes[] = { 1, 700, 100000 };
+  int n_families = 0;
+
+  mds = microdescs_parse_from_string(MD_PARSE_TEST_DATA, NULL, 1,
+                                     SAVED_NOWHERE, invalid);
+
+  for (unsigned i = 0; i < ARRAY_LENGTH(chunk_sizes); ++i) {
+    /* With no cpuworkers, the calling thread parses every chunk itself. */
+    mds_chunked = microdescs_parse_in_chunks(MD_PARSE_TEST_DATA,
+                                             MD_PARSE_TEST_DATA, eos, 1,
+                                             SAVED_NOWHERE, invalid_chunked,
+                                             0, chunk_sizes[i]);
+    tt_int_op(smartlist_len(mds_chunked), OP_EQ, smartlist_len(mds));
+    SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+      const microdesc_t *md2 = smartlist_get(mds_chunked, md_sl_idx);
+      tt_mem_op(md->digest, OP_EQ, md2->digest, DIGEST256_LEN);
+      tt_uint_op(md->off, OP_EQ, md2->off);
+      tt_uint_op(md->bodylen, OP_EQ, md2->bodylen);
+      tt_ptr_op(md->family, OP_EQ, md2->family);
+      tt_int_op(md->policy_is_reject_star, OP_EQ,
+                md2->policy_is_reject_star);
+      if (md->family)
+        ++n_families;
+    } SMARTLIST_FOREACH_END(md);
+
+    tt_int_op(smartlist_len(invalid_chunked), OP_EQ, smartlist_len(invalid));
+    SMARTLIST_FOREACH_BEGIN(invalid, const char *, d) {
+      tt_mem_op(d, OP_EQ, smartlist_get(invalid_chunked, d_sl_idx),
+                DIGEST256_LEN);
+    } SMARTLIST_FOREACH_END(d);
+
+    SMARTLIST_FOREACH(mds_chunked, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds_chunked);
+    mds_chunked = NULL;
+    SMARTLIST_FOREACH(invalid_chunked, char *, cp, qed_hs_free(cp));
+    smartlist_clear(invalid_chunked);
+  }
+  tt_int_op(n_families, OP_GT, 0);
+
+ done:
+  if (mds)
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  if (mds_chunked)
+    SMARTLIST_FOREACH(mds_chunked, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds_chunked);
+  SMARTLIST_FOREACH(invalid, char *, cp, qed_hs_free(cp));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(invalid_chunked, char *, cp, qed_hs_free(cp));
+  smartlist_free(invalid_chunked);
+}
+
+/** A cpuworker job that mock_cpuworker_queue_work_in_thread() is running on
+ * a thread of its own. */
+typedef struct md_helper_job_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} md_helper_job_t;
+
+/** Protects n_helpers_running. */
+static qed_hs_mutex_t helpers_lock;
+/** Signalled when a helper thread finishes its job. */
+static qed_hs_cond_t helpers_done_cond;
+static int n_helpers_running = 0;
+/** The md_helper_job_t of each job we queued. */
+static smartlist_t *helper_jobs = NULL;
+
+/** Thread function: run the md_helper_job_t in <b>arg</b>. */
+static void
+md_helper_thread_main(void *arg)
+{
+  md_helper_job_t *job = arg;
+  job->fn(NULL, job->arg);
+  qed_hs_mutex_acquire(&helpers_lock);
+  --n_helpers_running;
+  qed_hs_cond_signal_all(&helpers_done_cond);
+  qed_hs_mutex_release(&helpers_lock);
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work_in_thread(workqueue_priority_t priority,
+                                    workqueue_reply_t (*fn)(void *, void *),
+                                    void (*reply_fn)(void *),
+                                    void *arg)
+{
+  (void) priority;
+  md_helper_job_t *job = qed_hs_malloc_zero(sizeof(*job));
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(helper_jobs, job);
+
+  qed_hs_mutex_acquire(&helpers_lock);
+  ++n_helpers_running;
+  qed_hs_mutex_release(&helpers_lock);
+  if (spawn_func(md_helper_thread_main, job) < 0) {
+    qed_hs_mutex_acquire(&helpers_lock);
+    --n_helpers_running;
+    qed_hs_mutex_release(&helpers_lock);
+    smartlist_remove(helper_jobs, job);
+    qed_hs_free(job);
+    return NULL;
+  }
+  /* Callers only check this for NULL. */
+  return (workqueue_entry_t *) job;
+}
+
+/** A microdescriptor with a family and both exit policies, for
+ * test_md_parse_in_chunks_threaded(). */
+static const char test_md_with_policies[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMH3340d4ENNGrqx7UxT+lB7x6DNUKOdPEOn4teceE11xlMyZ9TPv41c\n"
+  "qj2fRZzfxlc88G/tmiaHshmdtEpklZ740OFqaaJVj4LjPMKFNE+J7Xc1142BE9Ci\n"
+  "KgsbjGYe2RY261aADRWLetJ8T9QDMm+JngL4288hc8pq1uB/3TAbAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "ntor-onion-key AppBt6CSeb1kKid/36ototmFA24ddfW5JpjWPLuoJgs=\n"
+  "family nodeX nodeY nodeZ\n"
+  "p accept 1-700,800-1000\n"
+  "p6 accept 80,443\n";
+
+/** Parsing a document with helper threads, when its microdescriptors share
+ * their exit policies, must still intern one copy of each policy, with one
+ * reference per microdescriptor. */
+static void
+test_md_parse_in_chunks_threaded(void *arg)
+{
+  (void) arg;
+  const int n_mds = 2000;
+  smartlist_t *pieces = smartlist_new();
+  smartlist_t *mds = NULL;
+  char *doc = NULL;
+  const microdesc_t *md0;
+  const short_policy_t *policy = NULL, *ipv6_policy = NULL;
+  const nodefamily_t *family = NULL;
+
+  qed_hs_mutex_init_for_cond(&helpers_lock);
+  qed_hs_cond_init(&helpers_done_cond);
+  helper_jobs = smartlist_new();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_in_thread);
+
+  for (int i = 0; i < n_mds; ++i)
+    smartlist_add(pieces, (char *) test_md_with_policies);
+  doc = smartlist_join_strings(pieces, "", 0, NULL);
+
+  /* One microdescriptor per chunk, so that the helpers and the main thread
+   * take turns as much as they can. */
+  mds = microdescs_parse_in_chunks(doc, doc, doc + strlen(doc), 1,
+                                   SAVED_NOWHERE, NULL, 4, 1);
+  tt_int_op(smartlist_len(helper_jobs), OP_EQ, 4);
+
+  qed_hs_mutex_acquire(&helpers_lock);
+  while (n_helpers_running > 0)
+    qed_hs_cond_wait(&helpers_done_cond, &helpers_lock, NULL);
+  qed_hs_mutex_release(&helpers_lock);
+  SMARTLIST_FOREACH(helper_jobs, md_helper_job_t *, job,
+                    job->reply_fn(job->arg));
+
+  tt_int_op(smartlist_len(mds), OP_EQ, n_mds);
+  md0 = smartlist_get(mds, 0);
+  policy = md0->exit_policy;
+  ipv6_policy = md0->ipv6_exit_policy;
+  family = md0->family;
+  tt_assert(policy);
+  tt_assert(ipv6_policy);
+  tt_assert(family);
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    tt_ptr_op(md->exit_policy, OP_EQ, policy);
+    tt_ptr_op(md->ipv6_exit_policy, OP_EQ, ipv6_policy);
+    tt_ptr_op(md->family, OP_EQ, family);
+    tt_int_op(md->policy_is_reject_star, OP_EQ, 0);
+  } SMARTLIST_FOREACH_END(md);
+  tt_uint_op(policy->refcnt, OP_EQ, n_mds);
+  tt_uint_op(ipv6_policy->refcnt, OP_EQ, n_mds);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  if (mds)
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  SMARTLIST_FOREACH(helper_jobs, md_helper_job_t *, job, qed_hs_free(job));
+  smartlist_free(helper_jobs);
+  helper_jobs = NULL;
+  smartlist_free(pieces);
+  qed_hs_free(doc);
+}
+
 static void
 test_md_parse_id_ed25519(void *arg)
 {
@@ -985,6 +1188,9 @@ struct testcase_t microdesc_tests[] = {
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
+  { "parse_in_chunks", test_md_parse_in_chunks, 0, NULL, NULL },
+  { "parse_in_chunks_threaded", test_md_parse_in_chunks_threaded, TT_FORK,
+    NULL, NULL },
   { "parse_id_ed25519", test_md_parse_id_ed25519, 0, NULL, NULL },
   { "parse_no_onion_key", test_md_parse_no_onion_key, 0, NULL, NULL },
   { "parse_family_ids", test_md_parse_family_ids, 0, NULL, NULL },
@@ -960,6 +960,22 @@ test_policies_general(void *arg)
   test_short_policy_parse("accept 100-200,,", "accept 100-200");
   test_short_policy_parse("reject ,1-10,,,,30-40", "reject 1-10,30-40");
 
+  /* Equal short policies are shared. */
+  {
+    short_policy_t *p1 = parse_short_policy("accept 80,443");
+    short_policy_t *p2 = parse_short_policy("accept 80,,443");
+    short_policy_t *p3 = parse_short_policy("reject 80,443");
+    tt_assert(p1);
+    tt_ptr_op(p1, OP_EQ, p2);
+    tt_uint_op(p1->refcnt, OP_EQ, 2);
+    tt_ptr_op(p1, OP_NE, p3);
+    tt_uint_op(p3->refcnt, OP_EQ, 1);
+    short_policy_free(p2);
+    tt_uint_op(p1->refcnt, OP_EQ, 1);
+    short_policy_free(p1);
+    short_policy_free(p3);
+  }
+
   /* Try parsing various broken short policies */
 #define TT_BAD_SHORT_POLICY(s)                                          \
   do {                                                                  \
@@ -80,6 +80,13 @@ test_proto_http_valid(void *arg)
       "PUT /qed-hs/bar HTTP/1.1\r\n\r\n",
       S("this is another \x00test"),
       0, 0,
+    },
+    { S("GET /qed-hs/a HTTP/1.1\r\n"
+        "Connection: keep-alive\r\n\r\n"
+        "GET /qed-hs/b HTTP/1.1\r\n\r\n"),
+      "GET /qed-hs/a HTTP/1.1\r\n" "Connection: keep-alive\r\n\r\n",
+      S(""),
+      0, 26,
     }
   };
   unsigned i;
@@ -203,10 +210,133 @@ test_proto_http_invalid(void *arg)
   teardown_capture_of_logs();
 }
 
+static void
+test_proto_http_keep_alive(void *arg)
+{
+  (void) arg;
+  const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Connection: keep-alive\r\n\r\n"
+    "5\r\nhello\r\n"
+    "7;ext=1\r\n, world\r\n"
+    "0\r\n\r\n"
+    "HTTP/1.1 404 Not found\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: keep-alive\r\n\r\n"
+    "HTTP/1.0 200 OK\r\n\r\n"
+    "the end";
+  buf_t *buf = buf_new();
+  buf_t *body = buf_new();
+  char *h = NULL, *b = NULL;
+  size_t i, left = 0, contentlen = 99;
+  int chunked = 0, r = 0;
+
+  /* Feed the first response one byte at a time. */
+  for (i = 0; i < sizeof(response)-1; ++i) {
+    buf_add(buf, response+i, 1);
+    if (!h) {
+      r = fetch_from_buf_http_keep_alive(buf, &h, 1024, &chunked,
+                                         &contentlen);
+      tt_int_op(r, OP_EQ, h ? 1 : 0);
+      continue;
+    }
+    tt_int_op(chunked, OP_EQ, 1);
+    r = buf_http_dechunk(buf, body, &left, 1024);
+    tt_int_op(r, OP_GE, 0);
+    if (r == 1)
+      break;
+  }
+  tt_int_op(r, OP_EQ, 1);
+  tt_str_op(h, OP_EQ, "HTTP/1.1 200 OK\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Connection: keep-alive\r\n\r\n");
+  b = buf_extract(body, NULL);
+  tt_str_op(b, OP_EQ, "hello, world");
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  qed_hs_free(h);
+  qed_hs_free(b);
+
+  /* Then the rest all at once. */
+  buf_add(buf, response+i+1, sizeof(response)-i-2);
+  tt_int_op(1, OP_EQ, fetch_from_buf_http_keep_alive(buf, &h, 1024,
+                                                     &chunked, &contentlen));
+  tt_int_op(chunked, OP_EQ, 0);
+  tt_u64_op(contentlen, OP_EQ, 0);
+  tt_str_op(h, OP_EQ, "HTTP/1.1 404 Not found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: keep-alive\r\n\r\n");
+  qed_hs_free(h);
+
+  /* The last response doesn't keep the connection open: leave it alone. */
+  tt_int_op(2, OP_EQ, fetch_from_buf_http_keep_alive(buf, &h, 1024,
+                                                     &chunked, &contentlen));
+  tt_ptr_op(h, OP_EQ, NULL);
+  tt_int_op(buf_datalen(buf), OP_EQ,
+            strlen("HTTP/1.0 200 OK\r\n\r\nthe end"));
+
+ done:
+  qed_hs_free(h);
+  qed_hs_free(b);
+  buf_free(buf);
+  buf_free(body);
+}
+
+static void
+test_proto_http_dechunk_invalid(void *arg)
+{
+  (void) arg;
+  const struct {
+    const char *message;
+    size_t len;
+  } cases[] = {
+    { S("5\r\nhello0\r\n\r\n") },
+    { S("q\r\nhello\r\n") },
+    { S("\r\n") },
+    { S("-5\r\nhello\r\n") },
+    { S("0\r\nX-Trailer: yes\r\n\r\n") },
+    { S("100000000000000000\r\n") },
+    { S("5                                                              "
+        "                                         \r\n") },
+    { S("20\r\nthis chunk is larger than max!!\r\n") },
+  };
+  unsigned i;
+  buf_t *buf = buf_new();
+  buf_t *body = buf_new();
+  size_t left;
+
+  setup_capture_of_logs(LOG_DEBUG);
+  for (i = 0; i < ARRAY_LENGTH(cases); ++i) {
+    TT_BLATHER(("Trying case %u", i));
+    left = 0;
+    buf_add(buf, cases[i].message, cases[i].len);
+    tt_int_op(-1, OP_EQ, buf_http_dechunk(buf, body, &left, 16));
+    buf_clear(buf);
+    buf_clear(body);
+    mock_clean_saved_logs();
+  }
+
+  /* A keep-alive response must say where its body ends. */
+  char *h = NULL;
+  int chunked;
+  size_t contentlen;
+  buf_add_string(buf, "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n\r\n");
+  tt_int_op(-1, OP_EQ, fetch_from_buf_http_keep_alive(buf, &h, 1024,
+                                                      &chunked, &contentlen));
+  tt_ptr_op(h, OP_EQ, NULL);
+
+ done:
+  buf_free(buf);
+  buf_free(body);
+  teardown_capture_of_logs();
+}
+
 struct testcase_t proto_http_tests[] = {
   { "peek", test_proto_http_peek, 0, NULL, NULL },
   { "valid", test_proto_http_valid, 0, NULL, NULL },
   { "invalid", test_proto_http_invalid, 0, NULL, NULL },
+  { "keep_alive", test_proto_http_keep_alive, 0, NULL, NULL },
+  { "dechunk_invalid", test_proto_http_dechunk_invalid, 0, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -277,7 +277,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_size(r),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +371,55 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_buckets(void *arg)
+{
+  replaycache_t *r = NULL;
+  time_t elapsed = 0;
+  uint32_t i;
+  int result;
+
+  (void)arg;
+  r = replaycache_new(600, 300);
+  tt_ptr_op(r, OP_NE, NULL);
+
+  /* Enough entries to make the bucket grow a few times. */
+  for (i = 0; i < 1000; ++i) {
+    result = replaycache_add_and_test_internal(1000, r, &i, sizeof(i), NULL);
+    tt_int_op(result, OP_EQ, 0);
+  }
+  for (i = 0; i < 1000; ++i) {
+    result = replaycache_add_and_test_internal(1000, r, &i, sizeof(i), NULL);
+    tt_int_op(result, OP_EQ, 1);
+  }
+  tt_uint_op(replaycache_size(r), OP_EQ, 1000);
+
+  /* A hit in a later span refreshes the entry into the current bucket. */
+  i = 0;
+  result = replaycache_add_and_test_internal(1500, r, &i, sizeof(i),
+                                             &elapsed);
+  tt_int_op(result, OP_EQ, 1);
+  tt_int_op(elapsed, OP_EQ, 500);
+  tt_uint_op(replaycache_size(r), OP_EQ, 1001);
+
+  /* Once the first bucket has aged out, it is dropped all at once, but the
+   * refreshed entry survives. */
+  replaycache_scrub_if_needed_internal(2050, r);
+  tt_uint_op(replaycache_size(r), OP_EQ, 1);
+  result = replaycache_add_and_test_internal(2050, r, &i, sizeof(i),
+                                             &elapsed);
+  tt_int_op(result, OP_EQ, 1);
+  tt_int_op(elapsed, OP_EQ, 550);
+  i = 1;
+  result = replaycache_add_and_test_internal(2050, r, &i, sizeof(i), NULL);
+  tt_int_op(result, OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +435,7 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(buckets),
   END_OF_TESTCASES
 };
 
@@ -9,6 +9,9 @@
 
 #include "feature/dirauth/voteflags.h"
 #include "feature/dirauth/dirauth_options_st.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/node_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 #include "feature/nodelist/routerinfo_st.h"
@@ -155,6 +158,52 @@ test_voting_flags_staledesc(void *arg)
   ;
 }
 
+/* When we decide that a relay is running, we must start choosing it for
+ * circuits, even if we already built a node selection table without it. */
+static void
+test_voting_flags_running_changes_selection(void *arg)
+{
+  routerinfo_t *ri[2] = { NULL, NULL };
+  node_t *node[2];
+  const time_t now = approx_time();
+  int i, chose_second = 0;
+  (void) arg;
+
+  for (i = 0; i < 2; ++i) {
+    ri[i] = qed_hs_malloc_zero(sizeof(routerinfo_t));
+    ri[i]->nickname = qed_hs_strdup(i ? "second" : "first");
+    memset(ri[i]->cache_info.identity_digest, 'a' + i, DIGEST_LEN);
+    ri[i]->cache_info.published_on = now - 100;
+    ri[i]->purpose = ROUTER_PURPOSE_GENERAL;
+    ri[i]->bandwidthrate = ri[i]->bandwidthcapacity = 100000;
+    ri[i]->onion_curve25519_pkey =
+      qed_hs_malloc_zero(sizeof(curve25519_public_key_t));
+    memset(ri[i]->onion_curve25519_pkey->public_key, 'x',
+           CURVE25519_PUBKEY_LEN);
+    node[i] = nodelist_set_routerinfo(ri[i], NULL);
+    node[i]->is_valid = 1;
+  }
+  node[0]->is_running = 1;
+
+  for (i = 0; i < 100; ++i)
+    tt_ptr_op(router_choose_random_node(NULL, NULL, 0), OP_EQ, node[0]);
+
+  node[1]->last_reachable = now;
+  dirserv_set_router_is_running(ri[1], now);
+  tt_assert(node[1]->is_running);
+
+  for (i = 0; i < 100; ++i) {
+    if (router_choose_random_node(NULL, NULL, 0) == node[1])
+      chose_second = 1;
+  }
+  tt_assert(chose_second);
+
+ done:
+  nodelist_free_all();
+  for (i = 0; i < 2; ++i)
+    routerinfo_free(ri[i]);
+}
+
 static void *
 setup_voting_flags_test(const struct testcase_t *testcase)
 {
@@ -186,5 +235,7 @@ struct testcase_t voting_flags_tests[] = {
   T(ipv6, TT_FORK),
   // TODO: Add more of these tests.
   T(staledesc, TT_FORK),
+  { "running_changes_selection", test_voting_flags_running_changes_selection,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };